@@ -0,0 +1,129 @@
+/*
+** Copyright 2014-2016 The Earlham Institute
+**
+** Licensed under the Apache License, Version 2.0 (the "License");
+** you may not use this file except in compliance with the License.
+** You may obtain a copy of the License at
+**
+**     http://www.apache.org/licenses/LICENSE-2.0
+**
+** Unless required by applicable law or agreed to in writing, software
+** distributed under the License is distributed on an "AS IS" BASIS,
+** WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+** See the License for the specific language governing permissions and
+** limitations under the License.
+*/
+
+/**
+ * @file
+ * @brief Optional accounting of the memory allocated while extracting
+ * the results from a page, broken down by stage and totalled for each
+ * operation.
+ */
+#ifndef ALLOCATION_STATS_HPP
+#define ALLOCATION_STATS_HPP
+
+#include <stddef.h>
+
+#include "typedefs.h"
+#include "jansson.h"
+
+#include "web_search_service_library.h"
+
+
+/**
+ * The stages of extracting the results from a page.
+ *
+ * @ingroup web_search_service
+ */
+typedef enum AllocationStage
+{
+	/** Building the DOM tree of the page. */
+	AS_DOM,
+
+	/** Indexing the page and running the selectors over it. */
+	AS_SELECTORS,
+
+	/** Extracting the text and addresses of the links. */
+	AS_LINKS,
+
+	/** Converting the links to JSON. */
+	AS_JSON,
+
+	/** The number of stages. */
+	AS_NUM_STAGES
+} AllocationStage;
+
+
+#ifdef __cplusplus
+extern "C"
+{
+#endif
+
+
+/**
+ * Start counting the allocations made by the current thread for a request.
+ * Until StopAllocationAccounting is called, any calls to CountAllocations
+ * and CountFrees on this thread are added to the request's totals.
+ *
+ * @return <code>true</code> if accounting was started, <code>false</code>
+ * upon error or if it had already been started on this thread.
+ * @ingroup web_search_service
+ */
+WEB_SEARCH_SERVICE_LOCAL bool StartAllocationAccounting (void);
+
+
+/**
+ * Stop counting the allocations for the current thread's request and add
+ * its totals to those of the operation that it was for.
+ *
+ * @param operation_s The name of the operation.
+ * @param log_interval If this is greater than 0, the operation's totals are
+ * logged after every log_interval requests.
+ * @ingroup web_search_service
+ */
+WEB_SEARCH_SERVICE_LOCAL void StopAllocationAccounting (const char *operation_s, const uint32 log_interval);
+
+
+/**
+ * Record some allocations made by the current thread. This does nothing
+ * unless StartAllocationAccounting has been called on the thread.
+ *
+ * @param stage The stage that made the allocations.
+ * @param num_allocations The number of allocations.
+ * @param num_bytes The total number of bytes allocated.
+ * @ingroup web_search_service
+ */
+WEB_SEARCH_SERVICE_LOCAL void CountAllocations (const AllocationStage stage, const size_t num_allocations, const size_t num_bytes);
+
+
+/**
+ * Record that some memory counted by CountAllocations has been freed. This
+ * does nothing unless StartAllocationAccounting has been called on the thread.
+ *
+ * @param stage The stage that made the allocations.
+ * @param num_bytes The number of bytes that have been freed.
+ * @ingroup web_search_service
+ */
+WEB_SEARCH_SERVICE_LOCAL void CountFrees (const AllocationStage stage, const size_t num_bytes);
+
+
+/**
+ * Get the allocation totals for an operation. This is exported from the
+ * service library so that the server, or a tool that has loaded it, can
+ * get the totals at any time rather than waiting for them to be logged.
+ *
+ * @param operation_s The name of the operation.
+ * @return The totals as a JSON object, which the caller must decref, or <code>NULL</code>
+ * if there are none for the operation or upon error.
+ * @ingroup web_search_service
+ */
+WEB_SEARCH_SERVICE_API json_t *GetAllocationStatsAsJSON (const char *operation_s);
+
+
+#ifdef __cplusplus
+}
+#endif
+
+
+#endif		/* #ifndef ALLOCATION_STATS_HPP */
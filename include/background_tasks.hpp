@@ -0,0 +1,78 @@
+/*
+** Copyright 2014-2016 The Earlham Institute
+**
+** Licensed under the Apache License, Version 2.0 (the "License");
+** you may not use this file except in compliance with the License.
+** You may obtain a copy of the License at
+**
+**     http://www.apache.org/licenses/LICENSE-2.0
+**
+** Unless required by applicable law or agreed to in writing, software
+** distributed under the License is distributed on an "AS IS" BASIS,
+** WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+** See the License for the specific language governing permissions and
+** limitations under the License.
+*/
+
+/**
+ * @file
+ * @brief A small pool of worker threads for running tasks such as cache
+ * refreshes outside of the requests that triggered them.
+ */
+#ifndef BACKGROUND_TASKS_HPP
+#define BACKGROUND_TASKS_HPP
+
+#include "typedefs.h"
+
+#include "web_search_service_library.h"
+
+
+/**
+ * The function that carries out a background task.
+ *
+ * @param data_p The data passed to ScheduleBackgroundTask.
+ * @ingroup web_search_service
+ */
+typedef void (*BackgroundTaskRunner) (void *data_p);
+
+
+/**
+ * The function that releases the data for a background task once
+ * it has been run or if it could not be scheduled.
+ *
+ * @param data_p The data passed to ScheduleBackgroundTask.
+ * @ingroup web_search_service
+ */
+typedef void (*BackgroundTaskDataFreer) (void *data_p);
+
+
+#ifdef __cplusplus
+extern "C"
+{
+#endif
+
+
+/**
+ * Schedule a task to be run on one of the background worker threads.
+ *
+ * @param group_s The name of the group that the task belongs to, typically the
+ * name of the operation that it is for.
+ * @param max_concurrent_tasks The maximum number of tasks from this group that
+ * can be queued or running at any one time.
+ * @param run_fn The function to run the task.
+ * @param free_fn The function to free data_p. This can be <code>NULL</code>.
+ * @param data_p The data to pass to run_fn and free_fn.
+ * @return <code>true</code> if the task was scheduled. If the group already has
+ * max_concurrent_tasks outstanding or upon error, <code>false</code> is returned and
+ * free_fn will have been called on data_p.
+ * @ingroup web_search_service
+ */
+WEB_SEARCH_SERVICE_LOCAL bool ScheduleBackgroundTask (const char *group_s, const uint32 max_concurrent_tasks, BackgroundTaskRunner run_fn, BackgroundTaskDataFreer free_fn, void *data_p);
+
+
+#ifdef __cplusplus
+}
+#endif
+
+
+#endif		/* #ifndef BACKGROUND_TASKS_HPP */
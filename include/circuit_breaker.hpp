@@ -0,0 +1,117 @@
+/*
+** Copyright 2014-2016 The Earlham Institute
+**
+** Licensed under the Apache License, Version 2.0 (the "License");
+** you may not use this file except in compliance with the License.
+** You may obtain a copy of the License at
+**
+**     http://www.apache.org/licenses/LICENSE-2.0
+**
+** Unless required by applicable law or agreed to in writing, software
+** distributed under the License is distributed on an "AS IS" BASIS,
+** WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+** See the License for the specific language governing permissions and
+** limitations under the License.
+*/
+
+/**
+ * @file
+ * @brief Circuit breakers that stop requests being sent to search engines
+ * that are failing so that they do not tie up the server's workers.
+ */
+#ifndef CIRCUIT_BREAKER_HPP
+#define CIRCUIT_BREAKER_HPP
+
+#include "typedefs.h"
+
+#include "web_search_service_library.h"
+
+
+/**
+ * The circuit breaker for a single web search operation. As with the
+ * ResultCaches, these are held in a process-wide registry so that they
+ * outlive the individual Service instances that use them.
+ *
+ * @ingroup web_search_service
+ */
+typedef struct CircuitBreaker CircuitBreaker;
+
+
+#ifdef __cplusplus
+extern "C"
+{
+#endif
+
+
+/**
+ * Get the circuit breaker for an operation, creating it if needed.
+ *
+ * The breaker opens once failure_threshold of the last window_size requests
+ * have failed. Whilst it is open, requests are refused until open_time
+ * seconds have passed, after which a single probe request is allowed
+ * through. If that succeeds, the breaker closes again and if it fails,
+ * the breaker stays open for another open_time seconds.
+ *
+ * @param name_s The name of the operation.
+ * @param failure_threshold The number of failed requests that opens the breaker.
+ * @param window_size The number of the most recent requests to track.
+ * @param open_time The number of seconds that the breaker stays open for before
+ * allowing a probe request.
+ * @return The CircuitBreaker or <code>NULL</code> upon error.
+ * @ingroup web_search_service
+ */
+WEB_SEARCH_SERVICE_LOCAL CircuitBreaker *GetCircuitBreaker (const char *name_s, const uint32 failure_threshold, const uint32 window_size, const uint32 open_time);
+
+
+/**
+ * Check whether a request can be sent.
+ *
+ * Each call that returns <code>true</code> must be followed by a call to
+ * either RecordCircuitBreakerResult once the request has finished or
+ * ReleaseCircuitBreakerRequest if it was not sent after all.
+ *
+ * @param breaker_p The CircuitBreaker.
+ * @param ticket_p If the request can be sent, this is set to the ticket to pass
+ * to RecordCircuitBreakerResult or ReleaseCircuitBreakerRequest. It identifies
+ * which state of the breaker the request was allowed in, so that only the probe
+ * request can close or reopen a half-open breaker.
+ * @return <code>true</code> if the request can be sent, <code>false</code> if
+ * the breaker is open and it should fail straight away.
+ * @ingroup web_search_service
+ */
+WEB_SEARCH_SERVICE_LOCAL bool AllowCircuitBreakerRequest (CircuitBreaker *breaker_p, uint32 *ticket_p);
+
+
+/**
+ * Record the outcome of a request that was allowed by AllowCircuitBreakerRequest.
+ * The outcomes of requests that were allowed before the breaker last changed
+ * state, such as those that were still running when it opened, are ignored.
+ *
+ * @param breaker_p The CircuitBreaker.
+ * @param ticket The ticket that AllowCircuitBreakerRequest gave the request.
+ * @param success_flag <code>true</code> if the search engine replied successfully,
+ * <code>false</code> if the request failed, timed out or returned a server error.
+ * @ingroup web_search_service
+ */
+WEB_SEARCH_SERVICE_LOCAL void RecordCircuitBreakerResult (CircuitBreaker *breaker_p, const uint32 ticket, const bool success_flag);
+
+
+/**
+ * Give back a request that was allowed by AllowCircuitBreakerRequest but
+ * could not be sent. If it was the probe of a half-open breaker, the
+ * breaker goes back to being open so that the next request becomes the
+ * probe instead.
+ *
+ * @param breaker_p The CircuitBreaker.
+ * @param ticket The ticket that AllowCircuitBreakerRequest gave the request.
+ * @ingroup web_search_service
+ */
+WEB_SEARCH_SERVICE_LOCAL void ReleaseCircuitBreakerRequest (CircuitBreaker *breaker_p, const uint32 ticket);
+
+
+#ifdef __cplusplus
+}
+#endif
+
+
+#endif		/* #ifndef CIRCUIT_BREAKER_HPP */
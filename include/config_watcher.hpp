@@ -0,0 +1,160 @@
+/*
+** Copyright 2014-2016 The Earlham Institute
+**
+** Licensed under the Apache License, Version 2.0 (the "License");
+** you may not use this file except in compliance with the License.
+** You may obtain a copy of the License at
+**
+**     http://www.apache.org/licenses/LICENSE-2.0
+**
+** Unless required by applicable law or agreed to in writing, software
+** distributed under the License is distributed on an "AS IS" BASIS,
+** WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+** See the License for the specific language governing permissions and
+** limitations under the License.
+*/
+
+/**
+ * @file
+ * @brief Settings that are rebuilt whenever their configuration file
+ * changes without disturbing the requests that are using them.
+ */
+#ifndef CONFIG_WATCHER_HPP
+#define CONFIG_WATCHER_HPP
+
+#include "typedefs.h"
+#include "jansson.h"
+
+#include "web_search_service_library.h"
+
+
+/**
+ * Holds the current version of a set of settings and watches the
+ * configuration file that they came from. When the file changes,
+ * a new version is built and swapped in. Requests that have already
+ * acquired the previous version carry on using it and it is freed once
+ * the last of them has released it.
+ *
+ * @ingroup web_search_service
+ */
+typedef struct ConfigWatcher ConfigWatcher;
+
+
+/**
+ * A reference to one version of the settings held by a ConfigWatcher.
+ *
+ * @ingroup web_search_service
+ */
+typedef struct ConfigVersion ConfigVersion;
+
+
+/**
+ * The function that builds a new version of the settings from a changed
+ * configuration file.
+ *
+ * @param config_p The contents of the configuration file.
+ * @param current_p The current version of the settings.
+ * @param data_p The data passed to AllocateConfigWatcher.
+ * @return The new version, current_p if the settings are unchanged or
+ * <code>NULL</code> if the new ones are invalid. Upon <code>NULL</code>, the
+ * current version is kept and the file is loaded again at the next check.
+ * @ingroup web_search_service
+ */
+typedef void *(*ConfigVersionBuilder) (const json_t *config_p, const void *current_p, void *data_p);
+
+
+/**
+ * The function that frees a version of the settings once it is no longer used.
+ *
+ * @param version_p The version to free.
+ * @ingroup web_search_service
+ */
+typedef void (*ConfigVersionFreer) (void *version_p);
+
+
+#ifdef __cplusplus
+extern "C"
+{
+#endif
+
+
+/**
+ * Allocate a ConfigWatcher.
+ *
+ * @param path_s The configuration file to watch. If this is <code>NULL</code>, the
+ * initial version is kept for as long as the ConfigWatcher exists.
+ * @param check_interval The minimum number of seconds between checks of whether the
+ * file has changed.
+ * @param version_p The initial version of the settings. The ConfigWatcher takes ownership of
+ * this, even upon error.
+ * @param build_fn The function to build a new version when the file changes.
+ * @param free_fn The function to free each version.
+ * @param data_p The data to pass to build_fn.
+ * @return The ConfigWatcher or <code>NULL</code> upon error.
+ * @ingroup web_search_service
+ */
+WEB_SEARCH_SERVICE_LOCAL ConfigWatcher *AllocateConfigWatcher (const char *path_s, const uint32 check_interval, void *version_p, ConfigVersionBuilder build_fn, ConfigVersionFreer free_fn, void *data_p);
+
+
+/**
+ * Free a ConfigWatcher, first waiting for any check of the file that is
+ * queued or running to finish. Any versions that are still acquired are
+ * freed once they have been released.
+ *
+ * @param watcher_p The ConfigWatcher to free.
+ * @ingroup web_search_service
+ */
+WEB_SEARCH_SERVICE_LOCAL void FreeConfigWatcher (ConfigWatcher *watcher_p);
+
+
+/**
+ * Get the current version of the settings. If the check interval has
+ * passed, a background task is queued to check whether the configuration
+ * file has changed and to build the new version, which later requests
+ * then get. The calling request doesn't wait for this.
+ *
+ * @param watcher_p The ConfigWatcher.
+ * @return The ConfigVersion, which must be released with ReleaseConfigVersion,
+ * or <code>NULL</code> upon error.
+ * @ingroup web_search_service
+ */
+WEB_SEARCH_SERVICE_LOCAL ConfigVersion *AcquireConfigVersion (ConfigWatcher *watcher_p);
+
+
+/**
+ * Take another reference to the same version of the settings, for work
+ * that carries on after the request that acquired them has finished.
+ *
+ * @param version_p The ConfigVersion to copy.
+ * @return The new ConfigVersion, which must be released with ReleaseConfigVersion,
+ * or <code>NULL</code> upon error.
+ * @ingroup web_search_service
+ */
+WEB_SEARCH_SERVICE_LOCAL ConfigVersion *CopyConfigVersion (const ConfigVersion *version_p);
+
+
+/**
+ * Get the settings from a ConfigVersion.
+ *
+ * @param version_p The ConfigVersion.
+ * @return The settings.
+ * @ingroup web_search_service
+ */
+WEB_SEARCH_SERVICE_LOCAL const void *GetConfigVersionData (const ConfigVersion *version_p);
+
+
+/**
+ * Release a ConfigVersion acquired by AcquireConfigVersion or CopyConfigVersion.
+ *
+ * @param version_p The ConfigVersion to release.
+ * @ingroup web_search_service
+ */
+WEB_SEARCH_SERVICE_LOCAL void ReleaseConfigVersion (ConfigVersion *version_p);
+
+
+#ifdef __cplusplus
+}
+#endif
+
+
+#endif		/* #ifndef CONFIG_WATCHER_HPP */
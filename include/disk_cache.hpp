@@ -0,0 +1,128 @@
+/*
+** Copyright 2014-2016 The Earlham Institute
+**
+** Licensed under the Apache License, Version 2.0 (the "License");
+** you may not use this file except in compliance with the License.
+** You may obtain a copy of the License at
+**
+**     http://www.apache.org/licenses/LICENSE-2.0
+**
+** Unless required by applicable law or agreed to in writing, software
+** distributed under the License is distributed on an "AS IS" BASIS,
+** WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+** See the License for the specific language governing permissions and
+** limitations under the License.
+*/
+
+/**
+ * @file
+ * @brief A persistent key-value store used to keep extracted results
+ * between restarts.
+ *
+ * Each DiskCache consists of an append-only data file holding the
+ * records and a fixed-size hash index which is memory-mapped so that
+ * it can be used as soon as it is opened. Old records are removed by
+ * compacting into a new pair of files which replace the current ones
+ * with an atomic rename, so a crash at any point leaves a usable cache.
+ */
+#ifndef DISK_CACHE_HPP
+#define DISK_CACHE_HPP
+
+#include <time.h>
+
+#include "typedefs.h"
+#include "jansson.h"
+
+#include "web_search_service_library.h"
+
+
+/**
+ * A persistent cache stored in a pair of files.
+ *
+ * @ingroup web_search_service
+ */
+typedef struct DiskCache DiskCache;
+
+
+#ifdef __cplusplus
+extern "C"
+{
+#endif
+
+
+/**
+ * Open a DiskCache, creating its files if they do not already exist.
+ *
+ * @param path_s The path used as the prefix for the cache's files.
+ * @param num_entries The maximum number of entries that the cache can hold. If the
+ * existing index is a different size, the cache will be rebuilt to this size.
+ * @param retention The number of seconds after an entry has expired that it is kept for.
+ * @return The DiskCache or <code>NULL</code> upon error.
+ * @ingroup web_search_service
+ */
+WEB_SEARCH_SERVICE_LOCAL DiskCache *OpenDiskCache (const char *path_s, const uint32 num_entries, const uint32 retention);
+
+
+/**
+ * Close a DiskCache and free its resources.
+ *
+ * @param cache_p The DiskCache to close.
+ * @ingroup web_search_service
+ */
+WEB_SEARCH_SERVICE_LOCAL void CloseDiskCache (DiskCache *cache_p);
+
+
+/**
+ * Get the path that a DiskCache was opened with.
+ *
+ * @param cache_p The DiskCache.
+ * @return The path.
+ * @ingroup web_search_service
+ */
+WEB_SEARCH_SERVICE_LOCAL const char *GetDiskCachePath (const DiskCache *cache_p);
+
+
+/**
+ * Get an entry from a DiskCache.
+ *
+ * @param cache_p The DiskCache to search.
+ * @param key_s The key of the entry.
+ * @param expiry_p If the entry is found, this will be set to its expiry time.
+ * @return The stored value or <code>NULL</code> if it could not be found or
+ * was not valid.
+ * @ingroup web_search_service
+ */
+WEB_SEARCH_SERVICE_LOCAL json_t *GetDiskCacheEntry (DiskCache *cache_p, const char *key_s, time_t *expiry_p);
+
+
+/**
+ * Add an entry to a DiskCache, replacing any existing one with the same key.
+ *
+ * @param cache_p The DiskCache to add to.
+ * @param key_s The key of the entry.
+ * @param value_p The value to store.
+ * @param expiry The time at which the entry expires.
+ * @return <code>true</code> if the entry was stored successfully, <code>false</code> otherwise.
+ * @ingroup web_search_service
+ */
+WEB_SEARCH_SERVICE_LOCAL bool AddDiskCacheEntry (DiskCache *cache_p, const char *key_s, const json_t *value_p, const time_t expiry);
+
+
+/**
+ * Update the expiry time of an existing entry in a DiskCache.
+ *
+ * @param cache_p The DiskCache containing the entry.
+ * @param key_s The key of the entry.
+ * @param expiry The new expiry time.
+ * @return <code>true</code> if the entry was found and updated, <code>false</code> otherwise.
+ * @ingroup web_search_service
+ */
+WEB_SEARCH_SERVICE_LOCAL bool SetDiskCacheEntryExpiry (DiskCache *cache_p, const char *key_s, const time_t expiry);
+
+
+#ifdef __cplusplus
+}
+#endif
+
+
+#endif		/* #ifndef DISK_CACHE_HPP */
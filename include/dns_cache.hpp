@@ -0,0 +1,86 @@
+/*
+** Copyright 2014-2016 The Earlham Institute
+**
+** Licensed under the Apache License, Version 2.0 (the "License");
+** you may not use this file except in compliance with the License.
+** You may obtain a copy of the License at
+**
+**     http://www.apache.org/licenses/LICENSE-2.0
+**
+** Unless required by applicable law or agreed to in writing, software
+** distributed under the License is distributed on an "AS IS" BASIS,
+** WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+** See the License for the specific language governing permissions and
+** limitations under the License.
+*/
+
+/**
+ * @file
+ * @brief A process-wide cache of the addresses of the search engines'
+ * hosts, which are resolved on a background thread so that requests
+ * don't have to wait for DNS lookups.
+ */
+#ifndef DNS_CACHE_HPP
+#define DNS_CACHE_HPP
+
+#include <curl/curl.h>
+
+#include "typedefs.h"
+#include "curl_tools.h"
+
+#include "web_search_service_library.h"
+
+
+#ifdef __cplusplus
+extern "C"
+{
+#endif
+
+
+/**
+ * Add the host of a URI to the DNS cache. It is resolved straight away
+ * on the cache's background thread and then again shortly before each
+ * resolution expires, for as long as the service library is loaded.
+ *
+ * @param uri_s The URI, which must be an http or https one.
+ * @param ttl The number of seconds that the host's addresses can be used for. If the
+ * host is already in the cache with a longer time, it is shortened to this.
+ * @return <code>true</code> if the host was added or was already there, <code>false</code>
+ * if the URI has no host that needs resolving, such as an IP address, or upon error.
+ * @ingroup web_search_service
+ */
+WEB_SEARCH_SERVICE_LOCAL bool WarmDnsCache (const char *uri_s, const uint32 ttl);
+
+
+/**
+ * Make a CurlTool's next request use the cached addresses of a URI's host
+ * rather than resolving it. If the host has no addresses in the cache,
+ * any that were given to the CurlTool before are removed from it so that
+ * it resolves the host itself.
+ *
+ * @param tool_p The CurlTool to make the request with.
+ * @param uri_s The URI that the request is for.
+ * @return The list of hosts given to the CurlTool which must be passed to
+ * ClearCurlToolResolvedHost after the request has finished, or <code>NULL</code>
+ * if the URI has no host that needs resolving or upon error.
+ * @ingroup web_search_service
+ */
+WEB_SEARCH_SERVICE_LOCAL struct curl_slist *SetCurlToolResolvedHost (CurlTool *tool_p, const char *uri_s);
+
+
+/**
+ * Remove the hosts given to a CurlTool by SetCurlToolResolvedHost.
+ *
+ * @param tool_p The CurlTool that made the request.
+ * @param hosts_p The value returned by SetCurlToolResolvedHost.
+ * @ingroup web_search_service
+ */
+WEB_SEARCH_SERVICE_LOCAL void ClearCurlToolResolvedHost (CurlTool *tool_p, struct curl_slist *hosts_p);
+
+
+#ifdef __cplusplus
+}
+#endif
+
+
+#endif		/* #ifndef DNS_CACHE_HPP */
@@ -0,0 +1,118 @@
+/*
+** Copyright 2014-2016 The Earlham Institute
+**
+** Licensed under the Apache License, Version 2.0 (the "License");
+** you may not use this file except in compliance with the License.
+** You may obtain a copy of the License at
+**
+**     http://www.apache.org/licenses/LICENSE-2.0
+**
+** Unless required by applicable law or agreed to in writing, software
+** distributed under the License is distributed on an "AS IS" BASIS,
+** WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+** See the License for the specific language governing permissions and
+** limitations under the License.
+*/
+
+/**
+ * @file
+ * @brief Resources that are only created when they are first needed and
+ * that are released again once they have not been used for a while.
+ */
+#ifndef IDLE_RESOURCES_HPP
+#define IDLE_RESOURCES_HPP
+
+#include "typedefs.h"
+
+#include "web_search_service_library.h"
+
+
+/**
+ * A resource, such as a service's curl handle and buffers, that is
+ * created on demand and released after an idle period.
+ *
+ * @ingroup web_search_service
+ */
+typedef struct IdleResource IdleResource;
+
+
+/**
+ * The function that creates the resource.
+ *
+ * @param data_p The data passed to AllocateIdleResource.
+ * @return <code>true</code> if the resource was created successfully,
+ * <code>false</code> otherwise.
+ * @ingroup web_search_service
+ */
+typedef bool (*IdleResourceCreator) (void *data_p);
+
+
+/**
+ * The function that releases the resource.
+ *
+ * @param data_p The data passed to AllocateIdleResource.
+ * @ingroup web_search_service
+ */
+typedef void (*IdleResourceReleaser) (void *data_p);
+
+
+#ifdef __cplusplus
+extern "C"
+{
+#endif
+
+
+/**
+ * Allocate an IdleResource. The resource itself is not created until
+ * AcquireIdleResource is first called.
+ *
+ * @param create_fn The function to create the resource.
+ * @param release_fn The function to release the resource.
+ * @param data_p The data to pass to create_fn and release_fn.
+ * @param idle_time The number of seconds that the resource can be unused for
+ * before it is released. If this is 0, the resource is kept until
+ * FreeIdleResource is called.
+ * @return The IdleResource or <code>NULL</code> upon error.
+ * @ingroup web_search_service
+ */
+WEB_SEARCH_SERVICE_LOCAL IdleResource *AllocateIdleResource (IdleResourceCreator create_fn, IdleResourceReleaser release_fn, void *data_p, const uint32 idle_time);
+
+
+/**
+ * Free an IdleResource, releasing the resource if it is currently held.
+ *
+ * @param resource_p The IdleResource to free.
+ * @ingroup web_search_service
+ */
+WEB_SEARCH_SERVICE_LOCAL void FreeIdleResource (IdleResource *resource_p);
+
+
+/**
+ * Mark the resource as being in use, creating it if needed. Whilst it
+ * is in use, it will not be released.
+ *
+ * @param resource_p The IdleResource.
+ * @return <code>true</code> if the resource is ready to use, <code>false</code>
+ * if it could not be created. Each successful call must be matched by
+ * a call to ReleaseIdleResource.
+ * @ingroup web_search_service
+ */
+WEB_SEARCH_SERVICE_LOCAL bool AcquireIdleResource (IdleResource *resource_p);
+
+
+/**
+ * Mark the resource as no longer being in use by the caller and
+ * start its idle period.
+ *
+ * @param resource_p The IdleResource.
+ * @ingroup web_search_service
+ */
+WEB_SEARCH_SERVICE_LOCAL void ReleaseIdleResource (IdleResource *resource_p);
+
+
+#ifdef __cplusplus
+}
+#endif
+
+
+#endif		/* #ifndef IDLE_RESOURCES_HPP */
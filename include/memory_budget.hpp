@@ -0,0 +1,84 @@
+/*
+** Copyright 2014-2016 The Earlham Institute
+**
+** Licensed under the Apache License, Version 2.0 (the "License");
+** you may not use this file except in compliance with the License.
+** You may obtain a copy of the License at
+**
+**     http://www.apache.org/licenses/LICENSE-2.0
+**
+** Unless required by applicable law or agreed to in writing, software
+** distributed under the License is distributed on an "AS IS" BASIS,
+** WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+** See the License for the specific language governing permissions and
+** limitations under the License.
+*/
+
+/**
+ * @file
+ * @brief A process-wide budget for the memory used by the responses that
+ * are being downloaded and parsed, so that new searches wait rather than
+ * pushing the server into swap when there are too many large pages in flight.
+ */
+#ifndef MEMORY_BUDGET_HPP
+#define MEMORY_BUDGET_HPP
+
+#include <stddef.h>
+
+#include "typedefs.h"
+
+#include "web_search_service_library.h"
+
+
+#ifdef __cplusplus
+extern "C"
+{
+#endif
+
+
+/**
+ * Set the number of bytes that the responses in flight can use between them,
+ * replacing any previous budget.
+ *
+ * @param budget The number of bytes. A value of 0 removes the budget.
+ * @ingroup web_search_service
+ */
+WEB_SEARCH_SERVICE_LOCAL void SetMemoryBudget (const size_t budget);
+
+
+/**
+ * Wait until the responses in flight are using less than the budget.
+ *
+ * @param timeout The maximum number of seconds to wait.
+ * @return <code>true</code> if there is room in the budget, or there is
+ * no budget, <code>false</code> if the wait timed out.
+ * @ingroup web_search_service
+ */
+WEB_SEARCH_SERVICE_LOCAL bool WaitForMemoryBudget (const uint32 timeout);
+
+
+/**
+ * Record that more memory is being used by a response.
+ *
+ * @param size The number of bytes.
+ * @ingroup web_search_service
+ */
+WEB_SEARCH_SERVICE_LOCAL void AddMemoryBudgetUsage (const size_t size);
+
+
+/**
+ * Record that memory used by a response has been freed, waking up any
+ * searches that are waiting for room in the budget.
+ *
+ * @param size The number of bytes.
+ * @ingroup web_search_service
+ */
+WEB_SEARCH_SERVICE_LOCAL void RemoveMemoryBudgetUsage (const size_t size);
+
+
+#ifdef __cplusplus
+}
+#endif
+
+
+#endif		/* #ifndef MEMORY_BUDGET_HPP */
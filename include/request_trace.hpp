@@ -0,0 +1,134 @@
+/*
+** Copyright 2014-2016 The Earlham Institute
+**
+** Licensed under the Apache License, Version 2.0 (the "License");
+** you may not use this file except in compliance with the License.
+** You may obtain a copy of the License at
+**
+**     http://www.apache.org/licenses/LICENSE-2.0
+**
+** Unless required by applicable law or agreed to in writing, software
+** distributed under the License is distributed on an "AS IS" BASIS,
+** WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+** See the License for the specific language governing permissions and
+** limitations under the License.
+*/
+
+/**
+ * @file
+ * @brief Sampled tracing of the stages of individual searches, written
+ * out in the Chrome trace-event format so that slow searches can be
+ * examined in a trace viewer.
+ */
+#ifndef REQUEST_TRACE_HPP
+#define REQUEST_TRACE_HPP
+
+#include <stddef.h>
+
+#include "typedefs.h"
+
+#include "web_search_service_library.h"
+
+
+/**
+ * The spans recorded for a single request.
+ *
+ * @ingroup web_search_service
+ */
+typedef struct RequestTrace RequestTrace;
+
+
+#ifdef __cplusplus
+extern "C"
+{
+#endif
+
+
+/**
+ * Decide whether to trace the request that is about to run on the current
+ * thread and, if so, start recording its spans.
+ *
+ * @param operation_s The name of the operation that the request is for.
+ * @param sample_rate The fraction of requests to trace, from 0 for none to 1 for all of them.
+ * @return <code>true</code> if the request is being traced, <code>false</code> otherwise.
+ * @ingroup web_search_service
+ */
+WEB_SEARCH_SERVICE_LOCAL bool StartRequestTrace (const char *operation_s, const double sample_rate);
+
+
+/**
+ * Stop tracing the current thread's request and append its spans to a
+ * trace file. Since the file's closing bracket is optional in the Chrome
+ * trace-event format, each request's spans can simply be added to the end
+ * of it.
+ *
+ * @param path_s The trace file.
+ * @param max_file_size Once the file is larger than this number of bytes, no more
+ * spans are added to it. If this is 0, there is no limit.
+ * @ingroup web_search_service
+ */
+WEB_SEARCH_SERVICE_LOCAL void FinishRequestTrace (const char *path_s, const size_t max_file_size);
+
+
+/**
+ * Stop recording spans for the current thread's request so that the
+ * rest of the request can be traced on another thread.
+ *
+ * @return The request's trace or <code>NULL</code> if it is not being traced.
+ * @ingroup web_search_service
+ */
+WEB_SEARCH_SERVICE_LOCAL RequestTrace *DetachRequestTrace (void);
+
+
+/**
+ * Carry on recording a request's spans on the current thread, which must
+ * not be tracing a request of its own. The trace is then finished with
+ * FinishRequestTrace as usual and keeps the thread id that it was started
+ * on, so all of the request's spans are shown together.
+ *
+ * @param trace_p The trace returned by DetachRequestTrace. If this is
+ * <code>NULL</code>, nothing is done.
+ * @ingroup web_search_service
+ */
+WEB_SEARCH_SERVICE_LOCAL void AttachRequestTrace (RequestTrace *trace_p);
+
+
+/**
+ * Get the time to use as the start of a span.
+ *
+ * @return The number of microseconds on a monotonic clock or 0 if the current
+ * thread's request is not being traced.
+ * @ingroup web_search_service
+ */
+WEB_SEARCH_SERVICE_LOCAL uint64 BeginTraceSpan (void);
+
+
+/**
+ * Record a span that finishes now.
+ *
+ * @param name_s The name of the span. This must be a string literal, or otherwise
+ * remain valid, until FinishRequestTrace is called.
+ * @param start The value returned by BeginTraceSpan. If this is 0, nothing is recorded.
+ * @ingroup web_search_service
+ */
+WEB_SEARCH_SERVICE_LOCAL void EndTraceSpan (const char *name_s, const uint64 start);
+
+
+/**
+ * Record a span with a given start and duration. This does nothing if
+ * the current thread's request is not being traced.
+ *
+ * @param name_s The name of the span, with the same lifetime as for EndTraceSpan.
+ * @param start The start of the span, on the same clock as BeginTraceSpan.
+ * @param duration The length of the span in microseconds.
+ * @ingroup web_search_service
+ */
+WEB_SEARCH_SERVICE_LOCAL void AddTraceSpan (const char *name_s, const uint64 start, const uint64 duration);
+
+
+#ifdef __cplusplus
+}
+#endif
+
+
+#endif		/* #ifndef REQUEST_TRACE_HPP */
@@ -0,0 +1,244 @@
+/*
+** Copyright 2014-2016 The Earlham Institute
+**
+** Licensed under the Apache License, Version 2.0 (the "License");
+** you may not use this file except in compliance with the License.
+** You may obtain a copy of the License at
+**
+**     http://www.apache.org/licenses/LICENSE-2.0
+**
+** Unless required by applicable law or agreed to in writing, software
+** distributed under the License is distributed on an "AS IS" BASIS,
+** WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+** See the License for the specific language governing permissions and
+** limitations under the License.
+*/
+
+/**
+ * @file
+ * @brief An in-memory cache of the extracted results for each web search operation.
+ */
+#ifndef RESULT_CACHE_HPP
+#define RESULT_CACHE_HPP
+
+#include "typedefs.h"
+#include "jansson.h"
+
+#include "web_search_service_library.h"
+
+
+/**
+ * The cache for a single web search operation. The caches are
+ * held in a process-wide registry so that they outlive the
+ * individual Service instances that use them.
+ *
+ * @ingroup web_search_service
+ */
+typedef struct ResultCache ResultCache;
+
+
+/**
+ * The state of an entry retrieved from a ResultCache.
+ *
+ * @ingroup web_search_service
+ */
+typedef enum CacheEntryState
+{
+	/** There is no entry for the given key. */
+	CES_MISSING,
+
+	/** The entry is within its time to live and can be used as it is. */
+	CES_FRESH,
+
+	/**
+	 * The entry has expired but is still within its grace period so it
+	 * can be used whilst it is refreshed in the background.
+	 */
+	CES_STALE,
+
+	/**
+	 * The entry has expired and needs to be revalidated against
+	 * the upstream search engine before it is used.
+	 */
+	CES_EXPIRED,
+
+	/**
+	 * A recent request to the upstream search engine failed so it should
+	 * not be tried again until the entry expires.
+	 */
+	CES_FAILED
+} CacheEntryState;
+
+
+/**
+ * The details of a cached response.
+ *
+ * @ingroup web_search_service
+ */
+typedef struct CachedResults
+{
+	/** The extracted results. */
+	json_t *cr_results_p;
+
+	/** The ETag header value sent with the response or <code>NULL</code> if there wasn't one. */
+	char *cr_etag_s;
+
+	/** The Last-Modified header value sent with the response or <code>NULL</code> if there wasn't one. */
+	char *cr_last_modified_s;
+
+	/**
+	 * The URI that the results can be fetched again from or <code>NULL</code>
+	 * if the request can't be repeated from its URI alone.
+	 */
+	char *cr_request_uri_s;
+} CachedResults;
+
+
+#ifdef __cplusplus
+extern "C"
+{
+#endif
+
+
+/**
+ * Get the ResultCache for a given web search operation, creating it if needed.
+ *
+ * @param name_s The name of the operation.
+ * @param uri_s The URI of the search engine that the operation wraps. If this differs
+ * from the URI that an existing cache was created for, that cache will be emptied.
+ * @param max_entries The maximum number of entries to keep. Once this is reached, the
+ * least recently used entries will be discarded.
+ * @param ttl The number of seconds that an entry is considered fresh for.
+ * @param stale_ttl The number of seconds after an entry has expired that it can
+ * still be used whilst it is being refreshed.
+ * @return The ResultCache or <code>NULL</code> upon error.
+ * @ingroup web_search_service
+ */
+WEB_SEARCH_SERVICE_LOCAL ResultCache *GetResultCache (const char *name_s, const char *uri_s, const uint32 max_entries, const uint32 ttl, const uint32 stale_ttl);
+
+
+/**
+ * Keep a persistent copy of a ResultCache's entries on disk so that they
+ * are available again straight away after a restart.
+ *
+ * @param cache_p The ResultCache to back with a DiskCache.
+ * @param path_s The path used as the prefix for the files of the DiskCache.
+ * @param num_entries The maximum number of entries to store on disk.
+ * @return <code>true</code> if the DiskCache was opened successfully, <code>false</code> otherwise.
+ * @ingroup web_search_service
+ */
+WEB_SEARCH_SERVICE_LOCAL bool AttachDiskCache (ResultCache *cache_p, const char *path_s, const uint32 num_entries);
+
+
+/**
+ * Remember searches that have no results or that failed for a short time
+ * so that repeating them does not need any network or parsing work.
+ * These negative entries are held separately from the results so that
+ * they cannot push any results out of the ResultCache and are not
+ * written to its DiskCache.
+ *
+ * @param cache_p The ResultCache to set up.
+ * @param max_entries The maximum number of negative entries to keep. Once this
+ * is reached, the least recently used entries will be discarded.
+ * @param empty_ttl The number of seconds that a search with no results is
+ * remembered for. If this is 0, empty results are cached like any others.
+ * @param failed_ttl The number of seconds that a failed search is remembered for.
+ * If this is 0, failed searches are not cached.
+ * @ingroup web_search_service
+ */
+WEB_SEARCH_SERVICE_LOCAL void SetNegativeCaching (ResultCache *cache_p, const uint32 max_entries, const uint32 empty_ttl, const uint32 failed_ttl);
+
+
+/**
+ * Look up the results for a given request. If the entry is not held in
+ * memory but the ResultCache has a DiskCache, that will be checked too.
+ *
+ * @param cache_p The ResultCache to search.
+ * @param key_s The key identifying the request.
+ * @param results_p If an entry is found, this will be filled in with a deep copy of
+ * the cached data which should be released with ClearCachedResults. For a
+ * remembered search with no results, this will just be an empty array.
+ * @return The state of the entry.
+ * @ingroup web_search_service
+ */
+WEB_SEARCH_SERVICE_LOCAL CacheEntryState GetCachedResults (ResultCache *cache_p, const char *key_s, CachedResults *results_p);
+
+
+/**
+ * Store the results for a given request, replacing any existing entry.
+ *
+ * @param cache_p The ResultCache to add to.
+ * @param key_s The key identifying the request.
+ * @param results_p The results to store. The ResultCache keeps its own deep copy
+ * of these so the caller retains ownership. Any of the string values can be <code>NULL</code>.
+ * @return <code>true</code> if the results were stored successfully, <code>false</code> otherwise.
+ * @ingroup web_search_service
+ */
+WEB_SEARCH_SERVICE_LOCAL bool AddCachedResults (ResultCache *cache_p, const char *key_s, const CachedResults *results_p);
+
+
+/**
+ * Remember that a request failed so that it is not sent to the search
+ * engine again until the time set by SetNegativeCaching has passed.
+ *
+ * @param cache_p The ResultCache to add to.
+ * @param key_s The key identifying the request.
+ * @return <code>true</code> if the failure was stored, <code>false</code> if
+ * caching failures is disabled or upon error.
+ * @ingroup web_search_service
+ */
+WEB_SEARCH_SERVICE_LOCAL bool AddFailedCachedResults (ResultCache *cache_p, const char *key_s);
+
+
+/**
+ * Mark an entry as fresh again after the search engine has confirmed
+ * that it is still valid.
+ *
+ * @param cache_p The ResultCache containing the entry.
+ * @param key_s The key identifying the request.
+ * @return <code>true</code> if the entry was found and renewed, <code>false</code> otherwise.
+ * @ingroup web_search_service
+ */
+WEB_SEARCH_SERVICE_LOCAL bool RenewCachedResults (ResultCache *cache_p, const char *key_s);
+
+
+/**
+ * Record that an entry is being refreshed so that only one refresh
+ * is scheduled for it at a time. The mark is removed when the entry is
+ * next added or renewed, or by calling ClearCachedResultsRefreshing.
+ *
+ * @param cache_p The ResultCache containing the entry.
+ * @param key_s The key identifying the request.
+ * @return <code>true</code> if the entry was marked, <code>false</code> if
+ * it is missing or already being refreshed.
+ * @ingroup web_search_service
+ */
+WEB_SEARCH_SERVICE_LOCAL bool MarkCachedResultsAsRefreshing (ResultCache *cache_p, const char *key_s);
+
+
+/**
+ * Remove the mark added by MarkCachedResultsAsRefreshing, typically
+ * because the refresh failed.
+ *
+ * @param cache_p The ResultCache containing the entry.
+ * @param key_s The key identifying the request.
+ * @ingroup web_search_service
+ */
+WEB_SEARCH_SERVICE_LOCAL void ClearCachedResultsRefreshing (ResultCache *cache_p, const char *key_s);
+
+
+/**
+ * Release the data held by a CachedResults.
+ *
+ * @param results_p The CachedResults to clear.
+ * @ingroup web_search_service
+ */
+WEB_SEARCH_SERVICE_LOCAL void ClearCachedResults (CachedResults *results_p);
+
+
+#ifdef __cplusplus
+}
+#endif
+
+
+#endif		/* #ifndef RESULT_CACHE_HPP */
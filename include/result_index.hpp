@@ -0,0 +1,98 @@
+/*
+** Copyright 2014-2016 The Earlham Institute
+**
+** Licensed under the Apache License, Version 2.0 (the "License");
+** you may not use this file except in compliance with the License.
+** You may obtain a copy of the License at
+**
+**     http://www.apache.org/licenses/LICENSE-2.0
+**
+** Unless required by applicable law or agreed to in writing, software
+** distributed under the License is distributed on an "AS IS" BASIS,
+** WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+** See the License for the specific language governing permissions and
+** limitations under the License.
+*/
+
+/**
+ * @file
+ * @brief A local full-text index of the results that a web search
+ * operation has extracted so that searches can be answered without
+ * calling the search engine.
+ */
+#ifndef RESULT_INDEX_HPP
+#define RESULT_INDEX_HPP
+
+#include "typedefs.h"
+#include "jansson.h"
+
+#include "web_search_service_library.h"
+
+
+/**
+ * The index for a single web search operation. As with the ResultCaches,
+ * these are held in a process-wide registry so that they outlive the
+ * individual Service instances that use them.
+ *
+ * @ingroup web_search_service
+ */
+typedef struct ResultIndex ResultIndex;
+
+
+#ifdef __cplusplus
+extern "C"
+{
+#endif
+
+
+/**
+ * Get the ResultIndex for a given web search operation, creating it if needed.
+ *
+ * @param name_s The name of the operation.
+ * @param uri_s The URI of the search engine that the operation wraps. If this differs
+ * from the URI that an existing index was created for, that index will be emptied.
+ * @param max_results The maximum number of results to index. Once this is reached, the
+ * results that were least recently extracted will be removed.
+ * @return The ResultIndex or <code>NULL</code> upon error.
+ * @ingroup web_search_service
+ */
+WEB_SEARCH_SERVICE_LOCAL ResultIndex *GetResultIndex (const char *name_s, const char *uri_s, const uint32 max_results);
+
+
+/**
+ * Add a set of extracted results to a ResultIndex. Each result is indexed
+ * by the words in all of its string values, such as its address and text.
+ * A result that is already in the index is moved to the back of the queue
+ * to be removed rather than being added again.
+ *
+ * @param index_p The ResultIndex to add to.
+ * @param results_p The array of results. The ResultIndex keeps its own deep
+ * copies of these so the caller retains ownership.
+ * @return <code>true</code> if the results were added successfully, <code>false</code> otherwise.
+ * @ingroup web_search_service
+ */
+WEB_SEARCH_SERVICE_LOCAL bool AddResultsToIndex (ResultIndex *index_p, const json_t *results_p);
+
+
+/**
+ * Find the indexed results that contain all of the words in a query.
+ * The last word matches any word that starts with it, so that the
+ * results can be updated as someone types a query.
+ *
+ * @param index_p The ResultIndex to search.
+ * @param query_s The query.
+ * @param max_results The maximum number of results to return. The most recently
+ * extracted results are returned first.
+ * @return A new array of the matching results, which may be empty, or
+ * <code>NULL</code> if the query has no words or upon error.
+ * @ingroup web_search_service
+ */
+WEB_SEARCH_SERVICE_LOCAL json_t *SearchResultIndex (ResultIndex *index_p, const char *query_s, const uint32 max_results);
+
+
+#ifdef __cplusplus
+}
+#endif
+
+
+#endif		/* #ifndef RESULT_INDEX_HPP */
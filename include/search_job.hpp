@@ -0,0 +1,165 @@
+/*
+** Copyright 2014-2016 The Earlham Institute
+**
+** Licensed under the Apache License, Version 2.0 (the "License");
+** you may not use this file except in compliance with the License.
+** You may obtain a copy of the License at
+**
+**     http://www.apache.org/licenses/LICENSE-2.0
+**
+** Unless required by applicable law or agreed to in writing, software
+** distributed under the License is distributed on an "AS IS" BASIS,
+** WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+** See the License for the specific language governing permissions and
+** limitations under the License.
+*/
+
+/**
+ * @file
+ * @brief The progress of a search, which collects its partial results,
+ * errors and final results so that they can be passed on to its
+ * ServiceJob from whichever thread is polling the job.
+ */
+#ifndef SEARCH_JOB_HPP
+#define SEARCH_JOB_HPP
+
+#include "typedefs.h"
+#include "jansson.h"
+#include "service_job.h"
+
+#include "web_search_service_library.h"
+
+
+/**
+ * The progress of a single search.
+ *
+ * @ingroup web_search_service
+ */
+typedef struct SearchJob SearchJob;
+
+
+/**
+ * The function that carries out a search in the background.
+ *
+ * @param search_p The SearchJob to add any partial results and errors to.
+ * @param data_p The data passed to RunSearchJobInBackground.
+ * @return The full set of results or <code>NULL</code> if the search failed.
+ * @ingroup web_search_service
+ */
+typedef json_t *(*SearchJobRunner) (SearchJob *search_p, void *data_p);
+
+
+/**
+ * The function that releases the data for a background search once it
+ * has been run or if it could not be started.
+ *
+ * @param data_p The data passed to RunSearchJobInBackground.
+ * @ingroup web_search_service
+ */
+typedef void (*SearchJobDataFreer) (void *data_p);
+
+
+#ifdef __cplusplus
+extern "C"
+{
+#endif
+
+
+/**
+ * Allocate a SearchJob.
+ *
+ * @return The SearchJob or <code>NULL</code> upon error.
+ * @ingroup web_search_service
+ */
+WEB_SEARCH_SERVICE_LOCAL SearchJob *AllocateSearchJob (void);
+
+
+/**
+ * Free a SearchJob. If it is still being run in the background, it is
+ * only freed once that has finished.
+ *
+ * @param search_p The SearchJob to free.
+ * @ingroup web_search_service
+ */
+WEB_SEARCH_SERVICE_LOCAL void FreeSearchJob (SearchJob *search_p);
+
+
+/**
+ * Add a batch of partial results to a SearchJob. This has the signature
+ * of a LinkBatchCallback so that it can be passed straight to the link
+ * extraction functions. The results are copied, so they are not shared
+ * with the thread that passes them on to the ServiceJob.
+ *
+ * @param results_p The array of results so far.
+ * @param from The index of the first result in the batch.
+ * @param to The index after the last result in the batch.
+ * @param data_p The SearchJob.
+ * @return <code>true</code> if the batch was added, <code>false</code> upon error.
+ * @ingroup web_search_service
+ */
+WEB_SEARCH_SERVICE_LOCAL bool AddSearchJobResults (json_t *results_p, const size_t from, const size_t to, void *data_p);
+
+
+/**
+ * Add an error message for the user to a SearchJob.
+ *
+ * @param search_p The SearchJob.
+ * @param message_s The message, which is copied.
+ * @ingroup web_search_service
+ */
+WEB_SEARCH_SERVICE_LOCAL void AddSearchJobError (SearchJob *search_p, const char *message_s);
+
+
+/**
+ * Mark a SearchJob as finished.
+ *
+ * @param search_p The SearchJob.
+ * @param results_p The full set of results, which the SearchJob takes
+ * ownership of, or <code>NULL</code> if the search failed.
+ * @ingroup web_search_service
+ */
+WEB_SEARCH_SERVICE_LOCAL void FinishSearchJob (SearchJob *search_p, json_t *results_p);
+
+
+/**
+ * Pass on any errors and results that a SearchJob has gathered since it
+ * was last called to a ServiceJob and update the ServiceJob's status.
+ * Whilst the search is running, any new partial results are added to the
+ * ServiceJob and it is marked as partially succeeded. Once the search
+ * has finished, its full results replace them.
+ *
+ * @param search_p The SearchJob.
+ * @param job_p The ServiceJob to update.
+ * @return <code>true</code> if the search has finished, <code>false</code>
+ * if it is still running.
+ * @ingroup web_search_service
+ */
+WEB_SEARCH_SERVICE_LOCAL bool UpdateServiceJobFromSearchJob (SearchJob *search_p, ServiceJob *job_p);
+
+
+/**
+ * Run a search on a thread of its own. The ServiceJob is given an update
+ * function that calls UpdateServiceJobFromSearchJob whenever the job is
+ * polled, so the job is only ever changed by the threads that poll it.
+ * The ServiceJob must stay live until it has seen the search finish.
+ *
+ * @param search_p The SearchJob for the search.
+ * @param job_p The ServiceJob to pass the search's results on to.
+ * @param run_fn The function to run the search.
+ * @param free_fn The function to free data_p. This is called before the
+ * search is marked as finished, so it can release anything that the
+ * ServiceJob's Service owns. This can be <code>NULL</code>.
+ * @param data_p The data to pass to run_fn and free_fn.
+ * @return <code>true</code> if the search was started. Upon error,
+ * <code>false</code> is returned and free_fn will have been called on data_p.
+ * @ingroup web_search_service
+ */
+WEB_SEARCH_SERVICE_LOCAL bool RunSearchJobInBackground (SearchJob *search_p, ServiceJob *job_p, SearchJobRunner run_fn, SearchJobDataFreer free_fn, void *data_p);
+
+
+#ifdef __cplusplus
+}
+#endif
+
+
+#endif		/* #ifndef SEARCH_JOB_HPP */
@@ -0,0 +1,124 @@
+/*
+** Copyright 2014-2016 The Earlham Institute
+**
+** Licensed under the Apache License, Version 2.0 (the "License");
+** you may not use this file except in compliance with the License.
+** You may obtain a copy of the License at
+**
+**     http://www.apache.org/licenses/LICENSE-2.0
+**
+** Unless required by applicable law or agreed to in writing, software
+** distributed under the License is distributed on an "AS IS" BASIS,
+** WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+** See the License for the specific language governing permissions and
+** limitations under the License.
+*/
+
+/**
+ * @file
+ * @brief Scheduling of searches between priority classes so that bulk
+ * searches cannot crowd out interactive ones.
+ */
+#ifndef SEARCH_SCHEDULER_HPP
+#define SEARCH_SCHEDULER_HPP
+
+#include "typedefs.h"
+
+#include "web_search_service_library.h"
+
+
+/**
+ * The priority classes that searches are scheduled in.
+ *
+ * @ingroup web_search_service
+ */
+typedef enum SearchPriority
+{
+	/** Searches made by people who are waiting for the results. */
+	SP_INTERACTIVE,
+
+	/** Searches made by batch jobs and background refreshes. */
+	SP_BULK,
+
+	/** The number of priority classes. */
+	SP_NUM_PRIORITIES
+} SearchPriority;
+
+
+/**
+ * The scheduling settings for a priority class.
+ *
+ * @ingroup web_search_service
+ */
+typedef struct SearchClassLimits
+{
+	/** The maximum number of searches in the class that can run at once or 0 for no limit. */
+	uint32 scl_max_running;
+
+	/**
+	 * The class's share of the searches that are started when more than one
+	 * class is waiting, relative to the weights of the other classes.
+	 */
+	uint32 scl_weight;
+} SearchClassLimits;
+
+
+#ifdef __cplusplus
+extern "C"
+{
+#endif
+
+
+/**
+ * Set how searches are scheduled. These settings are shared by every operation.
+ *
+ * @param max_running The maximum number of searches that can run at once, across
+ * all of the classes, or 0 for no limit.
+ * @param limits_p The settings for each class, indexed by SearchPriority.
+ * @ingroup web_search_service
+ */
+WEB_SEARCH_SERVICE_LOCAL void SetSearchSchedulerLimits (const uint32 max_running, const SearchClassLimits *limits_p);
+
+
+/**
+ * Get the SearchPriority with the given name.
+ *
+ * @param name_s The name, either "interactive" or "bulk".
+ * @param priority_p Where the SearchPriority will be stored.
+ * @return <code>true</code> if the name was recognised, <code>false</code> otherwise.
+ * @ingroup web_search_service
+ */
+WEB_SEARCH_SERVICE_LOCAL bool GetSearchPriorityFromString (const char *name_s, SearchPriority *priority_p);
+
+
+/**
+ * Wait for a search to be allowed to run. Whenever a search finishes, the
+ * waiting search that is started next is taken from whichever class, that
+ * is under its own limit, has had the smallest share of the searches relative
+ * to its weight. Within a class, searches are started in the order that they
+ * arrived.
+ *
+ * @param priority The class of the search.
+ * @param timeout The maximum number of seconds to wait.
+ * @return <code>true</code> if the search can run, in which case ReleaseSearchSlot
+ * must be called once it has finished, or <code>false</code> if the wait timed out.
+ * @ingroup web_search_service
+ */
+WEB_SEARCH_SERVICE_LOCAL bool AcquireSearchSlot (const SearchPriority priority, const uint32 timeout);
+
+
+/**
+ * Record that a search started by AcquireSearchSlot has finished.
+ *
+ * @param priority The class of the search.
+ * @ingroup web_search_service
+ */
+WEB_SEARCH_SERVICE_LOCAL void ReleaseSearchSlot (const SearchPriority priority);
+
+
+#ifdef __cplusplus
+}
+#endif
+
+
+#endif		/* #ifndef SEARCH_SCHEDULER_HPP */
@@ -66,6 +66,75 @@ typedef struct HtmlLinkArray
 } HtmlLinkArray;
 
 
+/**
+ * A function that is called with each batch of links as they are extracted.
+ *
+ * @param links_p The JSON array of all of the links extracted so far.
+ * @param from The index in links_p of the first link in the batch.
+ * @param to The index in links_p after the last link in the batch.
+ * @param data_p The custom data that was passed along with the callback.
+ * @return <code>true</code> to carry on extracting links, <code>false</code> to
+ * stop passing on any further batches.
+ */
+typedef bool (*LinkBatchCallback) (json_t *links_p, const size_t from, const size_t to, void *data_p);
+
+
+/**
+ * Where to find the results within the structured data, such as JSON-LD,
+ * that a page embeds in its script elements. Each of the paths is a list
+ * of object keys and array indexes separated by dots such as "item.url".
+ *
+ * @ingroup network_group
+ */
+typedef struct StructuredDataMapping
+{
+	/** The type attribute of the script elements to read such as "application/ld+json". */
+	const char *sdm_script_type_s;
+
+	/** The id of the script element to read or <code>NULL</code> to try each one of the right type. */
+	const char *sdm_script_id_s;
+
+	/**
+	 * The "@type" that the top level of the data must have or <code>NULL</code> to
+	 * accept any data. This tells an ItemList of results apart from a BreadcrumbList.
+	 */
+	const char *sdm_data_type_s;
+
+	/** The path to the array of results or <code>NULL</code> if the data is the array. */
+	const char *sdm_results_path_s;
+
+	/** The path within each result to its URI. */
+	const char *sdm_uri_path_s;
+
+	/** The path within each result to its title, which is used as the link's text, or <code>NULL</code>. */
+	const char *sdm_title_path_s;
+
+	/** The path within each result to its snippet or <code>NULL</code>. */
+	const char *sdm_snippet_path_s;
+} StructuredDataMapping;
+
+
+/**
+ * How to put the URIs of links into a canonical form so that different
+ * links to the same page can be recognised. The scheme and host are put
+ * into lower case, default ports, fragments and the given query parameters
+ * are removed, and "." and ".." segments are resolved in the path.
+ *
+ * @ingroup network_group
+ */
+typedef struct UriCanonicalisation
+{
+	/**
+	 * The names of the query parameters to remove, such as tracking ones.
+	 * A name ending in '*' removes every parameter starting with the rest of it.
+	 */
+	const char * const *uc_removed_params_ss;
+
+	/** The number of entries in uc_removed_params_ss. */
+	size_t uc_num_removed_params;
+} UriCanonicalisation;
+
+
 #ifdef __cplusplus
 extern "C"
 {
@@ -107,6 +176,73 @@ GRASSROOTS_NETWORK_API HtmlLinkArray *GetLinks (CurlTool *tool_p, const char * c
 GRASSROOTS_NETWORK_API json_t *GetMatchingLinksAsJSON (const char * const data_s, const char * const link_selector_s, const char * const title_selector_s, const char * const base_uri_s);
 
 
+/**
+ * Get an HtmlLinkArray in JSON format from a buffer of HTML data that
+ * is not necessarily NULL-terminated at the end of the data to use.
+ *
+ * @param data_s The HTML data.
+ * @param data_length The length of the HTML data.
+ * @param link_selector_s The CSS Selector for getting the uri link.
+ * @param title_selector_s The CSS Selector for getting the link's title. If this is <code>NULL</code>,
+ * then the inner text of the element found by link_selector_s will be used.
+ * @param base_uri_s The URI to prepend to any links.
+ * @return The JSON fragment or <code>NULL</code> upon error.
+ * @memberof HtmlLinkArray
+ * @see GetMatchingLinksAsJSON
+ */
+GRASSROOTS_NETWORK_API json_t *GetMatchingLinksAsJSONFromBuffer (const char * const data_s, const size_t data_length, const char * const link_selector_s, const char * const title_selector_s, const char * const base_uri_s);
+
+
+/**
+ * Get an HtmlLinkArray in JSON format from a buffer of HTML data, passing
+ * on the links in batches as they are extracted.
+ *
+ * @param data_s The HTML data.
+ * @param data_length The length of the HTML data.
+ * @param link_selector_s The CSS Selector for getting the uri link.
+ * @param title_selector_s The CSS Selector for getting the link's title.
+ * @param base_uri_s The URI to prepend to any links.
+ * @param canonical_p How to canonicalise the links' URIs. Only the first link to
+ * each page is kept, with http and https links and those with and without a
+ * trailing slash counted as the same. If this is <code>NULL</code>, the URIs are
+ * used as they are and all of the links are kept.
+ * @param max_nodes The maximum number of nodes that the page can have. If it has more,
+ * parsing stops as soon as the limit is reached and no links are extracted.
+ * If this is 0, there is no limit.
+ * @param batch_size The number of links in each batch. If this is 0, each link
+ * is passed on as soon as it has been extracted.
+ * @param callback_fn The function to call with each batch. This can be <code>NULL</code>.
+ * @param callback_data_p The custom data to pass to callback_fn.
+ * @return The JSON array of all of the links or <code>NULL</code> upon error.
+ * @memberof HtmlLinkArray
+ * @see GetMatchingLinksAsJSONFromBuffer
+ */
+GRASSROOTS_NETWORK_API json_t *GetMatchingLinksAsJSONInBatches (const char * const data_s, const size_t data_length, const char * const link_selector_s, const char * const title_selector_s, const char * const base_uri_s, const UriCanonicalisation *canonical_p, const size_t max_nodes, const size_t batch_size, LinkBatchCallback callback_fn, void *callback_data_p);
+
+
+/**
+ * Get the links from the structured data embedded in a page, in the same
+ * JSON format as GetMatchingLinksAsJSON, without parsing the page's HTML.
+ * Each script element of the mapping's type is tried in turn until one
+ * has the array of results. If a result has a snippet, it is added to its
+ * link's JSON as "snippet".
+ *
+ * @param data_s The HTML data.
+ * @param data_length The length of the HTML data.
+ * @param mapping_p Where to find the script element and the results within it.
+ * @param base_uri_s The URI to prepend to any links.
+ * @param canonical_p How to canonicalise the links' URIs, as for GetMatchingLinksAsJSONInBatches.
+ * @param batch_size The number of links in each batch.
+ * @param callback_fn The function to call with each batch. This can be <code>NULL</code>.
+ * @param callback_data_p The custom data to pass to callback_fn.
+ * @return The JSON array of all of the links or <code>NULL</code> if the page
+ * does not have the structured data or upon error.
+ * @memberof HtmlLinkArray
+ * @see GetMatchingLinksAsJSONInBatches
+ */
+GRASSROOTS_NETWORK_API json_t *GetStructuredDataLinksAsJSONInBatches (const char * const data_s, const size_t data_length, const StructuredDataMapping *mapping_p, const char * const base_uri_s, const UriCanonicalisation *canonical_p, const size_t batch_size, LinkBatchCallback callback_fn, void *callback_data_p);
+
+
 /**
  * Get an HtmlLinkArray from an HTML fragment.
  *
@@ -122,6 +258,23 @@ GRASSROOTS_NETWORK_API json_t *GetMatchingLinksAsJSON (const char * const data_s
  */
 GRASSROOTS_NETWORK_API HtmlLinkArray *GetMatchingLinks (const char * const data_s, const char * const link_selector_s, const char * const title_selector_s, const char * const base_uri_s);
 
+
+/**
+ * Get an HtmlLinkArray from a buffer of HTML data. The data is parsed
+ * in place without being copied.
+ *
+ * @param data_s The HTML data.
+ * @param data_length The length of the HTML data.
+ * @param link_selector_s The CSS Selector for getting the uri link.
+ * @param title_selector_s The CSS Selector for getting the link's title. If this is <code>NULL</code>,
+ * then the inner text of the element found by link_selector_s will be used.
+ * @param base_uri_s The URI to prepend to any links.
+ * @return The HtmlLinkArray or <code>NULL</code> upon error.
+ * @memberof HtmlLinkArray
+ * @see GetMatchingLinks
+ */
+GRASSROOTS_NETWORK_API HtmlLinkArray *GetMatchingLinksFromBuffer (const char * const data_s, const size_t data_length, const char * const link_selector_s, const char * const title_selector_s, const char * const base_uri_s);
+
 /**
  * Free a HtmlLinkArray
  *
@@ -131,6 +284,18 @@ GRASSROOTS_NETWORK_API HtmlLinkArray *GetMatchingLinks (const char * const data_
 GRASSROOTS_NETWORK_API void FreeHtmlLinkArray (HtmlLinkArray *links_p);
 
 
+/**
+ * Check and compile a set of selectors ahead of them being used, spreading
+ * the work across the available cores. Each selector is only ever parsed
+ * once and the result is shared by every later use of it.
+ *
+ * @param selectors_ss The selectors to prepare. Any <code>NULL</code> entries are skipped.
+ * @param num_selectors The number of selectors.
+ * @return <code>true</code> if all of the selectors are valid, <code>false</code> otherwise.
+ */
+GRASSROOTS_NETWORK_API bool PrepareSelectors (const char * const *selectors_ss, const size_t num_selectors);
+
+
 #ifdef __cplusplus
 }
 #endif
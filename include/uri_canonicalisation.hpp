@@ -0,0 +1,92 @@
+/*
+** Copyright 2014-2016 The Earlham Institute
+**
+** Licensed under the Apache License, Version 2.0 (the "License");
+** you may not use this file except in compliance with the License.
+** You may obtain a copy of the License at
+**
+**     http://www.apache.org/licenses/LICENSE-2.0
+**
+** Unless required by applicable law or agreed to in writing, software
+** distributed under the License is distributed on an "AS IS" BASIS,
+** WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+** See the License for the specific language governing permissions and
+** limitations under the License.
+*/
+
+/**
+ * @file
+ * @brief The canonical forms of the URIs of extracted links and the
+ * set of them that have been seen so far on a page, which the selectors
+ * use to drop duplicate links.
+ */
+#ifndef URI_CANONICALISATION_HPP
+#define URI_CANONICALISATION_HPP
+
+#include <string>
+#include <vector>
+
+#include "typedefs.h"
+
+#include "selector.hpp"
+#include "web_search_service_library.h"
+
+
+/**
+ * The hashes of the canonical URIs that have been seen so far while
+ * extracting a page's links. Only the hashes are stored, in an open
+ * addressing table that is sized for all of the page's links up front,
+ * so two different URIs with the same 64-bit hash would count as one.
+ *
+ * @ingroup web_search_service
+ */
+class WEB_SEARCH_SERVICE_LOCAL SeenUriSet
+{
+public:
+	/**
+	 * Create a SeenUriSet.
+	 *
+	 * @param num_links The number of links that will be added. If this is 0,
+	 * nothing is stored and every key is treated as new.
+	 */
+	SeenUriSet (const size_t num_links);
+	~SeenUriSet ();
+
+	/**
+	 * Add the key of a canonical URI.
+	 *
+	 * @param key_r The key.
+	 * @return <code>false</code> if the key has been added already,
+	 * <code>true</code> otherwise.
+	 */
+	bool Add (const std :: string &key_r);
+
+private:
+	std :: vector <uint64> sus_hashes;
+
+	/* The table's size minus one or 0 if it couldn't be allocated */
+	size_t sus_mask;
+};
+
+
+/**
+ * Get the canonical form of an http or https URI along with the key to
+ * compare it by. The scheme and host are lower-cased, default ports,
+ * "." and ".." path segments, removed query parameters and the fragment
+ * are dropped, and percent-encoded bytes use upper-case hex digits. The
+ * key leaves out the scheme and any trailing slash on the path so that
+ * the secure and insecure versions of a page and the ones with and
+ * without a trailing slash match.
+ *
+ * @param uri_s The URI.
+ * @param canonical_p The query parameters to remove.
+ * @param uri_r Set to the canonical URI.
+ * @param key_r Set to the key for the canonical URI.
+ * @return <code>true</code> if the URI was canonicalised or <code>false</code>
+ * if it is not an http or https URI, in which case it should be left as it is.
+ * @ingroup web_search_service
+ */
+WEB_SEARCH_SERVICE_LOCAL bool GetCanonicalUri (const char *uri_s, const UriCanonicalisation *canonical_p, std :: string &uri_r, std :: string &key_r);
+
+
+#endif		/* #ifndef URI_CANONICALISATION_HPP */
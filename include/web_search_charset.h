@@ -0,0 +1,65 @@
+/*
+** Copyright 2014-2016 The Earlham Institute
+**
+** Licensed under the Apache License, Version 2.0 (the "License");
+** you may not use this file except in compliance with the License.
+** You may obtain a copy of the License at
+**
+**     http://www.apache.org/licenses/LICENSE-2.0
+**
+** Unless required by applicable law or agreed to in writing, software
+** distributed under the License is distributed on an "AS IS" BASIS,
+** WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+** See the License for the specific language governing permissions and
+** limitations under the License.
+*/
+
+/**
+ * @file
+ * @brief Functions for converting the search engines' pages into UTF-8
+ * before the results are extracted from them.
+ */
+#ifndef WEB_SEARCH_CHARSET_H
+#define WEB_SEARCH_CHARSET_H
+
+#include <stddef.h>
+
+#include "typedefs.h"
+#include "web_search_service_library.h"
+
+
+#ifdef __cplusplus
+extern "C"
+{
+#endif
+
+
+/**
+ * Convert an HTML page into UTF-8 if needed.
+ *
+ * The character set is taken from the Content-Type header or, failing that,
+ * from a meta tag near the start of the page. Runs of ASCII characters are
+ * copied as they are, so pages that are already UTF-8 or that only contain
+ * ASCII in an ASCII-compatible character set are not copied at all. Pages
+ * in other character sets, such as UTF-16 or ISO-2022-JP, are always
+ * converted.
+ *
+ * @param data_s The page.
+ * @param length The length of the page.
+ * @param content_type_s The value of the response's Content-Type header. This can be <code>NULL</code>.
+ * @param converted_length_p If the page is converted, this will be set to the length
+ * of the converted page.
+ * @return The newly-allocated UTF-8 version of the page which should be freed with
+ * FreeMemory, or <code>NULL</code> if the page did not need converting or could
+ * not be converted.
+ * @ingroup web_search_service
+ */
+WEB_SEARCH_SERVICE_LOCAL char *ConvertPageToUTF8 (const char *data_s, const size_t length, const char *content_type_s, size_t *converted_length_p);
+
+
+#ifdef __cplusplus
+}
+#endif
+
+
+#endif		/* #ifndef WEB_SEARCH_CHARSET_H */
@@ -0,0 +1,247 @@
+/*
+** Copyright 2014-2016 The Earlham Institute
+**
+** Licensed under the Apache License, Version 2.0 (the "License");
+** you may not use this file except in compliance with the License.
+** You may obtain a copy of the License at
+**
+**     http://www.apache.org/licenses/LICENSE-2.0
+**
+** Unless required by applicable law or agreed to in writing, software
+** distributed under the License is distributed on an "AS IS" BASIS,
+** WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+** See the License for the specific language governing permissions and
+** limitations under the License.
+*/
+
+/**
+ * @file
+ * @brief Functions for adjusting how a web search operation's CurlTool
+ * sends its requests and for examining the responses that it receives.
+ */
+#ifndef WEB_SEARCH_FETCH_H
+#define WEB_SEARCH_FETCH_H
+
+#include <curl/curl.h>
+
+#include "curl_tools.h"
+#include "web_search_service_library.h"
+
+
+/**
+ * The response headers that the Web Search Service is interested in.
+ *
+ * @ingroup web_search_service
+ */
+typedef struct ResponseHeaders
+{
+	/** The value of the ETag header or <code>NULL</code> if it was not sent. */
+	char *rh_etag_s;
+
+	/** The value of the Last-Modified header or <code>NULL</code> if it was not sent. */
+	char *rh_last_modified_s;
+} ResponseHeaders;
+
+
+/**
+ * The limits on the size of a response that a CurlTool is downloading.
+ *
+ * @ingroup web_search_service
+ */
+typedef struct ResponseLimits
+{
+	/** The CurlTool that is downloading the response. */
+	CurlTool *rl_tool_p;
+
+	/** The maximum number of bytes that the response can use or 0 for no limit. */
+	size_t rl_max_size;
+
+	/** The number of bytes of the response counted against the memory budget. */
+	size_t rl_used_size;
+
+	/** Set to <code>true</code> if the transfer was aborted for exceeding rl_max_size. */
+	bool rl_exceeded_flag;
+} ResponseLimits;
+
+
+/**
+ * The times that the stages of a CurlTool's last transfer finished at,
+ * each in microseconds from the start of the transfer.
+ *
+ * @ingroup web_search_service
+ */
+typedef struct TransferTimings
+{
+	/** When the search engine's name had been resolved. */
+	curl_off_t tt_name_lookup;
+
+	/** When the connection to the search engine had been made. */
+	curl_off_t tt_connect;
+
+	/** When the TLS handshake had finished or 0 if the connection was not encrypted. */
+	curl_off_t tt_app_connect;
+
+	/** When the first byte of the response arrived. */
+	curl_off_t tt_start_transfer;
+
+	/** When the whole response had arrived. */
+	curl_off_t tt_total;
+} TransferTimings;
+
+
+#ifdef __cplusplus
+extern "C"
+{
+#endif
+
+
+/**
+ * Start recording the response headers that a CurlTool receives.
+ *
+ * @param tool_p The CurlTool to record the headers for.
+ * @param headers_p The ResponseHeaders to store the values in. This must remain
+ * valid until StopCapturingResponseHeaders is called.
+ * @return <code>true</code> if the CurlTool was set up successfully, <code>false</code> otherwise.
+ * @ingroup web_search_service
+ */
+WEB_SEARCH_SERVICE_LOCAL bool StartCapturingResponseHeaders (CurlTool *tool_p, ResponseHeaders *headers_p);
+
+
+/**
+ * Stop recording the response headers that a CurlTool receives.
+ *
+ * @param tool_p The CurlTool to stop recording the headers for.
+ * @ingroup web_search_service
+ */
+WEB_SEARCH_SERVICE_LOCAL void StopCapturingResponseHeaders (CurlTool *tool_p);
+
+
+/**
+ * Free any values stored in a ResponseHeaders.
+ *
+ * @param headers_p The ResponseHeaders to clear.
+ * @ingroup web_search_service
+ */
+WEB_SEARCH_SERVICE_LOCAL void ClearResponseHeaders (ResponseHeaders *headers_p);
+
+
+/**
+ * Start enforcing a limit on the size of the responses that a CurlTool receives.
+ * The limit is checked as the data arrives, after any decompression, and the
+ * transfer is aborted as soon as it is exceeded rather than once the whole
+ * response has been stored. The memory used by the response also counts against
+ * the memory budget until StopLimitingResponseSize is called.
+ *
+ * @param tool_p The CurlTool to limit.
+ * @param limits_p The ResponseLimits to use. This must remain valid until
+ * StopLimitingResponseSize is called.
+ * @param max_size The maximum number of bytes or 0 for no limit.
+ * @return <code>true</code> if the CurlTool was set up successfully, <code>false</code> otherwise.
+ * @ingroup web_search_service
+ */
+WEB_SEARCH_SERVICE_LOCAL bool StartLimitingResponseSize (CurlTool *tool_p, ResponseLimits *limits_p, const size_t max_size);
+
+
+/**
+ * Stop enforcing the limit set by StartLimitingResponseSize and return
+ * the memory used by the response to the memory budget. This should be
+ * called once the response has been processed.
+ *
+ * @param limits_p The ResponseLimits passed to StartLimitingResponseSize.
+ * @ingroup web_search_service
+ */
+WEB_SEARCH_SERVICE_LOCAL void StopLimitingResponseSize (ResponseLimits *limits_p);
+
+
+/**
+ * Make the next request from a CurlTool a conditional one so that the
+ * search engine only sends a body if its content has changed.
+ *
+ * @param tool_p The CurlTool to make the request with.
+ * @param etag_s The ETag of the cached response or <code>NULL</code> if there isn't one.
+ * @param last_modified_s The Last-Modified value of the cached response or <code>NULL</code>
+ * if there isn't one.
+ * @return The list of headers added to the request which must be passed to
+ * ClearConditionalRequestHeaders after the request has finished, or <code>NULL</code>
+ * if no headers were added.
+ * @ingroup web_search_service
+ */
+WEB_SEARCH_SERVICE_LOCAL struct curl_slist *SetConditionalRequestHeaders (CurlTool *tool_p, const char *etag_s, const char *last_modified_s);
+
+
+/**
+ * Remove the headers added by SetConditionalRequestHeaders.
+ *
+ * @param tool_p The CurlTool that made the request.
+ * @param headers_p The value returned by SetConditionalRequestHeaders.
+ * @ingroup web_search_service
+ */
+WEB_SEARCH_SERVICE_LOCAL void ClearConditionalRequestHeaders (CurlTool *tool_p, struct curl_slist *headers_p);
+
+
+/**
+ * Get the HTTP status code of the last response that a CurlTool received.
+ *
+ * @param tool_p The CurlTool to check.
+ * @return The status code or 0 if it could not be determined.
+ * @ingroup web_search_service
+ */
+WEB_SEARCH_SERVICE_LOCAL long GetCurlToolResponseCode (CurlTool *tool_p);
+
+
+/**
+ * Get the timings of the last transfer that a CurlTool made. If a connection
+ * was reused, the name lookup and connection times will be 0.
+ *
+ * @param tool_p The CurlTool to check.
+ * @param timings_p Where the timings will be stored.
+ * @return <code>true</code> if the timings were retrieved successfully, <code>false</code> otherwise.
+ * @ingroup web_search_service
+ */
+WEB_SEARCH_SERVICE_LOCAL bool GetCurlToolTimings (CurlTool *tool_p, TransferTimings *timings_p);
+
+
+/**
+ * Get the Content-Type of the last response that a CurlTool received.
+ *
+ * @param tool_p The CurlTool to check.
+ * @return The Content-Type, which belongs to the CurlTool, or <code>NULL</code>
+ * if it was not sent.
+ * @ingroup web_search_service
+ */
+WEB_SEARCH_SERVICE_LOCAL const char *GetCurlToolContentType (CurlTool *tool_p);
+
+
+/**
+ * Set whether a CurlTool asks for its responses to be compressed. If so, it
+ * advertises every encoding that libcurl was built with support for, such as
+ * gzip, deflate and brotli, and the response is decompressed as it arrives
+ * so only the decompressed data is ever stored.
+ *
+ * @param tool_p The CurlTool to adjust.
+ * @param compress_flag <code>true</code> to request compressed responses,
+ * <code>false</code> to request them without any encoding.
+ * @return <code>true</code> if the CurlTool was updated successfully, <code>false</code> otherwise.
+ * @ingroup web_search_service
+ */
+WEB_SEARCH_SERVICE_LOCAL bool SetCurlToolCompression (CurlTool *tool_p, const bool compress_flag);
+
+
+/**
+ * Get the URI that a CurlTool last made a request to, after following
+ * any redirects.
+ *
+ * @param tool_p The CurlTool to check.
+ * @return The URI, which belongs to the CurlTool, or <code>NULL</code> if it
+ * could not be determined.
+ * @ingroup web_search_service
+ */
+WEB_SEARCH_SERVICE_LOCAL const char *GetCurlToolEffectiveUri (CurlTool *tool_p);
+
+
+#ifdef __cplusplus
+}
+#endif
+
+
+#endif		/* #ifndef WEB_SEARCH_FETCH_H */
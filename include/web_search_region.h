@@ -0,0 +1,78 @@
+/*
+** Copyright 2014-2016 The Earlham Institute
+**
+** Licensed under the Apache License, Version 2.0 (the "License");
+** you may not use this file except in compliance with the License.
+** You may obtain a copy of the License at
+**
+**     http://www.apache.org/licenses/LICENSE-2.0
+**
+** Unless required by applicable law or agreed to in writing, software
+** distributed under the License is distributed on an "AS IS" BASIS,
+** WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+** See the License for the specific language governing permissions and
+** limitations under the License.
+*/
+
+/**
+ * @file
+ * @brief Functions for finding the part of a search engine's page that
+ * contains the results so that the rest of it does not need parsing.
+ */
+#ifndef WEB_SEARCH_REGION_H
+#define WEB_SEARCH_REGION_H
+
+#include <stddef.h>
+
+#include "typedefs.h"
+#include "web_search_service_library.h"
+
+
+#ifdef __cplusplus
+extern "C"
+{
+#endif
+
+
+/**
+ * Find the first occurrence of a sequence of bytes within a buffer.
+ *
+ * @param data_s The buffer to search.
+ * @param length The length of the buffer.
+ * @param needle_s The bytes to search for.
+ * @param needle_length The number of bytes to search for.
+ * @return The start of the first match or <code>NULL</code> if there isn't one.
+ * @ingroup web_search_service
+ */
+WEB_SEARCH_SERVICE_LOCAL const char *FindBytes (const char *data_s, const size_t length, const char *needle_s, const size_t needle_length);
+
+
+/**
+ * Get the region of a page between a pair of markers.
+ *
+ * Each marker is either a literal piece of text or, if it is of the form
+ * <code>tag#id</code>, the opening tag of the element with the given name and id.
+ * The region starts at the beginning of the start marker and finishes just before
+ * the first end marker after it.
+ *
+ * @param data_s The page.
+ * @param length The length of the page.
+ * @param start_marker_s The start marker. If this is <code>NULL</code>, the region
+ * starts at the beginning of the page.
+ * @param end_marker_s The end marker. If this is <code>NULL</code> or not found, the
+ * region runs to the end of the page.
+ * @param region_pp This will be set to the start of the region.
+ * @param region_length_p This will be set to the length of the region.
+ * @return <code>true</code> if the region was found, <code>false</code> if the start
+ * marker was not found in which case the whole page is used.
+ * @ingroup web_search_service
+ */
+WEB_SEARCH_SERVICE_LOCAL bool GetPageRegion (const char *data_s, const size_t length, const char *start_marker_s, const char *end_marker_s, const char **region_pp, size_t *region_length_p);
+
+
+#ifdef __cplusplus
+}
+#endif
+
+
+#endif		/* #ifndef WEB_SEARCH_REGION_H */
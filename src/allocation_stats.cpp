@@ -0,0 +1,238 @@
+/*
+** Copyright 2014-2016 The Earlham Institute
+**
+** Licensed under the Apache License, Version 2.0 (the "License");
+** you may not use this file except in compliance with the License.
+** You may obtain a copy of the License at
+**
+**     http://www.apache.org/licenses/LICENSE-2.0
+**
+** Unless required by applicable law or agreed to in writing, software
+** distributed under the License is distributed on an "AS IS" BASIS,
+** WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+** See the License for the specific language governing permissions and
+** limitations under the License.
+*/
+/*
+ * allocation_stats.cpp
+ *
+ *  Created on: 18 Oct 2026
+ */
+
+#include "allocation_stats.hpp"
+
+#include <algorithm>
+#include <mutex>
+#include <new>
+#include <string>
+#include <unordered_map>
+
+#include "streams.h"
+
+using namespace std;
+
+
+struct StageCounts
+{
+	size_t sc_num_allocations = 0;
+	size_t sc_num_bytes = 0;
+
+	/* The bytes that have been allocated and not yet freed */
+	size_t sc_live_bytes = 0;
+	size_t sc_peak_bytes = 0;
+};
+
+
+/* The counts for the request that is running on a thread */
+struct RequestAllocations
+{
+	StageCounts ra_stages [AS_NUM_STAGES];
+	size_t ra_live_bytes = 0;
+	size_t ra_peak_bytes = 0;
+};
+
+
+struct OperationTotals
+{
+	uint64 ot_num_requests = 0;
+	uint64 ot_num_allocations [AS_NUM_STAGES] = { 0 };
+	uint64 ot_num_bytes [AS_NUM_STAGES] = { 0 };
+
+	/* The largest peaks of any single request */
+	uint64 ot_max_peak_bytes [AS_NUM_STAGES] = { 0 };
+	uint64 ot_max_request_peak_bytes = 0;
+};
+
+
+static const char * const S_STAGE_NAMES_SS [AS_NUM_STAGES] = { "dom", "selectors", "links", "json" };
+
+static thread_local RequestAllocations *tl_request_p = NULL;
+
+static mutex s_totals_lock;
+static unordered_map <string, OperationTotals> s_totals;
+
+
+static json_t *GetOperationTotalsAsJSON (const OperationTotals &totals_r);
+
+
+bool StartAllocationAccounting (void)
+{
+	if (!tl_request_p)
+		{
+			tl_request_p = new (nothrow) RequestAllocations;
+
+			if (tl_request_p)
+				{
+					return true;
+				}
+
+			PrintErrors (STM_LEVEL_WARNING, __FILE__, __LINE__, "Failed to allocate allocation counts");
+		}
+
+	return false;
+}
+
+
+void StopAllocationAccounting (const char *operation_s, const uint32 log_interval)
+{
+	RequestAllocations *request_p = tl_request_p;
+
+	if (request_p)
+		{
+			json_t *totals_p = NULL;
+
+			tl_request_p = NULL;
+
+			PrintLog (STM_LEVEL_FINE, __FILE__, __LINE__, "\"%s\" request peaked at %lu bytes with %lu DOM, %lu selector, %lu link and %lu JSON allocations", operation_s,
+				(unsigned long) (request_p -> ra_peak_bytes), (unsigned long) (request_p -> ra_stages [AS_DOM].sc_num_allocations), (unsigned long) (request_p -> ra_stages [AS_SELECTORS].sc_num_allocations),
+				(unsigned long) (request_p -> ra_stages [AS_LINKS].sc_num_allocations), (unsigned long) (request_p -> ra_stages [AS_JSON].sc_num_allocations));
+
+			try
+				{
+					lock_guard <mutex> guard (s_totals_lock);
+					OperationTotals &totals_r = s_totals [operation_s];
+
+					++ (totals_r.ot_num_requests);
+
+					for (int i = 0; i < AS_NUM_STAGES; ++ i)
+						{
+							const StageCounts &stage_r = request_p -> ra_stages [i];
+
+							totals_r.ot_num_allocations [i] += stage_r.sc_num_allocations;
+							totals_r.ot_num_bytes [i] += stage_r.sc_num_bytes;
+							totals_r.ot_max_peak_bytes [i] = max (totals_r.ot_max_peak_bytes [i], (uint64) stage_r.sc_peak_bytes);
+						}
+
+					totals_r.ot_max_request_peak_bytes = max (totals_r.ot_max_request_peak_bytes, (uint64) (request_p -> ra_peak_bytes));
+
+					if ((log_interval > 0) && (totals_r.ot_num_requests % log_interval == 0))
+						{
+							totals_p = GetOperationTotalsAsJSON (totals_r);
+						}
+				}
+			catch (...)
+				{
+					PrintErrors (STM_LEVEL_WARNING, __FILE__, __LINE__, "Failed to add allocation counts for \"%s\"", operation_s);
+				}
+
+			if (totals_p)
+				{
+					PrintJSONToLog (STM_LEVEL_INFO, __FILE__, __LINE__, totals_p, "Allocations for \"%s\": ", operation_s);
+					json_decref (totals_p);
+				}
+
+			delete request_p;
+		}
+}
+
+
+void CountAllocations (const AllocationStage stage, const size_t num_allocations, const size_t num_bytes)
+{
+	RequestAllocations *request_p = tl_request_p;
+
+	if (request_p)
+		{
+			StageCounts &stage_r = request_p -> ra_stages [stage];
+
+			stage_r.sc_num_allocations += num_allocations;
+			stage_r.sc_num_bytes += num_bytes;
+			stage_r.sc_live_bytes += num_bytes;
+			stage_r.sc_peak_bytes = max (stage_r.sc_peak_bytes, stage_r.sc_live_bytes);
+
+			request_p -> ra_live_bytes += num_bytes;
+			request_p -> ra_peak_bytes = max (request_p -> ra_peak_bytes, request_p -> ra_live_bytes);
+		}
+}
+
+
+void CountFrees (const AllocationStage stage, const size_t num_bytes)
+{
+	RequestAllocations *request_p = tl_request_p;
+
+	if (request_p)
+		{
+			StageCounts &stage_r = request_p -> ra_stages [stage];
+
+			/* Memory that was allocated before accounting started may be freed during it */
+			stage_r.sc_live_bytes -= min (stage_r.sc_live_bytes, num_bytes);
+			request_p -> ra_live_bytes -= min (request_p -> ra_live_bytes, num_bytes);
+		}
+}
+
+
+json_t *GetAllocationStatsAsJSON (const char *operation_s)
+{
+	lock_guard <mutex> guard (s_totals_lock);
+	unordered_map <string, OperationTotals> :: const_iterator it = s_totals.find (operation_s);
+
+	if (it != s_totals.end ())
+		{
+			return GetOperationTotalsAsJSON (it -> second);
+		}
+
+	return NULL;
+}
+
+
+static json_t *GetOperationTotalsAsJSON (const OperationTotals &totals_r)
+{
+	json_t *totals_p = json_object ();
+
+	if (totals_p)
+		{
+			bool success_flag = (json_object_set_new (totals_p, "requests", json_integer (totals_r.ot_num_requests)) == 0) &&
+				(json_object_set_new (totals_p, "max_request_peak_bytes", json_integer (totals_r.ot_max_request_peak_bytes)) == 0);
+
+			for (int i = 0; (i < AS_NUM_STAGES) && success_flag; ++ i)
+				{
+					json_t *stage_p = json_object ();
+
+					success_flag = false;
+
+					if (stage_p)
+						{
+							if ((json_object_set_new (stage_p, "allocations", json_integer (totals_r.ot_num_allocations [i])) == 0) &&
+								(json_object_set_new (stage_p, "bytes", json_integer (totals_r.ot_num_bytes [i])) == 0) &&
+								(json_object_set_new (stage_p, "max_peak_bytes", json_integer (totals_r.ot_max_peak_bytes [i])) == 0))
+								{
+									success_flag = (json_object_set_new (totals_p, S_STAGE_NAMES_SS [i], stage_p) == 0);
+								}
+							else
+								{
+									json_decref (stage_p);
+								}
+						}
+				}
+
+			if (success_flag)
+				{
+					return totals_p;
+				}
+
+			json_decref (totals_p);
+		}
+
+	PrintErrors (STM_LEVEL_WARNING, __FILE__, __LINE__, "Failed to create allocation totals JSON");
+
+	return NULL;
+}
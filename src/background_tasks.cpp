@@ -0,0 +1,190 @@
+/*
+** Copyright 2014-2016 The Earlham Institute
+**
+** Licensed under the Apache License, Version 2.0 (the "License");
+** you may not use this file except in compliance with the License.
+** You may obtain a copy of the License at
+**
+**     http://www.apache.org/licenses/LICENSE-2.0
+**
+** Unless required by applicable law or agreed to in writing, software
+** distributed under the License is distributed on an "AS IS" BASIS,
+** WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+** See the License for the specific language governing permissions and
+** limitations under the License.
+*/
+/*
+ * background_tasks.cpp
+ *
+ *  Created on: 18 Oct 2026
+ */
+
+#include "background_tasks.hpp"
+
+#include <condition_variable>
+#include <deque>
+#include <map>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "streams.h"
+
+using namespace std;
+
+
+struct BackgroundTask
+{
+	string bt_group;
+	BackgroundTaskRunner bt_run_fn;
+	BackgroundTaskDataFreer bt_free_fn;
+	void *bt_data_p;
+};
+
+
+/*
+ * The workers are started on first use and are stopped and joined
+ * when the service library is unloaded.
+ */
+class BackgroundWorkers
+{
+public:
+	~BackgroundWorkers ();
+
+	bool Schedule (const BackgroundTask &task_r, const uint32 max_concurrent_tasks);
+
+private:
+	void Run ();
+
+	mutex bw_lock;
+	condition_variable bw_condition;
+	deque <BackgroundTask> bw_tasks;
+	map <string, uint32> bw_outstanding_tasks;
+	vector <thread> bw_threads;
+	bool bw_stopping = false;
+};
+
+
+static const size_t S_NUM_WORKERS = 4;
+
+static BackgroundWorkers s_workers;
+
+
+static void FreeBackgroundTask (const BackgroundTask &task_r);
+
+
+bool ScheduleBackgroundTask (const char *group_s, const uint32 max_concurrent_tasks, BackgroundTaskRunner run_fn, BackgroundTaskDataFreer free_fn, void *data_p)
+{
+	BackgroundTask task;
+
+	task.bt_group = group_s ? group_s : "";
+	task.bt_run_fn = run_fn;
+	task.bt_free_fn = free_fn;
+	task.bt_data_p = data_p;
+
+	if (s_workers.Schedule (task, max_concurrent_tasks))
+		{
+			return true;
+		}
+
+	FreeBackgroundTask (task);
+
+	return false;
+}
+
+
+BackgroundWorkers :: ~BackgroundWorkers ()
+{
+	{
+		lock_guard <mutex> guard (bw_lock);
+		bw_stopping = true;
+	}
+
+	bw_condition.notify_all ();
+
+	for (size_t i = 0; i < bw_threads.size (); ++ i)
+		{
+			bw_threads [i].join ();
+		}
+
+	/* Any tasks that never got to run still need their data freeing */
+	for (size_t i = 0; i < bw_tasks.size (); ++ i)
+		{
+			FreeBackgroundTask (bw_tasks [i]);
+		}
+}
+
+
+bool BackgroundWorkers :: Schedule (const BackgroundTask &task_r, const uint32 max_concurrent_tasks)
+{
+	{
+		lock_guard <mutex> guard (bw_lock);
+		uint32 &outstanding_r = bw_outstanding_tasks [task_r.bt_group];
+
+		if (bw_stopping || (outstanding_r >= max_concurrent_tasks))
+			{
+				return false;
+			}
+
+		try
+			{
+				while (bw_threads.size () < S_NUM_WORKERS)
+					{
+						bw_threads.push_back (thread (&BackgroundWorkers :: Run, this));
+					}
+			}
+		catch (...)
+			{
+				if (bw_threads.empty ())
+					{
+						PrintErrors (STM_LEVEL_SEVERE, __FILE__, __LINE__, "Failed to start background worker threads");
+						return false;
+					}
+			}
+
+		bw_tasks.push_back (task_r);
+		++ outstanding_r;
+	}
+
+	bw_condition.notify_one ();
+
+	return true;
+}
+
+
+void BackgroundWorkers :: Run ()
+{
+	unique_lock <mutex> lock (bw_lock);
+
+	while (true)
+		{
+			bw_condition.wait (lock, [this] { return bw_stopping || !bw_tasks.empty (); });
+
+			if (bw_stopping)
+				{
+					break;
+				}
+
+			BackgroundTask task = bw_tasks.front ();
+			bw_tasks.pop_front ();
+
+			lock.unlock ();
+
+			task.bt_run_fn (task.bt_data_p);
+			FreeBackgroundTask (task);
+
+			lock.lock ();
+
+			-- bw_outstanding_tasks [task.bt_group];
+		}
+}
+
+
+static void FreeBackgroundTask (const BackgroundTask &task_r)
+{
+	if (task_r.bt_free_fn)
+		{
+			task_r.bt_free_fn (task_r.bt_data_p);
+		}
+}
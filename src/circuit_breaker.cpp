@@ -0,0 +1,236 @@
+/*
+** Copyright 2014-2016 The Earlham Institute
+**
+** Licensed under the Apache License, Version 2.0 (the "License");
+** you may not use this file except in compliance with the License.
+** You may obtain a copy of the License at
+**
+**     http://www.apache.org/licenses/LICENSE-2.0
+**
+** Unless required by applicable law or agreed to in writing, software
+** distributed under the License is distributed on an "AS IS" BASIS,
+** WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+** See the License for the specific language governing permissions and
+** limitations under the License.
+*/
+/*
+ * circuit_breaker.cpp
+ *
+ *  Created on: 18 Oct 2026
+ */
+
+#include "circuit_breaker.hpp"
+
+#include <ctime>
+#include <map>
+#include <mutex>
+#include <new>
+#include <string>
+#include <vector>
+
+#include "streams.h"
+
+using namespace std;
+
+
+typedef enum CircuitBreakerState
+{
+	/** Requests are sent as normal. */
+	CBS_CLOSED,
+
+	/** Requests fail straight away. */
+	CBS_OPEN,
+
+	/** A single probe request has been let through to see if the search engine has recovered. */
+	CBS_HALF_OPEN
+} CircuitBreakerState;
+
+
+struct CircuitBreaker
+{
+	mutex cb_lock;
+	CircuitBreakerState cb_state = CBS_CLOSED;
+
+	/** The outcomes of the most recent requests, used as a ring buffer. */
+	vector <bool> cb_failures;
+	size_t cb_next_index = 0;
+	uint32 cb_num_failures = 0;
+
+	uint32 cb_failure_threshold = 0;
+	uint32 cb_open_time = 0;
+	time_t cb_opened_at = 0;
+
+	/**
+	 * Incremented each time that the state changes. Requests are given the
+	 * value at the time that they were allowed as their ticket.
+	 */
+	uint32 cb_generation = 0;
+};
+
+
+static void ResetCircuitBreaker (CircuitBreaker *breaker_p, const uint32 window_size);
+
+static void OpenCircuitBreaker (CircuitBreaker *breaker_p, const time_t now);
+
+
+static mutex s_registry_lock;
+static map <string, CircuitBreaker *> s_registry;
+
+
+CircuitBreaker *GetCircuitBreaker (const char *name_s, const uint32 failure_threshold, const uint32 window_size, const uint32 open_time)
+{
+	CircuitBreaker *breaker_p = NULL;
+
+	if (name_s && (failure_threshold > 0))
+		{
+			lock_guard <mutex> registry_guard (s_registry_lock);
+			map <string, CircuitBreaker *> :: iterator it = s_registry.find (name_s);
+
+			if (it != s_registry.end ())
+				{
+					breaker_p = it -> second;
+				}
+			else
+				{
+					breaker_p = new (nothrow) CircuitBreaker;
+
+					if (breaker_p)
+						{
+							s_registry [name_s] = breaker_p;
+						}
+					else
+						{
+							PrintErrors (STM_LEVEL_SEVERE, __FILE__, __LINE__, "Failed to allocate circuit breaker for \"%s\"", name_s);
+						}
+				}
+
+			if (breaker_p)
+				{
+					/* The window always has room for enough failures to open the breaker */
+					const uint32 size = (window_size >= failure_threshold) ? window_size : failure_threshold;
+					lock_guard <mutex> breaker_guard (breaker_p -> cb_lock);
+
+					breaker_p -> cb_failure_threshold = failure_threshold;
+					breaker_p -> cb_open_time = open_time;
+
+					if (breaker_p -> cb_failures.size () != size)
+						{
+							ResetCircuitBreaker (breaker_p, size);
+						}
+				}
+		}
+
+	return breaker_p;
+}
+
+
+bool AllowCircuitBreakerRequest (CircuitBreaker *breaker_p, uint32 *ticket_p)
+{
+	lock_guard <mutex> guard (breaker_p -> cb_lock);
+	bool allow_flag = true;
+
+	if (breaker_p -> cb_state == CBS_OPEN)
+		{
+			const time_t now = time (NULL);
+
+			if (now - breaker_p -> cb_opened_at >= (time_t) (breaker_p -> cb_open_time))
+				{
+					/* Let this request through as the probe */
+					breaker_p -> cb_state = CBS_HALF_OPEN;
+					++ (breaker_p -> cb_generation);
+				}
+			else
+				{
+					allow_flag = false;
+				}
+		}
+	else if (breaker_p -> cb_state == CBS_HALF_OPEN)
+		{
+			/* Only the probe is allowed through until we know how it got on */
+			allow_flag = false;
+		}
+
+	*ticket_p = breaker_p -> cb_generation;
+
+	return allow_flag;
+}
+
+
+void RecordCircuitBreakerResult (CircuitBreaker *breaker_p, const uint32 ticket, const bool success_flag)
+{
+	lock_guard <mutex> guard (breaker_p -> cb_lock);
+
+	/* Results of requests that were allowed before the last change of state are ignored */
+	if (ticket != breaker_p -> cb_generation)
+		{
+			return;
+		}
+
+	if (breaker_p -> cb_state == CBS_HALF_OPEN)
+		{
+			if (success_flag)
+				{
+					ResetCircuitBreaker (breaker_p, breaker_p -> cb_failures.size ());
+					PrintLog (STM_LEVEL_INFO, __FILE__, __LINE__, "Circuit breaker closed after a successful probe");
+				}
+			else
+				{
+					OpenCircuitBreaker (breaker_p, time (NULL));
+				}
+		}
+	else if (breaker_p -> cb_state == CBS_CLOSED)
+		{
+			const size_t i = breaker_p -> cb_next_index;
+
+			if (breaker_p -> cb_failures [i])
+				{
+					-- (breaker_p -> cb_num_failures);
+				}
+
+			breaker_p -> cb_failures [i] = !success_flag;
+
+			if (!success_flag)
+				{
+					++ (breaker_p -> cb_num_failures);
+				}
+
+			breaker_p -> cb_next_index = (i + 1) % breaker_p -> cb_failures.size ();
+
+			if (breaker_p -> cb_num_failures >= breaker_p -> cb_failure_threshold)
+				{
+					OpenCircuitBreaker (breaker_p, time (NULL));
+					PrintErrors (STM_LEVEL_WARNING, __FILE__, __LINE__, "Circuit breaker opened after %u of the last %lu requests failed", breaker_p -> cb_num_failures, (unsigned long) breaker_p -> cb_failures.size ());
+				}
+		}
+}
+
+
+void ReleaseCircuitBreakerRequest (CircuitBreaker *breaker_p, const uint32 ticket)
+{
+	lock_guard <mutex> guard (breaker_p -> cb_lock);
+
+	/* The open time has already passed so the next request will be the probe */
+	if ((breaker_p -> cb_state == CBS_HALF_OPEN) && (ticket == breaker_p -> cb_generation))
+		{
+			breaker_p -> cb_state = CBS_OPEN;
+			++ (breaker_p -> cb_generation);
+		}
+}
+
+
+static void ResetCircuitBreaker (CircuitBreaker *breaker_p, const uint32 window_size)
+{
+	breaker_p -> cb_failures.assign (window_size, false);
+	breaker_p -> cb_next_index = 0;
+	breaker_p -> cb_num_failures = 0;
+	breaker_p -> cb_state = CBS_CLOSED;
+	++ (breaker_p -> cb_generation);
+}
+
+
+static void OpenCircuitBreaker (CircuitBreaker *breaker_p, const time_t now)
+{
+	breaker_p -> cb_state = CBS_OPEN;
+	breaker_p -> cb_opened_at = now;
+	++ (breaker_p -> cb_generation);
+}
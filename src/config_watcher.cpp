@@ -0,0 +1,317 @@
+/*
+** Copyright 2014-2016 The Earlham Institute
+**
+** Licensed under the Apache License, Version 2.0 (the "License");
+** you may not use this file except in compliance with the License.
+** You may obtain a copy of the License at
+**
+**     http://www.apache.org/licenses/LICENSE-2.0
+**
+** Unless required by applicable law or agreed to in writing, software
+** distributed under the License is distributed on an "AS IS" BASIS,
+** WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+** See the License for the specific language governing permissions and
+** limitations under the License.
+*/
+/*
+ * config_watcher.cpp
+ *
+ *  Created on: 18 Oct 2026
+ */
+
+#include "config_watcher.hpp"
+
+#include <condition_variable>
+#include <ctime>
+#include <memory>
+#include <mutex>
+#include <new>
+#include <string>
+
+#include <sys/stat.h>
+
+#include "background_tasks.hpp"
+#include "streams.h"
+
+using namespace std;
+
+
+struct ConfigWatcher
+{
+	/* Guards cw_current and the details of the last check */
+	mutex cw_lock;
+	shared_ptr <void> cw_current;
+
+	string cw_path;
+	uint32 cw_check_interval;
+	time_t cw_next_check = 0;
+	time_t cw_modified = 0;
+	off_t cw_size = 0;
+
+	/* Set whilst a check is queued or running on a background worker */
+	bool cw_checking_flag = false;
+	condition_variable cw_check_done;
+
+	ConfigVersionBuilder cw_build_fn;
+	ConfigVersionFreer cw_free_fn;
+	void *cw_data_p;
+};
+
+
+struct ConfigVersion
+{
+	shared_ptr <void> cv_data;
+};
+
+
+static bool HasConfigFileChanged (const ConfigWatcher *watcher_p, struct stat *info_p);
+
+static void NoteConfigFileState (ConfigWatcher *watcher_p, const struct stat *info_p);
+
+static void ReloadConfig (ConfigWatcher *watcher_p);
+
+static void RunConfigCheck (void *data_p);
+
+static void FinishConfigCheck (void *data_p);
+
+
+ConfigWatcher *AllocateConfigWatcher (const char *path_s, const uint32 check_interval, void *version_p, ConfigVersionBuilder build_fn, ConfigVersionFreer free_fn, void *data_p)
+{
+	ConfigWatcher *watcher_p = new (nothrow) ConfigWatcher;
+
+	if (watcher_p)
+		{
+			try
+				{
+					watcher_p -> cw_current.reset (version_p, free_fn);
+					watcher_p -> cw_path = path_s ? path_s : "";
+					watcher_p -> cw_check_interval = check_interval;
+					watcher_p -> cw_build_fn = build_fn;
+					watcher_p -> cw_free_fn = free_fn;
+					watcher_p -> cw_data_p = data_p;
+
+					/* Note the file's current state so that we only reload when it changes */
+					if (path_s)
+						{
+							struct stat info;
+
+							if (HasConfigFileChanged (watcher_p, &info))
+								{
+									NoteConfigFileState (watcher_p, &info);
+								}
+
+							watcher_p -> cw_next_check = time (NULL) + check_interval;
+						}
+
+					return watcher_p;
+				}
+			catch (...)
+				{
+					/* If the shared_ptr couldn't be set up, it will have already freed version_p */
+					version_p = NULL;
+				}
+
+			delete watcher_p;
+		}
+
+	PrintErrors (STM_LEVEL_SEVERE, __FILE__, __LINE__, "Failed to allocate config watcher for \"%s\"", path_s ? path_s : "");
+
+	if (version_p)
+		{
+			free_fn (version_p);
+		}
+
+	return NULL;
+}
+
+
+void FreeConfigWatcher (ConfigWatcher *watcher_p)
+{
+	/* A check that is queued or running still needs the watcher */
+	{
+		unique_lock <mutex> lock (watcher_p -> cw_lock);
+		watcher_p -> cw_check_done.wait (lock, [watcher_p] { return ! (watcher_p -> cw_checking_flag); });
+	}
+
+	delete watcher_p;
+}
+
+
+ConfigVersion *AcquireConfigVersion (ConfigWatcher *watcher_p)
+{
+	ConfigVersion *version_p = new (nothrow) ConfigVersion;
+
+	if (version_p)
+		{
+			bool check_flag = false;
+
+			{
+				lock_guard <mutex> guard (watcher_p -> cw_lock);
+
+				if ((! (watcher_p -> cw_path.empty ())) && (! (watcher_p -> cw_checking_flag)))
+					{
+						const time_t now = time (NULL);
+
+						if (now >= watcher_p -> cw_next_check)
+							{
+								watcher_p -> cw_next_check = now + watcher_p -> cw_check_interval;
+								watcher_p -> cw_checking_flag = true;
+								check_flag = true;
+							}
+					}
+
+				version_p -> cv_data = watcher_p -> cw_current;
+			}
+
+			/*
+			 * The request that finds a check is due hands it to a background worker
+			 * rather than reading and building the file itself, so every request
+			 * carries on with the current version and a new one is used once it's ready.
+			 */
+			if (check_flag)
+				{
+					ScheduleBackgroundTask (watcher_p -> cw_path.c_str (), 1, RunConfigCheck, FinishConfigCheck, watcher_p);
+				}
+		}
+	else
+		{
+			PrintErrors (STM_LEVEL_SEVERE, __FILE__, __LINE__, "Failed to allocate config version");
+		}
+
+	return version_p;
+}
+
+
+ConfigVersion *CopyConfigVersion (const ConfigVersion *version_p)
+{
+	ConfigVersion *copy_p = new (nothrow) ConfigVersion;
+
+	if (copy_p)
+		{
+			copy_p -> cv_data = version_p -> cv_data;
+		}
+	else
+		{
+			PrintErrors (STM_LEVEL_SEVERE, __FILE__, __LINE__, "Failed to copy config version");
+		}
+
+	return copy_p;
+}
+
+
+const void *GetConfigVersionData (const ConfigVersion *version_p)
+{
+	return version_p -> cv_data.get ();
+}
+
+
+void ReleaseConfigVersion (ConfigVersion *version_p)
+{
+	delete version_p;
+}
+
+
+/*
+ * Check whether the file's modification time or size differ from the
+ * last time that it was successfully loaded.
+ */
+static bool HasConfigFileChanged (const ConfigWatcher *watcher_p, struct stat *info_p)
+{
+	if (stat (watcher_p -> cw_path.c_str (), info_p) == 0)
+		{
+			if ((info_p -> st_mtime != watcher_p -> cw_modified) || (info_p -> st_size != watcher_p -> cw_size))
+				{
+					return true;
+				}
+		}
+
+	return false;
+}
+
+
+static void NoteConfigFileState (ConfigWatcher *watcher_p, const struct stat *info_p)
+{
+	watcher_p -> cw_modified = info_p -> st_mtime;
+	watcher_p -> cw_size = info_p -> st_size;
+}
+
+
+/*
+ * Build and swap in a new version if the file has changed. This is called
+ * without the lock held but cw_checking_flag stops it running on more
+ * than one thread at once. The file's new state is only noted once it
+ * has been loaded successfully, so that a file which was caught whilst
+ * it was being written is tried again at the next check.
+ */
+static void ReloadConfig (ConfigWatcher *watcher_p)
+{
+	struct stat info;
+
+	if (HasConfigFileChanged (watcher_p, &info))
+		{
+			json_error_t error;
+			json_t *config_p = json_load_file (watcher_p -> cw_path.c_str (), 0, &error);
+
+			if (config_p)
+				{
+					shared_ptr <void> current;
+					void *new_version_p;
+
+					{
+						lock_guard <mutex> guard (watcher_p -> cw_lock);
+						current = watcher_p -> cw_current;
+					}
+
+					new_version_p = watcher_p -> cw_build_fn (config_p, current.get (), watcher_p -> cw_data_p);
+
+					if (new_version_p == current.get ())
+						{
+							/* The settings that we use haven't changed */
+							NoteConfigFileState (watcher_p, &info);
+						}
+					else if (new_version_p)
+						{
+							try
+								{
+									shared_ptr <void> new_version (new_version_p, watcher_p -> cw_free_fn);
+									lock_guard <mutex> guard (watcher_p -> cw_lock);
+
+									/* The old version is freed when the last request using it releases it */
+									watcher_p -> cw_current.swap (new_version);
+									NoteConfigFileState (watcher_p, &info);
+								}
+							catch (...)
+								{
+									PrintErrors (STM_LEVEL_WARNING, __FILE__, __LINE__, "Failed to swap in new settings from \"%s\"", watcher_p -> cw_path.c_str ());
+								}
+						}
+
+					json_decref (config_p);
+				}
+			else
+				{
+					PrintErrors (STM_LEVEL_WARNING, __FILE__, __LINE__, "Failed to load \"%s\", line %d: %s", watcher_p -> cw_path.c_str (), error.line, error.text);
+				}
+		}
+}
+
+
+static void RunConfigCheck (void *data_p)
+{
+	ReloadConfig ((ConfigWatcher *) data_p);
+}
+
+
+/*
+ * This is called once the check has run, or if it couldn't be scheduled
+ * or never got to run, so that the next check can go ahead and the
+ * watcher can be freed.
+ */
+static void FinishConfigCheck (void *data_p)
+{
+	ConfigWatcher *watcher_p = (ConfigWatcher *) data_p;
+	lock_guard <mutex> guard (watcher_p -> cw_lock);
+
+	watcher_p -> cw_checking_flag = false;
+	watcher_p -> cw_check_done.notify_all ();
+}
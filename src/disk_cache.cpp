@@ -0,0 +1,801 @@
+/*
+** Copyright 2014-2016 The Earlham Institute
+**
+** Licensed under the Apache License, Version 2.0 (the "License");
+** you may not use this file except in compliance with the License.
+** You may obtain a copy of the License at
+**
+**     http://www.apache.org/licenses/LICENSE-2.0
+**
+** Unless required by applicable law or agreed to in writing, software
+** distributed under the License is distributed on an "AS IS" BASIS,
+** WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+** See the License for the specific language governing permissions and
+** limitations under the License.
+*/
+/*
+ * disk_cache.cpp
+ *
+ *  Created on: 18 Oct 2026
+ */
+
+#include "disk_cache.hpp"
+
+#include <cerrno>
+#include <cstdlib>
+#include <cstring>
+#include <algorithm>
+#include <mutex>
+#include <string>
+#include <vector>
+
+#include <fcntl.h>
+#include <libgen.h>
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
+#include "streams.h"
+
+using namespace std;
+
+
+/*
+ * The on-disk layouts. The index file is a DiskCacheIndexHeader followed
+ * by dcih_num_slots DiskCacheSlots. The data file is a sequence of records,
+ * each of which is a DiskCacheRecordHeader followed by the key and the
+ * value as JSON text.
+ */
+
+static const char S_INDEX_MAGIC [8] = { 'W', 'S', 'D', 'C', 'I', 'D', 'X', '1' };
+static const uint32 S_RECORD_MAGIC = 0x57534443;
+
+struct DiskCacheIndexHeader
+{
+	char dcih_magic [8];
+	uint32 dcih_num_slots;
+	uint32 dcih_num_used;
+	uint64 dcih_generation;
+	uint64 dcih_live_bytes;
+};
+
+
+/* An empty slot has a hash of 0 */
+struct DiskCacheSlot
+{
+	uint64 dcs_hash;
+	uint64 dcs_offset;
+	int64 dcs_expiry;
+	uint32 dcs_length;
+	uint32 dcs_padding;
+};
+
+
+struct DiskCacheRecordHeader
+{
+	uint32 dcrh_magic;
+	uint32 dcrh_key_length;
+	uint32 dcrh_value_length;
+	uint32 dcrh_checksum;
+};
+
+
+/*
+ * Several processes can share the same files, so all access is
+ * guarded by an advisory lock on a separate lock file as well
+ * as the in-process mutex.
+ */
+struct DiskCache
+{
+	mutex dc_mutex;
+	string dc_path;
+	uint32 dc_max_entries;
+	uint32 dc_num_slots;
+	uint32 dc_retention;
+	int dc_lock_fd;
+	int dc_index_fd;
+	int dc_data_fd;
+	ino_t dc_index_inode;
+	DiskCacheIndexHeader *dc_header_p;
+	DiskCacheSlot *dc_slots_p;
+	size_t dc_map_size;
+};
+
+
+class DiskCacheLock
+{
+public:
+	DiskCacheLock (DiskCache *cache_p, const int operation)
+		: dcl_guard (cache_p -> dc_mutex), dcl_fd (cache_p -> dc_lock_fd)
+	{
+		dcl_locked_flag = (flock (dcl_fd, operation) == 0);
+	}
+
+	~DiskCacheLock ()
+	{
+		if (dcl_locked_flag)
+			{
+				flock (dcl_fd, LOCK_UN);
+			}
+	}
+
+	bool IsLocked () const
+	{
+		return dcl_locked_flag;
+	}
+
+private:
+	lock_guard <mutex> dcl_guard;
+	int dcl_fd;
+	bool dcl_locked_flag;
+};
+
+
+static bool MapDiskCache (DiskCache *cache_p);
+
+static void UnmapDiskCache (DiskCache *cache_p);
+
+static bool EnsureDiskCacheIsCurrent (DiskCache *cache_p);
+
+static bool CompactDiskCache (DiskCache *cache_p, const uint32 max_entries);
+
+static bool CompareSlotExpiries (const DiskCacheSlot *slot_0_p, const DiskCacheSlot *slot_1_p);
+
+static bool NeedsCompacting (const DiskCache *cache_p);
+
+static bool ReadRecord (const int fd, const DiskCacheSlot *slot_p, string *key_p, string *value_p);
+
+static bool AppendRecord (const int fd, const char *key_s, const size_t key_length, const char *value_s, const size_t value_length, uint64 *offset_p, uint32 *length_p);
+
+static DiskCacheSlot *FindSlot (DiskCache *cache_p, const char *key_s, const uint64 hash, const bool empty_slot_flag, string *value_p);
+
+static uint64 GetKeyHash (const char *key_s);
+
+static uint32 GetChecksum (const char *key_s, const size_t key_length, const char *value_s, const size_t value_length);
+
+static string GetDataFilename (const string &path_r, const uint64 generation);
+
+static bool SyncParentDirectory (const string &path_r);
+
+
+
+DiskCache *OpenDiskCache (const char *path_s, const uint32 num_entries, const uint32 retention)
+{
+	DiskCache *cache_p = new (nothrow) DiskCache;
+
+	if (cache_p)
+		{
+			/* keep the index sparse enough that probe sequences stay short */
+			cache_p -> dc_max_entries = (num_entries > 0) ? num_entries : 1;
+			cache_p -> dc_num_slots = cache_p -> dc_max_entries + (cache_p -> dc_max_entries / 3) + 1;
+			cache_p -> dc_retention = retention;
+			cache_p -> dc_path = path_s;
+			cache_p -> dc_index_fd = -1;
+			cache_p -> dc_data_fd = -1;
+			cache_p -> dc_index_inode = 0;
+			cache_p -> dc_header_p = NULL;
+			cache_p -> dc_slots_p = NULL;
+			cache_p -> dc_map_size = 0;
+			cache_p -> dc_lock_fd = open ((cache_p -> dc_path + ".lock").c_str (), O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+
+			if (cache_p -> dc_lock_fd != -1)
+				{
+					bool success_flag = false;
+
+					{
+						DiskCacheLock lock (cache_p, LOCK_EX);
+
+						if (lock.IsLocked ())
+							{
+								if (MapDiskCache (cache_p))
+									{
+										if (cache_p -> dc_header_p -> dcih_num_slots == cache_p -> dc_num_slots)
+											{
+												success_flag = true;
+											}
+										else
+											{
+												success_flag = CompactDiskCache (cache_p, cache_p -> dc_max_entries);
+											}
+									}
+								else
+									{
+										/* There is no valid cache so start a new one */
+										success_flag = CompactDiskCache (cache_p, cache_p -> dc_max_entries);
+									}
+							}
+					}
+
+					if (success_flag)
+						{
+							return cache_p;
+						}
+
+					PrintErrors (STM_LEVEL_WARNING, __FILE__, __LINE__, "Failed to open disk cache at \"%s\"", path_s);
+				}
+			else
+				{
+					PrintErrors (STM_LEVEL_WARNING, __FILE__, __LINE__, "Failed to open disk cache lock file for \"%s\": %s", path_s, strerror (errno));
+				}
+
+			CloseDiskCache (cache_p);
+		}
+
+	return NULL;
+}
+
+
+void CloseDiskCache (DiskCache *cache_p)
+{
+	UnmapDiskCache (cache_p);
+
+	if (cache_p -> dc_lock_fd != -1)
+		{
+			close (cache_p -> dc_lock_fd);
+		}
+
+	delete cache_p;
+}
+
+
+const char *GetDiskCachePath (const DiskCache *cache_p)
+{
+	return cache_p -> dc_path.c_str ();
+}
+
+
+json_t *GetDiskCacheEntry (DiskCache *cache_p, const char *key_s, time_t *expiry_p)
+{
+	string value;
+	bool found_flag = false;
+
+	{
+		DiskCacheLock lock (cache_p, LOCK_SH);
+
+		if (lock.IsLocked () && EnsureDiskCacheIsCurrent (cache_p))
+			{
+				DiskCacheSlot *slot_p = FindSlot (cache_p, key_s, GetKeyHash (key_s), false, &value);
+
+				if (slot_p)
+					{
+						*expiry_p = (time_t) (slot_p -> dcs_expiry);
+						found_flag = true;
+					}
+			}
+	}
+
+	if (found_flag)
+		{
+			return json_loadb (value.data (), value.size (), 0, NULL);
+		}
+
+	return NULL;
+}
+
+
+bool AddDiskCacheEntry (DiskCache *cache_p, const char *key_s, const json_t *value_p, const time_t expiry)
+{
+	bool success_flag = false;
+	char *value_s = json_dumps (value_p, JSON_COMPACT);
+
+	if (value_s)
+		{
+			DiskCacheLock lock (cache_p, LOCK_EX);
+
+			if (lock.IsLocked () && EnsureDiskCacheIsCurrent (cache_p))
+				{
+					const uint64 hash = GetKeyHash (key_s);
+					DiskCacheSlot *slot_p = NULL;
+
+					/*
+					 * Leave room for a quarter of the entries to be added before
+					 * we need to compact again
+					 */
+					if (NeedsCompacting (cache_p))
+						{
+							CompactDiskCache (cache_p, (cache_p -> dc_max_entries * 3) / 4);
+						}
+
+					slot_p = FindSlot (cache_p, key_s, hash, true, NULL);
+
+					if (slot_p)
+						{
+							uint64 offset = 0;
+							uint32 length = 0;
+
+							if (AppendRecord (cache_p -> dc_data_fd, key_s, strlen (key_s), value_s, strlen (value_s), &offset, &length))
+								{
+									DiskCacheIndexHeader *header_p = cache_p -> dc_header_p;
+
+									if (slot_p -> dcs_hash != 0)
+										{
+											header_p -> dcih_live_bytes -= slot_p -> dcs_length;
+										}
+									else
+										{
+											++ (header_p -> dcih_num_used);
+										}
+
+									/*
+									 * Write the hash last so that a reader in another process
+									 * never sees a slot that points at a partial record
+									 */
+									slot_p -> dcs_offset = offset;
+									slot_p -> dcs_length = length;
+									slot_p -> dcs_expiry = (int64) expiry;
+									slot_p -> dcs_hash = hash;
+
+									header_p -> dcih_live_bytes += length;
+
+									success_flag = true;
+								}
+						}
+					else
+						{
+							PrintErrors (STM_LEVEL_WARNING, __FILE__, __LINE__, "Disk cache \"%s\" is full", cache_p -> dc_path.c_str ());
+						}
+				}
+
+			free (value_s);
+		}
+
+	return success_flag;
+}
+
+
+bool SetDiskCacheEntryExpiry (DiskCache *cache_p, const char *key_s, const time_t expiry)
+{
+	DiskCacheLock lock (cache_p, LOCK_EX);
+
+	if (lock.IsLocked () && EnsureDiskCacheIsCurrent (cache_p))
+		{
+			DiskCacheSlot *slot_p = FindSlot (cache_p, key_s, GetKeyHash (key_s), false, NULL);
+
+			if (slot_p)
+				{
+					slot_p -> dcs_expiry = (int64) expiry;
+					return true;
+				}
+		}
+
+	return false;
+}
+
+
+
+/*
+ * Map the current index and open its data file. Returns false
+ * if there is no valid index.
+ */
+static bool MapDiskCache (DiskCache *cache_p)
+{
+	const string index_filename (cache_p -> dc_path + ".index");
+	int index_fd = open (index_filename.c_str (), O_RDWR | O_CLOEXEC);
+
+	if (index_fd != -1)
+		{
+			struct stat st;
+
+			if ((fstat (index_fd, &st) == 0) && ((size_t) st.st_size >= sizeof (DiskCacheIndexHeader)))
+				{
+					void *map_p = mmap (NULL, st.st_size, PROT_READ | PROT_WRITE, MAP_SHARED, index_fd, 0);
+
+					if (map_p != MAP_FAILED)
+						{
+							DiskCacheIndexHeader *header_p = (DiskCacheIndexHeader *) map_p;
+							const size_t expected_size = sizeof (DiskCacheIndexHeader) + (header_p -> dcih_num_slots * sizeof (DiskCacheSlot));
+
+							if ((memcmp (header_p -> dcih_magic, S_INDEX_MAGIC, sizeof (S_INDEX_MAGIC)) == 0) && (expected_size == (size_t) st.st_size))
+								{
+									int data_fd = open (GetDataFilename (cache_p -> dc_path, header_p -> dcih_generation).c_str (), O_RDWR | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+
+									if (data_fd != -1)
+										{
+											UnmapDiskCache (cache_p);
+
+											cache_p -> dc_index_fd = index_fd;
+											cache_p -> dc_data_fd = data_fd;
+											cache_p -> dc_index_inode = st.st_ino;
+											cache_p -> dc_header_p = header_p;
+											cache_p -> dc_slots_p = (DiskCacheSlot *) (header_p + 1);
+											cache_p -> dc_map_size = st.st_size;
+
+											return true;
+										}
+								}
+
+							munmap (map_p, st.st_size);
+						}
+				}
+
+			close (index_fd);
+		}
+
+	return false;
+}
+
+
+static void UnmapDiskCache (DiskCache *cache_p)
+{
+	if (cache_p -> dc_header_p)
+		{
+			munmap (cache_p -> dc_header_p, cache_p -> dc_map_size);
+			cache_p -> dc_header_p = NULL;
+			cache_p -> dc_slots_p = NULL;
+			cache_p -> dc_map_size = 0;
+		}
+
+	if (cache_p -> dc_index_fd != -1)
+		{
+			close (cache_p -> dc_index_fd);
+			cache_p -> dc_index_fd = -1;
+		}
+
+	if (cache_p -> dc_data_fd != -1)
+		{
+			close (cache_p -> dc_data_fd);
+			cache_p -> dc_data_fd = -1;
+		}
+}
+
+
+/*
+ * Another process may have compacted the cache since we mapped it,
+ * in which case the index file will have been replaced.
+ */
+static bool EnsureDiskCacheIsCurrent (DiskCache *cache_p)
+{
+	struct stat st;
+
+	if ((stat ((cache_p -> dc_path + ".index").c_str (), &st) == 0) && (st.st_ino == cache_p -> dc_index_inode) && (cache_p -> dc_header_p))
+		{
+			return true;
+		}
+
+	return MapDiskCache (cache_p);
+}
+
+
+static bool NeedsCompacting (const DiskCache *cache_p)
+{
+	const DiskCacheIndexHeader *header_p = cache_p -> dc_header_p;
+	struct stat st;
+
+	if (header_p -> dcih_num_used >= cache_p -> dc_max_entries)
+		{
+			return true;
+		}
+
+	/* Compact once more than half of the data file is superseded records */
+	if (fstat (cache_p -> dc_data_fd, &st) == 0)
+		{
+			const uint64 min_size = 1 << 20;
+
+			if (((uint64) st.st_size > min_size) && ((uint64) st.st_size > (header_p -> dcih_live_bytes * 2)))
+				{
+					return true;
+				}
+		}
+
+	return false;
+}
+
+
+/*
+ * Copy the live entries into a new data file and index, keeping at most
+ * max_entries of them with the latest expiry times. The new index is
+ * written to a temporary file and then renamed over the current one, so
+ * until that rename succeeds the existing files remain untouched. No more
+ * than the cache's maximum number of entries are ever kept, so that the
+ * new index always has empty slots to end its probe sequences.
+ */
+static bool CompactDiskCache (DiskCache *cache_p, const uint32 max_entries)
+{
+	bool success_flag = false;
+	const uint32 num_slots = cache_p -> dc_num_slots;
+	const uint32 num_entries = (max_entries < cache_p -> dc_max_entries) ? max_entries : cache_p -> dc_max_entries;
+	const uint64 generation = (cache_p -> dc_header_p) ? cache_p -> dc_header_p -> dcih_generation + 1 : (uint64) time (NULL);
+	const string index_filename (cache_p -> dc_path + ".index");
+	const string temp_index_filename (index_filename + ".tmp");
+	const string data_filename (GetDataFilename (cache_p -> dc_path, generation));
+	int data_fd = open (data_filename.c_str (), O_RDWR | O_CREAT | O_TRUNC | O_APPEND | O_CLOEXEC, 0644);
+
+	if (data_fd != -1)
+		{
+			int index_fd = open (temp_index_filename.c_str (), O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+
+			if (index_fd != -1)
+				{
+					DiskCacheIndexHeader header;
+					vector <DiskCacheSlot> slots (num_slots);
+					vector <const DiskCacheSlot *> live_slots;
+					bool copied_flag = true;
+
+					memset (&header, 0, sizeof (header));
+					memcpy (header.dcih_magic, S_INDEX_MAGIC, sizeof (S_INDEX_MAGIC));
+					header.dcih_num_slots = num_slots;
+					header.dcih_generation = generation;
+					memset (& (slots [0]), 0, num_slots * sizeof (DiskCacheSlot));
+
+					if (cache_p -> dc_header_p)
+						{
+							const DiskCacheSlot *old_slot_p = cache_p -> dc_slots_p;
+							const int64 now = (int64) time (NULL);
+
+							for (uint32 i = cache_p -> dc_header_p -> dcih_num_slots; i > 0; -- i, ++ old_slot_p)
+								{
+									if ((old_slot_p -> dcs_hash != 0) && (old_slot_p -> dcs_expiry + (int64) (cache_p -> dc_retention) > now))
+										{
+											live_slots.push_back (old_slot_p);
+										}
+								}
+
+							if (live_slots.size () > num_entries)
+								{
+									sort (live_slots.begin (), live_slots.end (), CompareSlotExpiries);
+									live_slots.resize (num_entries);
+								}
+						}
+
+					for (size_t i = 0; (i < live_slots.size ()) && copied_flag; ++ i)
+						{
+							string key;
+							string value;
+
+							/* Any records that fail their checksum are dropped */
+							if (ReadRecord (cache_p -> dc_data_fd, live_slots [i], &key, &value))
+								{
+									DiskCacheSlot slot = * (live_slots [i]);
+
+									if (AppendRecord (data_fd, key.data (), key.size (), value.data (), value.size (), & (slot.dcs_offset), & (slot.dcs_length)))
+										{
+											uint32 j = (uint32) (slot.dcs_hash % num_slots);
+
+											while (slots [j].dcs_hash != 0)
+												{
+													j = (j + 1) % num_slots;
+												}
+
+											slots [j] = slot;
+											++ header.dcih_num_used;
+											header.dcih_live_bytes += slot.dcs_length;
+										}
+									else
+										{
+											copied_flag = false;
+										}
+								}
+						}
+
+					if (copied_flag)
+						{
+							struct iovec iov [2];
+							const size_t slots_size = num_slots * sizeof (DiskCacheSlot);
+
+							iov [0].iov_base = &header;
+							iov [0].iov_len = sizeof (header);
+							iov [1].iov_base = & (slots [0]);
+							iov [1].iov_len = slots_size;
+
+							if (writev (index_fd, iov, 2) == (ssize_t) (sizeof (header) + slots_size))
+								{
+									if ((fdatasync (data_fd) == 0) && (fsync (index_fd) == 0))
+										{
+											if (rename (temp_index_filename.c_str (), index_filename.c_str ()) == 0)
+												{
+													SyncParentDirectory (index_filename);
+
+													if (cache_p -> dc_header_p)
+														{
+															unlink (GetDataFilename (cache_p -> dc_path, cache_p -> dc_header_p -> dcih_generation).c_str ());
+														}
+
+													success_flag = MapDiskCache (cache_p);
+												}
+										}
+								}
+						}
+
+					close (index_fd);
+
+					if (!success_flag)
+						{
+							unlink (temp_index_filename.c_str ());
+						}
+				}
+
+			close (data_fd);
+
+			if (!success_flag)
+				{
+					unlink (data_filename.c_str ());
+				}
+		}
+
+	if (!success_flag)
+		{
+			PrintErrors (STM_LEVEL_WARNING, __FILE__, __LINE__, "Failed to compact disk cache \"%s\"", cache_p -> dc_path.c_str ());
+		}
+
+	return success_flag;
+}
+
+
+static bool CompareSlotExpiries (const DiskCacheSlot *slot_0_p, const DiskCacheSlot *slot_1_p)
+{
+	return (slot_0_p -> dcs_expiry > slot_1_p -> dcs_expiry);
+}
+
+
+static bool ReadRecord (const int fd, const DiskCacheSlot *slot_p, string *key_p, string *value_p)
+{
+	if (slot_p -> dcs_length > sizeof (DiskCacheRecordHeader))
+		{
+			vector <char> buffer (slot_p -> dcs_length);
+
+			if (pread (fd, & (buffer [0]), slot_p -> dcs_length, (off_t) (slot_p -> dcs_offset)) == (ssize_t) (slot_p -> dcs_length))
+				{
+					DiskCacheRecordHeader header;
+
+					memcpy (&header, & (buffer [0]), sizeof (header));
+
+					if ((header.dcrh_magic == S_RECORD_MAGIC) && (sizeof (header) + header.dcrh_key_length + header.dcrh_value_length == slot_p -> dcs_length))
+						{
+							const char *key_s = & (buffer [sizeof (header)]);
+							const char *value_s = key_s + header.dcrh_key_length;
+
+							if (GetChecksum (key_s, header.dcrh_key_length, value_s, header.dcrh_value_length) == header.dcrh_checksum)
+								{
+									key_p -> assign (key_s, header.dcrh_key_length);
+									value_p -> assign (value_s, header.dcrh_value_length);
+
+									return true;
+								}
+						}
+				}
+		}
+
+	return false;
+}
+
+
+static bool AppendRecord (const int fd, const char *key_s, const size_t key_length, const char *value_s, const size_t value_length, uint64 *offset_p, uint32 *length_p)
+{
+	struct stat st;
+
+	/* We hold the exclusive lock so nobody else can be appending */
+	if (fstat (fd, &st) == 0)
+		{
+			DiskCacheRecordHeader header;
+			struct iovec iov [3];
+			const size_t length = sizeof (header) + key_length + value_length;
+
+			header.dcrh_magic = S_RECORD_MAGIC;
+			header.dcrh_key_length = (uint32) key_length;
+			header.dcrh_value_length = (uint32) value_length;
+			header.dcrh_checksum = GetChecksum (key_s, key_length, value_s, value_length);
+
+			iov [0].iov_base = &header;
+			iov [0].iov_len = sizeof (header);
+			iov [1].iov_base = (void *) key_s;
+			iov [1].iov_len = key_length;
+			iov [2].iov_base = (void *) value_s;
+			iov [2].iov_len = value_length;
+
+			if (writev (fd, iov, 3) == (ssize_t) length)
+				{
+					*offset_p = (uint64) st.st_size;
+					*length_p = (uint32) length;
+
+					return true;
+				}
+		}
+
+	return false;
+}
+
+
+/*
+ * Find the slot for the given key using linear probing. If empty_slot_flag
+ * is true and the key is not present, the first empty slot is returned.
+ * If value_p is not NULL, it is set to the value of the found entry.
+ */
+static DiskCacheSlot *FindSlot (DiskCache *cache_p, const char *key_s, const uint64 hash, const bool empty_slot_flag, string *value_p)
+{
+	const uint32 num_slots = cache_p -> dc_header_p -> dcih_num_slots;
+	uint32 i = (uint32) (hash % num_slots);
+
+	for (uint32 j = num_slots; j > 0; -- j)
+		{
+			DiskCacheSlot *slot_p = cache_p -> dc_slots_p + i;
+
+			if (slot_p -> dcs_hash == 0)
+				{
+					return empty_slot_flag ? slot_p : NULL;
+				}
+			else if (slot_p -> dcs_hash == hash)
+				{
+					string key;
+					string value;
+
+					if (ReadRecord (cache_p -> dc_data_fd, slot_p, &key, &value) && (key.compare (key_s) == 0))
+						{
+							if (value_p)
+								{
+									value_p -> swap (value);
+								}
+
+							return slot_p;
+						}
+				}
+
+			i = (i + 1) % num_slots;
+		}
+
+	return NULL;
+}
+
+
+/* 64-bit FNV-1a, with 0 reserved for empty slots */
+static uint64 GetKeyHash (const char *key_s)
+{
+	uint64 hash = 14695981039346656037ULL;
+
+	for ( ; *key_s; ++ key_s)
+		{
+			hash ^= (unsigned char) *key_s;
+			hash *= 1099511628211ULL;
+		}
+
+	return (hash != 0) ? hash : 1;
+}
+
+
+/* 32-bit FNV-1a over the key and value */
+static uint32 GetChecksum (const char *key_s, const size_t key_length, const char *value_s, const size_t value_length)
+{
+	uint32 checksum = 2166136261U;
+	size_t i;
+
+	for (i = 0; i < key_length; ++ i)
+		{
+			checksum ^= (unsigned char) key_s [i];
+			checksum *= 16777619U;
+		}
+
+	for (i = 0; i < value_length; ++ i)
+		{
+			checksum ^= (unsigned char) value_s [i];
+			checksum *= 16777619U;
+		}
+
+	return checksum;
+}
+
+
+static string GetDataFilename (const string &path_r, const uint64 generation)
+{
+	return path_r + ".data." + to_string (generation);
+}
+
+
+static bool SyncParentDirectory (const string &path_r)
+{
+	bool success_flag = false;
+	vector <char> path (path_r.begin (), path_r.end ());
+	int fd;
+
+	path.push_back ('\0');
+
+	fd = open (dirname (& (path [0])), O_RDONLY | O_CLOEXEC);
+
+	if (fd != -1)
+		{
+			success_flag = (fsync (fd) == 0);
+			close (fd);
+		}
+
+	return success_flag;
+}
@@ -0,0 +1,468 @@
+/*
+** Copyright 2014-2016 The Earlham Institute
+**
+** Licensed under the Apache License, Version 2.0 (the "License");
+** you may not use this file except in compliance with the License.
+** You may obtain a copy of the License at
+**
+**     http://www.apache.org/licenses/LICENSE-2.0
+**
+** Unless required by applicable law or agreed to in writing, software
+** distributed under the License is distributed on an "AS IS" BASIS,
+** WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+** See the License for the specific language governing permissions and
+** limitations under the License.
+*/
+/*
+ * dns_cache.cpp
+ *
+ *  Created on: 18 Oct 2026
+ */
+
+#include "dns_cache.hpp"
+
+#include <algorithm>
+#include <cctype>
+#include <chrono>
+#include <condition_variable>
+#include <cstring>
+#include <map>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <arpa/inet.h>
+#include <netdb.h>
+#include <strings.h>
+#include <sys/socket.h>
+
+#include "streams.h"
+
+using namespace std;
+
+
+struct DnsCacheEntry
+{
+	string dce_host;
+	string dce_port;
+
+	/* The addresses separated by commas, as CURLOPT_RESOLVE takes them, or empty if there aren't any */
+	string dce_addresses;
+
+	uint32 dce_ttl;
+	chrono :: steady_clock :: time_point dce_expiry;
+	chrono :: steady_clock :: time_point dce_refresh_time;
+};
+
+
+/*
+ * The resolver thread is started when the first host is added and is
+ * stopped and joined when the service library is unloaded.
+ */
+class DnsCache
+{
+public:
+	~DnsCache ();
+
+	bool Warm (const string &host_r, const string &port_r, const uint32 ttl);
+
+	bool GetAddresses (const string &host_r, const string &port_r, string &addresses_r);
+
+private:
+	void Run ();
+
+	mutex dc_lock;
+	condition_variable dc_condition;
+	map <string, DnsCacheEntry> dc_entries;
+	thread dc_thread;
+	bool dc_stopping = false;
+};
+
+
+/* How long to wait before trying again to resolve a host that failed */
+static const uint32 S_RETRY_INTERVAL = 5;
+
+static DnsCache s_cache;
+
+
+static bool GetUriHostAndPort (const char *uri_s, string &host_r, string &port_r);
+
+static bool ResolveHost (const string &host_r, const string &port_r, string &addresses_r);
+
+static void AddAddress (vector <string> &addresses_r, const string &address_r);
+
+
+bool WarmDnsCache (const char *uri_s, const uint32 ttl)
+{
+	try
+		{
+			string host;
+			string port;
+
+			if (GetUriHostAndPort (uri_s, host, port))
+				{
+					return s_cache.Warm (host, port, ttl);
+				}
+		}
+	catch (...)
+		{
+			PrintErrors (STM_LEVEL_WARNING, __FILE__, __LINE__, "Failed to add host of \"%s\" to DNS cache", uri_s);
+		}
+
+	return false;
+}
+
+
+struct curl_slist *SetCurlToolResolvedHost (CurlTool *tool_p, const char *uri_s)
+{
+	try
+		{
+			string host;
+			string port;
+
+			if (GetUriHostAndPort (uri_s, host, port))
+				{
+					string addresses;
+					string entry;
+					struct curl_slist *hosts_p;
+
+					/* The addresses that an earlier request was given stay in the curl handle unless they are removed */
+					if (s_cache.GetAddresses (host, port, addresses))
+						{
+							entry = host + ":" + port + ":" + addresses;
+						}
+					else
+						{
+							entry = "-" + host + ":" + port;
+						}
+
+					hosts_p = curl_slist_append (NULL, entry.c_str ());
+
+					if (hosts_p)
+						{
+							if (curl_easy_setopt (tool_p -> ct_curl_p, CURLOPT_RESOLVE, hosts_p) == CURLE_OK)
+								{
+									return hosts_p;
+								}
+
+							curl_slist_free_all (hosts_p);
+						}
+
+					PrintErrors (STM_LEVEL_WARNING, __FILE__, __LINE__, "Failed to set resolved addresses for \"%s\"", host.c_str ());
+				}
+		}
+	catch (...)
+		{
+			PrintErrors (STM_LEVEL_WARNING, __FILE__, __LINE__, "Failed to get resolved addresses for \"%s\"", uri_s);
+		}
+
+	return NULL;
+}
+
+
+void ClearCurlToolResolvedHost (CurlTool *tool_p, struct curl_slist *hosts_p)
+{
+	if (hosts_p)
+		{
+			curl_easy_setopt (tool_p -> ct_curl_p, CURLOPT_RESOLVE, NULL);
+			curl_slist_free_all (hosts_p);
+		}
+}
+
+
+DnsCache :: ~DnsCache ()
+{
+	{
+		lock_guard <mutex> guard (dc_lock);
+		dc_stopping = true;
+	}
+
+	dc_condition.notify_all ();
+
+	if (dc_thread.joinable ())
+		{
+			dc_thread.join ();
+		}
+}
+
+
+bool DnsCache :: Warm (const string &host_r, const string &port_r, const uint32 ttl)
+{
+	{
+		lock_guard <mutex> guard (dc_lock);
+		const string key (host_r + ":" + port_r);
+		map <string, DnsCacheEntry> :: iterator it = dc_entries.find (key);
+
+		if (dc_stopping)
+			{
+				return false;
+			}
+
+		if (!dc_thread.joinable ())
+			{
+				try
+					{
+						dc_thread = thread (&DnsCache :: Run, this);
+					}
+				catch (...)
+					{
+						PrintErrors (STM_LEVEL_SEVERE, __FILE__, __LINE__, "Failed to start DNS cache thread");
+						return false;
+					}
+			}
+
+		if (it != dc_entries.end ())
+			{
+				/* If several operations use the same host, the shortest time applies */
+				if (ttl < it -> second.dce_ttl)
+					{
+						it -> second.dce_ttl = ttl;
+						it -> second.dce_expiry = min (it -> second.dce_expiry, chrono :: steady_clock :: now () + chrono :: seconds (ttl));
+						it -> second.dce_refresh_time = min (it -> second.dce_refresh_time, it -> second.dce_expiry);
+					}
+				else
+					{
+						return true;
+					}
+			}
+		else
+			{
+				DnsCacheEntry &entry_r = dc_entries [key];
+
+				entry_r.dce_host = host_r;
+				entry_r.dce_port = port_r;
+				entry_r.dce_ttl = ttl;
+				entry_r.dce_expiry = chrono :: steady_clock :: now ();
+				entry_r.dce_refresh_time = entry_r.dce_expiry;
+			}
+	}
+
+	dc_condition.notify_one ();
+
+	return true;
+}
+
+
+bool DnsCache :: GetAddresses (const string &host_r, const string &port_r, string &addresses_r)
+{
+	lock_guard <mutex> guard (dc_lock);
+	map <string, DnsCacheEntry> :: const_iterator it = dc_entries.find (host_r + ":" + port_r);
+
+	if ((it != dc_entries.end ()) && (!it -> second.dce_addresses.empty ()) && (chrono :: steady_clock :: now () < it -> second.dce_expiry))
+		{
+			addresses_r = it -> second.dce_addresses;
+			return true;
+		}
+
+	return false;
+}
+
+
+/*
+ * Each host is resolved again once three quarters of its time has passed
+ * so that its addresses are replaced before they expire. If that fails,
+ * the old addresses are kept until they expire and the lookup is retried
+ * every few seconds.
+ */
+void DnsCache :: Run ()
+{
+	unique_lock <mutex> lock (dc_lock);
+
+	while (!dc_stopping)
+		{
+			map <string, DnsCacheEntry> :: iterator next_it = dc_entries.end ();
+
+			for (map <string, DnsCacheEntry> :: iterator it = dc_entries.begin (); it != dc_entries.end (); ++ it)
+				{
+					if ((next_it == dc_entries.end ()) || (it -> second.dce_refresh_time < next_it -> second.dce_refresh_time))
+						{
+							next_it = it;
+						}
+				}
+
+			if (next_it == dc_entries.end ())
+				{
+					dc_condition.wait (lock);
+				}
+			else if (chrono :: steady_clock :: now () < next_it -> second.dce_refresh_time)
+				{
+					/* A newly added host wakes this up early */
+					dc_condition.wait_until (lock, next_it -> second.dce_refresh_time);
+				}
+			else
+				{
+					/* Entries are never removed, so next_it is still valid once the lock is taken again */
+					const string host (next_it -> second.dce_host);
+					const string port (next_it -> second.dce_port);
+					string addresses;
+					bool resolved_flag;
+					chrono :: steady_clock :: time_point now;
+
+					lock.unlock ();
+					resolved_flag = ResolveHost (host, port, addresses);
+					lock.lock ();
+
+					now = chrono :: steady_clock :: now ();
+
+					if (resolved_flag)
+						{
+							const uint32 ttl = next_it -> second.dce_ttl;
+
+							next_it -> second.dce_addresses.swap (addresses);
+							next_it -> second.dce_expiry = now + chrono :: seconds (ttl);
+							next_it -> second.dce_refresh_time = now + chrono :: milliseconds (max ((uint64) ttl * 750, (uint64) 1000));
+						}
+					else
+						{
+							PrintErrors (STM_LEVEL_WARNING, __FILE__, __LINE__, "Failed to resolve \"%s\"", host.c_str ());
+
+							if (now >= next_it -> second.dce_expiry)
+								{
+									next_it -> second.dce_addresses.clear ();
+								}
+
+							next_it -> second.dce_refresh_time = now + chrono :: seconds (S_RETRY_INTERVAL);
+						}
+				}
+		}
+}
+
+
+/*
+ * Only http and https URIs with a host name are cached, since IP addresses
+ * don't need resolving.
+ */
+static bool GetUriHostAndPort (const char *uri_s, string &host_r, string &port_r)
+{
+	const char *host_p = strstr (uri_s, "://");
+
+	if (host_p)
+		{
+			const string scheme (uri_s, host_p - uri_s);
+			const char *end_p;
+			const char *port_p;
+
+			if (strcasecmp (scheme.c_str (), "https") == 0)
+				{
+					port_r = "443";
+				}
+			else if (strcasecmp (scheme.c_str (), "http") == 0)
+				{
+					port_r = "80";
+				}
+			else
+				{
+					return false;
+				}
+
+			host_p += 3;
+			end_p = host_p + strcspn (host_p, "/?#");
+
+			/* Skip any user name and password */
+			for (const char *at_p = host_p; at_p < end_p; ++ at_p)
+				{
+					if (*at_p == '@')
+						{
+							host_p = at_p + 1;
+						}
+				}
+
+			if ((host_p < end_p) && (*host_p != '['))
+				{
+					struct in_addr address;
+
+					port_p = (const char *) memchr (host_p, ':', end_p - host_p);
+
+					if (port_p)
+						{
+							if (port_p + 1 < end_p)
+								{
+									port_r.assign (port_p + 1, end_p - port_p - 1);
+								}
+
+							end_p = port_p;
+						}
+
+					host_r.assign (host_p, end_p - host_p);
+
+					for (string :: iterator it = host_r.begin (); it != host_r.end (); ++ it)
+						{
+							*it = tolower ((unsigned char) *it);
+						}
+
+					return ((!host_r.empty ()) && (inet_pton (AF_INET, host_r.c_str (), &address) != 1));
+				}
+		}
+
+	return false;
+}
+
+
+static bool ResolveHost (const string &host_r, const string &port_r, string &addresses_r)
+{
+	struct addrinfo hints;
+	struct addrinfo *results_p = NULL;
+	bool success_flag = false;
+
+	memset (&hints, 0, sizeof (hints));
+	hints.ai_family = AF_UNSPEC;
+	hints.ai_socktype = SOCK_STREAM;
+
+	if (getaddrinfo (host_r.c_str (), port_r.c_str (), &hints, &results_p) == 0)
+		{
+			vector <string> addresses;
+
+			for (struct addrinfo *result_p = results_p; result_p; result_p = result_p -> ai_next)
+				{
+					char address_s [INET6_ADDRSTRLEN + 2];
+
+					if (result_p -> ai_family == AF_INET)
+						{
+							if (inet_ntop (AF_INET, & (((struct sockaddr_in *) (result_p -> ai_addr)) -> sin_addr), address_s, sizeof (address_s)))
+								{
+									AddAddress (addresses, address_s);
+								}
+						}
+					else if (result_p -> ai_family == AF_INET6)
+						{
+							/* curl needs IPv6 addresses to be in brackets */
+							if (inet_ntop (AF_INET6, & (((struct sockaddr_in6 *) (result_p -> ai_addr)) -> sin6_addr), address_s, sizeof (address_s)))
+								{
+									AddAddress (addresses, string ("[") + address_s + "]");
+								}
+						}
+				}
+
+			freeaddrinfo (results_p);
+
+			if (!addresses.empty ())
+				{
+					addresses_r.clear ();
+
+					for (vector <string> :: const_iterator it = addresses.begin (); it != addresses.end (); ++ it)
+						{
+							if (!addresses_r.empty ())
+								{
+									addresses_r.push_back (',');
+								}
+
+							addresses_r.append (*it);
+						}
+
+					success_flag = true;
+				}
+		}
+
+	return success_flag;
+}
+
+
+/* The addresses are kept in the order that they were resolved in, since that is the order to try them in */
+static void AddAddress (vector <string> &addresses_r, const string &address_r)
+{
+	if (find (addresses_r.begin (), addresses_r.end (), address_r) == addresses_r.end ())
+		{
+			addresses_r.push_back (address_r);
+		}
+}
@@ -0,0 +1,248 @@
+/*
+** Copyright 2014-2016 The Earlham Institute
+**
+** Licensed under the Apache License, Version 2.0 (the "License");
+** you may not use this file except in compliance with the License.
+** You may obtain a copy of the License at
+**
+**     http://www.apache.org/licenses/LICENSE-2.0
+**
+** Unless required by applicable law or agreed to in writing, software
+** distributed under the License is distributed on an "AS IS" BASIS,
+** WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+** See the License for the specific language governing permissions and
+** limitations under the License.
+*/
+/*
+ * idle_resources.cpp
+ *
+ *  Created on: 18 Oct 2026
+ */
+
+#include "idle_resources.hpp"
+
+#include <chrono>
+#include <condition_variable>
+#include <ctime>
+#include <mutex>
+#include <new>
+#include <set>
+#include <thread>
+
+#include "streams.h"
+
+using namespace std;
+
+
+struct IdleResource
+{
+	mutex ir_lock;
+	IdleResourceCreator ir_create_fn;
+	IdleResourceReleaser ir_release_fn;
+	void *ir_data_p;
+	uint32 ir_idle_time;
+
+	bool ir_created_flag = false;
+	uint32 ir_num_users = 0;
+	time_t ir_last_used = 0;
+};
+
+
+/*
+ * The thread that releases resources once their idle periods are over.
+ * It is started when the first resource with an idle period is added
+ * and is stopped and joined when the service library is unloaded.
+ */
+class IdleResourceReaper
+{
+public:
+	~IdleResourceReaper ();
+
+	bool Add (IdleResource *resource_p);
+
+	void Remove (IdleResource *resource_p);
+
+private:
+	void Run ();
+
+	mutex irr_lock;
+	condition_variable irr_condition;
+	set <IdleResource *> irr_resources;
+	thread irr_thread;
+	bool irr_stopping = false;
+};
+
+
+/* How often the reaper checks for idle resources */
+static const chrono :: seconds S_REAP_INTERVAL (5);
+
+static IdleResourceReaper s_reaper;
+
+
+static void ReleaseHeldResource (IdleResource *resource_p);
+
+
+IdleResource *AllocateIdleResource (IdleResourceCreator create_fn, IdleResourceReleaser release_fn, void *data_p, const uint32 idle_time)
+{
+	IdleResource *resource_p = new (nothrow) IdleResource;
+
+	if (resource_p)
+		{
+			resource_p -> ir_create_fn = create_fn;
+			resource_p -> ir_release_fn = release_fn;
+			resource_p -> ir_data_p = data_p;
+			resource_p -> ir_idle_time = idle_time;
+
+			/* Without the reaper, the resource is just kept until it is freed */
+			if ((idle_time > 0) && (!s_reaper.Add (resource_p)))
+				{
+					PrintErrors (STM_LEVEL_WARNING, __FILE__, __LINE__, "Failed to watch resource for idleness, it will be kept until it is freed");
+				}
+		}
+	else
+		{
+			PrintErrors (STM_LEVEL_SEVERE, __FILE__, __LINE__, "Failed to allocate idle resource");
+		}
+
+	return resource_p;
+}
+
+
+void FreeIdleResource (IdleResource *resource_p)
+{
+	s_reaper.Remove (resource_p);
+
+	ReleaseHeldResource (resource_p);
+
+	delete resource_p;
+}
+
+
+bool AcquireIdleResource (IdleResource *resource_p)
+{
+	lock_guard <mutex> guard (resource_p -> ir_lock);
+
+	if (! (resource_p -> ir_created_flag))
+		{
+			if (resource_p -> ir_create_fn (resource_p -> ir_data_p))
+				{
+					resource_p -> ir_created_flag = true;
+				}
+			else
+				{
+					PrintErrors (STM_LEVEL_SEVERE, __FILE__, __LINE__, "Failed to create resource");
+					return false;
+				}
+		}
+
+	++ (resource_p -> ir_num_users);
+
+	return true;
+}
+
+
+void ReleaseIdleResource (IdleResource *resource_p)
+{
+	lock_guard <mutex> guard (resource_p -> ir_lock);
+
+	if (resource_p -> ir_num_users > 0)
+		{
+			-- (resource_p -> ir_num_users);
+		}
+
+	resource_p -> ir_last_used = time (NULL);
+}
+
+
+IdleResourceReaper :: ~IdleResourceReaper ()
+{
+	{
+		lock_guard <mutex> guard (irr_lock);
+		irr_stopping = true;
+	}
+
+	irr_condition.notify_all ();
+
+	if (irr_thread.joinable ())
+		{
+			irr_thread.join ();
+		}
+}
+
+
+bool IdleResourceReaper :: Add (IdleResource *resource_p)
+{
+	lock_guard <mutex> guard (irr_lock);
+
+	if (irr_stopping)
+		{
+			return false;
+		}
+
+	try
+		{
+			if (! (irr_thread.joinable ()))
+				{
+					irr_thread = thread (&IdleResourceReaper :: Run, this);
+				}
+
+			irr_resources.insert (resource_p);
+		}
+	catch (...)
+		{
+			return false;
+		}
+
+	return true;
+}
+
+
+void IdleResourceReaper :: Remove (IdleResource *resource_p)
+{
+	lock_guard <mutex> guard (irr_lock);
+
+	irr_resources.erase (resource_p);
+}
+
+
+void IdleResourceReaper :: Run ()
+{
+	unique_lock <mutex> lock (irr_lock);
+
+	while (!irr_stopping)
+		{
+			irr_condition.wait_for (lock, S_REAP_INTERVAL, [this] { return irr_stopping; });
+
+			if (!irr_stopping)
+				{
+					const time_t now = time (NULL);
+
+					for (set <IdleResource *> :: iterator it = irr_resources.begin (); it != irr_resources.end (); ++ it)
+						{
+							IdleResource *resource_p = *it;
+
+							/* Don't hold up a request that is creating the resource, we'll check again next time */
+							unique_lock <mutex> resource_lock (resource_p -> ir_lock, try_to_lock);
+
+							if (resource_lock.owns_lock () && (resource_p -> ir_created_flag) && (resource_p -> ir_num_users == 0) &&
+								(now - resource_p -> ir_last_used >= (time_t) (resource_p -> ir_idle_time)))
+								{
+									resource_p -> ir_release_fn (resource_p -> ir_data_p);
+									resource_p -> ir_created_flag = false;
+								}
+						}
+				}
+		}
+}
+
+
+static void ReleaseHeldResource (IdleResource *resource_p)
+{
+	lock_guard <mutex> guard (resource_p -> ir_lock);
+
+	if (resource_p -> ir_created_flag)
+		{
+			resource_p -> ir_release_fn (resource_p -> ir_data_p);
+			resource_p -> ir_created_flag = false;
+		}
+}
@@ -0,0 +1,77 @@
+/*
+** Copyright 2014-2016 The Earlham Institute
+**
+** Licensed under the Apache License, Version 2.0 (the "License");
+** you may not use this file except in compliance with the License.
+** You may obtain a copy of the License at
+**
+**     http://www.apache.org/licenses/LICENSE-2.0
+**
+** Unless required by applicable law or agreed to in writing, software
+** distributed under the License is distributed on an "AS IS" BASIS,
+** WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+** See the License for the specific language governing permissions and
+** limitations under the License.
+*/
+/*
+ * memory_budget.cpp
+ *
+ *  Created on: 18 Oct 2026
+ */
+
+#include "memory_budget.hpp"
+
+#include <chrono>
+#include <condition_variable>
+#include <mutex>
+
+using namespace std;
+
+
+static mutex s_budget_lock;
+static condition_variable s_budget_condition;
+
+/* 0 means that there is no budget */
+static size_t s_budget = 0;
+static size_t s_usage = 0;
+
+
+void SetMemoryBudget (const size_t budget)
+{
+	{
+		lock_guard <mutex> guard (s_budget_lock);
+
+		s_budget = budget;
+	}
+
+	/* A larger budget may let some of the waiting searches start */
+	s_budget_condition.notify_all ();
+}
+
+
+bool WaitForMemoryBudget (const uint32 timeout)
+{
+	unique_lock <mutex> lock (s_budget_lock);
+
+	return s_budget_condition.wait_for (lock, chrono :: seconds (timeout), [] { return (s_budget == 0) || (s_usage < s_budget); });
+}
+
+
+void AddMemoryBudgetUsage (const size_t size)
+{
+	lock_guard <mutex> guard (s_budget_lock);
+
+	s_usage += size;
+}
+
+
+void RemoveMemoryBudgetUsage (const size_t size)
+{
+	{
+		lock_guard <mutex> guard (s_budget_lock);
+
+		s_usage = (size < s_usage) ? s_usage - size : 0;
+	}
+
+	s_budget_condition.notify_all ();
+}
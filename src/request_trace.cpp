@@ -0,0 +1,345 @@
+/*
+** Copyright 2014-2016 The Earlham Institute
+**
+** Licensed under the Apache License, Version 2.0 (the "License");
+** you may not use this file except in compliance with the License.
+** You may obtain a copy of the License at
+**
+**     http://www.apache.org/licenses/LICENSE-2.0
+**
+** Unless required by applicable law or agreed to in writing, software
+** distributed under the License is distributed on an "AS IS" BASIS,
+** WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+** See the License for the specific language governing permissions and
+** limitations under the License.
+*/
+/*
+ * request_trace.cpp
+ *
+ *  Created on: 18 Oct 2026
+ */
+
+#include "request_trace.hpp"
+
+#include <cerrno>
+#include <chrono>
+#include <cstdlib>
+#include <functional>
+#include <new>
+#include <random>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/file.h>
+#include <sys/stat.h>
+
+#include "jansson.h"
+#include "streams.h"
+
+using namespace std;
+
+
+struct TraceSpan
+{
+	const char *ts_name_s;
+	uint64 ts_start;
+	uint64 ts_duration;
+};
+
+
+struct RequestTrace
+{
+	string rt_operation;
+	vector <TraceSpan> rt_spans;
+
+	/** The thread that the request was started on. */
+	unsigned long rt_tid;
+};
+
+
+/*
+ * A request with a huge page could otherwise record a span for every
+ * one of thousands of links.
+ */
+static const size_t S_MAX_SPANS = 4096;
+
+static thread_local RequestTrace *tl_trace_p = NULL;
+
+static json_t *GetTraceSpanAsJSON (const TraceSpan &span_r, const char *operation_s, const long pid, const unsigned long tid);
+
+static bool AppendTraceSpans (const char *path_s, const size_t max_file_size, const vector <char *> &events_r);
+
+
+bool StartRequestTrace (const char *operation_s, const double sample_rate)
+{
+	static thread_local minstd_rand tl_generator (random_device {} ());
+
+	if ((sample_rate > 0.0) && (!tl_trace_p))
+		{
+			uniform_real_distribution <double> distribution (0.0, 1.0);
+
+			if (distribution (tl_generator) < sample_rate)
+				{
+					RequestTrace *trace_p = new (nothrow) RequestTrace;
+
+					if (trace_p)
+						{
+							try
+								{
+									trace_p -> rt_operation = operation_s;
+									trace_p -> rt_spans.reserve (64);
+									trace_p -> rt_tid = (unsigned long) hash <thread :: id> () (this_thread :: get_id ());
+
+									tl_trace_p = trace_p;
+
+									return true;
+								}
+							catch (...)
+								{
+									delete trace_p;
+								}
+						}
+
+					PrintErrors (STM_LEVEL_WARNING, __FILE__, __LINE__, "Failed to start trace for \"%s\"", operation_s);
+				}
+		}
+
+	return false;
+}
+
+
+void FinishRequestTrace (const char *path_s, const size_t max_file_size)
+{
+	RequestTrace *trace_p = tl_trace_p;
+
+	if (trace_p)
+		{
+			const long pid = (long) getpid ();
+			vector <char *> events;
+
+			tl_trace_p = NULL;
+
+			/* Do the formatting before taking the lock so that other requests aren't held up by it */
+			try
+				{
+					events.reserve (trace_p -> rt_spans.size ());
+
+					for (vector <TraceSpan> :: const_iterator it = trace_p -> rt_spans.begin (); it != trace_p -> rt_spans.end (); ++ it)
+						{
+							json_t *event_p = GetTraceSpanAsJSON (*it, trace_p -> rt_operation.c_str (), pid, trace_p -> rt_tid);
+
+							if (event_p)
+								{
+									char *event_s = json_dumps (event_p, JSON_COMPACT);
+
+									if (event_s)
+										{
+											events.push_back (event_s);
+										}
+
+									json_decref (event_p);
+								}
+						}
+
+					if (path_s)
+						{
+							AppendTraceSpans (path_s, max_file_size, events);
+						}
+				}
+			catch (...)
+				{
+					PrintErrors (STM_LEVEL_WARNING, __FILE__, __LINE__, "Failed to write trace for \"%s\"", trace_p -> rt_operation.c_str ());
+				}
+
+			for (vector <char *> :: iterator it = events.begin (); it != events.end (); ++ it)
+				{
+					free (*it);
+				}
+
+			delete trace_p;
+		}
+}
+
+
+RequestTrace *DetachRequestTrace (void)
+{
+	RequestTrace *trace_p = tl_trace_p;
+
+	tl_trace_p = NULL;
+
+	return trace_p;
+}
+
+
+void AttachRequestTrace (RequestTrace *trace_p)
+{
+	if (trace_p)
+		{
+			if (!tl_trace_p)
+				{
+					tl_trace_p = trace_p;
+				}
+			else
+				{
+					PrintErrors (STM_LEVEL_WARNING, __FILE__, __LINE__, "Discarding trace for \"%s\" as the thread is already tracing \"%s\"", trace_p -> rt_operation.c_str (), tl_trace_p -> rt_operation.c_str ());
+					delete trace_p;
+				}
+		}
+}
+
+
+uint64 BeginTraceSpan (void)
+{
+	if (tl_trace_p)
+		{
+			const uint64 now = (uint64) chrono :: duration_cast <chrono :: microseconds> (chrono :: steady_clock :: now ().time_since_epoch ()).count ();
+
+			/* 0 means that there isn't a span */
+			return (now > 0) ? now : 1;
+		}
+
+	return 0;
+}
+
+
+void EndTraceSpan (const char *name_s, const uint64 start)
+{
+	if (start > 0)
+		{
+			const uint64 now = BeginTraceSpan ();
+
+			if (now > 0)
+				{
+					AddTraceSpan (name_s, start, (now > start) ? now - start : 0);
+				}
+		}
+}
+
+
+void AddTraceSpan (const char *name_s, const uint64 start, const uint64 duration)
+{
+	RequestTrace *trace_p = tl_trace_p;
+
+	if (trace_p && (trace_p -> rt_spans.size () < S_MAX_SPANS))
+		{
+			TraceSpan span;
+
+			span.ts_name_s = name_s;
+			span.ts_start = start;
+			span.ts_duration = duration;
+
+			try
+				{
+					trace_p -> rt_spans.push_back (span);
+				}
+			catch (...)
+				{
+					/* Losing a span isn't worth failing the search for */
+				}
+		}
+}
+
+
+/*
+ * Each span is a complete event, "ph": "X", with its times in microseconds.
+ */
+static json_t *GetTraceSpanAsJSON (const TraceSpan &span_r, const char *operation_s, const long pid, const unsigned long tid)
+{
+	json_t *event_p = json_pack ("{s:s,s:s,s:s,s:I,s:I,s:I,s:I,s:{s:s}}",
+		"name", span_r.ts_name_s,
+		"cat", "web_search",
+		"ph", "X",
+		"ts", (json_int_t) (span_r.ts_start),
+		"dur", (json_int_t) (span_r.ts_duration),
+		"pid", (json_int_t) pid,
+		"tid", (json_int_t) (tid & 0x7FFFFFFF),
+		"args", "operation", operation_s);
+
+	if (!event_p)
+		{
+			PrintErrors (STM_LEVEL_WARNING, __FILE__, __LINE__, "Failed to create trace event for \"%s\"", span_r.ts_name_s);
+		}
+
+	return event_p;
+}
+
+
+/*
+ * Several server processes can share the same trace file, so the lock is
+ * taken on the file itself to make checking whether it is new and
+ * appending to it atomic. Each batch of spans is added with a single
+ * write so that it can't be interleaved with another one.
+ */
+static bool AppendTraceSpans (const char *path_s, const size_t max_file_size, const vector <char *> &events_r)
+{
+	bool success_flag = false;
+	string batch;
+
+	for (vector <char *> :: const_iterator it = events_r.begin (); it != events_r.end (); ++ it)
+		{
+			batch.append (*it);
+			batch.append (",\n");
+		}
+
+	int trace_fd = open (path_s, O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+
+	if (trace_fd >= 0)
+		{
+			if (flock (trace_fd, LOCK_EX) == 0)
+				{
+					struct stat st;
+
+					if ((fstat (trace_fd, &st) == 0) && ((max_file_size == 0) || ((size_t) st.st_size < max_file_size)))
+						{
+							const char *data_s;
+							size_t remaining;
+
+							/* A new file needs the opening bracket of the array of events */
+							if (st.st_size == 0)
+								{
+									batch.insert (0, "[\n");
+								}
+
+							data_s = batch.c_str ();
+							remaining = batch.size ();
+							success_flag = true;
+
+							while ((remaining > 0) && success_flag)
+								{
+									const ssize_t written = write (trace_fd, data_s, remaining);
+
+									if (written > 0)
+										{
+											data_s += written;
+											remaining -= (size_t) written;
+										}
+									else if ((written < 0) && (errno == EINTR))
+										{
+											continue;
+										}
+									else
+										{
+											success_flag = false;
+										}
+								}
+						}
+
+					flock (trace_fd, LOCK_UN);
+				}
+
+			if (close (trace_fd) != 0)
+				{
+					success_flag = false;
+				}
+		}
+
+	if (!success_flag)
+		{
+			PrintLog (STM_LEVEL_FINE, __FILE__, __LINE__, "Not writing trace to \"%s\"", path_s);
+		}
+
+	return success_flag;
+}
@@ -0,0 +1,694 @@
+/*
+** Copyright 2014-2016 The Earlham Institute
+**
+** Licensed under the Apache License, Version 2.0 (the "License");
+** you may not use this file except in compliance with the License.
+** You may obtain a copy of the License at
+**
+**     http://www.apache.org/licenses/LICENSE-2.0
+**
+** Unless required by applicable law or agreed to in writing, software
+** distributed under the License is distributed on an "AS IS" BASIS,
+** WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+** See the License for the specific language governing permissions and
+** limitations under the License.
+*/
+/*
+ * result_cache.cpp
+ *
+ *  Created on: 18 Oct 2026
+ */
+
+#include "result_cache.hpp"
+#include "disk_cache.hpp"
+
+#include <cstring>
+#include <ctime>
+#include <list>
+#include <map>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+
+#include "memory_allocations.h"
+#include "string_utils.h"
+#include "streams.h"
+
+using namespace std;
+
+
+struct CacheEntry
+{
+	string ce_key;
+	json_t *ce_results_p;
+	string ce_etag;
+	string ce_last_modified;
+	string ce_request_uri;
+	time_t ce_expiry;
+	bool ce_refreshing_flag;
+};
+
+
+/* A search that had no results or that failed */
+struct NegativeCacheEntry
+{
+	string nce_key;
+	time_t nce_expiry;
+	bool nce_failed_flag;
+};
+
+
+struct ResultCache
+{
+	mutex rc_lock;
+	string rc_uri;
+	size_t rc_max_entries;
+	uint32 rc_ttl;
+	uint32 rc_stale_ttl;
+
+	/* The optional persistent tier that entries are written through to */
+	DiskCache *rc_disk_cache_p = NULL;
+
+	/* Most recently used entries are at the front */
+	list <CacheEntry> rc_entries;
+	unordered_map <string, list <CacheEntry> :: iterator> rc_index;
+
+	/* The negative entries, kept apart so that they can't evict any results */
+	size_t rc_max_negative_entries = 0;
+	uint32 rc_empty_ttl = 0;
+	uint32 rc_failed_ttl = 0;
+	list <NegativeCacheEntry> rc_negative_entries;
+	unordered_map <string, list <NegativeCacheEntry> :: iterator> rc_negative_index;
+
+	~ResultCache ();
+};
+
+
+static void ClearResultCache (ResultCache *cache_p);
+
+static void RemoveOldestEntry (ResultCache *cache_p);
+
+static char *CopyOptionalString (const string &value_r);
+
+static CacheEntry *FindCacheEntry (ResultCache *cache_p, const char *key_s);
+
+static CacheEntry *InsertCacheEntry (ResultCache *cache_p, const char *key_s, json_t *results_p, const char *etag_s, const char *last_modified_s, const char *request_uri_s, const time_t expiry);
+
+static CacheEntryState FillCachedResults (ResultCache *cache_p, CacheEntry *entry_p, CachedResults *results_p);
+
+static void RemoveCacheEntry (ResultCache *cache_p, const char *key_s);
+
+static NegativeCacheEntry *FindNegativeCacheEntry (ResultCache *cache_p, const char *key_s);
+
+static bool InsertNegativeCacheEntry (ResultCache *cache_p, const char *key_s, const bool failed_flag, const time_t expiry);
+
+static void RemoveNegativeCacheEntry (ResultCache *cache_p, const char *key_s);
+
+static json_t *GetCachedResultsAsJSON (const CachedResults *results_p);
+
+static const char *GetOptionalJSONString (const json_t *json_p, const char *key_s);
+
+
+
+/*
+ * The caches are shared between every Service instance for a given
+ * operation so they survive the services being reloaded.
+ */
+static mutex s_registry_lock;
+static map <string, ResultCache *> s_registry;
+
+
+ResultCache :: ~ResultCache ()
+{
+	ClearResultCache (this);
+
+	if (rc_disk_cache_p)
+		{
+			CloseDiskCache (rc_disk_cache_p);
+		}
+}
+
+
+ResultCache *GetResultCache (const char *name_s, const char *uri_s, const uint32 max_entries, const uint32 ttl, const uint32 stale_ttl)
+{
+	ResultCache *cache_p = NULL;
+
+	if (name_s && (max_entries > 0))
+		{
+			lock_guard <mutex> registry_guard (s_registry_lock);
+			map <string, ResultCache *> :: iterator it = s_registry.find (name_s);
+
+			if (it != s_registry.end ())
+				{
+					cache_p = it -> second;
+				}
+			else
+				{
+					cache_p = new (nothrow) ResultCache;
+
+					if (cache_p)
+						{
+							s_registry [name_s] = cache_p;
+						}
+					else
+						{
+							PrintErrors (STM_LEVEL_SEVERE, __FILE__, __LINE__, "Failed to allocate result cache for \"%s\"", name_s);
+						}
+				}
+
+			if (cache_p)
+				{
+					const string uri (uri_s ? uri_s : "");
+					lock_guard <mutex> cache_guard (cache_p -> rc_lock);
+
+					/* Any cached results from a different search engine are no longer valid */
+					if (cache_p -> rc_uri != uri)
+						{
+							ClearResultCache (cache_p);
+							cache_p -> rc_uri = uri;
+						}
+
+					cache_p -> rc_max_entries = max_entries;
+					cache_p -> rc_ttl = ttl;
+					cache_p -> rc_stale_ttl = stale_ttl;
+
+					while (cache_p -> rc_entries.size () > cache_p -> rc_max_entries)
+						{
+							RemoveOldestEntry (cache_p);
+						}
+				}
+
+		}		/* if (name_s && (max_entries > 0)) */
+
+	return cache_p;
+}
+
+
+bool AttachDiskCache (ResultCache *cache_p, const char *path_s, const uint32 num_entries)
+{
+	lock_guard <mutex> guard (cache_p -> rc_lock);
+
+	if (cache_p -> rc_disk_cache_p)
+		{
+			if (strcmp (GetDiskCachePath (cache_p -> rc_disk_cache_p), path_s) == 0)
+				{
+					return true;
+				}
+
+			CloseDiskCache (cache_p -> rc_disk_cache_p);
+		}
+
+	cache_p -> rc_disk_cache_p = OpenDiskCache (path_s, num_entries, cache_p -> rc_stale_ttl);
+
+	return (cache_p -> rc_disk_cache_p != NULL);
+}
+
+
+void SetNegativeCaching (ResultCache *cache_p, const uint32 max_entries, const uint32 empty_ttl, const uint32 failed_ttl)
+{
+	lock_guard <mutex> guard (cache_p -> rc_lock);
+
+	cache_p -> rc_max_negative_entries = max_entries;
+	cache_p -> rc_empty_ttl = empty_ttl;
+	cache_p -> rc_failed_ttl = failed_ttl;
+
+	while (cache_p -> rc_negative_entries.size () > cache_p -> rc_max_negative_entries)
+		{
+			cache_p -> rc_negative_index.erase (cache_p -> rc_negative_entries.back ().nce_key);
+			cache_p -> rc_negative_entries.pop_back ();
+		}
+}
+
+
+CacheEntryState GetCachedResults (ResultCache *cache_p, const char *key_s, CachedResults *results_p)
+{
+	DiskCache *disk_cache_p = NULL;
+
+	results_p -> cr_results_p = NULL;
+	results_p -> cr_etag_s = NULL;
+	results_p -> cr_last_modified_s = NULL;
+	results_p -> cr_request_uri_s = NULL;
+
+	{
+		lock_guard <mutex> guard (cache_p -> rc_lock);
+		NegativeCacheEntry *negative_entry_p = FindNegativeCacheEntry (cache_p, key_s);
+		CacheEntry *entry_p;
+
+		if (negative_entry_p)
+			{
+				if (negative_entry_p -> nce_failed_flag)
+					{
+						return CES_FAILED;
+					}
+
+				results_p -> cr_results_p = json_array ();
+
+				return (results_p -> cr_results_p) ? CES_FRESH : CES_MISSING;
+			}
+
+		entry_p = FindCacheEntry (cache_p, key_s);
+
+		if (entry_p)
+			{
+				return FillCachedResults (cache_p, entry_p, results_p);
+			}
+
+		disk_cache_p = cache_p -> rc_disk_cache_p;
+	}
+
+	/*
+	 * Check the persistent tier without holding the lock and, if the
+	 * entry is there, promote it back into memory.
+	 */
+	if (disk_cache_p)
+		{
+			time_t expiry;
+			json_t *value_p = GetDiskCacheEntry (disk_cache_p, key_s, &expiry);
+
+			if (value_p)
+				{
+					CacheEntryState state = CES_MISSING;
+					json_t *disk_results_p = json_object_get (value_p, "results");
+
+					if (disk_results_p)
+						{
+							lock_guard <mutex> guard (cache_p -> rc_lock);
+							CacheEntry *entry_p = InsertCacheEntry (cache_p, key_s, json_incref (disk_results_p), GetOptionalJSONString (value_p, "etag"),
+								GetOptionalJSONString (value_p, "last_modified"), GetOptionalJSONString (value_p, "request_uri"), expiry);
+
+							if (entry_p)
+								{
+									state = FillCachedResults (cache_p, entry_p, results_p);
+								}
+						}
+
+					json_decref (value_p);
+
+					return state;
+				}
+		}
+
+	return CES_MISSING;
+}
+
+
+bool AddCachedResults (ResultCache *cache_p, const char *key_s, const CachedResults *results_p)
+{
+	json_t *copied_results_p = NULL;
+
+	if (json_is_array (results_p -> cr_results_p) && (json_array_size (results_p -> cr_results_p) == 0))
+		{
+			DiskCache *disk_cache_p = NULL;
+			bool negative_flag = false;
+			bool success_flag = false;
+
+			{
+				lock_guard <mutex> guard (cache_p -> rc_lock);
+
+				/* If empty results aren't negatively cached, they are cached like any others */
+				if ((cache_p -> rc_empty_ttl > 0) && (cache_p -> rc_max_negative_entries > 0))
+					{
+						/* The empty results supersede any that we had before */
+						RemoveCacheEntry (cache_p, key_s);
+						success_flag = InsertNegativeCacheEntry (cache_p, key_s, false, time (NULL) + cache_p -> rc_empty_ttl);
+						disk_cache_p = cache_p -> rc_disk_cache_p;
+						negative_flag = true;
+					}
+			}
+
+			if (negative_flag)
+				{
+					if (disk_cache_p)
+						{
+							/* Stop the previous results being promoted again without being revalidated */
+							SetDiskCacheEntryExpiry (disk_cache_p, key_s, 0);
+						}
+
+					return success_flag;
+				}
+		}
+
+	copied_results_p = json_deep_copy (results_p -> cr_results_p);
+
+	if (copied_results_p)
+		{
+			DiskCache *disk_cache_p = NULL;
+			time_t expiry;
+			bool success_flag = false;
+
+			{
+				lock_guard <mutex> guard (cache_p -> rc_lock);
+
+				expiry = time (NULL) + cache_p -> rc_ttl;
+				RemoveNegativeCacheEntry (cache_p, key_s);
+				success_flag = (InsertCacheEntry (cache_p, key_s, copied_results_p, results_p -> cr_etag_s, results_p -> cr_last_modified_s, results_p -> cr_request_uri_s, expiry) != NULL);
+				disk_cache_p = cache_p -> rc_disk_cache_p;
+			}
+
+			if (success_flag && disk_cache_p)
+				{
+					json_t *value_p = GetCachedResultsAsJSON (results_p);
+
+					if (value_p)
+						{
+							if (!AddDiskCacheEntry (disk_cache_p, key_s, value_p, expiry))
+								{
+									PrintErrors (STM_LEVEL_WARNING, __FILE__, __LINE__, "Failed to write results for \"%s\" to disk cache", key_s);
+								}
+
+							json_decref (value_p);
+						}
+				}
+
+			return success_flag;
+		}
+	else
+		{
+			PrintErrors (STM_LEVEL_WARNING, __FILE__, __LINE__, "Failed to copy results to cache for \"%s\"", key_s);
+		}
+
+	return false;
+}
+
+
+bool AddFailedCachedResults (ResultCache *cache_p, const char *key_s)
+{
+	lock_guard <mutex> guard (cache_p -> rc_lock);
+
+	if (cache_p -> rc_failed_ttl > 0)
+		{
+			return InsertNegativeCacheEntry (cache_p, key_s, true, time (NULL) + cache_p -> rc_failed_ttl);
+		}
+
+	return false;
+}
+
+
+bool RenewCachedResults (ResultCache *cache_p, const char *key_s)
+{
+	DiskCache *disk_cache_p = NULL;
+	time_t expiry;
+
+	{
+		lock_guard <mutex> guard (cache_p -> rc_lock);
+		CacheEntry *entry_p = FindCacheEntry (cache_p, key_s);
+
+		if (!entry_p)
+			{
+				return false;
+			}
+
+		expiry = time (NULL) + cache_p -> rc_ttl;
+		entry_p -> ce_expiry = expiry;
+		entry_p -> ce_refreshing_flag = false;
+		disk_cache_p = cache_p -> rc_disk_cache_p;
+	}
+
+	if (disk_cache_p)
+		{
+			SetDiskCacheEntryExpiry (disk_cache_p, key_s, expiry);
+		}
+
+	return true;
+}
+
+
+bool MarkCachedResultsAsRefreshing (ResultCache *cache_p, const char *key_s)
+{
+	lock_guard <mutex> guard (cache_p -> rc_lock);
+	CacheEntry *entry_p = FindCacheEntry (cache_p, key_s);
+
+	if (entry_p && ! (entry_p -> ce_refreshing_flag))
+		{
+			entry_p -> ce_refreshing_flag = true;
+			return true;
+		}
+
+	return false;
+}
+
+
+void ClearCachedResultsRefreshing (ResultCache *cache_p, const char *key_s)
+{
+	lock_guard <mutex> guard (cache_p -> rc_lock);
+	CacheEntry *entry_p = FindCacheEntry (cache_p, key_s);
+
+	if (entry_p)
+		{
+			entry_p -> ce_refreshing_flag = false;
+		}
+}
+
+
+void ClearCachedResults (CachedResults *results_p)
+{
+	if (results_p -> cr_results_p)
+		{
+			json_decref (results_p -> cr_results_p);
+			results_p -> cr_results_p = NULL;
+		}
+
+	if (results_p -> cr_etag_s)
+		{
+			FreeCopiedString (results_p -> cr_etag_s);
+			results_p -> cr_etag_s = NULL;
+		}
+
+	if (results_p -> cr_last_modified_s)
+		{
+			FreeCopiedString (results_p -> cr_last_modified_s);
+			results_p -> cr_last_modified_s = NULL;
+		}
+
+	if (results_p -> cr_request_uri_s)
+		{
+			FreeCopiedString (results_p -> cr_request_uri_s);
+			results_p -> cr_request_uri_s = NULL;
+		}
+}
+
+
+static void ClearResultCache (ResultCache *cache_p)
+{
+	for (list <CacheEntry> :: iterator it = cache_p -> rc_entries.begin (); it != cache_p -> rc_entries.end (); ++ it)
+		{
+			json_decref (it -> ce_results_p);
+		}
+
+	cache_p -> rc_entries.clear ();
+	cache_p -> rc_index.clear ();
+
+	cache_p -> rc_negative_entries.clear ();
+	cache_p -> rc_negative_index.clear ();
+}
+
+
+static void RemoveOldestEntry (ResultCache *cache_p)
+{
+	CacheEntry &entry_r = cache_p -> rc_entries.back ();
+
+	json_decref (entry_r.ce_results_p);
+	cache_p -> rc_index.erase (entry_r.ce_key);
+	cache_p -> rc_entries.pop_back ();
+}
+
+
+static char *CopyOptionalString (const string &value_r)
+{
+	return value_r.empty () ? NULL : EasyCopyToNewString (value_r.c_str ());
+}
+
+
+/* The cache's lock must be held when calling this */
+static CacheEntry *FindCacheEntry (ResultCache *cache_p, const char *key_s)
+{
+	unordered_map <string, list <CacheEntry> :: iterator> :: iterator it = cache_p -> rc_index.find (key_s);
+
+	return (it != cache_p -> rc_index.end ()) ? & (* (it -> second)) : NULL;
+}
+
+
+/*
+ * Add an entry, replacing any existing one with the same key, and taking
+ * ownership of results_p. The cache's lock must be held when calling this.
+ */
+static CacheEntry *InsertCacheEntry (ResultCache *cache_p, const char *key_s, json_t *results_p, const char *etag_s, const char *last_modified_s, const char *request_uri_s, const time_t expiry)
+{
+	CacheEntry entry;
+
+	RemoveCacheEntry (cache_p, key_s);
+
+	while (cache_p -> rc_entries.size () >= cache_p -> rc_max_entries)
+		{
+			RemoveOldestEntry (cache_p);
+		}
+
+	entry.ce_key = key_s;
+	entry.ce_results_p = results_p;
+	entry.ce_etag = etag_s ? etag_s : "";
+	entry.ce_last_modified = last_modified_s ? last_modified_s : "";
+	entry.ce_request_uri = request_uri_s ? request_uri_s : "";
+	entry.ce_expiry = expiry;
+	entry.ce_refreshing_flag = false;
+
+	cache_p -> rc_entries.push_front (entry);
+	cache_p -> rc_index [entry.ce_key] = cache_p -> rc_entries.begin ();
+
+	return & (cache_p -> rc_entries.front ());
+}
+
+
+/* The cache's lock must be held when calling this */
+static CacheEntryState FillCachedResults (ResultCache *cache_p, CacheEntry *entry_p, CachedResults *results_p)
+{
+	CacheEntryState state = CES_MISSING;
+
+	results_p -> cr_results_p = json_deep_copy (entry_p -> ce_results_p);
+
+	if (results_p -> cr_results_p)
+		{
+			const time_t now = time (NULL);
+			list <CacheEntry> :: iterator entry_itr = cache_p -> rc_index [entry_p -> ce_key];
+
+			results_p -> cr_etag_s = CopyOptionalString (entry_p -> ce_etag);
+			results_p -> cr_last_modified_s = CopyOptionalString (entry_p -> ce_last_modified);
+			results_p -> cr_request_uri_s = CopyOptionalString (entry_p -> ce_request_uri);
+
+			if (entry_p -> ce_expiry > now)
+				{
+					state = CES_FRESH;
+				}
+			else if (entry_p -> ce_expiry + (time_t) (cache_p -> rc_stale_ttl) > now)
+				{
+					state = CES_STALE;
+				}
+			else
+				{
+					state = CES_EXPIRED;
+				}
+
+			/* move it to the front as the most recently used entry */
+			cache_p -> rc_entries.splice (cache_p -> rc_entries.begin (), cache_p -> rc_entries, entry_itr);
+		}
+	else
+		{
+			PrintErrors (STM_LEVEL_WARNING, __FILE__, __LINE__, "Failed to copy cached results for \"%s\"", entry_p -> ce_key.c_str ());
+		}
+
+	return state;
+}
+
+
+/* The cache's lock must be held when calling this */
+static void RemoveCacheEntry (ResultCache *cache_p, const char *key_s)
+{
+	unordered_map <string, list <CacheEntry> :: iterator> :: iterator it = cache_p -> rc_index.find (key_s);
+
+	if (it != cache_p -> rc_index.end ())
+		{
+			json_decref (it -> second -> ce_results_p);
+			cache_p -> rc_entries.erase (it -> second);
+			cache_p -> rc_index.erase (it);
+		}
+}
+
+
+/*
+ * Get the negative entry for a key, discarding it if it has expired.
+ * The cache's lock must be held when calling this.
+ */
+static NegativeCacheEntry *FindNegativeCacheEntry (ResultCache *cache_p, const char *key_s)
+{
+	unordered_map <string, list <NegativeCacheEntry> :: iterator> :: iterator it = cache_p -> rc_negative_index.find (key_s);
+
+	if (it != cache_p -> rc_negative_index.end ())
+		{
+			list <NegativeCacheEntry> :: iterator entry_itr = it -> second;
+
+			if (entry_itr -> nce_expiry > time (NULL))
+				{
+					/* move it to the front as the most recently used entry */
+					cache_p -> rc_negative_entries.splice (cache_p -> rc_negative_entries.begin (), cache_p -> rc_negative_entries, entry_itr);
+
+					return & (*entry_itr);
+				}
+
+			cache_p -> rc_negative_entries.erase (entry_itr);
+			cache_p -> rc_negative_index.erase (it);
+		}
+
+	return NULL;
+}
+
+
+/* The cache's lock must be held when calling this */
+static bool InsertNegativeCacheEntry (ResultCache *cache_p, const char *key_s, const bool failed_flag, const time_t expiry)
+{
+	NegativeCacheEntry entry;
+
+	if (cache_p -> rc_max_negative_entries == 0)
+		{
+			return false;
+		}
+
+	RemoveNegativeCacheEntry (cache_p, key_s);
+
+	while (cache_p -> rc_negative_entries.size () >= cache_p -> rc_max_negative_entries)
+		{
+			cache_p -> rc_negative_index.erase (cache_p -> rc_negative_entries.back ().nce_key);
+			cache_p -> rc_negative_entries.pop_back ();
+		}
+
+	entry.nce_key = key_s;
+	entry.nce_expiry = expiry;
+	entry.nce_failed_flag = failed_flag;
+
+	cache_p -> rc_negative_entries.push_front (entry);
+	cache_p -> rc_negative_index [entry.nce_key] = cache_p -> rc_negative_entries.begin ();
+
+	return true;
+}
+
+
+/* The cache's lock must be held when calling this */
+static void RemoveNegativeCacheEntry (ResultCache *cache_p, const char *key_s)
+{
+	unordered_map <string, list <NegativeCacheEntry> :: iterator> :: iterator it = cache_p -> rc_negative_index.find (key_s);
+
+	if (it != cache_p -> rc_negative_index.end ())
+		{
+			cache_p -> rc_negative_entries.erase (it -> second);
+			cache_p -> rc_negative_index.erase (it);
+		}
+}
+
+
+static json_t *GetCachedResultsAsJSON (const CachedResults *results_p)
+{
+	json_t *value_p = json_object ();
+
+	if (value_p)
+		{
+			if (json_object_set_new (value_p, "results", json_incref (results_p -> cr_results_p)) == 0)
+				{
+					if (((results_p -> cr_etag_s == NULL) || (json_object_set_new (value_p, "etag", json_string (results_p -> cr_etag_s)) == 0)) &&
+						((results_p -> cr_last_modified_s == NULL) || (json_object_set_new (value_p, "last_modified", json_string (results_p -> cr_last_modified_s)) == 0)) &&
+						((results_p -> cr_request_uri_s == NULL) || (json_object_set_new (value_p, "request_uri", json_string (results_p -> cr_request_uri_s)) == 0)))
+						{
+							return value_p;
+						}
+				}
+
+			json_decref (value_p);
+		}
+
+	return NULL;
+}
+
+
+static const char *GetOptionalJSONString (const json_t *json_p, const char *key_s)
+{
+	const json_t *value_p = json_object_get (json_p, key_s);
+
+	return (value_p && json_is_string (value_p)) ? json_string_value (value_p) : NULL;
+}
@@ -0,0 +1,572 @@
+/*
+** Copyright 2014-2016 The Earlham Institute
+**
+** Licensed under the Apache License, Version 2.0 (the "License");
+** you may not use this file except in compliance with the License.
+** You may obtain a copy of the License at
+**
+**     http://www.apache.org/licenses/LICENSE-2.0
+**
+** Unless required by applicable law or agreed to in writing, software
+** distributed under the License is distributed on an "AS IS" BASIS,
+** WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+** See the License for the specific language governing permissions and
+** limitations under the License.
+*/
+/*
+ * result_index.cpp
+ *
+ *  Created on: 18 Oct 2026
+ */
+
+#include "result_index.hpp"
+
+#include <algorithm>
+#include <cctype>
+#include <cstdlib>
+#include <cstring>
+#include <iterator>
+#include <map>
+#include <mutex>
+#include <new>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include "streams.h"
+
+using namespace std;
+
+
+/*
+ * The ids of the results that contain a term. Since results are always
+ * given a higher id than any before them, the ids are in increasing order
+ * and each is stored as the difference from the one before it, using 7
+ * bits per byte, so most only need a single byte.
+ */
+struct PostingList
+{
+	vector <uint8> pl_deltas;
+	uint32 pl_last_id = 0;
+	uint32 pl_num_ids = 0;
+};
+
+
+struct IndexedResult
+{
+	string ir_key;
+	json_t *ir_result_p;
+	size_t ir_num_terms;
+};
+
+
+struct ResultIndex
+{
+	mutex ri_lock;
+	string ri_uri;
+	size_t ri_max_results;
+	uint32 ri_next_id = 1;
+
+	/* Ordered by id so the least recently extracted results are first */
+	map <uint32, IndexedResult> ri_results;
+	unordered_map <string, uint32> ri_ids;
+
+	/* Ordered by term so that all of the terms with a given prefix are next to each other */
+	map <string, PostingList> ri_terms;
+
+	/*
+	 * Removing a result leaves its ids in the posting lists, where they are
+	 * skipped, until there are more of these than live ones and the lists
+	 * are rebuilt.
+	 */
+	size_t ri_num_live_postings = 0;
+	size_t ri_num_dead_postings = 0;
+
+	~ResultIndex ();
+};
+
+
+/* Longer words are very unlikely to be searched for */
+static const size_t S_MAX_TERM_LENGTH = 64;
+
+
+static void ClearResultIndex (ResultIndex *index_p);
+
+static bool AddResultToIndex (ResultIndex *index_p, const json_t *result_p);
+
+static void RemoveIndexedResult (ResultIndex *index_p, map <uint32, IndexedResult> :: iterator it);
+
+static void RebuildPostingLists (ResultIndex *index_p);
+
+static void AddTerms (const char *text_p, const size_t length, vector <string> &terms_r);
+
+static void AddResultTerms (const json_t *value_p, vector <string> &terms_r);
+
+static void AppendPosting (PostingList &list_r, const uint32 id);
+
+static void GetPostings (const PostingList &list_r, vector <uint32> &ids_r);
+
+static void GetPrefixPostings (const ResultIndex *index_p, const string &prefix_r, vector <uint32> &ids_r);
+
+
+/*
+ * The indexes are shared between every Service instance for a given
+ * operation so they survive the services being reloaded.
+ */
+static mutex s_registry_lock;
+static map <string, ResultIndex *> s_registry;
+
+
+ResultIndex :: ~ResultIndex ()
+{
+	ClearResultIndex (this);
+}
+
+
+ResultIndex *GetResultIndex (const char *name_s, const char *uri_s, const uint32 max_results)
+{
+	ResultIndex *index_p = NULL;
+
+	if (name_s && (max_results > 0))
+		{
+			lock_guard <mutex> registry_guard (s_registry_lock);
+			map <string, ResultIndex *> :: iterator it = s_registry.find (name_s);
+
+			if (it != s_registry.end ())
+				{
+					index_p = it -> second;
+				}
+			else
+				{
+					index_p = new (nothrow) ResultIndex;
+
+					if (index_p)
+						{
+							s_registry [name_s] = index_p;
+						}
+					else
+						{
+							PrintErrors (STM_LEVEL_SEVERE, __FILE__, __LINE__, "Failed to allocate result index for \"%s\"", name_s);
+						}
+				}
+
+			if (index_p)
+				{
+					const string uri (uri_s ? uri_s : "");
+					lock_guard <mutex> index_guard (index_p -> ri_lock);
+
+					/* Results from a different search engine shouldn't be used to answer searches */
+					if (index_p -> ri_uri != uri)
+						{
+							ClearResultIndex (index_p);
+							index_p -> ri_uri = uri;
+						}
+
+					index_p -> ri_max_results = max_results;
+
+					while (index_p -> ri_results.size () > index_p -> ri_max_results)
+						{
+							RemoveIndexedResult (index_p, index_p -> ri_results.begin ());
+						}
+				}
+
+		}		/* if (name_s && (max_results > 0)) */
+
+	return index_p;
+}
+
+
+bool AddResultsToIndex (ResultIndex *index_p, const json_t *results_p)
+{
+	lock_guard <mutex> guard (index_p -> ri_lock);
+	const size_t num_results = json_array_size (results_p);
+	bool success_flag = true;
+
+	for (size_t i = 0; (i < num_results) && success_flag; ++ i)
+		{
+			success_flag = AddResultToIndex (index_p, json_array_get (results_p, i));
+		}
+
+	while (index_p -> ri_results.size () > index_p -> ri_max_results)
+		{
+			RemoveIndexedResult (index_p, index_p -> ri_results.begin ());
+		}
+
+	if (index_p -> ri_num_dead_postings > index_p -> ri_num_live_postings)
+		{
+			RebuildPostingLists (index_p);
+		}
+
+	return success_flag;
+}
+
+
+json_t *SearchResultIndex (ResultIndex *index_p, const char *query_s, const uint32 max_results)
+{
+	json_t *results_p = NULL;
+
+	try
+		{
+			vector <string> terms;
+
+			AddTerms (query_s, strlen (query_s), terms);
+
+			if (!terms.empty ())
+				{
+					lock_guard <mutex> guard (index_p -> ri_lock);
+					vector <vector <uint32> > candidates (terms.size ());
+					vector <uint32> ids;
+					size_t i;
+
+					for (i = 0; i < terms.size () - 1; ++ i)
+						{
+							map <string, PostingList> :: const_iterator it = index_p -> ri_terms.find (terms [i]);
+
+							if (it != index_p -> ri_terms.end ())
+								{
+									GetPostings (it -> second, candidates [i]);
+								}
+						}
+
+					GetPrefixPostings (index_p, terms.back (), candidates.back ());
+
+					/* Intersecting the shortest lists first keeps the intermediate results small */
+					sort (candidates.begin (), candidates.end (), [] (const vector <uint32> &a_r, const vector <uint32> &b_r)
+						{
+							return a_r.size () < b_r.size ();
+						});
+
+					ids.swap (candidates [0]);
+
+					for (i = 1; (i < candidates.size ()) && (!ids.empty ()); ++ i)
+						{
+							vector <uint32> matches;
+
+							set_intersection (ids.begin (), ids.end (), candidates [i].begin (), candidates [i].end (), back_inserter (matches));
+							ids.swap (matches);
+						}
+
+					results_p = json_array ();
+
+					if (results_p)
+						{
+							uint32 num_added = 0;
+
+							for (vector <uint32> :: const_reverse_iterator it = ids.rbegin (); (it != ids.rend ()) && (num_added < max_results); ++ it)
+								{
+									map <uint32, IndexedResult> :: const_iterator result_it = index_p -> ri_results.find (*it);
+
+									/* The ids of removed results stay in the posting lists until they are rebuilt */
+									if (result_it != index_p -> ri_results.end ())
+										{
+											json_t *copy_p = json_deep_copy (result_it -> second.ir_result_p);
+
+											if (copy_p && (json_array_append_new (results_p, copy_p) == 0))
+												{
+													++ num_added;
+												}
+											else
+												{
+													PrintErrors (STM_LEVEL_WARNING, __FILE__, __LINE__, "Failed to add indexed result for \"%s\"", query_s);
+
+													if (copy_p)
+														{
+															json_decref (copy_p);
+														}
+												}
+										}
+								}
+						}
+				}		/* if (!terms.empty ()) */
+
+		}
+	catch (...)
+		{
+			PrintErrors (STM_LEVEL_WARNING, __FILE__, __LINE__, "Failed to search result index for \"%s\"", query_s);
+
+			if (results_p)
+				{
+					json_decref (results_p);
+					results_p = NULL;
+				}
+		}
+
+	return results_p;
+}
+
+
+static void ClearResultIndex (ResultIndex *index_p)
+{
+	for (map <uint32, IndexedResult> :: iterator it = index_p -> ri_results.begin (); it != index_p -> ri_results.end (); ++ it)
+		{
+			json_decref (it -> second.ir_result_p);
+		}
+
+	index_p -> ri_results.clear ();
+	index_p -> ri_ids.clear ();
+	index_p -> ri_terms.clear ();
+	index_p -> ri_num_live_postings = 0;
+	index_p -> ri_num_dead_postings = 0;
+}
+
+
+/*
+ * A result is identified by all of its values so that if the search engine
+ * changes any of them, the old version ages out of the index.
+ */
+static bool AddResultToIndex (ResultIndex *index_p, const json_t *result_p)
+{
+	char *key_s = json_dumps (result_p, JSON_COMPACT | JSON_SORT_KEYS);
+	bool success_flag = false;
+
+	if (key_s)
+		{
+			json_t *copy_p = NULL;
+
+			try
+				{
+					const string key (key_s);
+					unordered_map <string, uint32> :: iterator id_it = index_p -> ri_ids.find (key);
+					vector <string> terms;
+
+					/* A result that is extracted again is moved to the newest end of the index */
+					if (id_it != index_p -> ri_ids.end ())
+						{
+							RemoveIndexedResult (index_p, index_p -> ri_results.find (id_it -> second));
+						}
+
+					AddResultTerms (result_p, terms);
+
+					sort (terms.begin (), terms.end ());
+					terms.erase (unique (terms.begin (), terms.end ()), terms.end ());
+
+					copy_p = json_deep_copy (result_p);
+
+					if (copy_p)
+						{
+							const uint32 id = (index_p -> ri_next_id) ++;
+							IndexedResult &result_r = index_p -> ri_results [id];
+
+							result_r.ir_key = key;
+							result_r.ir_result_p = copy_p;
+							result_r.ir_num_terms = terms.size ();
+							copy_p = NULL;
+
+							index_p -> ri_ids [key] = id;
+
+							for (vector <string> :: const_iterator it = terms.begin (); it != terms.end (); ++ it)
+								{
+									AppendPosting (index_p -> ri_terms [*it], id);
+								}
+
+							index_p -> ri_num_live_postings += terms.size ();
+							success_flag = true;
+						}
+				}
+			catch (...)
+				{
+					if (copy_p)
+						{
+							json_decref (copy_p);
+						}
+				}
+
+			free (key_s);
+		}
+
+	if (!success_flag)
+		{
+			PrintErrors (STM_LEVEL_WARNING, __FILE__, __LINE__, "Failed to add result to index");
+		}
+
+	return success_flag;
+}
+
+
+static void RemoveIndexedResult (ResultIndex *index_p, map <uint32, IndexedResult> :: iterator it)
+{
+	if (it != index_p -> ri_results.end ())
+		{
+			const size_t num_terms = it -> second.ir_num_terms;
+
+			index_p -> ri_num_live_postings -= min (index_p -> ri_num_live_postings, num_terms);
+			index_p -> ri_num_dead_postings += num_terms;
+
+			json_decref (it -> second.ir_result_p);
+			index_p -> ri_ids.erase (it -> second.ir_key);
+			index_p -> ri_results.erase (it);
+		}
+}
+
+
+/*
+ * The results keep their ids, so each list is built in increasing order
+ * again, and terms that are only in removed results are dropped.
+ */
+static void RebuildPostingLists (ResultIndex *index_p)
+{
+	try
+		{
+			map <string, PostingList> terms;
+			size_t num_postings = 0;
+
+			for (map <uint32, IndexedResult> :: const_iterator it = index_p -> ri_results.begin (); it != index_p -> ri_results.end (); ++ it)
+				{
+					vector <string> result_terms;
+
+					AddResultTerms (it -> second.ir_result_p, result_terms);
+
+					sort (result_terms.begin (), result_terms.end ());
+					result_terms.erase (unique (result_terms.begin (), result_terms.end ()), result_terms.end ());
+
+					for (vector <string> :: const_iterator term_it = result_terms.begin (); term_it != result_terms.end (); ++ term_it)
+						{
+							AppendPosting (terms [*term_it], it -> first);
+						}
+
+					num_postings += result_terms.size ();
+				}
+
+			index_p -> ri_terms.swap (terms);
+			index_p -> ri_num_live_postings = num_postings;
+			index_p -> ri_num_dead_postings = 0;
+		}
+	catch (...)
+		{
+			/* The existing lists are still correct, just larger than they need to be */
+			PrintErrors (STM_LEVEL_WARNING, __FILE__, __LINE__, "Failed to rebuild result index");
+		}
+}
+
+
+/*
+ * A term is a run of letters and digits, in lower case. Any bytes of
+ * multibyte UTF-8 characters are treated as letters so that words in
+ * other scripts are indexed as they are.
+ */
+static void AddTerms (const char *text_p, const size_t length, vector <string> &terms_r)
+{
+	const char * const end_p = text_p + length;
+
+	while (text_p < end_p)
+		{
+			const char *term_p;
+
+			while ((text_p < end_p) && (!isalnum ((unsigned char) *text_p)) && (((unsigned char) *text_p) < 0x80))
+				{
+					++ text_p;
+				}
+
+			term_p = text_p;
+
+			while ((text_p < end_p) && (isalnum ((unsigned char) *text_p) || (((unsigned char) *text_p) >= 0x80)))
+				{
+					++ text_p;
+				}
+
+			if ((text_p > term_p) && ((size_t) (text_p - term_p) <= S_MAX_TERM_LENGTH))
+				{
+					string term (term_p, text_p - term_p);
+
+					for (string :: iterator it = term.begin (); it != term.end (); ++ it)
+						{
+							*it = tolower ((unsigned char) *it);
+						}
+
+					terms_r.push_back (term);
+				}
+		}
+}
+
+
+static void AddResultTerms (const json_t *value_p, vector <string> &terms_r)
+{
+	if (json_is_string (value_p))
+		{
+			AddTerms (json_string_value (value_p), json_string_length (value_p), terms_r);
+		}
+	else if (json_is_array (value_p))
+		{
+			const size_t size = json_array_size (value_p);
+
+			for (size_t i = 0; i < size; ++ i)
+				{
+					AddResultTerms (json_array_get (value_p, i), terms_r);
+				}
+		}
+	else if (json_is_object (value_p))
+		{
+			const char *key_s;
+			json_t *child_p;
+
+			json_object_foreach ((json_t *) value_p, key_s, child_p)
+				{
+					AddResultTerms (child_p, terms_r);
+				}
+		}
+}
+
+
+static void AppendPosting (PostingList &list_r, const uint32 id)
+{
+	uint32 delta = id - list_r.pl_last_id;
+
+	while (delta >= 0x80)
+		{
+			list_r.pl_deltas.push_back ((uint8) ((delta & 0x7F) | 0x80));
+			delta >>= 7;
+		}
+
+	list_r.pl_deltas.push_back ((uint8) delta);
+
+	list_r.pl_last_id = id;
+	++ (list_r.pl_num_ids);
+}
+
+
+static void GetPostings (const PostingList &list_r, vector <uint32> &ids_r)
+{
+	vector <uint8> :: const_iterator it = list_r.pl_deltas.begin ();
+	uint32 id = 0;
+
+	ids_r.reserve (ids_r.size () + list_r.pl_num_ids);
+
+	while (it != list_r.pl_deltas.end ())
+		{
+			uint32 delta = 0;
+			int shift = 0;
+
+			while ((it != list_r.pl_deltas.end ()) && ((*it) & 0x80))
+				{
+					delta |= ((uint32) ((*it) & 0x7F)) << shift;
+					shift += 7;
+					++ it;
+				}
+
+			if (it != list_r.pl_deltas.end ())
+				{
+					delta |= ((uint32) (*it)) << shift;
+					++ it;
+				}
+
+			id += delta;
+			ids_r.push_back (id);
+		}
+}
+
+
+/*
+ * Merge the ids of every term that starts with the prefix. Since the
+ * terms are sorted, these are all found by a single walk from the first
+ * term that isn't less than the prefix.
+ */
+static void GetPrefixPostings (const ResultIndex *index_p, const string &prefix_r, vector <uint32> &ids_r)
+{
+	for (map <string, PostingList> :: const_iterator it = index_p -> ri_terms.lower_bound (prefix_r); (it != index_p -> ri_terms.end ()) && (it -> first.compare (0, prefix_r.size (), prefix_r) == 0); ++ it)
+		{
+			GetPostings (it -> second, ids_r);
+		}
+
+	sort (ids_r.begin (), ids_r.end ());
+	ids_r.erase (unique (ids_r.begin (), ids_r.end ()), ids_r.end ());
+}
@@ -0,0 +1,351 @@
+/*
+** Copyright 2014-2016 The Earlham Institute
+**
+** Licensed under the Apache License, Version 2.0 (the "License");
+** you may not use this file except in compliance with the License.
+** You may obtain a copy of the License at
+**
+**     http://www.apache.org/licenses/LICENSE-2.0
+**
+** Unless required by applicable law or agreed to in writing, software
+** distributed under the License is distributed on an "AS IS" BASIS,
+** WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+** See the License for the specific language governing permissions and
+** limitations under the License.
+*/
+/*
+ * search_job.cpp
+ *
+ *  Created on: 18 Oct 2026
+ */
+
+#include "search_job.hpp"
+
+#include <map>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "streams.h"
+
+using namespace std;
+
+
+/*
+ * The thread running the search only ever touches the SearchJob and the
+ * threads polling the ServiceJob move what it has gathered across under
+ * sj_lock, so the ServiceJob itself is never shared between threads.
+ */
+struct SearchJob
+{
+	mutex sj_lock;
+
+	/** The references held by the owner, the background thread and the registry of running searches. */
+	uint32 sj_references = 1;
+
+	/** The partial results that have not been added to the ServiceJob yet. */
+	vector <json_t *> sj_pending_results;
+
+	/** The error messages that have not been added to the ServiceJob yet. */
+	vector <string> sj_pending_errors;
+
+	/** The full set of results once the search has finished successfully. */
+	json_t *sj_results_p = nullptr;
+
+	bool sj_finished_flag = false;
+
+	/** Has the ServiceJob been given the final status yet? */
+	bool sj_delivered_flag = false;
+};
+
+
+static mutex s_running_lock;
+
+static map <ServiceJob *, SearchJob *> s_running_searches;
+
+
+static void RunBackgroundSearch (SearchJob *search_p, SearchJobRunner run_fn, SearchJobDataFreer free_fn, void *data_p);
+
+static bool UpdateBackgroundServiceJob (ServiceJob *job_p);
+
+static SearchJob *RemoveRunningSearch (ServiceJob *job_p, const SearchJob *search_p);
+
+
+SearchJob *AllocateSearchJob (void)
+{
+	try
+		{
+			return new SearchJob;
+		}
+	catch (...)
+		{
+			PrintErrors (STM_LEVEL_SEVERE, __FILE__, __LINE__, "Failed to allocate SearchJob");
+		}
+
+	return NULL;
+}
+
+
+void FreeSearchJob (SearchJob *search_p)
+{
+	bool free_flag;
+
+	{
+		lock_guard <mutex> guard (search_p -> sj_lock);
+		free_flag = (-- (search_p -> sj_references) == 0);
+	}
+
+	if (free_flag)
+		{
+			for (size_t i = 0; i < search_p -> sj_pending_results.size (); ++ i)
+				{
+					json_decref (search_p -> sj_pending_results [i]);
+				}
+
+			if (search_p -> sj_results_p)
+				{
+					json_decref (search_p -> sj_results_p);
+				}
+
+			delete search_p;
+		}
+}
+
+
+bool AddSearchJobResults (json_t *results_p, const size_t from, const size_t to, void *data_p)
+{
+	SearchJob *search_p = (SearchJob *) data_p;
+	vector <json_t *> batch;
+
+	/* The copies are made outside of the lock so that polling the job isn't held up by them */
+	for (size_t i = from; i < to; ++ i)
+		{
+			json_t *result_p = json_deep_copy (json_array_get (results_p, i));
+
+			if (!result_p)
+				{
+					PrintErrors (STM_LEVEL_WARNING, __FILE__, __LINE__, "Failed to copy partial result %lu", (unsigned long) i);
+
+					for (size_t j = 0; j < batch.size (); ++ j)
+						{
+							json_decref (batch [j]);
+						}
+
+					return false;
+				}
+
+			batch.push_back (result_p);
+		}
+
+	lock_guard <mutex> guard (search_p -> sj_lock);
+	search_p -> sj_pending_results.insert (search_p -> sj_pending_results.end (), batch.begin (), batch.end ());
+
+	return true;
+}
+
+
+void AddSearchJobError (SearchJob *search_p, const char *message_s)
+{
+	lock_guard <mutex> guard (search_p -> sj_lock);
+	search_p -> sj_pending_errors.push_back (message_s);
+}
+
+
+void FinishSearchJob (SearchJob *search_p, json_t *results_p)
+{
+	lock_guard <mutex> guard (search_p -> sj_lock);
+
+	search_p -> sj_results_p = results_p;
+	search_p -> sj_finished_flag = true;
+}
+
+
+bool UpdateServiceJobFromSearchJob (SearchJob *search_p, ServiceJob *job_p)
+{
+	lock_guard <mutex> guard (search_p -> sj_lock);
+
+	if (search_p -> sj_delivered_flag)
+		{
+			return true;
+		}
+
+	for (size_t i = 0; i < search_p -> sj_pending_errors.size (); ++ i)
+		{
+			AddGeneralErrorMessageToServiceJob (job_p, search_p -> sj_pending_errors [i].c_str ());
+		}
+
+	search_p -> sj_pending_errors.clear ();
+
+	if (search_p -> sj_finished_flag)
+		{
+			json_t *results_p = search_p -> sj_results_p;
+
+			search_p -> sj_results_p = nullptr;
+
+			if (results_p)
+				{
+					if (ReplaceServiceJobResults (job_p, results_p))
+						{
+							SetServiceJobStatus (job_p, OS_SUCCEEDED);
+						}
+					else
+						{
+							PrintJSONToErrors (STM_LEVEL_SEVERE, __FILE__, __LINE__, results_p, "Failed to set job results");
+							json_decref (results_p);
+							SetServiceJobStatus (job_p, OS_FAILED);
+						}
+				}
+			else
+				{
+					SetServiceJobStatus (job_p, OS_FAILED);
+				}
+
+			search_p -> sj_delivered_flag = true;
+		}
+	else if (!search_p -> sj_pending_results.empty ())
+		{
+			size_t i;
+
+			for (i = 0; i < search_p -> sj_pending_results.size (); ++ i)
+				{
+					json_t *result_p = search_p -> sj_pending_results [i];
+
+					if (!AddResultToServiceJob (job_p, result_p))
+						{
+							PrintJSONToErrors (STM_LEVEL_WARNING, __FILE__, __LINE__, result_p, "Failed to add partial result to job");
+							break;
+						}
+				}
+
+			/* Any that couldn't be added will be superseded by the full results anyway */
+			for ( ; i < search_p -> sj_pending_results.size (); ++ i)
+				{
+					json_decref (search_p -> sj_pending_results [i]);
+				}
+
+			search_p -> sj_pending_results.clear ();
+
+			SetServiceJobStatus (job_p, OS_PARTIALLY_SUCCEEDED);
+		}
+
+	return search_p -> sj_delivered_flag;
+}
+
+
+bool RunSearchJobInBackground (SearchJob *search_p, ServiceJob *job_p, SearchJobRunner run_fn, SearchJobDataFreer free_fn, void *data_p)
+{
+	{
+		lock_guard <mutex> guard (search_p -> sj_lock);
+
+		/* One for the thread and one for the registry */
+		search_p -> sj_references += 2;
+	}
+
+	{
+		lock_guard <mutex> guard (s_running_lock);
+		s_running_searches [job_p] = search_p;
+	}
+
+	SetServiceJobUpdateFunction (job_p, UpdateBackgroundServiceJob);
+
+	try
+		{
+			thread (RunBackgroundSearch, search_p, run_fn, free_fn, data_p).detach ();
+
+			return true;
+		}
+	catch (...)
+		{
+			PrintErrors (STM_LEVEL_SEVERE, __FILE__, __LINE__, "Failed to start search thread");
+		}
+
+	SetServiceJobUpdateFunction (job_p, NULL);
+
+	if (RemoveRunningSearch (job_p, search_p))
+		{
+			FreeSearchJob (search_p);
+		}
+
+	if (free_fn)
+		{
+			free_fn (data_p);
+		}
+
+	FreeSearchJob (search_p);
+
+	return false;
+}
+
+
+static void RunBackgroundSearch (SearchJob *search_p, SearchJobRunner run_fn, SearchJobDataFreer free_fn, void *data_p)
+{
+	json_t *results_p = run_fn (search_p, data_p);
+
+	/* The data must be released before the job can be seen to finish and its Service be freed */
+	if (free_fn)
+		{
+			free_fn (data_p);
+		}
+
+	FinishSearchJob (search_p, results_p);
+	FreeSearchJob (search_p);
+}
+
+
+static bool UpdateBackgroundServiceJob (ServiceJob *job_p)
+{
+	SearchJob *search_p = NULL;
+
+	{
+		lock_guard <mutex> guard (s_running_lock);
+		map <ServiceJob *, SearchJob *> :: iterator itr = s_running_searches.find (job_p);
+
+		if (itr != s_running_searches.end ())
+			{
+				search_p = itr -> second;
+
+				/* Keep it alive whilst we update the job in case another thread polling it removes it */
+				lock_guard <mutex> search_guard (search_p -> sj_lock);
+				++ (search_p -> sj_references);
+			}
+	}
+
+	if (search_p)
+		{
+			/*
+			 * Once the job has its final status, the search is no longer needed. If
+			 * the job is polled by more than one thread at once, only one of them
+			 * will remove it.
+			 */
+			if (UpdateServiceJobFromSearchJob (search_p, job_p))
+				{
+					if (RemoveRunningSearch (job_p, search_p))
+						{
+							FreeSearchJob (search_p);
+						}
+				}
+
+			FreeSearchJob (search_p);
+		}
+
+	return true;
+}
+
+
+static SearchJob *RemoveRunningSearch (ServiceJob *job_p, const SearchJob *search_p)
+{
+	lock_guard <mutex> guard (s_running_lock);
+	map <ServiceJob *, SearchJob *> :: iterator itr = s_running_searches.find (job_p);
+
+	if ((itr != s_running_searches.end ()) && (itr -> second == search_p))
+		{
+			SearchJob *removed_p = itr -> second;
+
+			s_running_searches.erase (itr);
+
+			return removed_p;
+		}
+
+	return NULL;
+}
@@ -0,0 +1,235 @@
+/*
+** Copyright 2014-2016 The Earlham Institute
+**
+** Licensed under the Apache License, Version 2.0 (the "License");
+** you may not use this file except in compliance with the License.
+** You may obtain a copy of the License at
+**
+**     http://www.apache.org/licenses/LICENSE-2.0
+**
+** Unless required by applicable law or agreed to in writing, software
+** distributed under the License is distributed on an "AS IS" BASIS,
+** WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+** See the License for the specific language governing permissions and
+** limitations under the License.
+*/
+/*
+ * search_scheduler.cpp
+ *
+ *  Created on: 18 Oct 2026
+ */
+
+#include "search_scheduler.hpp"
+
+#include <algorithm>
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <mutex>
+#include <strings.h>
+
+#include "streams.h"
+
+using namespace std;
+
+
+/*
+ * A search waiting to run. It lives on the waiting thread's stack
+ * and is only touched with s_scheduler_lock held.
+ */
+struct SearchWaiter
+{
+	bool sw_granted_flag = false;
+};
+
+
+struct SearchClass
+{
+	deque <SearchWaiter *> sc_waiters;
+	uint32 sc_num_running = 0;
+	uint32 sc_max_running = 0;
+	uint32 sc_weight = 1;
+
+	/*
+	 * The class's virtual time, which advances by 1 / weight for each
+	 * search that it starts. The waiting class with the lowest pass
+	 * goes next.
+	 */
+	double sc_pass = 0.0;
+};
+
+
+static const char * const S_PRIORITY_NAMES_SS [SP_NUM_PRIORITIES] = { "interactive", "bulk" };
+
+static mutex s_scheduler_lock;
+static condition_variable s_scheduler_condition;
+
+static SearchClass s_classes [SP_NUM_PRIORITIES];
+static uint32 s_max_running = 0;
+static uint32 s_num_running = 0;
+
+/* The pass of the last class to start a search */
+static double s_current_pass = 0.0;
+
+
+static void StartWaitingSearches ();
+
+static void RemoveWaiter (SearchClass &class_r, SearchWaiter *waiter_p);
+
+
+void SetSearchSchedulerLimits (const uint32 max_running, const SearchClassLimits *limits_p)
+{
+	{
+		lock_guard <mutex> guard (s_scheduler_lock);
+
+		s_max_running = max_running;
+
+		for (int i = 0; i < SP_NUM_PRIORITIES; ++ i)
+			{
+				s_classes [i].sc_max_running = limits_p [i].scl_max_running;
+				s_classes [i].sc_weight = (limits_p [i].scl_weight > 0) ? limits_p [i].scl_weight : 1;
+			}
+
+		/* Raising a limit may let some of the waiting searches start */
+		StartWaitingSearches ();
+	}
+
+	s_scheduler_condition.notify_all ();
+}
+
+
+bool GetSearchPriorityFromString (const char *name_s, SearchPriority *priority_p)
+{
+	for (int i = 0; i < SP_NUM_PRIORITIES; ++ i)
+		{
+			if (strcasecmp (name_s, S_PRIORITY_NAMES_SS [i]) == 0)
+				{
+					*priority_p = (SearchPriority) i;
+					return true;
+				}
+		}
+
+	return false;
+}
+
+
+bool AcquireSearchSlot (const SearchPriority priority, const uint32 timeout)
+{
+	SearchClass &class_r = s_classes [priority];
+	SearchWaiter waiter;
+	bool granted_flag;
+
+	{
+		unique_lock <mutex> lock (s_scheduler_lock);
+
+		/*
+		 * A class that has been idle doesn't get to make up for lost time
+		 * by then starting a run of searches ahead of everyone else.
+		 */
+		if (class_r.sc_waiters.empty () && (class_r.sc_num_running == 0))
+			{
+				class_r.sc_pass = max (class_r.sc_pass, s_current_pass);
+			}
+
+		try
+			{
+				class_r.sc_waiters.push_back (&waiter);
+			}
+		catch (...)
+			{
+				PrintErrors (STM_LEVEL_SEVERE, __FILE__, __LINE__, "Failed to queue %s search", S_PRIORITY_NAMES_SS [priority]);
+				return false;
+			}
+
+		StartWaitingSearches ();
+
+		granted_flag = s_scheduler_condition.wait_for (lock, chrono :: seconds (timeout), [&waiter] { return waiter.sw_granted_flag; });
+
+		if (!granted_flag)
+			{
+				RemoveWaiter (class_r, &waiter);
+			}
+	}
+
+	/* Other searches may have been started along with ours */
+	s_scheduler_condition.notify_all ();
+
+	return granted_flag;
+}
+
+
+void ReleaseSearchSlot (const SearchPriority priority)
+{
+	{
+		lock_guard <mutex> guard (s_scheduler_lock);
+		SearchClass &class_r = s_classes [priority];
+
+		if (class_r.sc_num_running > 0)
+			{
+				-- (class_r.sc_num_running);
+			}
+
+		if (s_num_running > 0)
+			{
+				-- s_num_running;
+			}
+
+		StartWaitingSearches ();
+	}
+
+	s_scheduler_condition.notify_all ();
+}
+
+
+/*
+ * Start as many of the waiting searches as the limits allow, picking
+ * the class for each one by its pass. This must be called with
+ * s_scheduler_lock held.
+ */
+static void StartWaitingSearches ()
+{
+	while ((s_max_running == 0) || (s_num_running < s_max_running))
+		{
+			SearchClass *next_p = NULL;
+
+			for (int i = 0; i < SP_NUM_PRIORITIES; ++ i)
+				{
+					SearchClass &class_r = s_classes [i];
+
+					if ((! (class_r.sc_waiters.empty ())) && ((class_r.sc_max_running == 0) || (class_r.sc_num_running < class_r.sc_max_running)))
+						{
+							if ((next_p == NULL) || (class_r.sc_pass < next_p -> sc_pass))
+								{
+									next_p = &class_r;
+								}
+						}
+				}
+
+			if (next_p)
+				{
+					next_p -> sc_waiters.front () -> sw_granted_flag = true;
+					next_p -> sc_waiters.pop_front ();
+
+					++ (next_p -> sc_num_running);
+					++ s_num_running;
+
+					s_current_pass = next_p -> sc_pass;
+					next_p -> sc_pass += 1.0 / next_p -> sc_weight;
+				}
+			else
+				{
+					break;
+				}
+		}
+}
+
+
+static void RemoveWaiter (SearchClass &class_r, SearchWaiter *waiter_p)
+{
+	deque <SearchWaiter *> :: iterator it = find (class_r.sc_waiters.begin (), class_r.sc_waiters.end (), waiter_p);
+
+	if (it != class_r.sc_waiters.end ())
+		{
+			class_r.sc_waiters.erase (it);
+		}
+}
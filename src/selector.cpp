@@ -22,7 +22,19 @@
 
 #include "selector.hpp"
 
+#include <atomic>
+#include <cctype>
+#include <cstring>
+#include <strings.h>
 #include <string>
+#include <vector>
+#include <unordered_map>
+#include <unordered_set>
+#include <memory>
+#include <mutex>
+#include <new>
+#include <stdexcept>
+#include <thread>
 #include <iostream>
 
 #include <htmlcxx/html/ParserDom.h>
@@ -34,492 +46,3674 @@
 #include "string_utils.h"
 #include "byte_buffer.h"
 #include "data_resource.h"
+#include "allocation_stats.hpp"
+#include "request_trace.hpp"
+#include "uri_canonicalisation.hpp"
 
 using namespace std;
 using namespace htmlcxx :: HTML;
 //using namespace hcxselect;
 
 
+/**
+ * A view of an attribute's value within the raw bytes of a tag.
+ */
+typedef struct AttributeValue
+{
+	/** The start of the value or <code>NULL</code> if the attribute is not in the tag. */
+	const char *av_value_p;
+
+	/** The length of the value. */
+	size_t av_length;
+} AttributeValue;
+
+
+/* The attributes that we read from each matching link */
+static const char * const S_LINK_ATTRIBUTES_SS [] = { "href", "title" };
+
+enum
+{
+	LA_HREF,
+	LA_TITLE,
+	LA_NUM_ATTRIBUTES
+};
+
+
 static HtmlLinkArray *AllocateHtmlLinksArray (const size_t num_links);
 
 
-static HtmlLinkArray *AllocateHtmlLinksArrayFromSet (const hcxselect :: Selector &selector_r, const char *title_selector_s, const char * const data_s, const char * const base_uri_s);
+typedef unordered_set <const hcxselect :: Node *> NodeSet;
+
+static HtmlLinkArray *AllocateHtmlLinksArrayFromNodes (const vector <hcxselect :: Node *> &nodes_r, const NodeSet *titles_p, const char * const data_s, const char * const base_uri_s);
+
+static const hcxselect :: Node *FindTitleNode (const hcxselect :: Node *link_p, const NodeSet &titles_r);
+
+static bool InitHtmlLinkFromNode (HtmlLink *link_p, const hcxselect :: Node *tree_node_p, const NodeSet *titles_p, const char * const data_s, ByteBuffer *buffer_p, const char * const base_uri_s);
 
 static void ClearHtmlLink (HtmlLink *link_p);
 static char *GetInnerText (const htmlcxx :: HTML :: Node *node_p, const char *data_s, ByteBuffer *buffer_p, const bool include_child_text_flag);
 
-static bool InitHtmlLink (HtmlLink *link_p, const char *title_s, const char *uri_s, const char *data_s, const char *base_uri_s);
+static char *GetElementInnerText (const char *data_s, const size_t offset, const size_t tag_length, const size_t length, ByteBuffer *buffer_p, const bool include_child_text_flag);
+
+static bool InitHtmlLinkFromElement (HtmlLink *link_p, const char * const data_s, const size_t offset, const size_t tag_length, const size_t length, const htmlcxx :: HTML :: Node *title_node_p, ByteBuffer *buffer_p, const char * const base_uri_s);
+
+static size_t DecodeEntity (const char *entity_p, const char *limit_p, uint32 *code_point_p);
+
+static size_t GetUnicodeSpaceLength (const unsigned char *text_p, const unsigned char *limit_p);
+
+static bool IsUnicodeSpace (const uint32 code_point);
+
+static bool AppendCodePoint (ByteBuffer *buffer_p, const uint32 code_point, size_t *length_p);
+
+static bool InitHtmlLink (HtmlLink *link_p, const AttributeValue *title_p, const AttributeValue *uri_p, const char *data_s, const char *base_uri_s);
+
+static uint32 GetTagAttributes (const char *tag_p, const size_t tag_length, const char * const *names_ss, AttributeValue *values_p, const uint32 num_names);
+
+static char *JoinUriParts (const char *prefix_p, const size_t prefix_length, const char *uri_p, const size_t uri_length);
 
 static json_t *GetHtmlLinkAsJSON (const HtmlLink * const link_p);
 
+static void AddStringAllocation (const string &value_r, size_t *num_allocations_p, size_t *num_bytes_p);
 
-HtmlLinkArray *GetLinks (CurlTool *tool_p, const char * const uri_s, const char * const link_selector_s, const char * const title_selector_s)
-{
-	HtmlLinkArray *links_p = NULL;
+static size_t GetHtmlLinkSize (const HtmlLink *link_p, size_t *num_allocations_p);
 
-	if (uri_s)
-		{
-			if (!SetUriForCurlTool (tool_p, uri_s))
-				{
-					return NULL;
-				}
-		}
+static void CountJSONAllocations (const json_t *value_p);
 
-	if (RunCurlTool (tool_p) == CURLE_OK)
-		{
-			const char *data_s = GetCurlToolData (tool_p);
+static const char *FindStructuredDataScript (const char *current_p, const char *end_p, const StructuredDataMapping *mapping_p, const char **text_pp, size_t *text_length_p);
 
-			links_p = GetMatchingLinks (data_s, link_selector_s, title_selector_s, uri_s);
-		}
+static bool MatchesAttributeValue (const AttributeValue *value_p, const char *expected_s);
 
-	return links_p;
-}
+static const json_t *GetJSONPathValue (const json_t *value_p, const char *path_s);
 
+static bool InitHtmlLinkFromStructuredData (HtmlLink *link_p, const json_t *result_p, const StructuredDataMapping *mapping_p, const char * const base_uri_s);
 
+static void AddStructuredDataSnippet (json_t *link_json_p, const json_t *result_p, const StructuredDataMapping *mapping_p);
 
-json_t *GetMatchingLinksAsJSON (const char * const data_s, const char * const link_selector_s, const char * const title_selector_s, const char * const base_uri_s)
+/* For links that don't need anything adding to their JSON */
+struct NoExtraLinkFields
 {
-	json_t *res_p = NULL;
-	HtmlLinkArray *links_p = GetMatchingLinks (data_s, link_selector_s, title_selector_s, base_uri_s);
+	void operator () (json_t * /* link_json_p */, const size_t /* i */) const
+	{
+	}
+};
 
-	if (links_p)
-		{
-			res_p = json_array ();
+static bool CanonicaliseHtmlLink (HtmlLink *link_p, const UriCanonicalisation *canonical_p, SeenUriSet *seen_p);
 
-			if (res_p)
-				{
-					size_t i = links_p -> hla_num_entries;
-					HtmlLink *link_p = links_p -> hla_data_p;
+static void AppendCanonicalPath (const char *path_p, const size_t path_length, string &uri_r);
 
-					for ( ; i > 0; -- i, ++ link_p)
-						{
-							json_t *link_json_p = GetHtmlLinkAsJSON (link_p);
+static void AppendCanonicalQuery (const char *query_p, const size_t query_length, const UriCanonicalisation *canonical_p, string &uri_r);
 
-							if (link_json_p)
-								{
-									if (json_array_append_new (res_p, link_json_p) != 0)
-										{
-											PrintErrors (STM_LEVEL_SEVERE, __FILE__, __LINE__, "Failed to add link for %s to json array", link_p -> hl_uri_s);
-											json_decref (link_json_p);
-										}
-								}
-							else
-								{
-									PrintErrors (STM_LEVEL_SEVERE, __FILE__, __LINE__, "Failed to get json for %s", link_p -> hl_uri_s);
-								}
-						}
+static void AppendPercentEncoded (const char *value_p, const size_t value_length, string &uri_r);
 
-				}		/* if (res_p) */
-			else
-				{
-					PrintErrors (STM_LEVEL_SEVERE, __FILE__, __LINE__, "Failed to create json array for links json");
-				}
+static bool IsRemovedQueryParameter (const char *name_p, const size_t name_length, const UriCanonicalisation *canonical_p);
 
-			FreeHtmlLinkArray (links_p);
-		}		/* if (links_p) */
-	else
-		{
-			PrintErrors (STM_LEVEL_WARNING, __FILE__, __LINE__, "Failed to get html links");
-		}
+template <typename INIT_FN, typename EXTRA_FN = NoExtraLinkFields>
+static json_t *GetLinksAsJSON (const size_t num_links, INIT_FN init_fn, const size_t batch_size, LinkBatchCallback callback_fn, void *callback_data_p, const UriCanonicalisation *canonical_p, EXTRA_FN extra_fn = EXTRA_FN ());
 
-	return res_p;
-}
+template <typename INIT_FN>
+static HtmlLinkArray *AllocateHtmlLinksArrayFromLinks (const size_t num_links, INIT_FN init_fn);
+
+
+/*
+ * TEXT EXTRACTION
+ *
+ * The types of bytes that need more than just copying when extracting
+ * the text from an element. All other bytes are copied in runs.
+ */
+enum TextByteType
+{
+	TB_PLAIN,
+	TB_SPACE,
+	TB_MARKUP,
+	TB_ENTITY,
+
+	/* The lead byte of a UTF-8 sequence that might be a Unicode space */
+	TB_UTF8_SPACE_LEAD
+};
 
 
+struct TextByteTable
+{
+	uint8 tbt_types [256];
+
+	TextByteTable ()
+	{
+		memset (tbt_types, TB_PLAIN, sizeof (tbt_types));
+
+		tbt_types [(unsigned char) ' '] = TB_SPACE;
+		tbt_types [(unsigned char) '\t'] = TB_SPACE;
+		tbt_types [(unsigned char) '\n'] = TB_SPACE;
+		tbt_types [(unsigned char) '\v'] = TB_SPACE;
+		tbt_types [(unsigned char) '\f'] = TB_SPACE;
+		tbt_types [(unsigned char) '\r'] = TB_SPACE;
+		tbt_types [(unsigned char) '<'] = TB_MARKUP;
+		tbt_types [(unsigned char) '>'] = TB_MARKUP;
+		tbt_types [(unsigned char) '&'] = TB_ENTITY;
+		tbt_types [0xC2] = TB_UTF8_SPACE_LEAD;
+		tbt_types [0xE1] = TB_UTF8_SPACE_LEAD;
+		tbt_types [0xE2] = TB_UTF8_SPACE_LEAD;
+		tbt_types [0xE3] = TB_UTF8_SPACE_LEAD;
+	}
+};
+
+static const TextByteTable S_TEXT_BYTES;
+
+
+struct NamedEntity
+{
+	const char *ne_name_s;
+	uint32 ne_code_point;
+};
 
 
-static json_t *GetHtmlLinkAsJSON (const HtmlLink * const link_p)
+/* The named entities that we decode, sorted by name for a binary search */
+static const NamedEntity S_NAMED_ENTITIES [] =
 {
-	json_t *json_p = NULL;
-	char *protocol_s = NULL;
-	char *path_s = NULL;
+	{ "AElig", 0x00C6 }, { "Aacute", 0x00C1 }, { "Agrave", 0x00C0 }, { "Auml", 0x00C4 },
+	{ "Ccedil", 0x00C7 }, { "Eacute", 0x00C9 }, { "Egrave", 0x00C8 }, { "Iacute", 0x00CD },
+	{ "Ntilde", 0x00D1 }, { "Oacute", 0x00D3 }, { "Oslash", 0x00D8 }, { "Ouml", 0x00D6 },
+	{ "Uacute", 0x00DA }, { "Uuml", 0x00DC },
+	{ "aacute", 0x00E1 }, { "acirc", 0x00E2 }, { "aelig", 0x00E6 }, { "agrave", 0x00E0 },
+	{ "alpha", 0x03B1 }, { "amp", 0x0026 }, { "apos", 0x0027 }, { "aring", 0x00E5 },
+	{ "atilde", 0x00E3 }, { "auml", 0x00E4 }, { "beta", 0x03B2 }, { "bull", 0x2022 },
+	{ "ccedil", 0x00E7 }, { "cent", 0x00A2 }, { "copy", 0x00A9 }, { "dagger", 0x2020 },
+	{ "deg", 0x00B0 }, { "eacute", 0x00E9 }, { "ecirc", 0x00EA }, { "egrave", 0x00E8 },
+	{ "emsp", 0x2003 }, { "ensp", 0x2002 }, { "euml", 0x00EB }, { "euro", 0x20AC },
+	{ "frac12", 0x00BD }, { "gt", 0x003E }, { "hellip", 0x2026 }, { "iacute", 0x00ED },
+	{ "icirc", 0x00EE }, { "iexcl", 0x00A1 }, { "igrave", 0x00EC }, { "iquest", 0x00BF },
+	{ "iuml", 0x00EF }, { "laquo", 0x00AB }, { "ldquo", 0x201C }, { "lsaquo", 0x2039 },
+	{ "lsquo", 0x2018 }, { "lt", 0x003C }, { "mdash", 0x2014 }, { "micro", 0x00B5 },
+	{ "middot", 0x00B7 }, { "mu", 0x03BC }, { "nbsp", 0x00A0 }, { "ndash", 0x2013 },
+	{ "ntilde", 0x00F1 }, { "oacute", 0x00F3 }, { "ocirc", 0x00F4 }, { "ograve", 0x00F2 },
+	{ "oslash", 0x00F8 }, { "otilde", 0x00F5 }, { "ouml", 0x00F6 }, { "para", 0x00B6 },
+	{ "plusmn", 0x00B1 }, { "pound", 0x00A3 }, { "quot", 0x0022 }, { "raquo", 0x00BB },
+	{ "rdquo", 0x201D }, { "reg", 0x00AE }, { "rsaquo", 0x203A }, { "rsquo", 0x2019 },
+	{ "sbquo", 0x201A }, { "sect", 0x00A7 }, { "shy", 0x00AD }, { "szlig", 0x00DF },
+	{ "thinsp", 0x2009 }, { "times", 0x00D7 }, { "trade", 0x2122 }, { "uacute", 0x00FA },
+	{ "ucirc", 0x00FB }, { "ugrave", 0x00F9 }, { "uuml", 0x00FC }, { "yen", 0x00A5 },
+	{ "zwj", 0x200D }, { "zwnj", 0x200C }
+};
+
+/* The longest entity name that we need to look up */
+#define MAX_ENTITY_NAME_LENGTH (8)
 
-	if (GetDataResourceProtocolAndPath (link_p -> hl_uri_s, &protocol_s, &path_s))
-		{
-			json_p = GetDataResourceAsJSONByParts (protocol_s, path_s, link_p -> hl_data_s, NULL);
 
-			FreeCopiedString (protocol_s);
-			FreeCopiedString (path_s);
-		}
+/*
+ * SELECTOR COMPILER
+ *
+ * Most selectors are simple chains of compound steps such as
+ * "div.result-item h3 a" so rather than getting hcxselect to interpret
+ * them, they are compiled into a matcher that tests each element of the
+ * DOM against the last step and then walks up through its ancestors for
+ * the others. The checks for the last step are specialised at compile time
+ * on which of the tag, classes and id it uses. Any other selectors are left
+ * to hcxselect.
+ */
 
-	return json_p;
-}
+/**
+ * A compound step of a selector such as "div.result-item".
+ */
+struct SelectorStep
+{
+	/** The tag name or empty for any tag. */
+	string ss_tag;
 
+	/** The classes that the element must have. */
+	vector <string> ss_classes;
 
-HtmlLinkArray *GetMatchingLinks (const char * const data_s, const char * const link_selector_s, const char * const title_selector_s, const char * const base_uri_s)
+	/** The id that the element must have or empty for any id. */
+	string ss_id;
+
+	/** Is this step joined to the previous one by ">" rather than whitespace? */
+	bool ss_child_flag;
+};
+
+
+/**
+ * An index of a page's elements by tag name, class and id that is built
+ * in a single pass over the DOM. When more than one selector is run on a
+ * page, each can then start from the shortest list of candidates for its
+ * last step rather than from every node in the DOM.
+ */
+class DomIndex
 {
-	string source (data_s);
-	ParserDom parser;
-	tree <htmlcxx :: HTML :: Node> dom = parser.parseTree (source);
-	hcxselect :: Selector s (dom);
-	bool success_flag = false;
-	HtmlLinkArray *links_p = NULL;
+public:
+	DomIndex (const tree <htmlcxx :: HTML :: Node> &dom_r);
 
-	try
-		{
-			s = s.select (link_selector_s);
-			success_flag = true;
-		}
-	catch (hcxselect::ParseException &ex)
-		{
-			PrintErrors (STM_LEVEL_SEVERE, __FILE__, __LINE__, "Parse error on '%s' - %s\n", link_selector_s, ex.what ());
-		}
-	catch (...)
-		{
-			PrintErrors (STM_LEVEL_SEVERE, __FILE__, __LINE__, "Error parsing '%s'\n", link_selector_s);
-		}
+	/**
+	 * Get the elements that could match a step in document order, or
+	 * NULL if the step can match any element.
+	 */
+	const vector <hcxselect :: Node *> *GetCandidates (const SelectorStep &step_r) const;
 
-	if (success_flag)
-		{
-			links_p = AllocateHtmlLinksArrayFromSet (s, title_selector_s, data_s, base_uri_s);
+	/**
+	 * Get the number of bytes that the index uses.
+	 *
+	 * @param num_allocations_p The number of allocations that it is made up of
+	 * will be stored here.
+	 */
+	size_t GetMemoryUsage (size_t *num_allocations_p) const;
 
-		}
+private:
+	typedef unordered_map <string, vector <hcxselect :: Node *> > NodeLists;
 
-	return links_p;
-}
+	const vector <hcxselect :: Node *> *GetNodeList (const NodeLists &lists_r, const string &key_r) const;
 
+	static size_t GetNodeListsMemoryUsage (const NodeLists &lists_r, size_t *num_allocations_p);
 
-static HtmlLinkArray *AllocateHtmlLinksArray (const size_t num_links)
+	NodeLists di_tags;
+	NodeLists di_classes;
+	NodeLists di_ids;
+	vector <hcxselect :: Node *> di_no_nodes;
+};
+
+
+class CompiledSelector
 {
-	HtmlLink *data_p = (HtmlLink *) AllocMemoryArray (num_links, sizeof (HtmlLink));
+public:
+	virtual ~CompiledSelector () {}
 
-	if (data_p)
-		{
-			HtmlLinkArray *links_p = (HtmlLinkArray *) AllocMemory (sizeof (HtmlLinkArray));
+	/**
+	 * Add the matching elements, in document order, to the given list.
+	 *
+	 * @param index_p If this is not NULL, only the index's candidates for
+	 * the selector are checked rather than the whole DOM.
+	 */
+	virtual void Select (const tree <htmlcxx :: HTML :: Node> &dom_r, const DomIndex *index_p, vector <hcxselect :: Node *> &matches_r) const = 0;
+};
 
-			if (links_p)
-				{
-					links_p -> hla_data_p = data_p;
-					links_p -> hla_num_entries = num_links;
 
-					return links_p;
-				}
+/**
+ * A selector that has been checked and, if possible, compiled.
+ */
+struct PreparedSelector
+{
+	/** The compiled matcher or NULL if hcxselect has to be used. */
+	unique_ptr <CompiledSelector> ps_compiled_p;
 
-			FreeMemory (data_p);
-		}
+	/**
+	 * If the selector is a simple chain that ends in an "a" step, its steps
+	 * for the AnchorScanner, otherwise NULL.
+	 */
+	unique_ptr <vector <SelectorStep> > ps_anchor_steps_p;
 
-	return NULL;
-}
+	bool ps_valid_flag;
+};
 
 
-static HtmlLinkArray *AllocateHtmlLinksArrayFromSet (const hcxselect :: Selector &selector_r, const char *title_selector_s, const char * const data_s, const char * const base_uri_s)
+/**
+ * A ParserDom that gives up as soon as the page has more than a given
+ * number of nodes rather than building the whole of a huge DOM tree.
+ * It also counts the memory used by the tree's nodes for the allocation
+ * accounting.
+ */
+class LimitedParserDom : public ParserDom
 {
-	const size_t num_links = selector_r.size ();
-	HtmlLinkArray *links_p = AllocateHtmlLinksArray (num_links);
+public:
+	/**
+	 * @param max_nodes The maximum number of nodes or 0 for no limit.
+	 */
+	explicit LimitedParserDom (const size_t max_nodes)
+		: lpd_max_nodes (max_nodes), lpd_num_nodes (0), lpd_num_bytes (0)
+	{
+	}
+
+	virtual ~LimitedParserDom ()
+	{
+		CountFrees (AS_DOM, lpd_num_bytes);
+	}
+
+protected:
+	virtual void foundTag (htmlcxx :: HTML :: Node node, bool is_end)
+	{
+		/* Closing tags don't add a node to the tree */
+		if (!is_end)
+			{
+				CountNode (node);
+			}
+
+		ParserDom :: foundTag (node, is_end);
+	}
+
+	virtual void foundText (htmlcxx :: HTML :: Node node)
+	{
+		CountNode (node);
+		ParserDom :: foundText (node);
+	}
+
+	virtual void foundComment (htmlcxx :: HTML :: Node node)
+	{
+		CountNode (node);
+		ParserDom :: foundComment (node);
+	}
+
+private:
+	void CountNode (const htmlcxx :: HTML :: Node &node_r)
+	{
+		size_t num_allocations = 1;
+		size_t num_bytes = sizeof (tree <htmlcxx :: HTML :: Node> :: tree_node);
+
+		if ((lpd_max_nodes > 0) && (lpd_num_nodes >= lpd_max_nodes))
+			{
+				throw length_error ("too many nodes");
+			}
+
+		++ lpd_num_nodes;
+
+		/* The tree stores its own copy of the node's strings */
+		AddStringAllocation (node_r.text (), &num_allocations, &num_bytes);
+		AddStringAllocation (node_r.tagName (), &num_allocations, &num_bytes);
+
+		lpd_num_bytes += num_bytes;
+		CountAllocations (AS_DOM, num_allocations, num_bytes);
+	}
+
+	size_t lpd_max_nodes;
+	size_t lpd_num_nodes;
+	size_t lpd_num_bytes;
+};
 
-	if (links_p)
-		{
-			HtmlLink *link_p = links_p -> hla_data_p;
-			ByteBuffer *buffer_p = AllocateByteBuffer (1024);
 
-			if (buffer_p)
-				{
-					for (hcxselect::Selector::const_iterator it = selector_r.begin (); it != selector_r.end (); ++ it, ++ link_p)
-						{
-							htmlcxx :: HTML :: Node *node_p = & ((*it) -> data);
-							const string &tag_name_r = node_p -> tagName ();
+/*
+ * ANCHOR SCANNER
+ *
+ * Many link selectors are simple chains that end in an "a" step, such as
+ * "div.results a", and for these, when there is no title selector, the
+ * links can be found without building a DOM tree at all. The page is
+ * scanned for each '<' with memchr, which the C library vectorises, and
+ * the tags are split out using the same rules as htmlcxx's ParserSax,
+ * including its handling of comments and of the literal text in script,
+ * style, xmp, plaintext and textarea elements. The open elements are kept
+ * on a stack and each closing tag is matched against it as ParserDom
+ * does, so any unclosed elements that it skips over are flattened and
+ * each link ends up with the same ancestors and extent, and so the same
+ * text, that it would have in the DOM.
+ */
 
-							const map <string, string> &attrs_r = node_p -> attributes ();
+/**
+ * An element found by the AnchorScanner. Only the offsets are stored, all
+ * of its text is read straight from the page.
+ */
+struct ScannedElement
+{
+	/** The offset of the element's opening tag. */
+	size_t se_offset;
 
-							size_t num_attrs = attrs_r.size();
+	/** The length of the opening tag. */
+	size_t se_tag_length;
 
-							node_p -> parseAttributes ();
+	/**
+	 * The length of the element up to the end of its closing tag or, until
+	 * it has been closed, just that of its opening tag.
+	 */
+	size_t se_length;
 
-							num_attrs = attrs_r.size();
+	/** The index of the element that it was opened in or S_NO_ELEMENT for the top level. */
+	size_t se_parent;
 
-							#if SELECTOR_DEBUG >= STM_LEVEL_FINEST
-							PrintLog (STM_LEVEL_FINEST, __FILE__, __LINE__, "node %s", node_p -> string ().c_data ());
-							#endif
+	/** The length of the tag name which starts just after the '<'. */
+	uint32 se_name_length;
 
-							if ((tag_name_r.compare ("a") == 0) || ((tag_name_r.compare ("A") == 0)))
-								{
-									pair <bool, string> p = node_p -> attribute ("href");
+	/**
+	 * Was the element still open when one of its ancestors was closed? If
+	 * so, ParserDom moves its children up to its parent.
+	 */
+	bool se_flattened_flag;
+};
 
-									if (p.first == false)
-										{
-											p = node_p -> attribute ("HREF");
-										}
 
-									if (p.first == true)
-										{
-											const string &uri_r = p.second;
-											const char *title_s = NULL;
-											char *inner_text_s = GetInnerText (node_p, data_s, buffer_p, false);
+class AnchorScanner
+{
+public:
+	/**
+	 * @param max_nodes The maximum number of nodes that the page's DOM tree
+	 * would have, counted in the same way as LimitedParserDom, or 0 for no limit.
+	 */
+	AnchorScanner (const char *data_s, const size_t data_length, const size_t max_nodes);
 
-											if (inner_text_s)
-												{
-													pair <bool, string> title_attr = node_p -> attribute ("title");
+	/**
+	 * Scan the page. This throws length_error if the page has more than the
+	 * maximum number of nodes.
+	 */
+	void Scan ();
 
-													if (title_attr.first == true)
-														{
-															title_s = title_attr.second.c_str ();
-														}
+	/**
+	 * Add the elements that match the steps of a selector, whose last step
+	 * must be for "a" elements, in document order.
+	 */
+	void SelectLinks (const vector <SelectorStep> &steps_r, vector <const ScannedElement *> &links_r) const;
 
-													if (!InitHtmlLink (link_p, title_s, uri_r.c_str (), inner_text_s, base_uri_s))
-														{
+	/**
+	 * Get the number of bytes that the scanner's lists use.
+	 */
+	size_t GetMemoryUsage () const;
 
-														}
+	static const size_t S_NO_ELEMENT = (size_t) -1;
 
-													FreeCopiedString (inner_text_s);
-												}
+private:
+	const char *ScanMarkup (const char *markup_p);
 
-										}
-								}
-						}
+	const char *SkipTag (const char *current_p) const;
 
-					FreeByteBuffer (buffer_p);
-				}
+	const char *SkipComment (const char *current_p) const;
 
-		}		/* if (links_p) */
+	const char *FindLiteralTextEnd (const char *current_p) const;
 
+	void OpenElement (const char *tag_p, const char *tag_end_p);
 
-	return links_p;
-}
+	void CloseElement (const char *tag_p, const char *tag_end_p);
 
+	void CountNode ();
 
+	const ScannedElement *GetParent (const ScannedElement &element_r) const;
 
-static char *GetInnerText (const htmlcxx :: HTML :: Node *node_p, const char *data_s, ByteBuffer *buffer_p, const bool include_child_text_flag)
+	bool MatchesStep (const SelectorStep &step_r, const ScannedElement &element_r) const;
+
+	bool MatchesAncestors (const vector <SelectorStep> &steps_r, const ScannedElement &element_r, const size_t step_index) const;
+
+	const char *as_data_s;
+	const char *as_end_p;
+	size_t as_max_nodes;
+	size_t as_num_nodes;
+
+	/* The element whose text is being treated as literal text, if any */
+	const char *as_literal_s;
+
+	vector <ScannedElement> as_elements;
+	vector <size_t> as_open_elements;
+
+	/* The indexes of the "a" elements in document order */
+	vector <size_t> as_anchors;
+};
+
+
+/* The result of looking for links with an AnchorScanner */
+enum ScanStatus
 {
-	const string &text_r = node_p -> text ();
-	char *inner_text_s = NULL;
-	const char *start_p = data_s + (node_p -> offset ()) + text_r.length ();
+	SS_OK,
+	SS_TOO_MANY_NODES,
+	SS_FAILED
+};
 
-	if (*start_p)
-		{
-			const char *end_p = data_s + (node_p -> offset ()) + (node_p -> length ()) - 1;
 
-			while (*end_p && (*end_p != '<') && (start_p < end_p))
-				{
-					-- end_p;
-				}
+/* The elements whose text htmlcxx treats as literal text up to their closing tag */
+static const char * const S_LITERAL_ELEMENTS_SS [] = { "script", "style", "xmp", "plaintext", "textarea", NULL };
 
-			if (*end_p == '<')
-				{
-					bool space_flag = false;
-					bool success_flag = true;
-					uint32 child_tag_count = 0;
 
-					/* scroll past the < and > */
-					-- end_p;
+/*
+ * The prepared selectors are shared between every request, and every
+ * operation that uses the same selector, and are never removed so
+ * pointers to them stay valid.
+ */
+static mutex s_prepared_selectors_lock;
+static unordered_map <string, PreparedSelector> s_prepared_selectors;
 
-					if (*start_p == '>')
-						{
-							++ start_p;
-						}
 
-					ResetByteBuffer (buffer_p);
+static const PreparedSelector *GetPreparedSelector (const char *selector_s);
 
-					while (isspace (*start_p) != 0)
-						{
-							++ start_p;
-						}
+static bool IsValidGeneralSelector (const char *selector_s);
 
-					/*
-					 * Make a copy of the inner text whilst reduces any occurrences
-					 * of 2 or more consecutive spaces with a single space.
-					 */
-					while ((start_p <= end_p) && success_flag)
-						{
-							const char c = *start_p;
+static vector <SelectorStep> *GetAnchorSelectorSteps (const char *selector_s);
 
-							if (isspace (c) != 0)
-								{
-									if (!space_flag)
-										{
-											success_flag = AppendToByteBuffer (buffer_p, " ", 1);
-											space_flag = true;
-										}
-								}
-							else
-								{
+static const vector <SelectorStep> *GetAnchorLinkSteps (const char *link_selector_s, const char *title_selector_s);
 
-									if (c == '<')
-										{
-											++ child_tag_count;
-										}
-									else if (c == '>')
-										{
-											-- child_tag_count;
-										}
-									else
-										{
-											if (include_child_text_flag || (child_tag_count == 0))
-												{
-													if (space_flag)
-														{
-															space_flag = false;
-														}
+static ScanStatus ScanAnchors (AnchorScanner &scanner_r, const vector <SelectorStep> &steps_r, vector <const ScannedElement *> &links_r);
 
-													success_flag = AppendToByteBuffer (buffer_p, &c, 1);
-												}
-										}
-								}
 
-							++ start_p;
-						}
+static bool SelectNodes (const tree <htmlcxx :: HTML :: Node> &dom_r, const DomIndex *index_p, const char *selector_s, vector <hcxselect :: Node *> &matches_r);
 
-					if (success_flag)
-						{
-							inner_text_s = EasyCopyToNewString (GetByteBufferData (buffer_p));
-						}
-				}
-		}
+static bool SelectLinksAndTitles (const tree <htmlcxx :: HTML :: Node> &dom_r, const char * const link_selector_s, const char * const title_selector_s, vector <hcxselect :: Node *> &links_r, NodeSet &titles_r, bool *titles_flag_p);
 
-	return inner_text_s;
-}
+static string GetLowerCaseString (const string &value_r);
 
 
-void FreeHtmlLinkArray (HtmlLinkArray *links_p)
-{
-	size_t i = links_p -> hla_num_entries;
-	HtmlLink *link_p = links_p -> hla_data_p;
+static CompiledSelector *CompileSelector (const char *selector_s);
 
-	for ( ; i > 0; -- i, ++ link_p)
-		{
-			ClearHtmlLink (link_p);
-		}
+static bool ParseSimpleSelector (const char *selector_s, vector <SelectorStep> &steps_r);
 
-	FreeMemory (links_p -> hla_data_p);
-	FreeMemory (links_p);
-}
+static bool MatchesStep (const SelectorStep &step_r, const htmlcxx :: HTML :: Node &node_r);
 
+static bool MatchesAncestors (const vector <SelectorStep> &steps_r, const hcxselect :: Node *node_p, const size_t step_index);
 
-static void ClearHtmlLink (HtmlLink *link_p)
-{
-	if (link_p -> hl_uri_s)
-		{
-			FreeCopiedString (link_p -> hl_uri_s);
-		}
+static bool MatchesClassesAndId (const SelectorStep &step_r, const char *tag_p, const size_t tag_length, const bool check_classes_flag, const bool check_id_flag);
 
-	if (link_p -> hl_title_s)
+
+template <bool HAS_TAG, bool HAS_CLASSES, bool HAS_ID>
+static inline bool MatchesSubjectStep (const SelectorStep &step_r, const htmlcxx :: HTML :: Node &node_r)
+{
+	if (HAS_TAG && (strcasecmp (node_r.tagName ().c_str (), step_r.ss_tag.c_str ()) != 0))
 		{
-			FreeCopiedString (link_p -> hl_title_s);
+			return false;
 		}
 
-	if (link_p -> hl_data_s)
+	if (HAS_CLASSES || HAS_ID)
 		{
-			FreeCopiedString (link_p -> hl_data_s);
+			return MatchesClassesAndId (step_r, node_r.text ().data (), node_r.text ().length (), HAS_CLASSES, HAS_ID);
 		}
 
+	return true;
 }
 
 
-static bool InitHtmlLink (HtmlLink *link_p, const char *title_s, const char *uri_s, const char *data_s, const char *base_uri_s)
+template <bool HAS_TAG, bool HAS_CLASSES, bool HAS_ID>
+class ChainSelector : public CompiledSelector
 {
-	char *value_s = NULL;
+public:
+	ChainSelector (const vector <SelectorStep> &steps_r)
+	: cs_steps (steps_r)
+	{
+	}
+
+	virtual void Select (const tree <htmlcxx :: HTML :: Node> &dom_r, const DomIndex *index_p, vector <hcxselect :: Node *> &matches_r) const
+	{
+		const vector <hcxselect :: Node *> *candidates_p = index_p ? index_p -> GetCandidates (cs_steps.back ()) : NULL;
+
+		if (candidates_p)
+			{
+				for (vector <hcxselect :: Node *> :: const_iterator it = candidates_p -> begin (); it != candidates_p -> end (); ++ it)
+					{
+						AddIfMatching (*it, matches_r);
+					}
+			}
+		else
+			{
+				for (tree <htmlcxx :: HTML :: Node> :: iterator it = dom_r.begin (); it != dom_r.end (); ++ it)
+					{
+						AddIfMatching (it.node, matches_r);
+					}
+			}
+	}
+
+private:
+	inline void AddIfMatching (hcxselect :: Node *node_p, vector <hcxselect :: Node *> &matches_r) const
+	{
+		const htmlcxx :: HTML :: Node &html_node_r = node_p -> data;
+
+		if (html_node_r.isTag () && (!html_node_r.tagName ().empty ()))
+			{
+				if (MatchesSubjectStep <HAS_TAG, HAS_CLASSES, HAS_ID> (cs_steps.back (), html_node_r) && MatchesAncestors (cs_steps, node_p, cs_steps.size () - 1))
+					{
+						matches_r.push_back (node_p);
+					}
+			}
+	}
+
+	vector <SelectorStep> cs_steps;
+};
 
-	if (base_uri_s)
-		{
-			/* is the uri an absolute uri? */
-			const char HTTP_S [] = "http://";
-			const char HTTPS_S [] = "https://";
-
-			if ((strncmp (HTTP_S, uri_s, strlen (HTTP_S)) == 0) || (strncmp (HTTPS_S, uri_s, strlen (HTTPS_S)) == 0))
-				{
-					value_s = EasyCopyToNewString (uri_s);
 
-					if (!value_s)
+HtmlLinkArray *GetLinks (CurlTool *tool_p, const char * const uri_s, const char * const link_selector_s, const char * const title_selector_s)
+{
+	HtmlLinkArray *links_p = NULL;
+
+	if (uri_s)
+		{
+			if (!SetUriForCurlTool (tool_p, uri_s))
+				{
+					return NULL;
+				}
+		}
+
+	if (RunCurlTool (tool_p) == CURLE_OK)
+		{
+			const char *data_s = GetCurlToolData (tool_p);
+
+			links_p = GetMatchingLinks (data_s, link_selector_s, title_selector_s, uri_s);
+		}
+
+	return links_p;
+}
+
+
+
+json_t *GetMatchingLinksAsJSON (const char * const data_s, const char * const link_selector_s, const char * const title_selector_s, const char * const base_uri_s)
+{
+	return GetMatchingLinksAsJSONFromBuffer (data_s, strlen (data_s), link_selector_s, title_selector_s, base_uri_s);
+}
+
+
+json_t *GetMatchingLinksAsJSONFromBuffer (const char * const data_s, const size_t data_length, const char * const link_selector_s, const char * const title_selector_s, const char * const base_uri_s)
+{
+	return GetMatchingLinksAsJSONInBatches (data_s, data_length, link_selector_s, title_selector_s, base_uri_s, NULL, 0, 0, NULL, NULL);
+}
+
+
+json_t *GetMatchingLinksAsJSONInBatches (const char * const data_s, const size_t data_length, const char * const link_selector_s, const char * const title_selector_s, const char * const base_uri_s, const UriCanonicalisation *canonical_p, const size_t max_nodes, const size_t batch_size, LinkBatchCallback callback_fn, void *callback_data_p)
+{
+	const vector <SelectorStep> *anchor_steps_p = GetAnchorLinkSteps (link_selector_s, title_selector_s);
+
+	if (anchor_steps_p)
+		{
+			AnchorScanner scanner (data_s, data_length, max_nodes);
+			vector <const ScannedElement *> anchors;
+			const uint64 scan_start = BeginTraceSpan ();
+			const ScanStatus status = ScanAnchors (scanner, *anchor_steps_p, anchors);
+
+			EndTraceSpan ("scan", scan_start);
+
+			if (status == SS_OK)
+				{
+					const size_t scan_size = scanner.GetMemoryUsage () + (anchors.capacity () * sizeof (const ScannedElement *));
+					json_t *res_p;
+
+					CountAllocations (AS_SELECTORS, 4, scan_size);
+
+					res_p = GetLinksAsJSON (anchors.size (), [&] (HtmlLink *link_p, const size_t i, ByteBuffer *buffer_p)
+						{
+							const ScannedElement *anchor_p = anchors [i];
+
+							return InitHtmlLinkFromElement (link_p, data_s, anchor_p -> se_offset, anchor_p -> se_tag_length, anchor_p -> se_length, NULL, buffer_p, base_uri_s);
+						}, batch_size, callback_fn, callback_data_p, canonical_p);
+
+					CountFrees (AS_SELECTORS, scan_size);
+
+					return res_p;
+				}
+			else if (status == SS_TOO_MANY_NODES)
+				{
+					PrintErrors (STM_LEVEL_WARNING, __FILE__, __LINE__, "Page has more than %lu elements, not extracting any links", (unsigned long) max_nodes);
+					return NULL;
+				}
+
+			/* Fall back to building the DOM */
+		}
+
+	LimitedParserDom parser (max_nodes);
+	const uint64 parse_start = BeginTraceSpan ();
+
+	/* Parse the buffer in place rather than copying it into a string first */
+	try
+		{
+			parser.parse (data_s, data_s + data_length);
+		}
+	catch (const length_error &)
+		{
+			EndTraceSpan ("parse", parse_start);
+			PrintErrors (STM_LEVEL_WARNING, __FILE__, __LINE__, "Page has more than %lu elements, not extracting any links", (unsigned long) max_nodes);
+			return NULL;
+		}
+
+	EndTraceSpan ("parse", parse_start);
+
+	const tree <htmlcxx :: HTML :: Node> &dom = parser.getTree ();
+	json_t *res_p = NULL;
+	vector <hcxselect :: Node *> links;
+	NodeSet titles;
+	bool titles_flag;
+	const uint64 select_start = BeginTraceSpan ();
+	const bool selected_flag = SelectLinksAndTitles (dom, link_selector_s, title_selector_s, links, titles, &titles_flag);
+
+	EndTraceSpan ("select", select_start);
+
+	if (selected_flag)
+		{
+			/* The matches' vector and, if there are titles, the set's buckets and nodes */
+			const size_t matches_size = (links.capacity () * sizeof (hcxselect :: Node *)) + (titles.bucket_count () * sizeof (void *)) + (titles.size () * 2 * sizeof (void *));
+
+			CountAllocations (AS_SELECTORS, 1 + (titles_flag ? 1 + titles.size () : 0), matches_size);
+
+			res_p = GetLinksAsJSON (links.size (), [&] (HtmlLink *link_p, const size_t i, ByteBuffer *buffer_p)
+				{
+					return InitHtmlLinkFromNode (link_p, links [i], titles_flag ? &titles : NULL, data_s, buffer_p, base_uri_s);
+				}, batch_size, callback_fn, callback_data_p, canonical_p);
+
+			CountFrees (AS_SELECTORS, matches_size);
+		}
+	else
+		{
+			PrintErrors (STM_LEVEL_WARNING, __FILE__, __LINE__, "Failed to get html links");
+		}
+
+	return res_p;
+}
+
+
+/*
+ * Convert the links to JSON one at a time, so that only a single HtmlLink
+ * is held at once, and pass on each full batch to the callback as soon as
+ * it is ready. init_fn (link_p, i, buffer_p) fills in the i-th link and
+ * extra_fn (link_json_p, i) can add to its JSON. If canonical_p is set,
+ * each link's URI is canonicalised and any link to a page that an earlier
+ * link went to is dropped.
+ */
+template <typename INIT_FN, typename EXTRA_FN>
+static json_t *GetLinksAsJSON (const size_t num_links, INIT_FN init_fn, const size_t batch_size, LinkBatchCallback callback_fn, void *callback_data_p, const UriCanonicalisation *canonical_p, EXTRA_FN extra_fn)
+{
+	json_t *res_p = json_array ();
+	SeenUriSet seen (canonical_p ? num_links : 0);
+
+	if (res_p)
+		{
+			ByteBuffer *buffer_p = AllocateByteBuffer (1024);
+
+			if (buffer_p)
+				{
+					size_t batch_start = 0;
+					bool success_flag = true;
+
+					CountAllocations (AS_LINKS, 2, sizeof (ByteBuffer) + 1024);
+
+					for (size_t i = 0; (i < num_links) && success_flag; ++ i)
+						{
+							HtmlLink link;
+							uint64 span_start = BeginTraceSpan ();
+							bool link_flag;
+
+							memset (&link, 0, sizeof (HtmlLink));
+
+							link_flag = init_fn (&link, i, buffer_p);
+
+							if (link_flag && canonical_p)
+								{
+									link_flag = CanonicaliseHtmlLink (&link, canonical_p, &seen);
+								}
+
+							EndTraceSpan ("link", span_start);
+
+							if (link_flag)
+								{
+									json_t *link_json_p;
+
+									span_start = BeginTraceSpan ();
+									link_json_p = GetHtmlLinkAsJSON (&link);
+									EndTraceSpan ("json", span_start);
+
+									if (link_json_p)
+										{
+											extra_fn (link_json_p, i);
+
+											if (json_array_append_new (res_p, link_json_p) != 0)
+												{
+													PrintErrors (STM_LEVEL_SEVERE, __FILE__, __LINE__, "Failed to add link for %s to json array", link.hl_uri_s);
+													json_decref (link_json_p);
+												}
+										}
+									else
+										{
+											PrintErrors (STM_LEVEL_SEVERE, __FILE__, __LINE__, "Failed to get json for %s", link.hl_uri_s);
+										}
+
+									ClearHtmlLink (&link);
+								}
+
+							if (callback_fn && (json_array_size (res_p) - batch_start >= batch_size) && (json_array_size (res_p) > batch_start))
+								{
+									success_flag = callback_fn (res_p, batch_start, json_array_size (res_p), callback_data_p);
+									batch_start = json_array_size (res_p);
+								}
+						}
+
+					if (callback_fn && success_flag && (json_array_size (res_p) > batch_start))
+						{
+							callback_fn (res_p, batch_start, json_array_size (res_p), callback_data_p);
+						}
+
+					FreeByteBuffer (buffer_p);
+					CountFrees (AS_LINKS, sizeof (ByteBuffer) + 1024);
+				}
+			else
+				{
+					PrintErrors (STM_LEVEL_SEVERE, __FILE__, __LINE__, "Failed to allocate buffer for link text");
+					json_decref (res_p);
+					res_p = NULL;
+				}
+
+		}		/* if (res_p) */
+	else
+		{
+			PrintErrors (STM_LEVEL_SEVERE, __FILE__, __LINE__, "Failed to create json array for links json");
+		}
+
+	return res_p;
+}
+
+
+/*
+ * URI CANONICALISATION
+ *
+ * Links to the same page often differ only by tracking parameters, the
+ * case of the host or a default port, so these are put into a single form
+ * before the links are compared.
+ */
+SeenUriSet :: SeenUriSet (const size_t num_links)
+	: sus_mask (0)
+{
+	if (num_links > 0)
+		{
+			size_t num_slots = 16;
+
+			/* Keep the table at most half full so that probe runs stay short */
+			while (num_slots < (num_links << 1))
+				{
+					num_slots <<= 1;
+				}
+
+			try
+				{
+					sus_hashes.assign (num_slots, 0);
+					sus_mask = num_slots - 1;
+
+					CountAllocations (AS_LINKS, 1, num_slots * sizeof (uint64));
+				}
+			catch (const bad_alloc &)
+				{
+					PrintErrors (STM_LEVEL_WARNING, __FILE__, __LINE__, "Failed to allocate space for %lu link hashes, not removing duplicate links", (unsigned long) num_slots);
+				}
+		}
+}
+
+
+SeenUriSet :: ~SeenUriSet ()
+{
+	if (sus_mask != 0)
+		{
+			CountFrees (AS_LINKS, sus_hashes.size () * sizeof (uint64));
+		}
+}
+
+
+bool SeenUriSet :: Add (const string &key_r)
+{
+	if (sus_mask != 0)
+		{
+			/* 64-bit FNV-1a */
+			uint64 hash = 14695981039346656037ULL;
+			size_t i;
+
+			for (string :: const_iterator itr = key_r.begin (); itr != key_r.end (); ++ itr)
+				{
+					hash ^= (unsigned char) *itr;
+					hash *= 1099511628211ULL;
+				}
+
+			/* An empty slot has a hash of 0 */
+			if (hash == 0)
+				{
+					hash = 1;
+				}
+
+			i = (size_t) hash & sus_mask;
+
+			while (sus_hashes [i] != 0)
+				{
+					if (sus_hashes [i] == hash)
+						{
+							return false;
+						}
+
+					i = (i + 1) & sus_mask;
+				}
+
+			sus_hashes [i] = hash;
+		}
+
+	return true;
+}
+
+
+/*
+ * Replace the link's URI with its canonical form. If the link goes to a
+ * page that has already been seen, it is cleared and false is returned.
+ */
+static bool CanonicaliseHtmlLink (HtmlLink *link_p, const UriCanonicalisation *canonical_p, SeenUriSet *seen_p)
+{
+	string uri;
+	string key;
+
+	if (GetCanonicalUri (link_p -> hl_uri_s, canonical_p, uri, key))
+		{
+			if (uri.compare (link_p -> hl_uri_s) != 0)
+				{
+					char *uri_s = CopyToNewString (uri.c_str (), uri.size (), false);
+
+					if (uri_s)
+						{
+							CountFrees (AS_LINKS, strlen (link_p -> hl_uri_s) + 1);
+							CountAllocations (AS_LINKS, 1, uri.size () + 1);
+
+							FreeCopiedString (link_p -> hl_uri_s);
+							link_p -> hl_uri_s = uri_s;
+						}
+					else
+						{
+							PrintErrors (STM_LEVEL_WARNING, __FILE__, __LINE__, "Failed to copy canonical uri \"%s\" for \"%s\"", uri.c_str (), link_p -> hl_uri_s);
+						}
+				}
+		}
+	else
+		{
+			key = link_p -> hl_uri_s;
+		}
+
+	if (seen_p -> Add (key))
+		{
+			return true;
+		}
+
+	ClearHtmlLink (link_p);
+
+	return false;
+}
+
+
+/*
+ * Get the canonical form of an http or https URI along with the key to
+ * compare it by, which leaves out the scheme and any trailing slash on
+ * the path so that the secure and insecure versions of a page and the
+ * ones with and without a trailing slash match. Returns false for any
+ * other URIs, which are left as they are.
+ */
+bool GetCanonicalUri (const char *uri_s, const UriCanonicalisation *canonical_p, string &uri_r, string &key_r)
+{
+	const char *authority_p = strstr (uri_s, "://");
+	size_t default_port_length;
+
+	if (!authority_p)
+		{
+			return false;
+		}
+
+	if (((authority_p - uri_s) == 4) && (strncasecmp (uri_s, "http", 4) == 0))
+		{
+			uri_r.assign ("http://");
+			default_port_length = 3;
+		}
+	else if (((authority_p - uri_s) == 5) && (strncasecmp (uri_s, "https", 5) == 0))
+		{
+			uri_r.assign ("https://");
+			default_port_length = 4;
+		}
+	else
+		{
+			return false;
+		}
+
+	authority_p += 3;
+
+	const size_t authority_length = strcspn (authority_p, "/?#");
+	const char *path_p = authority_p + authority_length;
+	const size_t path_length = strcspn (path_p, "?#");
+	const char *query_p = path_p + path_length;
+	const size_t query_length = (*query_p == '?') ? strcspn (query_p + 1, "#") : 0;
+	const char *host_p = authority_p;
+	const char *host_end_p = authority_p + authority_length;
+	const char *port_p = NULL;
+	size_t key_start;
+
+	/* Leave any user information as it is */
+	for (const char *c_p = authority_p; c_p < host_end_p; ++ c_p)
+		{
+			if (*c_p == '@')
+				{
+					host_p = c_p + 1;
+				}
+		}
+
+	uri_r.append (authority_p, host_p - authority_p);
+
+	/* The last colon that isn't within an IPv6 address starts the port */
+	for (const char *c_p = host_end_p; c_p > host_p; -- c_p)
+		{
+			if (c_p [-1] == ':')
+				{
+					port_p = c_p - 1;
+					break;
+				}
+			else if ((c_p [-1] == ']') || (!isdigit ((unsigned char) c_p [-1])))
+				{
+					break;
+				}
+		}
+
+	for (const char *c_p = host_p; c_p < (port_p ? port_p : host_end_p); ++ c_p)
+		{
+			uri_r.push_back ((char) tolower ((unsigned char) *c_p));
+		}
+
+	if (port_p)
+		{
+			const size_t port_length = host_end_p - port_p;
+
+			if (! ((port_length == 1) || ((port_length == default_port_length) && (strncmp (port_p, default_port_length == 3 ? ":80" : ":443", port_length) == 0))))
+				{
+					uri_r.append (port_p, port_length);
+				}
+		}
+
+	key_start = (uri_r [4] == 's') ? 8 : 7;
+
+	AppendCanonicalPath (path_p, path_length, uri_r);
+
+	key_r.assign (uri_r, key_start, string :: npos);
+
+	if ((key_r.size () > 0) && (key_r [key_r.size () - 1] == '/'))
+		{
+			key_r.erase (key_r.size () - 1);
+		}
+
+	if (query_length > 0)
+		{
+			const size_t uri_length = uri_r.size ();
+
+			AppendCanonicalQuery (query_p + 1, query_length, canonical_p, uri_r);
+			key_r.append (uri_r, uri_length, string :: npos);
+		}
+
+	/* The fragment is dropped as it is the same page */
+	return true;
+}
+
+
+/*
+ * Append a path with its "." and ".." segments resolved, as in section
+ * 5.2.4 of RFC 3986. An empty path becomes "/".
+ */
+static void AppendCanonicalPath (const char *path_p, const size_t path_length, string &uri_r)
+{
+	const char *end_p = path_p + path_length;
+	const size_t start = uri_r.size ();
+
+	if (path_p < end_p)
+		{
+			/* Skip the leading slash */
+			++ path_p;
+		}
+
+	uri_r.push_back ('/');
+
+	while (path_p <= end_p)
+		{
+			const char *segment_end_p = (const char *) memchr (path_p, '/', end_p - path_p);
+			size_t segment_length;
+			bool last_flag = false;
+
+			if (!segment_end_p)
+				{
+					segment_end_p = end_p;
+					last_flag = true;
+				}
+
+			segment_length = segment_end_p - path_p;
+
+			if ((segment_length == 1) && (*path_p == '.'))
+				{
+					/* Stay where we are */
+				}
+			else if ((segment_length == 2) && (path_p [0] == '.') && (path_p [1] == '.'))
+				{
+					/* Go up a level, removing the last segment and its trailing slash */
+					if (uri_r.size () > start + 1)
+						{
+							const size_t slash = uri_r.rfind ('/', uri_r.size () - 2);
+
+							uri_r.erase (slash + 1);
+						}
+				}
+			else
+				{
+					AppendPercentEncoded (path_p, segment_length, uri_r);
+
+					if (!last_flag)
+						{
+							uri_r.push_back ('/');
+						}
+				}
+
+			path_p = segment_end_p + 1;
+		}
+}
+
+
+/*
+ * Append a query without the removed parameters. The '?' is only added
+ * if any parameters are left.
+ */
+static void AppendCanonicalQuery (const char *query_p, const size_t query_length, const UriCanonicalisation *canonical_p, string &uri_r)
+{
+	const char *end_p = query_p + query_length;
+	bool first_flag = true;
+
+	while (query_p < end_p)
+		{
+			const char *param_end_p = (const char *) memchr (query_p, '&', end_p - query_p);
+			const char *name_end_p;
+
+			if (!param_end_p)
+				{
+					param_end_p = end_p;
+				}
+
+			name_end_p = (const char *) memchr (query_p, '=', param_end_p - query_p);
+
+			if (!name_end_p)
+				{
+					name_end_p = param_end_p;
+				}
+
+			if ((param_end_p > query_p) && (!IsRemovedQueryParameter (query_p, name_end_p - query_p, canonical_p)))
+				{
+					uri_r.push_back (first_flag ? '?' : '&');
+					AppendPercentEncoded (query_p, param_end_p - query_p, uri_r);
+					first_flag = false;
+				}
+
+			query_p = param_end_p + 1;
+		}
+}
+
+
+/* Append a value with the hex digits of any percent-encoded bytes in upper case */
+static void AppendPercentEncoded (const char *value_p, const size_t value_length, string &uri_r)
+{
+	const char *end_p = value_p + value_length;
+
+	while (value_p < end_p)
+		{
+			const char *percent_p = (const char *) memchr (value_p, '%', end_p - value_p);
+
+			if (!percent_p)
+				{
+					percent_p = end_p;
+				}
+
+			uri_r.append (value_p, percent_p - value_p);
+			value_p = percent_p;
+
+			if (value_p < end_p)
+				{
+					uri_r.push_back ('%');
+					++ value_p;
+
+					if ((end_p - value_p >= 2) && isxdigit ((unsigned char) value_p [0]) && isxdigit ((unsigned char) value_p [1]))
+						{
+							uri_r.push_back ((char) toupper ((unsigned char) value_p [0]));
+							uri_r.push_back ((char) toupper ((unsigned char) value_p [1]));
+							value_p += 2;
+						}
+				}
+		}
+}
+
+
+static bool IsRemovedQueryParameter (const char *name_p, const size_t name_length, const UriCanonicalisation *canonical_p)
+{
+	for (size_t i = 0; i < canonical_p -> uc_num_removed_params; ++ i)
+		{
+			const char *removed_s = canonical_p -> uc_removed_params_ss [i];
+			size_t removed_length = strlen (removed_s);
+
+			if ((removed_length > 0) && (removed_s [removed_length - 1] == '*'))
+				{
+					-- removed_length;
+
+					if ((name_length >= removed_length) && (strncmp (name_p, removed_s, removed_length) == 0))
+						{
+							return true;
+						}
+				}
+			else if ((name_length == removed_length) && (strncmp (name_p, removed_s, removed_length) == 0))
+				{
+					return true;
+				}
+		}
+
+	return false;
+}
+
+
+/*
+ * STRUCTURED DATA
+ *
+ * Rather than parsing the HTML, the script elements are found with a
+ * byte scan and only the contents of the right one are parsed, as JSON.
+ */
+json_t *GetStructuredDataLinksAsJSONInBatches (const char * const data_s, const size_t data_length, const StructuredDataMapping *mapping_p, const char * const base_uri_s, const UriCanonicalisation *canonical_p, const size_t batch_size, LinkBatchCallback callback_fn, void *callback_data_p)
+{
+	const char * const end_p = data_s + data_length;
+	const char *current_p = data_s;
+	const char *text_p;
+	size_t text_length;
+	const uint64 scan_start = BeginTraceSpan ();
+
+	while ((current_p = FindStructuredDataScript (current_p, end_p, mapping_p, &text_p, &text_length)) != NULL)
+		{
+			json_t *data_p = json_loadb (text_p, text_length, 0, NULL);
+
+			if (data_p)
+				{
+					const json_t *type_p = mapping_p -> sdm_data_type_s ? json_object_get (data_p, "@type") : NULL;
+
+					if ((mapping_p -> sdm_data_type_s == NULL) || (json_is_string (type_p) && (strcmp (json_string_value (type_p), mapping_p -> sdm_data_type_s) == 0)))
+						{
+							const json_t *results_p = GetJSONPathValue (data_p, mapping_p -> sdm_results_path_s);
+
+							if (json_is_array (results_p))
+								{
+									json_t *res_p;
+
+									EndTraceSpan ("structured data", scan_start);
+
+									res_p = GetLinksAsJSON (json_array_size (results_p), [&] (HtmlLink *link_p, const size_t i, ByteBuffer * /* buffer_p */)
+										{
+											return InitHtmlLinkFromStructuredData (link_p, json_array_get (results_p, i), mapping_p, base_uri_s);
+										}, batch_size, callback_fn, callback_data_p, canonical_p, [&] (json_t *link_json_p, const size_t i)
+										{
+											AddStructuredDataSnippet (link_json_p, json_array_get (results_p, i), mapping_p);
+										});
+
+									json_decref (data_p);
+
+									return res_p;
+								}
+						}
+
+					json_decref (data_p);
+				}
+			else
+				{
+					PrintErrors (STM_LEVEL_WARNING, __FILE__, __LINE__, "Failed to parse the %lu bytes of structured data in \"%s\" script element", (unsigned long) text_length, mapping_p -> sdm_script_type_s);
+				}
+		}
+
+	EndTraceSpan ("structured data", scan_start);
+
+	return NULL;
+}
+
+
+/*
+ * Find the next script element with the mapping's type and id, getting
+ * the text within it. Returns the position to carry on looking from or
+ * NULL if there aren't any more.
+ */
+static const char *FindStructuredDataScript (const char *current_p, const char *end_p, const StructuredDataMapping *mapping_p, const char **text_pp, size_t *text_length_p)
+{
+	static const char * const S_NAMES_SS [] = { "type", "id" };
+	static const char S_SCRIPT_S [] = "script";
+	const size_t script_length = sizeof (S_SCRIPT_S) - 1;
+
+	while ((current_p = (const char *) memchr (current_p, '<', end_p - current_p)) != NULL)
+		{
+			const char *tag_p = current_p ++;
+
+			if (((size_t) (end_p - current_p) > script_length) && (strncasecmp (current_p, S_SCRIPT_S, script_length) == 0) && (!isalnum ((unsigned char) current_p [script_length])))
+				{
+					const char *text_p = (const char *) memchr (current_p, '>', end_p - current_p);
+
+					if (text_p)
+						{
+							const char *close_p = ++ text_p;
+
+							/* A script's text runs up to the first closing tag */
+							while (((close_p = (const char *) memchr (close_p, '<', end_p - close_p)) != NULL) && (! (((size_t) (end_p - close_p) > script_length + 1) && (close_p [1] == '/') && (strncasecmp (close_p + 2, S_SCRIPT_S, script_length) == 0))))
+								{
+									++ close_p;
+								}
+
+							if (close_p)
+								{
+									AttributeValue values [2];
+
+									GetTagAttributes (tag_p, text_p - tag_p, S_NAMES_SS, values, 2);
+
+									if (MatchesAttributeValue (& (values [0]), mapping_p -> sdm_script_type_s) && ((mapping_p -> sdm_script_id_s == NULL) || MatchesAttributeValue (& (values [1]), mapping_p -> sdm_script_id_s)))
+										{
+											*text_pp = text_p;
+											*text_length_p = close_p - text_p;
+
+											return close_p;
+										}
+
+									current_p = close_p;
+								}
+							else
+								{
+									return NULL;
+								}
+						}
+					else
+						{
+							return NULL;
+						}
+				}
+		}
+
+	return NULL;
+}
+
+
+static bool MatchesAttributeValue (const AttributeValue *value_p, const char *expected_s)
+{
+	return ((value_p -> av_value_p != NULL) && (value_p -> av_length == strlen (expected_s)) && (strncasecmp (value_p -> av_value_p, expected_s, value_p -> av_length) == 0));
+}
+
+
+/*
+ * Get the value at a path of object keys and array indexes separated by
+ * dots such as "itemListElement.0.item". A NULL or empty path gives the
+ * value itself.
+ */
+static const json_t *GetJSONPathValue (const json_t *value_p, const char *path_s)
+{
+	const char *segment_p = path_s ? path_s : "";
+
+	while (value_p && (*segment_p != '\0'))
+		{
+			const char *segment_end_p = strchr (segment_p, '.');
+			size_t segment_length;
+
+			if (!segment_end_p)
+				{
+					segment_end_p = segment_p + strlen (segment_p);
+				}
+
+			segment_length = segment_end_p - segment_p;
+
+			if (json_is_object (value_p))
+				{
+					const char *key_s;
+					json_t *child_p;
+					const json_t *match_p = NULL;
+
+					/* The key isn't NULL-terminated in the path so it can't just be looked up */
+					json_object_foreach ((json_t *) value_p, key_s, child_p)
+						{
+							if ((strncmp (key_s, segment_p, segment_length) == 0) && (key_s [segment_length] == '\0'))
+								{
+									match_p = child_p;
+									break;
+								}
+						}
+
+					value_p = match_p;
+				}
+			else if (json_is_array (value_p) && isdigit ((unsigned char) *segment_p))
+				{
+					char *index_end_p;
+					const unsigned long index = strtoul (segment_p, &index_end_p, 10);
+
+					value_p = (index_end_p == segment_end_p) ? json_array_get (value_p, index) : NULL;
+				}
+			else
+				{
+					value_p = NULL;
+				}
+
+			segment_p = (*segment_end_p == '.') ? segment_end_p + 1 : segment_end_p;
+		}
+
+	return value_p;
+}
+
+
+/*
+ * The result's title is used as the link's text, as that is what the
+ * text of a result's link on the page would usually be.
+ */
+static bool InitHtmlLinkFromStructuredData (HtmlLink *link_p, const json_t *result_p, const StructuredDataMapping *mapping_p, const char * const base_uri_s)
+{
+	const json_t *uri_p = GetJSONPathValue (result_p, mapping_p -> sdm_uri_path_s);
+	bool success_flag = false;
+
+	if (json_is_string (uri_p))
+		{
+			const json_t *title_p = mapping_p -> sdm_title_path_s ? GetJSONPathValue (result_p, mapping_p -> sdm_title_path_s) : NULL;
+			AttributeValue uri;
+			AttributeValue title;
+
+			uri.av_value_p = json_string_value (uri_p);
+			uri.av_length = json_string_length (uri_p);
+
+			title.av_value_p = NULL;
+			title.av_length = 0;
+
+			success_flag = InitHtmlLink (link_p, &title, &uri, json_is_string (title_p) ? json_string_value (title_p) : "", base_uri_s);
+
+			if (success_flag)
+				{
+					size_t num_allocations = 0;
+					const size_t link_size = GetHtmlLinkSize (link_p, &num_allocations);
+
+					CountAllocations (AS_LINKS, num_allocations, link_size);
+				}
+		}
+
+	return success_flag;
+}
+
+
+static void AddStructuredDataSnippet (json_t *link_json_p, const json_t *result_p, const StructuredDataMapping *mapping_p)
+{
+	if (mapping_p -> sdm_snippet_path_s)
+		{
+			const json_t *snippet_p = GetJSONPathValue (result_p, mapping_p -> sdm_snippet_path_s);
+
+			/* The string is shared rather than copied */
+			if (json_is_string (snippet_p) && (json_object_set (link_json_p, "snippet", (json_t *) snippet_p) != 0))
+				{
+					PrintErrors (STM_LEVEL_WARNING, __FILE__, __LINE__, "Failed to add snippet \"%s\" to link", json_string_value (snippet_p));
+				}
+		}
+}
+
+
+
+
+static json_t *GetHtmlLinkAsJSON (const HtmlLink * const link_p)
+{
+	json_t *json_p = NULL;
+	char *protocol_s = NULL;
+	char *path_s = NULL;
+
+	if (GetDataResourceProtocolAndPath (link_p -> hl_uri_s, &protocol_s, &path_s))
+		{
+			const size_t parts_size = strlen (protocol_s) + strlen (path_s) + 2;
+
+			CountAllocations (AS_JSON, 2, parts_size);
+
+			json_p = GetDataResourceAsJSONByParts (protocol_s, path_s, link_p -> hl_data_s, NULL);
+
+			if (json_p)
+				{
+					/* The title is only worth adding if it was found */
+					if ((link_p -> hl_title_s) && (* (link_p -> hl_title_s)))
+						{
+							if (json_object_set_new (json_p, "title", json_string (link_p -> hl_title_s)) != 0)
+								{
+									PrintErrors (STM_LEVEL_WARNING, __FILE__, __LINE__, "Failed to add title \"%s\" to link for %s", link_p -> hl_title_s, link_p -> hl_uri_s);
+								}
+						}
+
+					CountJSONAllocations (json_p);
+				}
+
+			FreeCopiedString (protocol_s);
+			FreeCopiedString (path_s);
+
+			CountFrees (AS_JSON, parts_size);
+		}
+
+	return json_p;
+}
+
+
+HtmlLinkArray *GetMatchingLinks (const char * const data_s, const char * const link_selector_s, const char * const title_selector_s, const char * const base_uri_s)
+{
+	return GetMatchingLinksFromBuffer (data_s, strlen (data_s), link_selector_s, title_selector_s, base_uri_s);
+}
+
+
+HtmlLinkArray *GetMatchingLinksFromBuffer (const char * const data_s, const size_t data_length, const char * const link_selector_s, const char * const title_selector_s, const char * const base_uri_s)
+{
+	const vector <SelectorStep> *anchor_steps_p = GetAnchorLinkSteps (link_selector_s, title_selector_s);
+
+	if (anchor_steps_p)
+		{
+			AnchorScanner scanner (data_s, data_length, 0);
+			vector <const ScannedElement *> anchors;
+
+			if (ScanAnchors (scanner, *anchor_steps_p, anchors) == SS_OK)
+				{
+					return AllocateHtmlLinksArrayFromLinks (anchors.size (), [&] (HtmlLink *link_p, const size_t i, ByteBuffer *buffer_p)
+						{
+							const ScannedElement *anchor_p = anchors [i];
+
+							return InitHtmlLinkFromElement (link_p, data_s, anchor_p -> se_offset, anchor_p -> se_tag_length, anchor_p -> se_length, NULL, buffer_p, base_uri_s);
+						});
+				}
+		}
+
+	ParserDom parser;
+
+	/* Parse the buffer in place rather than copying it into a string first */
+	parser.parse (data_s, data_s + data_length);
+
+	const tree <htmlcxx :: HTML :: Node> &dom = parser.getTree ();
+	HtmlLinkArray *links_p = NULL;
+	vector <hcxselect :: Node *> links;
+	NodeSet titles;
+	bool titles_flag;
+
+	if (SelectLinksAndTitles (dom, link_selector_s, title_selector_s, links, titles, &titles_flag))
+		{
+			links_p = AllocateHtmlLinksArrayFromNodes (links, titles_flag ? &titles : NULL, data_s, base_uri_s);
+		}
+
+	return links_p;
+}
+
+
+static HtmlLinkArray *AllocateHtmlLinksArray (const size_t num_links)
+{
+	HtmlLink *data_p = (HtmlLink *) AllocMemoryArray (num_links, sizeof (HtmlLink));
+
+	if (data_p)
+		{
+			HtmlLinkArray *links_p = (HtmlLinkArray *) AllocMemory (sizeof (HtmlLinkArray));
+
+			if (links_p)
+				{
+					links_p -> hla_data_p = data_p;
+					links_p -> hla_num_entries = num_links;
+
+					return links_p;
+				}
+
+			FreeMemory (data_p);
+		}
+
+	return NULL;
+}
+
+
+/*
+ * If there is a title selector, each link's title is the text of the
+ * first element that matched it out of the link itself, its ancestors and
+ * then its descendants.
+ */
+static HtmlLinkArray *AllocateHtmlLinksArrayFromNodes (const vector <hcxselect :: Node *> &nodes_r, const NodeSet *titles_p, const char * const data_s, const char * const base_uri_s)
+{
+	return AllocateHtmlLinksArrayFromLinks (nodes_r.size (), [&] (HtmlLink *link_p, const size_t i, ByteBuffer *buffer_p)
+		{
+			return InitHtmlLinkFromNode (link_p, nodes_r [i], titles_p, data_s, buffer_p, base_uri_s);
+		});
+}
+
+
+/*
+ * init_fn (link_p, i, buffer_p) fills in the i-th link.
+ */
+template <typename INIT_FN>
+static HtmlLinkArray *AllocateHtmlLinksArrayFromLinks (const size_t num_links, INIT_FN init_fn)
+{
+	HtmlLinkArray *links_p = AllocateHtmlLinksArray (num_links);
+
+	if (links_p)
+		{
+			HtmlLink *link_p = links_p -> hla_data_p;
+			ByteBuffer *buffer_p = AllocateByteBuffer (1024);
+
+			if (buffer_p)
+				{
+					for (size_t i = 0; i < num_links; ++ i, ++ link_p)
+						{
+							init_fn (link_p, i, buffer_p);
+						}
+
+					FreeByteBuffer (buffer_p);
+				}
+
+		}		/* if (links_p) */
+
+
+	return links_p;
+}
+
+
+
+static char *GetInnerText (const htmlcxx :: HTML :: Node *node_p, const char *data_s, ByteBuffer *buffer_p, const bool include_child_text_flag)
+{
+	return GetElementInnerText (data_s, node_p -> offset (), node_p -> text ().length (), node_p -> length (), buffer_p, include_child_text_flag);
+}
+
+
+/*
+ * Get the text of the element whose opening tag is at the given offset.
+ * Its length runs up to the end of its closing tag or, if it has not
+ * been closed, is just that of its opening tag.
+ */
+static char *GetElementInnerText (const char *data_s, const size_t offset, const size_t tag_length, const size_t length, ByteBuffer *buffer_p, const bool include_child_text_flag)
+{
+	char *inner_text_s = NULL;
+	const char *start_p = data_s + offset + tag_length;
+
+	if (*start_p)
+		{
+			const char *end_p = data_s + offset + length - 1;
+
+			while (*end_p && (*end_p != '<') && (start_p < end_p))
+				{
+					-- end_p;
+				}
+
+			if (*end_p == '<')
+				{
+					const unsigned char *text_p;
+					const unsigned char *limit_p;
+					bool space_flag = false;
+					bool success_flag = true;
+					uint32 child_tag_count = 0;
+					size_t length = 0;
+
+					/* scroll past the < and > */
+					-- end_p;
+
+					if (*start_p == '>')
+						{
+							++ start_p;
+						}
+
+					ResetByteBuffer (buffer_p);
+
+					text_p = (const unsigned char *) start_p;
+					limit_p = (const unsigned char *) end_p + 1;
+
+					/*
+					 * Make a copy of the inner text in a single pass whilst decoding any
+					 * entities and replacing each run of whitespace, including Unicode
+					 * whitespace, with a single space. Leading and trailing whitespace
+					 * is dropped. Runs of bytes that need none of this are copied in
+					 * one go.
+					 */
+					while ((text_p < limit_p) && success_flag)
+						{
+							const bool copy_flag = (include_child_text_flag || (child_tag_count == 0));
+
+							switch (S_TEXT_BYTES.tbt_types [*text_p])
+								{
+									case TB_SPACE:
+										space_flag = true;
+										++ text_p;
+										break;
+
+									case TB_MARKUP:
+										if (*text_p == '<')
+											{
+												++ child_tag_count;
+											}
+										else if (child_tag_count > 0)
+											{
+												-- child_tag_count;
+											}
+
+										++ text_p;
+										break;
+
+									case TB_ENTITY:
+										{
+											uint32 code_point;
+											const size_t entity_length = copy_flag ? DecodeEntity ((const char *) text_p, (const char *) limit_p, &code_point) : 0;
+
+											if (entity_length > 0)
+												{
+													if (IsUnicodeSpace (code_point))
+														{
+															space_flag = true;
+														}
+													else
+														{
+															if (space_flag && (length > 0))
+																{
+																	success_flag = AppendToByteBuffer (buffer_p, " ", 1);
+																	++ length;
+																}
+
+															space_flag = false;
+
+															if (success_flag)
+																{
+																	success_flag = AppendCodePoint (buffer_p, code_point, &length);
+																}
+														}
+
+													text_p += entity_length;
+													break;
+												}
+										}
+
+										/* A lone & is just text, so fall through */
+
+									case TB_UTF8_SPACE_LEAD:
+										{
+											const size_t space_length = GetUnicodeSpaceLength (text_p, limit_p);
+
+											if (space_length > 0)
+												{
+													space_flag = true;
+													text_p += space_length;
+													break;
+												}
+										}
+
+										/* Not a space, so fall through */
+
+									default:
+										{
+											const unsigned char *run_p = text_p + 1;
+
+											while ((run_p < limit_p) && (S_TEXT_BYTES.tbt_types [*run_p] == TB_PLAIN))
+												{
+													++ run_p;
+												}
+
+											if (copy_flag)
+												{
+													if (space_flag && (length > 0))
+														{
+															success_flag = AppendToByteBuffer (buffer_p, " ", 1);
+															++ length;
+														}
+
+													space_flag = false;
+
+													if (success_flag)
+														{
+															success_flag = AppendToByteBuffer (buffer_p, text_p, run_p - text_p);
+															length += run_p - text_p;
+														}
+												}
+
+											text_p = run_p;
+										}
+										break;
+								}
+						}
+
+					if (success_flag)
+						{
+							inner_text_s = CopyToNewString (GetByteBufferData (buffer_p), length, false);
+						}
+				}
+		}
+
+	return inner_text_s;
+}
+
+
+bool PrepareSelectors (const char * const *selectors_ss, const size_t num_selectors)
+{
+	atomic <size_t> next_index (0);
+	atomic <bool> valid_flag (true);
+	vector <thread> workers;
+	size_t num_workers = thread :: hardware_concurrency ();
+
+	auto prepare = [&] ()
+		{
+			size_t i;
+
+			while ((i = next_index ++) < num_selectors)
+				{
+					if (selectors_ss [i])
+						{
+							const PreparedSelector *prepared_p = GetPreparedSelector (selectors_ss [i]);
+
+							if (! (prepared_p && prepared_p -> ps_valid_flag))
+								{
+									valid_flag = false;
+								}
+						}
+				}
+		};
+
+	/* This thread does its share of the work too */
+	if (num_workers > num_selectors)
+		{
+			num_workers = num_selectors;
+		}
+
+	try
+		{
+			for (size_t i = 1; i < num_workers; ++ i)
+				{
+					workers.push_back (thread (prepare));
+				}
+		}
+	catch (...)
+		{
+			/* Carry on with however many workers were started */
+		}
+
+	prepare ();
+
+	for (size_t i = 0; i < workers.size (); ++ i)
+		{
+			workers [i].join ();
+		}
+
+	return valid_flag;
+}
+
+
+void FreeHtmlLinkArray (HtmlLinkArray *links_p)
+{
+	size_t i = links_p -> hla_num_entries;
+	HtmlLink *link_p = links_p -> hla_data_p;
+
+	for ( ; i > 0; -- i, ++ link_p)
+		{
+			ClearHtmlLink (link_p);
+		}
+
+	FreeMemory (links_p -> hla_data_p);
+	FreeMemory (links_p);
+}
+
+
+static void ClearHtmlLink (HtmlLink *link_p)
+{
+	size_t num_allocations;
+
+	CountFrees (AS_LINKS, GetHtmlLinkSize (link_p, &num_allocations));
+
+	if (link_p -> hl_uri_s)
+		{
+			FreeCopiedString (link_p -> hl_uri_s);
+		}
+
+	if (link_p -> hl_title_s)
+		{
+			FreeCopiedString (link_p -> hl_title_s);
+		}
+
+	if (link_p -> hl_data_s)
+		{
+			FreeCopiedString (link_p -> hl_data_s);
+		}
+
+}
+
+
+static bool InitHtmlLink (HtmlLink *link_p, const AttributeValue *title_p, const AttributeValue *uri_p, const char *data_s, const char *base_uri_s)
+{
+	char *value_s = NULL;
+	const char *uri_s = uri_p -> av_value_p;
+	const size_t uri_length = uri_p -> av_length;
+
+	if (base_uri_s)
+		{
+			/* is the uri an absolute uri? */
+			const char HTTP_S [] = "http://";
+			const char HTTPS_S [] = "https://";
+
+			if (((uri_length >= strlen (HTTP_S)) && (strncmp (HTTP_S, uri_s, strlen (HTTP_S)) == 0)) || ((uri_length >= strlen (HTTPS_S)) && (strncmp (HTTPS_S, uri_s, strlen (HTTPS_S)) == 0)))
+				{
+					value_s = CopyToNewString (uri_s, uri_length, false);
+
+					if (!value_s)
+						{
+							PrintErrors (STM_LEVEL_SEVERE, __FILE__, __LINE__, "Failed to copy %.*s", (int) uri_length, uri_s);
+						}
+				}		/* if ((strcmp ("http://", uri_s) == 0) || (strcmp ("http://", uri_s) == 0)) */
+			else
+				{
+					if ((uri_length > 0) && (*uri_s == '/'))
+						{
+							/* skip past the "://" in the base uri */
+							const char delim_s [] = "://";
+							const char *slash_p = strstr (base_uri_s, delim_s);
+
+							if (slash_p)
+								{
+									slash_p += strlen (delim_s);
+								}
+							else
+								{
+									slash_p = base_uri_s;
+								}
+
+							/* Now find the next slash and append our uri to it */
+							slash_p = strchr (slash_p, '/');
+
+							if (slash_p)
+								{
+									value_s = JoinUriParts (base_uri_s, slash_p - base_uri_s, uri_s, uri_length);
+								}		/* if (slash_p) */
+
+						} 	/* if (*uri_s == '/') */
+					else
+						{
+							const char *last_slash_p = strrchr (base_uri_s, '/');
+
+							if (last_slash_p)
+								{
+									value_s = JoinUriParts (base_uri_s, last_slash_p - base_uri_s + 1, uri_s, uri_length);
+								}		/* if (last_slash_p) */
+
+						}
+
+				}
+
+		}		/* if (base_uri_s) */
+	else
+		{
+			value_s = CopyToNewString (uri_s, uri_length, false);
+
+			if (!value_s)
+				{
+					PrintErrors (STM_LEVEL_SEVERE, __FILE__, __LINE__, "Failed to copy %.*s", (int) uri_length, uri_s);
+				}
+		}
+
+
+	link_p -> hl_uri_s = NULL;
+	link_p -> hl_data_s = NULL;
+	link_p -> hl_title_s = NULL;
+
+	if (value_s)
+		{
+			link_p -> hl_uri_s = value_s;
+
+			value_s = EasyCopyToNewString (data_s);
+
+			if (value_s)
+				{
+					link_p -> hl_data_s = value_s;
+
+					link_p -> hl_title_s = NULL;
+
+					if (title_p -> av_value_p)
+						{
+							value_s = CopyToNewString (title_p -> av_value_p, title_p -> av_length, false);
+
+							if (value_s)
+								{
+									link_p -> hl_title_s = value_s;
+								}
+						}
+
+					return true;
+				}
+
+			FreeCopiedString (link_p -> hl_uri_s);
+			link_p -> hl_uri_s = NULL;
+		}
+
+	return false;
+}
+
+
+static char *JoinUriParts (const char *prefix_p, const size_t prefix_length, const char *uri_p, const size_t uri_length)
+{
+	char *value_s = (char *) AllocMemory (prefix_length + uri_length + 1);
+
+	if (value_s)
+		{
+			memcpy (value_s, prefix_p, prefix_length);
+			memcpy (value_s + prefix_length, uri_p, uri_length);
+			* (value_s + prefix_length + uri_length) = '\0';
+		}
+	else
+		{
+			PrintErrors (STM_LEVEL_SEVERE, __FILE__, __LINE__, "Failed to allocate memory to join %s and %.*s", prefix_p, (int) uri_length, uri_p);
+		}
+
+	return value_s;
+}
+
+
+/*
+ * Scan the raw bytes of an opening tag for the named attributes. The names
+ * are matched case-insensitively and the values are left pointing into
+ * the tag, so no copies are made. Any attributes that are not found have
+ * their av_value_p set to NULL. If an attribute appears more than once,
+ * the first occurrence is used as per the HTML specification.
+ */
+static uint32 GetTagAttributes (const char *tag_p, const size_t tag_length, const char * const *names_ss, AttributeValue *values_p, const uint32 num_names)
+{
+	const char * const end_p = tag_p + tag_length;
+	const char *current_p = tag_p;
+	uint32 num_found = 0;
+	uint32 i;
+
+	for (i = 0; i < num_names; ++ i)
+		{
+			values_p [i].av_value_p = NULL;
+			values_p [i].av_length = 0;
+		}
+
+	/* Skip the < and the tag name */
+	if ((current_p < end_p) && (*current_p == '<'))
+		{
+			++ current_p;
+		}
+
+	while ((current_p < end_p) && (!isspace ((unsigned char) *current_p)) && (*current_p != '>') && (*current_p != '/'))
+		{
+			++ current_p;
+		}
+
+	while ((current_p < end_p) && (num_found < num_names))
+		{
+			const char *name_p;
+			size_t name_length;
+			const char *value_p = NULL;
+			size_t value_length = 0;
+
+			while ((current_p < end_p) && (isspace ((unsigned char) *current_p) || (*current_p == '/')))
+				{
+					++ current_p;
+				}
+
+			if ((current_p == end_p) || (*current_p == '>'))
+				{
+					break;
+				}
+
+			name_p = current_p;
+
+			while ((current_p < end_p) && (!isspace ((unsigned char) *current_p)) && (*current_p != '=') && (*current_p != '>') && (*current_p != '/'))
+				{
+					++ current_p;
+				}
+
+			name_length = current_p - name_p;
+
+			while ((current_p < end_p) && isspace ((unsigned char) *current_p))
+				{
+					++ current_p;
+				}
+
+			if ((current_p < end_p) && (*current_p == '='))
+				{
+					++ current_p;
+
+					while ((current_p < end_p) && isspace ((unsigned char) *current_p))
+						{
+							++ current_p;
+						}
+
+					if ((current_p < end_p) && ((*current_p == '"') || (*current_p == '\'')))
+						{
+							const char quote = *current_p;
+
+							value_p = ++ current_p;
+
+							while ((current_p < end_p) && (*current_p != quote))
+								{
+									++ current_p;
+								}
+
+							value_length = current_p - value_p;
+
+							if (current_p < end_p)
+								{
+									++ current_p;
+								}
+						}
+					else
+						{
+							value_p = current_p;
+
+							while ((current_p < end_p) && (!isspace ((unsigned char) *current_p)) && (*current_p != '>'))
+								{
+									++ current_p;
+								}
+
+							value_length = current_p - value_p;
+						}
+				}
+			else
+				{
+					/* An attribute without a value such as "disabled" */
+					value_p = name_p + name_length;
+				}
+
+			for (i = 0; i < num_names; ++ i)
+				{
+					if ((values_p [i].av_value_p == NULL) && (strlen (names_ss [i]) == name_length) && (strncasecmp (names_ss [i], name_p, name_length) == 0))
+						{
+							values_p [i].av_value_p = value_p;
+							values_p [i].av_length = value_length;
+							++ num_found;
+							break;
+						}
+				}
+		}
+
+	return num_found;
+}
+
+
+static CompiledSelector *CompileSelector (const char *selector_s)
+{
+	CompiledSelector *compiled_p = NULL;
+	vector <SelectorStep> steps;
+
+	try
+		{
+			if (ParseSimpleSelector (selector_s, steps))
+				{
+					const SelectorStep &subject_r = steps.back ();
+					const int shape = ((subject_r.ss_tag.empty ()) ? 0 : 4) | ((subject_r.ss_classes.empty ()) ? 0 : 2) | ((subject_r.ss_id.empty ()) ? 0 : 1);
+
+					switch (shape)
+						{
+							case 0:
+								compiled_p = new (nothrow) ChainSelector <false, false, false> (steps);
+								break;
+
+							case 1:
+								compiled_p = new (nothrow) ChainSelector <false, false, true> (steps);
+								break;
+
+							case 2:
+								compiled_p = new (nothrow) ChainSelector <false, true, false> (steps);
+								break;
+
+							case 3:
+								compiled_p = new (nothrow) ChainSelector <false, true, true> (steps);
+								break;
+
+							case 4:
+								compiled_p = new (nothrow) ChainSelector <true, false, false> (steps);
+								break;
+
+							case 5:
+								compiled_p = new (nothrow) ChainSelector <true, false, true> (steps);
+								break;
+
+							case 6:
+								compiled_p = new (nothrow) ChainSelector <true, true, false> (steps);
+								break;
+
+							default:
+								compiled_p = new (nothrow) ChainSelector <true, true, true> (steps);
+								break;
+						}
+				}
+		}
+	catch (...)
+		{
+			PrintErrors (STM_LEVEL_WARNING, __FILE__, __LINE__, "Failed to compile selector '%s'", selector_s);
+		}
+
+	return compiled_p;
+}
+
+
+/*
+ * Parse selectors made up of tag names, .class and #id, joined by
+ * descendant and child combinators. Anything else, such as attribute
+ * selectors, pseudo-classes and selector lists, makes this return false.
+ */
+static bool ParseSimpleSelector (const char *selector_s, vector <SelectorStep> &steps_r)
+{
+	const char *current_p = selector_s;
+	bool child_flag = false;
+
+	while (true)
+		{
+			SelectorStep step;
+			bool empty_flag = true;
+
+			while (isspace ((unsigned char) *current_p))
+				{
+					++ current_p;
+				}
+
+			if (*current_p == '\0')
+				{
+					/* A trailing combinator is an error */
+					return ((!child_flag) && (!steps_r.empty ()));
+				}
+
+			if (*current_p == '>')
+				{
+					if (child_flag || steps_r.empty ())
+						{
+							return false;
+						}
+
+					child_flag = true;
+					++ current_p;
+					continue;
+				}
+
+			step.ss_child_flag = child_flag;
+			child_flag = false;
+
+			if (*current_p == '*')
+				{
+					++ current_p;
+					empty_flag = false;
+				}
+			else
+				{
+					const char *name_p = current_p;
+
+					while (isalnum ((unsigned char) *current_p) || (*current_p == '-'))
+						{
+							++ current_p;
+						}
+
+					if (current_p > name_p)
+						{
+							step.ss_tag.assign (name_p, current_p - name_p);
+							empty_flag = false;
+						}
+				}
+
+			while ((*current_p == '.') || (*current_p == '#'))
+				{
+					const char prefix = *current_p;
+					const char *name_p = ++ current_p;
+
+					while (isalnum ((unsigned char) *current_p) || (*current_p == '-') || (*current_p == '_'))
+						{
+							++ current_p;
+						}
+
+					if (current_p == name_p)
+						{
+							return false;
+						}
+
+					if (prefix == '.')
+						{
+							step.ss_classes.push_back (string (name_p, current_p - name_p));
+						}
+					else if (step.ss_id.empty ())
+						{
+							step.ss_id.assign (name_p, current_p - name_p);
+						}
+					else
+						{
+							return false;
+						}
+
+					empty_flag = false;
+				}
+
+			/* The step must be followed by a combinator or the end of the selector */
+			if (empty_flag || ((*current_p != '\0') && (*current_p != '>') && (!isspace ((unsigned char) *current_p))))
+				{
+					return false;
+				}
+
+			steps_r.push_back (step);
+		}
+}
+
+
+static bool MatchesStep (const SelectorStep &step_r, const htmlcxx :: HTML :: Node &node_r)
+{
+	if ((!step_r.ss_tag.empty ()) && (strcasecmp (node_r.tagName ().c_str (), step_r.ss_tag.c_str ()) != 0))
+		{
+			return false;
+		}
+
+	if ((!step_r.ss_classes.empty ()) || (!step_r.ss_id.empty ()))
+		{
+			return MatchesClassesAndId (step_r, node_r.text ().data (), node_r.text ().length (), !step_r.ss_classes.empty (), !step_r.ss_id.empty ());
+		}
+
+	return true;
+}
+
+
+/*
+ * Check the steps before the given one against the ancestors of the node
+ * that matched it, backtracking where a descendant combinator could match
+ * more than one ancestor.
+ */
+static bool MatchesAncestors (const vector <SelectorStep> &steps_r, const hcxselect :: Node *node_p, const size_t step_index)
+{
+	if (step_index == 0)
+		{
+			return true;
+		}
+	else
+		{
+			const SelectorStep &step_r = steps_r [step_index - 1];
+			const bool child_flag = steps_r [step_index].ss_child_flag;
+			const hcxselect :: Node *parent_p = node_p -> parent;
+
+			while (parent_p)
+				{
+					const htmlcxx :: HTML :: Node &html_node_r = parent_p -> data;
+
+					if (html_node_r.isTag () && (!html_node_r.tagName ().empty ()) && MatchesStep (step_r, html_node_r) && MatchesAncestors (steps_r, parent_p, step_index - 1))
+						{
+							return true;
+						}
+
+					if (child_flag)
+						{
+							break;
+						}
+
+					parent_p = parent_p -> parent;
+				}
+		}
+
+	return false;
+}
+
+
+/*
+ * The class and id attributes are read straight from the raw tag rather
+ * than getting htmlcxx to parse all of the node's attributes.
+ */
+static bool MatchesClassesAndId (const SelectorStep &step_r, const char *tag_p, const size_t tag_length, const bool check_classes_flag, const bool check_id_flag)
+{
+	static const char * const S_NAMES_SS [] = { "class", "id" };
+	AttributeValue values [2];
+
+	GetTagAttributes (tag_p, tag_length, S_NAMES_SS, values, 2);
+
+	if (check_id_flag)
+		{
+			if ((values [1].av_value_p == NULL) || (values [1].av_length != step_r.ss_id.length ()) || (strncmp (values [1].av_value_p, step_r.ss_id.data (), values [1].av_length) != 0))
+				{
+					return false;
+				}
+		}
+
+	if (check_classes_flag)
+		{
+			const char * const classes_end_p = values [0].av_value_p + values [0].av_length;
+
+			if (values [0].av_value_p == NULL)
+				{
+					return false;
+				}
+
+			for (vector <string> :: const_iterator it = step_r.ss_classes.begin (); it != step_r.ss_classes.end (); ++ it)
+				{
+					const char *token_p = values [0].av_value_p;
+					bool found_flag = false;
+
+					while ((token_p < classes_end_p) && (!found_flag))
+						{
+							const char *token_end_p;
+
+							while ((token_p < classes_end_p) && isspace ((unsigned char) *token_p))
+								{
+									++ token_p;
+								}
+
+							token_end_p = token_p;
+
+							while ((token_end_p < classes_end_p) && (!isspace ((unsigned char) *token_end_p)))
+								{
+									++ token_end_p;
+								}
+
+							if (((size_t) (token_end_p - token_p) == it -> length ()) && (strncmp (token_p, it -> data (), it -> length ()) == 0))
+								{
+									found_flag = true;
+								}
+
+							token_p = token_end_p;
+						}
+
+					if (!found_flag)
+						{
+							return false;
+						}
+				}
+		}
+
+	return true;
+}
+
+
+static bool InitHtmlLinkFromNode (HtmlLink *link_p, const hcxselect :: Node *tree_node_p, const NodeSet *titles_p, const char * const data_s, ByteBuffer *buffer_p, const char * const base_uri_s)
+{
+	const htmlcxx :: HTML :: Node *node_p = & (tree_node_p -> data);
+	const string &tag_name_r = node_p -> tagName ();
+	bool success_flag = false;
+
+	#if SELECTOR_DEBUG >= STM_LEVEL_FINEST
+	PrintLog (STM_LEVEL_FINEST, __FILE__, __LINE__, "node %s", node_p -> string ().c_data ());
+	#endif
+
+	if ((tag_name_r.compare ("a") == 0) || ((tag_name_r.compare ("A") == 0)))
+		{
+			const hcxselect :: Node *title_node_p = titles_p ? FindTitleNode (tree_node_p, *titles_p) : NULL;
+
+			success_flag = InitHtmlLinkFromElement (link_p, data_s, node_p -> offset (), node_p -> text ().length (), node_p -> length (), title_node_p ? & (title_node_p -> data) : NULL, buffer_p, base_uri_s);
+		}
+
+	return success_flag;
+}
+
+
+/*
+ * Fill in a link from an "a" element, given by the offset and lengths of
+ * its tags, and the element whose text is its title if there is one.
+ */
+static bool InitHtmlLinkFromElement (HtmlLink *link_p, const char * const data_s, const size_t offset, const size_t tag_length, const size_t length, const htmlcxx :: HTML :: Node *title_node_p, ByteBuffer *buffer_p, const char * const base_uri_s)
+{
+	/*
+	 * Rather than getting htmlcxx to parse every attribute into a map,
+	 * just scan the raw tag for the ones that we need.
+	 */
+	AttributeValue attrs [LA_NUM_ATTRIBUTES];
+	bool success_flag = false;
+
+	GetTagAttributes (data_s + offset, tag_length, S_LINK_ATTRIBUTES_SS, attrs, LA_NUM_ATTRIBUTES);
+
+	if (attrs [LA_HREF].av_value_p)
+		{
+			char *inner_text_s = GetElementInnerText (data_s, offset, tag_length, length, buffer_p, false);
+
+			if (inner_text_s)
+				{
+					char *title_text_s = NULL;
+					const size_t inner_text_size = strlen (inner_text_s) + 1;
+
+					CountAllocations (AS_LINKS, 1, inner_text_size);
+
+					if (title_node_p)
+						{
+							title_text_s = GetInnerText (title_node_p, data_s, buffer_p, false);
+
+							if (title_text_s)
+								{
+									attrs [LA_TITLE].av_value_p = title_text_s;
+									attrs [LA_TITLE].av_length = strlen (title_text_s);
+
+									CountAllocations (AS_LINKS, 1, attrs [LA_TITLE].av_length + 1);
+								}
+						}
+
+					success_flag = InitHtmlLink (link_p, & (attrs [LA_TITLE]), & (attrs [LA_HREF]), inner_text_s, base_uri_s);
+
+					if (success_flag)
+						{
+							size_t num_allocations = 0;
+							const size_t link_size = GetHtmlLinkSize (link_p, &num_allocations);
+
+							CountAllocations (AS_LINKS, num_allocations, link_size);
+						}
+
+					if (title_text_s)
+						{
+							CountFrees (AS_LINKS, attrs [LA_TITLE].av_length + 1);
+							FreeCopiedString (title_text_s);
+						}
+
+					CountFrees (AS_LINKS, inner_text_size);
+					FreeCopiedString (inner_text_s);
+				}
+
+		}
+
+	return success_flag;
+}
+
+
+/*
+ * If there is a title selector, the page is indexed first so that
+ * neither selector needs to walk the whole DOM.
+ */
+static bool SelectLinksAndTitles (const tree <htmlcxx :: HTML :: Node> &dom_r, const char * const link_selector_s, const char * const title_selector_s, vector <hcxselect :: Node *> &links_r, NodeSet &titles_r, bool *titles_flag_p)
+{
+	const bool titles_flag = (title_selector_s != NULL) && (*title_selector_s != '\0');
+	DomIndex *index_p = NULL;
+	size_t index_size = 0;
+	size_t num_index_allocations = 0;
+	bool success_flag = false;
+
+	if (titles_flag)
+		{
+			try
+				{
+					index_p = new DomIndex (dom_r);
+					index_size = index_p -> GetMemoryUsage (&num_index_allocations);
+					CountAllocations (AS_SELECTORS, num_index_allocations, index_size);
+				}
+			catch (...)
+				{
+					PrintErrors (STM_LEVEL_WARNING, __FILE__, __LINE__, "Failed to index page, running selectors over the whole page");
+				}
+		}
+
+	if (SelectNodes (dom_r, index_p, link_selector_s, links_r))
+		{
+			success_flag = true;
+
+			if (titles_flag)
+				{
+					vector <hcxselect :: Node *> title_nodes;
+
+					success_flag = false;
+
+					if (SelectNodes (dom_r, index_p, title_selector_s, title_nodes))
+						{
+							try
+								{
+									titles_r.insert (title_nodes.begin (), title_nodes.end ());
+									success_flag = true;
+								}
+							catch (...)
+								{
+									PrintErrors (STM_LEVEL_SEVERE, __FILE__, __LINE__, "Failed to store matches for '%s'", title_selector_s);
+								}
+						}
+				}
+		}
+
+	if (index_p)
+		{
+			delete index_p;
+			CountFrees (AS_SELECTORS, index_size);
+		}
+
+	*titles_flag_p = titles_flag;
+
+	return success_flag;
+}
+
+
+static const hcxselect :: Node *FindTitleNode (const hcxselect :: Node *link_p, const NodeSet &titles_r)
+{
+	const hcxselect :: Node *node_p = link_p;
+
+	while (node_p)
+		{
+			if (titles_r.count (node_p) > 0)
+				{
+					return node_p;
+				}
+
+			node_p = node_p -> parent;
+		}
+
+	/* Walk the link's descendants in document order */
+	node_p = link_p -> first_child;
+
+	while (node_p)
+		{
+			if (titles_r.count (node_p) > 0)
+				{
+					return node_p;
+				}
+
+			if (node_p -> first_child)
+				{
+					node_p = node_p -> first_child;
+				}
+			else
+				{
+					while ((node_p != link_p) && (node_p -> next_sibling == NULL))
+						{
+							node_p = node_p -> parent;
+						}
+
+					node_p = (node_p != link_p) ? node_p -> next_sibling : NULL;
+				}
+		}
+
+	return NULL;
+}
+
+
+/*
+ * Run a selector using the compiled matchers if possible and falling
+ * back to hcxselect if not.
+ */
+static bool SelectNodes (const tree <htmlcxx :: HTML :: Node> &dom_r, const DomIndex *index_p, const char *selector_s, vector <hcxselect :: Node *> &matches_r)
+{
+	bool success_flag = false;
+	const PreparedSelector *prepared_p = GetPreparedSelector (selector_s);
+
+	if (prepared_p && (prepared_p -> ps_compiled_p))
+		{
+			try
+				{
+					prepared_p -> ps_compiled_p -> Select (dom_r, index_p, matches_r);
+					success_flag = true;
+				}
+			catch (...)
+				{
+					PrintErrors (STM_LEVEL_SEVERE, __FILE__, __LINE__, "Error selecting '%s'\n", selector_s);
+				}
+		}
+	else if ((prepared_p == NULL) || (prepared_p -> ps_valid_flag))
+		{
+			try
+				{
+					hcxselect :: Selector s (dom_r);
+
+					s = s.select (selector_s);
+					matches_r.assign (s.begin (), s.end ());
+					success_flag = true;
+				}
+			catch (hcxselect::ParseException &ex)
+				{
+					PrintErrors (STM_LEVEL_SEVERE, __FILE__, __LINE__, "Parse error on '%s' - %s\n", selector_s, ex.what ());
+				}
+			catch (...)
+				{
+					PrintErrors (STM_LEVEL_SEVERE, __FILE__, __LINE__, "Error parsing '%s'\n", selector_s);
+				}
+		}
+
+	return success_flag;
+}
+
+
+/*
+ * Get the prepared version of a selector, checking and compiling it the
+ * first time that it is seen.
+ */
+static const PreparedSelector *GetPreparedSelector (const char *selector_s)
+{
+	PreparedSelector prepared;
+
+	{
+		lock_guard <mutex> guard (s_prepared_selectors_lock);
+		unordered_map <string, PreparedSelector> :: const_iterator it = s_prepared_selectors.find (selector_s);
+
+		if (it != s_prepared_selectors.end ())
+			{
+				return & (it -> second);
+			}
+	}
+
+	/* Do the work without holding the lock so that selectors can be prepared in parallel */
+	prepared.ps_compiled_p.reset (CompileSelector (selector_s));
+	prepared.ps_anchor_steps_p.reset (GetAnchorSelectorSteps (selector_s));
+	prepared.ps_valid_flag = (prepared.ps_compiled_p != NULL) || IsValidGeneralSelector (selector_s);
+
+	try
+		{
+			lock_guard <mutex> guard (s_prepared_selectors_lock);
+
+			/* If another thread got there first, its version is kept */
+			return & (s_prepared_selectors.emplace (selector_s, move (prepared)).first -> second);
+		}
+	catch (...)
+		{
+			PrintErrors (STM_LEVEL_WARNING, __FILE__, __LINE__, "Failed to store prepared selector '%s'", selector_s);
+		}
+
+	return NULL;
+}
+
+
+/*
+ * Check that hcxselect can parse a selector that is too complex for
+ * CompileSelector by running it over an empty page.
+ */
+static bool IsValidGeneralSelector (const char *selector_s)
+{
+	try
+		{
+			ParserDom parser;
+			const tree <htmlcxx :: HTML :: Node> &dom = parser.parseTree ("<html></html>");
+			hcxselect :: Selector s (dom);
+
+			s.select (selector_s);
+
+			return true;
+		}
+	catch (hcxselect::ParseException &ex)
+		{
+			PrintErrors (STM_LEVEL_SEVERE, __FILE__, __LINE__, "Parse error on '%s' - %s\n", selector_s, ex.what ());
+		}
+	catch (...)
+		{
+			PrintErrors (STM_LEVEL_SEVERE, __FILE__, __LINE__, "Error parsing '%s'\n", selector_s);
+		}
+
+	return false;
+}
+
+
+DomIndex :: DomIndex (const tree <htmlcxx :: HTML :: Node> &dom_r)
+{
+	static const char * const S_NAMES_SS [] = { "class", "id" };
+
+	for (tree <htmlcxx :: HTML :: Node> :: iterator it = dom_r.begin (); it != dom_r.end (); ++ it)
+		{
+			hcxselect :: Node *node_p = it.node;
+			const htmlcxx :: HTML :: Node &html_node_r = node_p -> data;
+
+			if (html_node_r.isTag () && (!html_node_r.tagName ().empty ()))
+				{
+					const string &tag_r = html_node_r.text ();
+					AttributeValue values [2];
+
+					di_tags [GetLowerCaseString (html_node_r.tagName ())].push_back (node_p);
+
+					GetTagAttributes (tag_r.data (), tag_r.length (), S_NAMES_SS, values, 2);
+
+					if (values [0].av_value_p)
+						{
+							const char *token_p = values [0].av_value_p;
+							const char * const end_p = token_p + values [0].av_length;
+
+							while (token_p < end_p)
+								{
+									const char *token_end_p;
+
+									while ((token_p < end_p) && isspace ((unsigned char) *token_p))
+										{
+											++ token_p;
+										}
+
+									token_end_p = token_p;
+
+									while ((token_end_p < end_p) && (!isspace ((unsigned char) *token_end_p)))
+										{
+											++ token_end_p;
+										}
+
+									if (token_end_p > token_p)
+										{
+											vector <hcxselect :: Node *> &nodes_r = di_classes [string (token_p, token_end_p - token_p)];
+
+											/* Don't add the node twice if it repeats a class */
+											if (nodes_r.empty () || (nodes_r.back () != node_p))
+												{
+													nodes_r.push_back (node_p);
+												}
+										}
+
+									token_p = token_end_p;
+								}
+						}
+
+					if (values [1].av_value_p)
 						{
-							PrintErrors (STM_LEVEL_SEVERE, __FILE__, __LINE__, "Failed to copy %s", uri_s);
+							di_ids [string (values [1].av_value_p, values [1].av_length)].push_back (node_p);
 						}
-				}		/* if ((strcmp ("http://", uri_s) == 0) || (strcmp ("http://", uri_s) == 0)) */
+				}
+		}
+}
+
+
+const vector <hcxselect :: Node *> *DomIndex :: GetCandidates (const SelectorStep &step_r) const
+{
+	const vector <hcxselect :: Node *> *candidates_p = NULL;
+
+	if (!step_r.ss_id.empty ())
+		{
+			candidates_p = GetNodeList (di_ids, step_r.ss_id);
+		}
+
+	for (vector <string> :: const_iterator it = step_r.ss_classes.begin (); it != step_r.ss_classes.end (); ++ it)
+		{
+			const vector <hcxselect :: Node *> *nodes_p = GetNodeList (di_classes, *it);
+
+			if ((candidates_p == NULL) || (nodes_p -> size () < candidates_p -> size ()))
+				{
+					candidates_p = nodes_p;
+				}
+		}
+
+	if (!step_r.ss_tag.empty ())
+		{
+			const vector <hcxselect :: Node *> *nodes_p = GetNodeList (di_tags, GetLowerCaseString (step_r.ss_tag));
+
+			if ((candidates_p == NULL) || (nodes_p -> size () < candidates_p -> size ()))
+				{
+					candidates_p = nodes_p;
+				}
+		}
+
+	return candidates_p;
+}
+
+
+size_t DomIndex :: GetMemoryUsage (size_t *num_allocations_p) const
+{
+	*num_allocations_p = 0;
+
+	return GetNodeListsMemoryUsage (di_tags, num_allocations_p) + GetNodeListsMemoryUsage (di_classes, num_allocations_p) + GetNodeListsMemoryUsage (di_ids, num_allocations_p);
+}
+
+
+/*
+ * Each entry is a node holding the key and vector, along with any heap
+ * storage for each of them, and the buckets are a single array.
+ */
+size_t DomIndex :: GetNodeListsMemoryUsage (const NodeLists &lists_r, size_t *num_allocations_p)
+{
+	size_t num_allocations = 1;
+	size_t num_bytes = lists_r.bucket_count () * sizeof (void *);
+
+	for (NodeLists :: const_iterator it = lists_r.begin (); it != lists_r.end (); ++ it)
+		{
+			++ num_allocations;
+			num_bytes += sizeof (void *) + sizeof (NodeLists :: value_type);
+
+			AddStringAllocation (it -> first, &num_allocations, &num_bytes);
+
+			if (it -> second.capacity () > 0)
+				{
+					++ num_allocations;
+					num_bytes += it -> second.capacity () * sizeof (hcxselect :: Node *);
+				}
+		}
+
+	*num_allocations_p += num_allocations;
+
+	return num_bytes;
+}
+
+
+const vector <hcxselect :: Node *> *DomIndex :: GetNodeList (const NodeLists &lists_r, const string &key_r) const
+{
+	NodeLists :: const_iterator it = lists_r.find (key_r);
+
+	return (it != lists_r.end ()) ? & (it -> second) : &di_no_nodes;
+}
+
+
+/*
+ * If a selector is a simple chain that ends in an "a" step, get its
+ * steps for the AnchorScanner.
+ */
+static vector <SelectorStep> *GetAnchorSelectorSteps (const char *selector_s)
+{
+	vector <SelectorStep> *steps_p = new (nothrow) vector <SelectorStep>;
+
+	if (steps_p)
+		{
+			try
+				{
+					if (ParseSimpleSelector (selector_s, *steps_p) && (strcasecmp (steps_p -> back ().ss_tag.c_str (), "a") == 0))
+						{
+							return steps_p;
+						}
+				}
+			catch (...)
+				{
+					/* Just use the DOM for this selector */
+				}
+
+			delete steps_p;
+		}
+
+	return NULL;
+}
+
+
+/*
+ * Get the steps to give to an AnchorScanner if it can find the links for
+ * the given selectors. Since the titles are matched against the DOM,
+ * there must not be a title selector.
+ */
+static const vector <SelectorStep> *GetAnchorLinkSteps (const char *link_selector_s, const char *title_selector_s)
+{
+	if ((title_selector_s == NULL) || (*title_selector_s == '\0'))
+		{
+			const PreparedSelector *prepared_p = GetPreparedSelector (link_selector_s);
+
+			if (prepared_p)
+				{
+					return prepared_p -> ps_anchor_steps_p.get ();
+				}
+		}
+
+	return NULL;
+}
+
+
+static ScanStatus ScanAnchors (AnchorScanner &scanner_r, const vector <SelectorStep> &steps_r, vector <const ScannedElement *> &links_r)
+{
+	try
+		{
+			scanner_r.Scan ();
+			scanner_r.SelectLinks (steps_r, links_r);
+
+			return SS_OK;
+		}
+	catch (const length_error &)
+		{
+			return SS_TOO_MANY_NODES;
+		}
+	catch (...)
+		{
+			PrintErrors (STM_LEVEL_WARNING, __FILE__, __LINE__, "Failed to scan page for links, building its DOM instead");
+		}
+
+	return SS_FAILED;
+}
+
+
+const size_t AnchorScanner :: S_NO_ELEMENT;
+
+
+AnchorScanner :: AnchorScanner (const char *data_s, const size_t data_length, const size_t max_nodes)
+	: as_data_s (data_s), as_end_p (data_s + data_length), as_max_nodes (max_nodes), as_num_nodes (0), as_literal_s (NULL)
+{
+}
+
+
+/*
+ * This follows htmlcxx's ParserSax :: parse, calling CountNode wherever
+ * it would create a node, so that the page is split up in exactly the
+ * same way.
+ */
+void AnchorScanner :: Scan ()
+{
+	const char *text_p = as_data_s;
+	const char *current_p = as_data_s;
+
+	as_open_elements.reserve (64);
+
+	while (current_p < as_end_p)
+		{
+			const char *markup_p;
+
+			if (as_literal_s)
+				{
+					markup_p = FindLiteralTextEnd (current_p);
+
+					if (!markup_p)
+						{
+							/* The rest of the page is the element's text */
+							if (text_p < as_end_p)
+								{
+									CountNode ();
+								}
+
+							return;
+						}
+
+					if (markup_p > text_p)
+						{
+							CountNode ();
+						}
+
+					as_literal_s = NULL;
+					text_p = markup_p;
+					current_p = markup_p;
+				}
+
+			markup_p = (const char *) memchr (current_p, '<', as_end_p - current_p);
+
+			if (markup_p)
+				{
+					const char next = (markup_p + 1 < as_end_p) ? markup_p [1] : '\0';
+
+					if (isalpha ((unsigned char) next) || (next == '/') || (next == '!') || (next == '?') || (next == '%'))
+						{
+							/* Any text before the markup is a node of its own */
+							if (markup_p > text_p)
+								{
+									CountNode ();
+								}
+
+							current_p = ScanMarkup (markup_p);
+							text_p = current_p;
+						}
+					else
+						{
+							/* A '<' that is just text */
+							current_p = markup_p + 1;
+						}
+				}
+			else
+				{
+					current_p = as_end_p;
+				}
+		}
+
+	if (current_p > text_p)
+		{
+			CountNode ();
+		}
+}
+
+
+void AnchorScanner :: SelectLinks (const vector <SelectorStep> &steps_r, vector <const ScannedElement *> &links_r) const
+{
+	links_r.reserve (as_anchors.size ());
+
+	for (vector <size_t> :: const_iterator it = as_anchors.begin (); it != as_anchors.end (); ++ it)
+		{
+			const ScannedElement &element_r = as_elements [*it];
+
+			if (MatchesStep (steps_r.back (), element_r) && MatchesAncestors (steps_r, element_r, steps_r.size () - 1))
+				{
+					links_r.push_back (&element_r);
+				}
+		}
+}
+
+
+size_t AnchorScanner :: GetMemoryUsage () const
+{
+	return (as_elements.capacity () * sizeof (ScannedElement)) + ((as_open_elements.capacity () + as_anchors.capacity ()) * sizeof (size_t));
+}
+
+
+/*
+ * Process the tag, comment or other markup that starts at the given '<'
+ * and return the end of it.
+ */
+const char *AnchorScanner :: ScanMarkup (const char *markup_p)
+{
+	const char *name_p = markup_p + 1;
+	const char *end_p;
+
+	if (isalpha ((unsigned char) *name_p))
+		{
+			end_p = SkipTag (name_p);
+			OpenElement (markup_p, end_p);
+		}
+	else if (*name_p == '/')
+		{
+			end_p = SkipTag (name_p);
+
+			if ((name_p + 1 < as_end_p) && isalpha ((unsigned char) name_p [1]))
+				{
+					CloseElement (markup_p, end_p);
+				}
 			else
 				{
-					if (*uri_s == '/')
+					/* htmlcxx treats this as a comment as Mozilla does */
+					CountNode ();
+				}
+		}
+	else
+		{
+			/* A comment or something like <?xml or <%VBSCRIPT */
+			if ((*name_p == '!') && (name_p + 2 < as_end_p) && (name_p [1] == '-') && (name_p [2] == '-'))
+				{
+					end_p = SkipComment (name_p + 3);
+				}
+			else
+				{
+					end_p = SkipTag (name_p);
+				}
+
+			CountNode ();
+		}
+
+	return end_p;
+}
+
+
+/*
+ * Find the end of a tag, skipping over any quoted attribute values, and
+ * return the position just after its '>'.
+ */
+const char *AnchorScanner :: SkipTag (const char *current_p) const
+{
+	while ((current_p < as_end_p) && (*current_p != '>'))
+		{
+			if (*current_p != '=')
+				{
+					++ current_p;
+				}
+			else
+				{
+					++ current_p;
+
+					while ((current_p < as_end_p) && isspace ((unsigned char) *current_p))
+						{
+							++ current_p;
+						}
+
+					if (current_p == as_end_p)
+						{
+							break;
+						}
+
+					if ((*current_p == '"') || (*current_p == '\''))
+						{
+							const char *quote_p = (const char *) memchr (current_p + 1, *current_p, as_end_p - current_p - 1);
+
+							/* An unterminated value is just skipped over as text */
+							current_p = quote_p ? quote_p + 1 : current_p + 1;
+						}
+				}
+		}
+
+	if (current_p < as_end_p)
+		{
+			++ current_p;
+		}
+
+	return current_p;
+}
+
+
+/*
+ * Find the end of a comment that starts just after the given "<!--". As
+ * in htmlcxx, the closing "--" can be followed by whitespace before the '>'.
+ */
+const char *AnchorScanner :: SkipComment (const char *current_p) const
+{
+	while (current_p < as_end_p)
+		{
+			if ((*current_p ++ == '-') && (current_p < as_end_p) && (*current_p == '-'))
+				{
+					const char *dash_p = current_p;
+
+					while ((++ current_p < as_end_p) && isspace ((unsigned char) *current_p))
+						{
+						}
+
+					if ((current_p == as_end_p) || (*current_p ++ == '>'))
+						{
+							break;
+						}
+
+					current_p = dash_p;
+				}
+		}
+
+	return current_p;
+}
+
+
+/*
+ * Find the '<' of the closing tag of the element whose text is being
+ * treated as literal text, skipping any comments in it. Returns NULL if
+ * the text runs to the end of the page, which it always does for plaintext.
+ */
+const char *AnchorScanner :: FindLiteralTextEnd (const char *current_p) const
+{
+	const bool closable_flag = (strcmp (as_literal_s, "plaintext") != 0);
+
+	while ((current_p = (const char *) memchr (current_p, '<', as_end_p - current_p)) != NULL)
+		{
+			const char *tag_p = current_p ++;
+
+			if ((current_p < as_end_p) && (*current_p == '/'))
+				{
+					const char *name_p = as_literal_s;
+
+					++ current_p;
+
+					while ((*name_p != '\0') && (current_p < as_end_p) && (tolower ((unsigned char) *current_p) == *name_p))
 						{
-							/* skip past the "://" in the base uri */
-							const char delim_s [] = "://";
-							const char *slash_p = strstr (base_uri_s, delim_s);
+							++ current_p;
+							++ name_p;
+						}
 
-							if (slash_p)
+					if ((*name_p == '\0') && closable_flag)
+						{
+							while ((current_p < as_end_p) && isspace ((unsigned char) *current_p))
 								{
-									slash_p += strlen (delim_s);
+									++ current_p;
 								}
-							else
+
+							if ((current_p < as_end_p) && (*current_p == '>'))
 								{
-									slash_p = base_uri_s;
+									return tag_p;
 								}
+						}
+				}
+			else if ((current_p + 2 < as_end_p) && (*current_p == '!') && (current_p [1] == '-') && (current_p [2] == '-'))
+				{
+					current_p = SkipComment (current_p + 3);
+				}
+		}
 
-							/* Now find the next slash and append our uri to it */
-							slash_p = strchr (slash_p, '/');
+	return NULL;
+}
 
-							if (slash_p)
-								{
-									char *root_s = CopyToNewString (base_uri_s, slash_p - base_uri_s, false);
 
-									if (root_s)
-										{
-											value_s = ConcatenateStrings (root_s, uri_s);
-											FreeCopiedString (root_s);
-										}		/* if (root_s) */
+void AnchorScanner :: OpenElement (const char *tag_p, const char *tag_end_p)
+{
+	const char *name_p = tag_p + 1;
+	const char *name_end_p = name_p;
+	ScannedElement element;
 
-								}		/* if (slash_p) */
+	while ((name_end_p < tag_end_p) && isalnum ((unsigned char) *name_end_p))
+		{
+			++ name_end_p;
+		}
 
-						} 	/* if (*uri_s == '/') */
-					else
+	CountNode ();
+
+	element.se_offset = tag_p - as_data_s;
+	element.se_tag_length = tag_end_p - tag_p;
+	element.se_length = element.se_tag_length;
+	element.se_parent = as_open_elements.empty () ? S_NO_ELEMENT : as_open_elements.back ();
+	element.se_name_length = (uint32) (name_end_p - name_p);
+	element.se_flattened_flag = false;
+
+	as_elements.push_back (element);
+	as_open_elements.push_back (as_elements.size () - 1);
+
+	if ((element.se_name_length == 1) && (tolower ((unsigned char) *name_p) == 'a'))
+		{
+			as_anchors.push_back (as_elements.size () - 1);
+		}
+
+	for (const char * const *literal_ss = S_LITERAL_ELEMENTS_SS; *literal_ss; ++ literal_ss)
+		{
+			if ((strlen (*literal_ss) == element.se_name_length) && (strncasecmp (*literal_ss, name_p, element.se_name_length) == 0))
+				{
+					as_literal_s = *literal_ss;
+					break;
+				}
+		}
+}
+
+
+/*
+ * As in ParserDom, a closing tag closes the innermost open element with
+ * the same name and flattens any that are open inside it. If there isn't
+ * one, ParserDom keeps the tag as a comment, which LimitedParserDom
+ * doesn't count.
+ */
+void AnchorScanner :: CloseElement (const char *tag_p, const char *tag_end_p)
+{
+	const char *name_p = tag_p + 2;
+	const char *name_end_p = name_p;
+	size_t name_length;
+	size_t i = as_open_elements.size ();
+
+	while ((name_end_p < tag_end_p) && isalnum ((unsigned char) *name_end_p))
+		{
+			++ name_end_p;
+		}
+
+	name_length = name_end_p - name_p;
+
+	while (i > 0)
+		{
+			ScannedElement &element_r = as_elements [as_open_elements [-- i]];
+
+			if ((element_r.se_name_length == name_length) && (strncasecmp (as_data_s + element_r.se_offset + 1, name_p, name_length) == 0))
+				{
+					element_r.se_length = (tag_end_p - as_data_s) - element_r.se_offset;
+
+					for (size_t j = i + 1; j < as_open_elements.size (); ++ j)
 						{
-							const char *last_slash_p = strrchr (base_uri_s, '/');
+							as_elements [as_open_elements [j]].se_flattened_flag = true;
+						}
 
-							if (last_slash_p)
-								{
-									char *root_path_s = CopyToNewString (base_uri_s, last_slash_p - base_uri_s + 1, false);
+					as_open_elements.resize (i);
+					break;
+				}
+		}
+}
 
-									if (root_path_s)
-										{
-											value_s = ConcatenateStrings (root_path_s, uri_s);
-											FreeCopiedString (root_path_s);
-										}
 
-								}		/* if (last_slash_p) */
+void AnchorScanner :: CountNode ()
+{
+	if ((as_max_nodes > 0) && (as_num_nodes >= as_max_nodes))
+		{
+			throw length_error ("too many nodes");
+		}
+
+	++ as_num_nodes;
+}
+
+
+/*
+ * Get the element's parent in the DOM, which is the nearest element that
+ * it was opened in that wasn't later flattened.
+ */
+const ScannedElement *AnchorScanner :: GetParent (const ScannedElement &element_r) const
+{
+	size_t parent = element_r.se_parent;
+
+	while ((parent != S_NO_ELEMENT) && (as_elements [parent].se_flattened_flag))
+		{
+			parent = as_elements [parent].se_parent;
+		}
+
+	return (parent != S_NO_ELEMENT) ? & (as_elements [parent]) : NULL;
+}
+
+
+bool AnchorScanner :: MatchesStep (const SelectorStep &step_r, const ScannedElement &element_r) const
+{
+	const char *tag_p = as_data_s + element_r.se_offset;
+
+	if ((!step_r.ss_tag.empty ()) && ((step_r.ss_tag.length () != element_r.se_name_length) || (strncasecmp (tag_p + 1, step_r.ss_tag.data (), element_r.se_name_length) != 0)))
+		{
+			return false;
+		}
+
+	if ((!step_r.ss_classes.empty ()) || (!step_r.ss_id.empty ()))
+		{
+			return MatchesClassesAndId (step_r, tag_p, element_r.se_tag_length, !step_r.ss_classes.empty (), !step_r.ss_id.empty ());
+		}
+
+	return true;
+}
+
+
+/*
+ * The same as the DOM version of MatchesAncestors, but walking up through
+ * the scanned elements.
+ */
+bool AnchorScanner :: MatchesAncestors (const vector <SelectorStep> &steps_r, const ScannedElement &element_r, const size_t step_index) const
+{
+	if (step_index > 0)
+		{
+			const SelectorStep &step_r = steps_r [step_index - 1];
+			const bool child_flag = steps_r [step_index].ss_child_flag;
+			const ScannedElement *parent_p = GetParent (element_r);
+
+			while (parent_p)
+				{
+					if (MatchesStep (step_r, *parent_p) && MatchesAncestors (steps_r, *parent_p, step_index - 1))
+						{
+							return true;
+						}
 
+					if (child_flag)
+						{
+							break;
 						}
 
+					parent_p = GetParent (*parent_p);
 				}
 
-		}		/* if (base_uri_s) */
-	else
+			return false;
+		}
+
+	return true;
+}
+
+
+static string GetLowerCaseString (const string &value_r)
+{
+	string lower (value_r);
+
+	for (string :: iterator it = lower.begin (); it != lower.end (); ++ it)
 		{
-			value_s = EasyCopyToNewString (uri_s);
+			*it = (char) tolower ((unsigned char) *it);
+		}
 
-			if (!value_s)
+	return lower;
+}
+
+
+/*
+ * Strings that are short enough to fit in the string object itself
+ * don't allocate anything.
+ */
+static void AddStringAllocation (const string &value_r, size_t *num_allocations_p, size_t *num_bytes_p)
+{
+	static const size_t S_INLINE_CAPACITY = string ().capacity ();
+
+	if (value_r.capacity () > S_INLINE_CAPACITY)
+		{
+			++ (*num_allocations_p);
+			*num_bytes_p += value_r.capacity () + 1;
+		}
+}
+
+
+static size_t GetHtmlLinkSize (const HtmlLink *link_p, size_t *num_allocations_p)
+{
+	const char * const values_ss [] = { link_p -> hl_uri_s, link_p -> hl_title_s, link_p -> hl_data_s };
+	size_t num_bytes = 0;
+
+	*num_allocations_p = 0;
+
+	for (size_t i = 0; i < sizeof (values_ss) / sizeof (values_ss [0]); ++ i)
+		{
+			if (values_ss [i])
 				{
-					PrintErrors (STM_LEVEL_SEVERE, __FILE__, __LINE__, "Failed to copy %s", uri_s);
+					++ (*num_allocations_p);
+					num_bytes += strlen (values_ss [i]) + 1;
 				}
 		}
 
+	return num_bytes;
+}
 
-	link_p -> hl_uri_s = NULL;
-	link_p -> hl_data_s = NULL;
-	link_p -> hl_title_s = NULL;
 
-	if (value_s)
+/*
+ * jansson's value structs are private so these are the sizes of them
+ * on a 64-bit build. Every value is one allocation, strings have a
+ * second for their text, objects have one for their hashtable buckets
+ * and one for each member with its key, and arrays have one for their
+ * storage.
+ */
+static void CountJSONAllocations (const json_t *value_p)
+{
+	static const size_t S_JSON_VALUE_SIZE = 32;
+	static const size_t S_JSON_MEMBER_SIZE = 48;
+
+	size_t num_allocations = 1;
+	size_t num_bytes = S_JSON_VALUE_SIZE;
+
+	switch (json_typeof (value_p))
 		{
-			link_p -> hl_uri_s = value_s;
+			case JSON_STRING:
+				++ num_allocations;
+				num_bytes += json_string_length (value_p) + 1;
+				break;
 
-			value_s = EasyCopyToNewString (data_s);
+			case JSON_OBJECT:
+				{
+					const char *key_s;
+					json_t *member_p;
 
-			if (value_s)
+					++ num_allocations;
+					num_bytes += json_object_size (value_p) * 2 * sizeof (void *);
+
+					json_object_foreach ((json_t *) value_p, key_s, member_p)
+						{
+							++ num_allocations;
+							num_bytes += S_JSON_MEMBER_SIZE + strlen (key_s) + 1;
+
+							CountJSONAllocations (member_p);
+						}
+				}
+				break;
+
+			case JSON_ARRAY:
 				{
-					link_p -> hl_data_s = value_s;
+					size_t i;
 
-					link_p -> hl_title_s = NULL;
+					++ num_allocations;
+					num_bytes += json_array_size (value_p) * sizeof (json_t *);
 
-					if (title_s)
+					for (i = 0; i < json_array_size (value_p); ++ i)
 						{
-							value_s = EasyCopyToNewString (title_s);
+							CountJSONAllocations (json_array_get (value_p, i));
+						}
+				}
+				break;
 
-							if (value_s)
+			default:
+				break;
+		}
+
+	CountAllocations (AS_JSON, num_allocations, num_bytes);
+}
+
+
+/*
+ * Decode the entity at the given position, returning the number of bytes
+ * that it takes up or 0 if it isn't a valid entity. Numeric references
+ * that aren't valid code points become U+FFFD as per the HTML specification.
+ */
+static size_t DecodeEntity (const char *entity_p, const char *limit_p, uint32 *code_point_p)
+{
+	const char *current_p = entity_p + 1;
+
+	if ((current_p < limit_p) && (*current_p == '#'))
+		{
+			uint32 code_point = 0;
+			uint32 base = 10;
+			const char *digits_p;
+
+			++ current_p;
+
+			if ((current_p < limit_p) && ((*current_p == 'x') || (*current_p == 'X')))
+				{
+					base = 16;
+					++ current_p;
+				}
+
+			digits_p = current_p;
+
+			while ((current_p < limit_p) && (base == 16 ? isxdigit ((unsigned char) *current_p) : isdigit ((unsigned char) *current_p)))
+				{
+					const char c = *current_p;
+					const uint32 digit = isdigit ((unsigned char) c) ? (uint32) (c - '0') : (uint32) (tolower ((unsigned char) c) - 'a' + 10);
+
+					/* Stop overflow whilst still consuming the digits */
+					if (code_point <= 0x10FFFF)
+						{
+							code_point = (code_point * base) + digit;
+						}
+
+					++ current_p;
+				}
+
+			if (current_p == digits_p)
+				{
+					return 0;
+				}
+
+			if ((code_point == 0) || (code_point > 0x10FFFF) || ((code_point >= 0xD800) && (code_point <= 0xDFFF)))
+				{
+					code_point = 0xFFFD;
+				}
+
+			/* The semicolon is optional for numeric references */
+			if ((current_p < limit_p) && (*current_p == ';'))
+				{
+					++ current_p;
+				}
+
+			*code_point_p = code_point;
+
+			return current_p - entity_p;
+		}
+	else
+		{
+			const char *name_p = current_p;
+			size_t name_length;
+
+			while ((current_p < limit_p) && isalnum ((unsigned char) *current_p) && (current_p - name_p <= MAX_ENTITY_NAME_LENGTH))
+				{
+					++ current_p;
+				}
+
+			name_length = current_p - name_p;
+
+			if ((name_length > 0) && (name_length <= MAX_ENTITY_NAME_LENGTH) && (current_p < limit_p) && (*current_p == ';'))
+				{
+					size_t low = 0;
+					size_t high = sizeof (S_NAMED_ENTITIES) / sizeof (S_NAMED_ENTITIES [0]);
+
+					while (low < high)
+						{
+							const size_t mid = (low + high) / 2;
+							const char *entity_name_s = S_NAMED_ENTITIES [mid].ne_name_s;
+							int res = strncmp (name_p, entity_name_s, name_length);
+
+							if ((res == 0) && (entity_name_s [name_length] != '\0'))
 								{
-									link_p -> hl_title_s = value_s;
+									res = -1;
+								}
+
+							if (res == 0)
+								{
+									*code_point_p = S_NAMED_ENTITIES [mid].ne_code_point;
+
+									return name_length + 2;
+								}
+							else if (res < 0)
+								{
+									high = mid;
+								}
+							else
+								{
+									low = mid + 1;
 								}
 						}
+				}
+		}
 
-					return true;
+	return 0;
+}
+
+
+/*
+ * Get the length of the UTF-8 encoded Unicode whitespace character at the
+ * given position or 0 if there isn't one.
+ */
+static size_t GetUnicodeSpaceLength (const unsigned char *text_p, const unsigned char *limit_p)
+{
+	const size_t available = limit_p - text_p;
+
+	if ((available >= 2) && (text_p [0] == 0xC2) && (text_p [1] == 0xA0))
+		{
+			return 2;
+		}
+
+	if (available >= 3)
+		{
+			uint32 code_point;
+
+			if (((text_p [0] & 0xF0) != 0xE0) || ((text_p [1] & 0xC0) != 0x80) || ((text_p [2] & 0xC0) != 0x80))
+				{
+					return 0;
 				}
 
-			FreeCopiedString (link_p -> hl_uri_s);
-			link_p -> hl_uri_s = NULL;
+			code_point = ((text_p [0] & 0x0F) << 12) | ((text_p [1] & 0x3F) << 6) | (text_p [2] & 0x3F);
+
+			if (IsUnicodeSpace (code_point))
+				{
+					return 3;
+				}
 		}
 
-	return false;
+	return 0;
+}
+
+
+static bool IsUnicodeSpace (const uint32 code_point)
+{
+	switch (code_point)
+		{
+			case 0x0009:
+			case 0x000A:
+			case 0x000B:
+			case 0x000C:
+			case 0x000D:
+			case 0x0020:
+			case 0x00A0:
+			case 0x1680:
+			case 0x2028:
+			case 0x2029:
+			case 0x202F:
+			case 0x205F:
+			case 0x3000:
+				return true;
+
+			default:
+				return ((code_point >= 0x2000) && (code_point <= 0x200A));
+		}
+}
+
+
+static bool AppendCodePoint (ByteBuffer *buffer_p, const uint32 code_point, size_t *length_p)
+{
+	char utf8 [4];
+	size_t utf8_length;
+
+	if (code_point < 0x80)
+		{
+			utf8 [0] = (char) code_point;
+			utf8_length = 1;
+		}
+	else if (code_point < 0x800)
+		{
+			utf8 [0] = (char) (0xC0 | (code_point >> 6));
+			utf8 [1] = (char) (0x80 | (code_point & 0x3F));
+			utf8_length = 2;
+		}
+	else if (code_point < 0x10000)
+		{
+			utf8 [0] = (char) (0xE0 | (code_point >> 12));
+			utf8 [1] = (char) (0x80 | ((code_point >> 6) & 0x3F));
+			utf8 [2] = (char) (0x80 | (code_point & 0x3F));
+			utf8_length = 3;
+		}
+	else
+		{
+			utf8 [0] = (char) (0xF0 | (code_point >> 18));
+			utf8 [1] = (char) (0x80 | ((code_point >> 12) & 0x3F));
+			utf8 [2] = (char) (0x80 | ((code_point >> 6) & 0x3F));
+			utf8 [3] = (char) (0x80 | (code_point & 0x3F));
+			utf8_length = 4;
+		}
+
+	*length_p += utf8_length;
+
+	return AppendToByteBuffer (buffer_p, utf8, utf8_length);
 }
@@ -0,0 +1,449 @@
+/*
+** Copyright 2014-2016 The Earlham Institute
+**
+** Licensed under the Apache License, Version 2.0 (the "License");
+** you may not use this file except in compliance with the License.
+** You may obtain a copy of the License at
+**
+**     http://www.apache.org/licenses/LICENSE-2.0
+**
+** Unless required by applicable law or agreed to in writing, software
+** distributed under the License is distributed on an "AS IS" BASIS,
+** WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+** See the License for the specific language governing permissions and
+** limitations under the License.
+*/
+#include <ctype.h>
+#include <errno.h>
+#include <iconv.h>
+#include <string.h>
+#include <strings.h>
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+#include "web_search_charset.h"
+#include "memory_allocations.h"
+#include "streams.h"
+
+
+typedef enum PageCharset
+{
+	PC_UTF_8,
+	PC_WINDOWS_1252,
+
+	/* A character set whose bytes below 0x80 are always ASCII */
+	PC_ASCII_COMPATIBLE,
+
+	/* A character set such as UTF-16 or ISO-2022-JP whose pages can't be assumed to be ASCII */
+	PC_OTHER
+} PageCharset;
+
+
+/* The number of bytes at the start of a page to check for a meta charset */
+#define CHARSET_PRESCAN_LENGTH (1024)
+
+#define MAX_CHARSET_LABEL_LENGTH (40)
+
+
+/*
+ * The Unicode code points for bytes 0x80 - 0x9F in Windows-1252. The
+ * remaining bytes above 0x7F map to the code point with the same value.
+ */
+static const uint16 S_WINDOWS_1252_C1 [32] =
+{
+	0x20AC, 0x0081, 0x201A, 0x0192, 0x201E, 0x2026, 0x2020, 0x2021,
+	0x02C6, 0x2030, 0x0160, 0x2039, 0x0152, 0x008D, 0x017D, 0x008F,
+	0x0090, 0x2018, 0x2019, 0x201C, 0x201D, 0x2022, 0x2013, 0x2014,
+	0x02DC, 0x2122, 0x0161, 0x203A, 0x0153, 0x009D, 0x017E, 0x0178
+};
+
+
+/*
+ * STATIC PROTOTYPES
+ */
+
+static bool GetCharsetLabel (const char *data_s, const size_t length, const char *content_type_s, char *label_s);
+
+static bool CopyCharsetLabel (const char *value_s, const char *end_p, char *label_s);
+
+static PageCharset GetPageCharset (const char *label_s);
+
+static size_t GetASCIIPrefixLength (const char *data_s, const size_t length);
+
+static size_t CountNonASCIIBytes (const char *data_s, const size_t length);
+
+static char *ConvertWindows1252ToUTF8 (const char *data_s, const size_t length, const size_t ascii_length, size_t *converted_length_p);
+
+static char *ConvertWithIconv (const char *data_s, const size_t length, const char *label_s, size_t *converted_length_p);
+
+
+/*
+ * API FUNCTIONS
+ */
+
+char *ConvertPageToUTF8 (const char *data_s, const size_t length, const char *content_type_s, size_t *converted_length_p)
+{
+	char label_s [MAX_CHARSET_LABEL_LENGTH + 1];
+
+	if (GetCharsetLabel (data_s, length, content_type_s, label_s))
+		{
+			const PageCharset charset = GetPageCharset (label_s);
+
+			if (charset == PC_OTHER)
+				{
+					return ConvertWithIconv (data_s, length, label_s, converted_length_p);
+				}
+			else if (charset != PC_UTF_8)
+				{
+					const size_t ascii_length = GetASCIIPrefixLength (data_s, length);
+
+					/* A page that is pure ASCII is already valid UTF-8 */
+					if (ascii_length < length)
+						{
+							if (charset == PC_WINDOWS_1252)
+								{
+									return ConvertWindows1252ToUTF8 (data_s, length, ascii_length, converted_length_p);
+								}
+							else
+								{
+									return ConvertWithIconv (data_s, length, label_s, converted_length_p);
+								}
+						}
+				}
+		}
+
+	return NULL;
+}
+
+
+/*
+ * STATIC FUNCTIONS
+ */
+
+
+/*
+ * The Content-Type header takes precedence over anything in the page
+ * itself as per the HTML specification's encoding sniffing algorithm.
+ */
+static bool GetCharsetLabel (const char *data_s, const size_t length, const char *content_type_s, char *label_s)
+{
+	const char CHARSET_S [] = "charset";
+	const size_t charset_length = strlen (CHARSET_S);
+
+	if (content_type_s)
+		{
+			const char *value_p = content_type_s;
+			const char *end_p = content_type_s + strlen (content_type_s);
+
+			while (value_p + charset_length < end_p)
+				{
+					if (strncasecmp (value_p, CHARSET_S, charset_length) == 0)
+						{
+							if (CopyCharsetLabel (value_p + charset_length, end_p, label_s))
+								{
+									return true;
+								}
+						}
+
+					++ value_p;
+				}
+		}
+
+	if (length > charset_length)
+		{
+			const char *end_p = data_s + ((length < CHARSET_PRESCAN_LENGTH) ? length : CHARSET_PRESCAN_LENGTH);
+			const char *value_p = data_s;
+
+			while ((value_p = memchr (value_p, '<', end_p - value_p)) != NULL)
+				{
+					if ((end_p - value_p > 5) && (strncasecmp (value_p, "<meta", 5) == 0))
+						{
+							const char *tag_end_p = memchr (value_p, '>', end_p - value_p);
+
+							if (tag_end_p)
+								{
+									const char *attr_p = value_p + 5;
+
+									while (attr_p + charset_length < tag_end_p)
+										{
+											if (strncasecmp (attr_p, CHARSET_S, charset_length) == 0)
+												{
+													if (CopyCharsetLabel (attr_p + charset_length, tag_end_p, label_s))
+														{
+															return true;
+														}
+												}
+
+											++ attr_p;
+										}
+								}
+						}
+
+					++ value_p;
+				}
+		}
+
+	return false;
+}
+
+
+/* Copy the label from text of the form "= 'label'" */
+static bool CopyCharsetLabel (const char *value_s, const char *end_p, char *label_s)
+{
+	size_t i = 0;
+
+	while ((value_s < end_p) && isspace ((unsigned char) *value_s))
+		{
+			++ value_s;
+		}
+
+	if ((value_s < end_p) && (*value_s == '='))
+		{
+			++ value_s;
+
+			while ((value_s < end_p) && (isspace ((unsigned char) *value_s) || (*value_s == '"') || (*value_s == '\'')))
+				{
+					++ value_s;
+				}
+
+			while ((value_s < end_p) && (i < MAX_CHARSET_LABEL_LENGTH) && (isalnum ((unsigned char) *value_s) || (strchr ("-_.:", *value_s) != NULL)))
+				{
+					label_s [i ++] = *value_s ++;
+				}
+		}
+
+	label_s [i] = '\0';
+
+	return (i > 0);
+}
+
+
+/*
+ * As browsers do, the Latin-1 and ASCII labels are treated as
+ * Windows-1252 since that is what such pages almost always are.
+ */
+static PageCharset GetPageCharset (const char *label_s)
+{
+	static const char * const S_WINDOWS_1252_LABELS [] =
+	{
+		"windows-1252", "cp1252", "x-cp1252", "iso-8859-1", "iso8859-1", "iso_8859-1", "latin1", "l1",
+		"us-ascii", "ascii", "ansi_x3.4-1968", "cp819", "ibm819", NULL
+	};
+	/*
+	 * The single byte families plus the multibyte encodings whose lead and
+	 * trail bytes are all 0x80 or above, so a page without any such bytes
+	 * is ASCII.
+	 */
+	static const char * const S_ASCII_COMPATIBLE_PREFIXES [] =
+	{
+		"iso-8859-", "iso8859-", "iso_8859-", "windows-125", "cp125", "x-cp125", "koi8-", "macintosh", "x-mac-",
+		"euc-", "gbk", "gb2312", "gb18030", "big5", NULL
+	};
+	const char * const *windows_1252_label_ss = S_WINDOWS_1252_LABELS;
+	const char * const *prefix_ss = S_ASCII_COMPATIBLE_PREFIXES;
+
+	if ((strcasecmp (label_s, "utf-8") == 0) || (strcasecmp (label_s, "utf8") == 0) || (strcasecmp (label_s, "unicode-1-1-utf-8") == 0))
+		{
+			return PC_UTF_8;
+		}
+
+	while (*windows_1252_label_ss)
+		{
+			if (strcasecmp (label_s, *windows_1252_label_ss) == 0)
+				{
+					return PC_WINDOWS_1252;
+				}
+
+			++ windows_1252_label_ss;
+		}
+
+	while (*prefix_ss)
+		{
+			if (strncasecmp (label_s, *prefix_ss, strlen (*prefix_ss)) == 0)
+				{
+					return PC_ASCII_COMPATIBLE;
+				}
+
+			++ prefix_ss;
+		}
+
+	return PC_OTHER;
+}
+
+
+/*
+ * Find the length of the run of ASCII bytes at the start of the data,
+ * checking 16 bytes at a time where possible.
+ */
+static size_t GetASCIIPrefixLength (const char *data_s, const size_t length)
+{
+	size_t i = 0;
+
+#ifdef __SSE2__
+	while (i + 16 <= length)
+		{
+			const __m128i chunk = _mm_loadu_si128 ((const __m128i *) (data_s + i));
+			const int mask = _mm_movemask_epi8 (chunk);
+
+			if (mask != 0)
+				{
+					return i + __builtin_ctz (mask);
+				}
+
+			i += 16;
+		}
+#else
+	while (i + 8 <= length)
+		{
+			uint64 chunk;
+
+			memcpy (&chunk, data_s + i, sizeof (chunk));
+
+			if ((chunk & 0x8080808080808080ULL) != 0)
+				{
+					break;
+				}
+
+			i += 8;
+		}
+#endif
+
+	while ((i < length) && (((unsigned char) data_s [i]) < 0x80))
+		{
+			++ i;
+		}
+
+	return i;
+}
+
+
+static size_t CountNonASCIIBytes (const char *data_s, const size_t length)
+{
+	size_t count = 0;
+	size_t i = 0;
+
+#ifdef __SSE2__
+	while (i + 16 <= length)
+		{
+			const __m128i chunk = _mm_loadu_si128 ((const __m128i *) (data_s + i));
+
+			count += __builtin_popcount (_mm_movemask_epi8 (chunk));
+			i += 16;
+		}
+#endif
+
+	for ( ; i < length; ++ i)
+		{
+			if (((unsigned char) data_s [i]) >= 0x80)
+				{
+					++ count;
+				}
+		}
+
+	return count;
+}
+
+
+static char *ConvertWindows1252ToUTF8 (const char *data_s, const size_t length, const size_t ascii_length, size_t *converted_length_p)
+{
+	/* Each non-ASCII byte becomes at most 3 bytes of UTF-8 */
+	const size_t max_length = length + (2 * CountNonASCIIBytes (data_s + ascii_length, length - ascii_length));
+	char *converted_s = (char *) AllocMemory (max_length + 1);
+
+	if (converted_s)
+		{
+			const char *src_p = data_s + ascii_length;
+			const char * const end_p = data_s + length;
+			char *dest_p = converted_s + ascii_length;
+
+			memcpy (converted_s, data_s, ascii_length);
+
+			while (src_p < end_p)
+				{
+					const unsigned char c = (unsigned char) *src_p;
+
+					if (c < 0x80)
+						{
+							/* Copy the whole run of ASCII in one go */
+							const size_t run_length = GetASCIIPrefixLength (src_p, end_p - src_p);
+
+							memcpy (dest_p, src_p, run_length);
+							dest_p += run_length;
+							src_p += run_length;
+						}
+					else
+						{
+							const uint16 code_point = (c < 0xA0) ? S_WINDOWS_1252_C1 [c - 0x80] : c;
+
+							if (code_point < 0x800)
+								{
+									*dest_p ++ = (char) (0xC0 | (code_point >> 6));
+									*dest_p ++ = (char) (0x80 | (code_point & 0x3F));
+								}
+							else
+								{
+									*dest_p ++ = (char) (0xE0 | (code_point >> 12));
+									*dest_p ++ = (char) (0x80 | ((code_point >> 6) & 0x3F));
+									*dest_p ++ = (char) (0x80 | (code_point & 0x3F));
+								}
+
+							++ src_p;
+						}
+				}
+
+			*dest_p = '\0';
+			*converted_length_p = dest_p - converted_s;
+		}
+	else
+		{
+			PrintErrors (STM_LEVEL_WARNING, __FILE__, __LINE__, "Failed to allocate %lu bytes to convert page to UTF-8", (unsigned long) (max_length + 1));
+		}
+
+	return converted_s;
+}
+
+
+/* Any other character sets are left to iconv */
+static char *ConvertWithIconv (const char *data_s, const size_t length, const char *label_s, size_t *converted_length_p)
+{
+	char *converted_s = NULL;
+	iconv_t converter = iconv_open ("UTF-8", label_s);
+
+	if (converter != (iconv_t) -1)
+		{
+			/* Allow for up to 4 bytes of UTF-8 per input byte */
+			const size_t max_length = (length * 4);
+
+			converted_s = (char *) AllocMemory (max_length + 1);
+
+			if (converted_s)
+				{
+					char *src_p = (char *) data_s;
+					size_t src_left = length;
+					char *dest_p = converted_s;
+					size_t dest_left = max_length;
+
+					if (iconv (converter, &src_p, &src_left, &dest_p, &dest_left) != (size_t) -1)
+						{
+							*dest_p = '\0';
+							*converted_length_p = dest_p - converted_s;
+						}
+					else
+						{
+							PrintErrors (STM_LEVEL_WARNING, __FILE__, __LINE__, "Failed to convert page from %s to UTF-8: %s", label_s, strerror (errno));
+							FreeMemory (converted_s);
+							converted_s = NULL;
+						}
+				}
+
+			iconv_close (converter);
+		}
+	else
+		{
+			PrintErrors (STM_LEVEL_WARNING, __FILE__, __LINE__, "Unsupported character set \"%s\", using page as is", label_s);
+		}
+
+	return converted_s;
+}
@@ -0,0 +1,374 @@
+/*
+** Copyright 2014-2016 The Earlham Institute
+**
+** Licensed under the Apache License, Version 2.0 (the "License");
+** you may not use this file except in compliance with the License.
+** You may obtain a copy of the License at
+**
+**     http://www.apache.org/licenses/LICENSE-2.0
+**
+** Unless required by applicable law or agreed to in writing, software
+** distributed under the License is distributed on an "AS IS" BASIS,
+** WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+** See the License for the specific language governing permissions and
+** limitations under the License.
+*/
+#include <string.h>
+#include <strings.h>
+
+#include "web_search_fetch.h"
+#include "memory_allocations.h"
+#include "string_utils.h"
+#include "streams.h"
+#include "memory_budget.hpp"
+
+
+/*
+ * STATIC PROTOTYPES
+ */
+
+static size_t HeaderCallback (char *buffer_p, size_t size, size_t num_items, void *user_data_p);
+
+static bool SetHeaderValue (char **value_ss, const char *header_s, const size_t header_length, const char *name_s);
+
+static int ProgressCallback (void *user_data_p, curl_off_t download_total, curl_off_t download_now, curl_off_t upload_total, curl_off_t upload_now);
+
+
+/*
+ * API FUNCTIONS
+ */
+
+bool StartCapturingResponseHeaders (CurlTool *tool_p, ResponseHeaders *headers_p)
+{
+	headers_p -> rh_etag_s = NULL;
+	headers_p -> rh_last_modified_s = NULL;
+
+	if (curl_easy_setopt (tool_p -> ct_curl_p, CURLOPT_HEADERFUNCTION, HeaderCallback) == CURLE_OK)
+		{
+			if (curl_easy_setopt (tool_p -> ct_curl_p, CURLOPT_HEADERDATA, headers_p) == CURLE_OK)
+				{
+					return true;
+				}
+			else
+				{
+					PrintErrors (STM_LEVEL_WARNING, __FILE__, __LINE__, "Failed to set header data");
+				}
+
+			curl_easy_setopt (tool_p -> ct_curl_p, CURLOPT_HEADERFUNCTION, NULL);
+		}
+	else
+		{
+			PrintErrors (STM_LEVEL_WARNING, __FILE__, __LINE__, "Failed to set header callback");
+		}
+
+	return false;
+}
+
+
+void StopCapturingResponseHeaders (CurlTool *tool_p)
+{
+	curl_easy_setopt (tool_p -> ct_curl_p, CURLOPT_HEADERFUNCTION, NULL);
+	curl_easy_setopt (tool_p -> ct_curl_p, CURLOPT_HEADERDATA, NULL);
+}
+
+
+bool StartLimitingResponseSize (CurlTool *tool_p, ResponseLimits *limits_p, const size_t max_size)
+{
+	CURL *curl_p = tool_p -> ct_curl_p;
+
+	limits_p -> rl_tool_p = tool_p;
+	limits_p -> rl_max_size = max_size;
+	limits_p -> rl_used_size = 0;
+	limits_p -> rl_exceeded_flag = false;
+
+	/*
+	 * Servers that send a Content-Length can be rejected before any of
+	 * the body arrives, the progress callback catches the rest.
+	 */
+	if (curl_easy_setopt (curl_p, CURLOPT_MAXFILESIZE_LARGE, (curl_off_t) max_size) == CURLE_OK)
+		{
+			if ((curl_easy_setopt (curl_p, CURLOPT_XFERINFOFUNCTION, ProgressCallback) == CURLE_OK) &&
+				(curl_easy_setopt (curl_p, CURLOPT_XFERINFODATA, limits_p) == CURLE_OK) &&
+				(curl_easy_setopt (curl_p, CURLOPT_NOPROGRESS, 0L) == CURLE_OK))
+				{
+					return true;
+				}
+			else
+				{
+					PrintErrors (STM_LEVEL_WARNING, __FILE__, __LINE__, "Failed to set progress callback");
+				}
+
+			curl_easy_setopt (curl_p, CURLOPT_NOPROGRESS, 1L);
+			curl_easy_setopt (curl_p, CURLOPT_XFERINFOFUNCTION, NULL);
+			curl_easy_setopt (curl_p, CURLOPT_XFERINFODATA, NULL);
+			curl_easy_setopt (curl_p, CURLOPT_MAXFILESIZE_LARGE, (curl_off_t) 0);
+		}
+	else
+		{
+			PrintErrors (STM_LEVEL_WARNING, __FILE__, __LINE__, "Failed to set maximum response size to %lu bytes", (unsigned long) max_size);
+		}
+
+	return false;
+}
+
+
+void StopLimitingResponseSize (ResponseLimits *limits_p)
+{
+	CURL *curl_p = limits_p -> rl_tool_p -> ct_curl_p;
+
+	curl_easy_setopt (curl_p, CURLOPT_NOPROGRESS, 1L);
+	curl_easy_setopt (curl_p, CURLOPT_XFERINFOFUNCTION, NULL);
+	curl_easy_setopt (curl_p, CURLOPT_XFERINFODATA, NULL);
+	curl_easy_setopt (curl_p, CURLOPT_MAXFILESIZE_LARGE, (curl_off_t) 0);
+
+	if (limits_p -> rl_used_size > 0)
+		{
+			RemoveMemoryBudgetUsage (limits_p -> rl_used_size);
+			limits_p -> rl_used_size = 0;
+		}
+}
+
+
+void ClearResponseHeaders (ResponseHeaders *headers_p)
+{
+	if (headers_p -> rh_etag_s)
+		{
+			FreeCopiedString (headers_p -> rh_etag_s);
+			headers_p -> rh_etag_s = NULL;
+		}
+
+	if (headers_p -> rh_last_modified_s)
+		{
+			FreeCopiedString (headers_p -> rh_last_modified_s);
+			headers_p -> rh_last_modified_s = NULL;
+		}
+}
+
+
+struct curl_slist *SetConditionalRequestHeaders (CurlTool *tool_p, const char *etag_s, const char *last_modified_s)
+{
+	struct curl_slist *headers_p = NULL;
+
+	if (etag_s)
+		{
+			char *header_s = ConcatenateStrings ("If-None-Match: ", etag_s);
+
+			if (header_s)
+				{
+					headers_p = curl_slist_append (headers_p, header_s);
+					FreeCopiedString (header_s);
+				}
+		}
+
+	if (last_modified_s)
+		{
+			char *header_s = ConcatenateStrings ("If-Modified-Since: ", last_modified_s);
+
+			if (header_s)
+				{
+					struct curl_slist *list_p = curl_slist_append (headers_p, header_s);
+
+					if (list_p)
+						{
+							headers_p = list_p;
+						}
+
+					FreeCopiedString (header_s);
+				}
+		}
+
+	if (headers_p)
+		{
+			if (curl_easy_setopt (tool_p -> ct_curl_p, CURLOPT_HTTPHEADER, headers_p) != CURLE_OK)
+				{
+					PrintErrors (STM_LEVEL_WARNING, __FILE__, __LINE__, "Failed to set conditional request headers");
+					curl_slist_free_all (headers_p);
+					headers_p = NULL;
+				}
+		}
+
+	return headers_p;
+}
+
+
+void ClearConditionalRequestHeaders (CurlTool *tool_p, struct curl_slist *headers_p)
+{
+	if (headers_p)
+		{
+			curl_easy_setopt (tool_p -> ct_curl_p, CURLOPT_HTTPHEADER, NULL);
+			curl_slist_free_all (headers_p);
+		}
+}
+
+
+long GetCurlToolResponseCode (CurlTool *tool_p)
+{
+	long code = 0;
+
+	if (curl_easy_getinfo (tool_p -> ct_curl_p, CURLINFO_RESPONSE_CODE, &code) != CURLE_OK)
+		{
+			code = 0;
+		}
+
+	return code;
+}
+
+
+bool GetCurlToolTimings (CurlTool *tool_p, TransferTimings *timings_p)
+{
+	CURL *curl_p = tool_p -> ct_curl_p;
+
+	if ((curl_easy_getinfo (curl_p, CURLINFO_NAMELOOKUP_TIME_T, & (timings_p -> tt_name_lookup)) == CURLE_OK) &&
+		(curl_easy_getinfo (curl_p, CURLINFO_CONNECT_TIME_T, & (timings_p -> tt_connect)) == CURLE_OK) &&
+		(curl_easy_getinfo (curl_p, CURLINFO_APPCONNECT_TIME_T, & (timings_p -> tt_app_connect)) == CURLE_OK) &&
+		(curl_easy_getinfo (curl_p, CURLINFO_STARTTRANSFER_TIME_T, & (timings_p -> tt_start_transfer)) == CURLE_OK) &&
+		(curl_easy_getinfo (curl_p, CURLINFO_TOTAL_TIME_T, & (timings_p -> tt_total)) == CURLE_OK))
+		{
+			return true;
+		}
+
+	PrintLog (STM_LEVEL_FINE, __FILE__, __LINE__, "Failed to get transfer timings");
+
+	return false;
+}
+
+
+const char *GetCurlToolContentType (CurlTool *tool_p)
+{
+	char *content_type_s = NULL;
+
+	if (curl_easy_getinfo (tool_p -> ct_curl_p, CURLINFO_CONTENT_TYPE, &content_type_s) != CURLE_OK)
+		{
+			content_type_s = NULL;
+		}
+
+	return content_type_s;
+}
+
+
+bool SetCurlToolCompression (CurlTool *tool_p, const bool compress_flag)
+{
+	/* An empty string tells libcurl to offer all of its supported encodings */
+	const char *encodings_s = compress_flag ? "" : NULL;
+
+	if (curl_easy_setopt (tool_p -> ct_curl_p, CURLOPT_ACCEPT_ENCODING, encodings_s) == CURLE_OK)
+		{
+			return true;
+		}
+
+	PrintErrors (STM_LEVEL_WARNING, __FILE__, __LINE__, "Failed to set accepted encodings");
+
+	return false;
+}
+
+
+const char *GetCurlToolEffectiveUri (CurlTool *tool_p)
+{
+	char *uri_s = NULL;
+
+	if (curl_easy_getinfo (tool_p -> ct_curl_p, CURLINFO_EFFECTIVE_URL, &uri_s) != CURLE_OK)
+		{
+			uri_s = NULL;
+		}
+
+	return uri_s;
+}
+
+
+/*
+ * STATIC FUNCTIONS
+ */
+
+static size_t HeaderCallback (char *buffer_p, size_t size, size_t num_items, void *user_data_p)
+{
+	ResponseHeaders *headers_p = (ResponseHeaders *) user_data_p;
+	const size_t length = size * num_items;
+
+	/*
+	 * If we have followed a redirect, only the headers from
+	 * the final response are relevant
+	 */
+	if ((length > 5) && (strncmp (buffer_p, "HTTP/", 5) == 0))
+		{
+			ClearResponseHeaders (headers_p);
+		}
+	else if (!SetHeaderValue (& (headers_p -> rh_etag_s), buffer_p, length, "ETag"))
+		{
+			SetHeaderValue (& (headers_p -> rh_last_modified_s), buffer_p, length, "Last-Modified");
+		}
+
+	return length;
+}
+
+
+/*
+ * The downloaded count is of the bytes on the wire so for compressed
+ * responses we also check how much has been written to the buffer.
+ */
+static int ProgressCallback (void *user_data_p, curl_off_t UNUSED_PARAM (download_total), curl_off_t download_now, curl_off_t UNUSED_PARAM (upload_total), curl_off_t UNUSED_PARAM (upload_now))
+{
+	ResponseLimits *limits_p = (ResponseLimits *) user_data_p;
+	size_t size = GetByteBufferSize (limits_p -> rl_tool_p -> ct_buffer_p);
+
+	if ((download_now > 0) && ((size_t) download_now > size))
+		{
+			size = (size_t) download_now;
+		}
+
+	if (size > limits_p -> rl_used_size)
+		{
+			AddMemoryBudgetUsage (size - limits_p -> rl_used_size);
+			limits_p -> rl_used_size = size;
+		}
+
+	if ((limits_p -> rl_max_size > 0) && (size > limits_p -> rl_max_size))
+		{
+			limits_p -> rl_exceeded_flag = true;
+
+			/* Any non-zero value aborts the transfer */
+			return 1;
+		}
+
+	return 0;
+}
+
+
+static bool SetHeaderValue (char **value_ss, const char *header_s, const size_t header_length, const char *name_s)
+{
+	const size_t name_length = strlen (name_s);
+
+	if ((header_length > name_length) && (header_s [name_length] == ':') && (strncasecmp (header_s, name_s, name_length) == 0))
+		{
+			const char *start_p = header_s + name_length + 1;
+			const char *end_p = header_s + header_length;
+
+			while ((start_p < end_p) && ((*start_p == ' ') || (*start_p == '\t')))
+				{
+					++ start_p;
+				}
+
+			while ((end_p > start_p) && ((* (end_p - 1) == '\r') || (* (end_p - 1) == '\n') || (* (end_p - 1) == ' ')))
+				{
+					-- end_p;
+				}
+
+			if (end_p > start_p)
+				{
+					char *value_s = CopyToNewString (start_p, end_p - start_p, false);
+
+					if (value_s)
+						{
+							if (*value_ss)
+								{
+									FreeCopiedString (*value_ss);
+								}
+
+							*value_ss = value_s;
+						}
+				}
+
+			return true;
+		}
+
+	return false;
+}
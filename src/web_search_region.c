@@ -0,0 +1,256 @@
+/*
+** Copyright 2014-2016 The Earlham Institute
+**
+** Licensed under the Apache License, Version 2.0 (the "License");
+** you may not use this file except in compliance with the License.
+** You may obtain a copy of the License at
+**
+**     http://www.apache.org/licenses/LICENSE-2.0
+**
+** Unless required by applicable law or agreed to in writing, software
+** distributed under the License is distributed on an "AS IS" BASIS,
+** WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+** See the License for the specific language governing permissions and
+** limitations under the License.
+*/
+#include <ctype.h>
+#include <string.h>
+#include <strings.h>
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+#include "web_search_region.h"
+
+
+/*
+ * STATIC PROTOTYPES
+ */
+
+static const char *FindMarker (const char *data_s, const size_t length, const char *marker_s);
+
+static bool IsElementMarker (const char *marker_s, size_t *tag_length_p);
+
+static const char *FindElement (const char *data_s, const size_t length, const char *tag_s, const size_t tag_length, const char *id_s);
+
+
+/*
+ * API FUNCTIONS
+ */
+
+
+/*
+ * Using SSE2, compare the first and last bytes of the needle against 16
+ * candidate positions at once and only check the full needle where both
+ * match. Without SSE2 this falls back to memchr on the first byte.
+ */
+const char *FindBytes (const char *data_s, const size_t length, const char *needle_s, const size_t needle_length)
+{
+	const char *end_p;
+	const char *current_p = data_s;
+
+	if (needle_length == 0)
+		{
+			return data_s;
+		}
+
+	if (needle_length > length)
+		{
+			return NULL;
+		}
+
+	end_p = data_s + length - needle_length + 1;
+
+#ifdef __SSE2__
+	{
+		const __m128i first = _mm_set1_epi8 (needle_s [0]);
+		const __m128i last = _mm_set1_epi8 (needle_s [needle_length - 1]);
+
+		while (current_p + 16 <= end_p)
+			{
+				const __m128i block_first = _mm_loadu_si128 ((const __m128i *) current_p);
+				const __m128i block_last = _mm_loadu_si128 ((const __m128i *) (current_p + needle_length - 1));
+				unsigned int mask = (unsigned int) _mm_movemask_epi8 (_mm_and_si128 (_mm_cmpeq_epi8 (block_first, first), _mm_cmpeq_epi8 (block_last, last)));
+
+				while (mask != 0)
+					{
+						const int bit = __builtin_ctz (mask);
+
+						if (memcmp (current_p + bit + 1, needle_s + 1, needle_length - 1) == 0)
+							{
+								return current_p + bit;
+							}
+
+						mask &= mask - 1;
+					}
+
+				current_p += 16;
+			}
+	}
+#endif
+
+	while (current_p < end_p)
+		{
+			current_p = (const char *) memchr (current_p, needle_s [0], end_p - current_p);
+
+			if (!current_p)
+				{
+					return NULL;
+				}
+
+			if (memcmp (current_p + 1, needle_s + 1, needle_length - 1) == 0)
+				{
+					return current_p;
+				}
+
+			++ current_p;
+		}
+
+	return NULL;
+}
+
+
+bool GetPageRegion (const char *data_s, const size_t length, const char *start_marker_s, const char *end_marker_s, const char **region_pp, size_t *region_length_p)
+{
+	const char *start_p = data_s;
+	bool found_flag = true;
+
+	if (start_marker_s)
+		{
+			start_p = FindMarker (data_s, length, start_marker_s);
+
+			if (!start_p)
+				{
+					start_p = data_s;
+					found_flag = false;
+				}
+		}
+
+	*region_pp = start_p;
+	*region_length_p = length - (start_p - data_s);
+
+	if (found_flag && end_marker_s)
+		{
+			/* Skip past the start of the region so the end marker can't match it */
+			const char *search_p = (start_p < data_s + length) ? start_p + 1 : start_p;
+			const char *end_p = FindMarker (search_p, length - (search_p - data_s), end_marker_s);
+
+			if (end_p)
+				{
+					*region_length_p = end_p - start_p;
+				}
+		}
+
+	return found_flag;
+}
+
+
+/*
+ * STATIC FUNCTIONS
+ */
+
+static const char *FindMarker (const char *data_s, const size_t length, const char *marker_s)
+{
+	size_t tag_length;
+
+	if (IsElementMarker (marker_s, &tag_length))
+		{
+			return FindElement (data_s, length, marker_s, tag_length, marker_s + tag_length + 1);
+		}
+
+	return FindBytes (data_s, length, marker_s, strlen (marker_s));
+}
+
+
+/* Is the marker of the form tag#id? */
+static bool IsElementMarker (const char *marker_s, size_t *tag_length_p)
+{
+	const char *hash_p = strchr (marker_s, '#');
+
+	if (hash_p && (hash_p > marker_s) && (* (hash_p + 1) != '\0'))
+		{
+			const char *c_p;
+
+			for (c_p = marker_s; c_p < hash_p; ++ c_p)
+				{
+					if (!isalnum ((unsigned char) *c_p))
+						{
+							return false;
+						}
+				}
+
+			for (c_p = hash_p + 1; *c_p; ++ c_p)
+				{
+					if (!isalnum ((unsigned char) *c_p) && (*c_p != '-') && (*c_p != '_') && (*c_p != ':') && (*c_p != '.'))
+						{
+							return false;
+						}
+				}
+
+			*tag_length_p = hash_p - marker_s;
+
+			return true;
+		}
+
+	return false;
+}
+
+
+/*
+ * Find the id attribute value first, since that is far rarer than the
+ * tag name, and then check that it is within an opening tag of the
+ * right name.
+ */
+static const char *FindElement (const char *data_s, const size_t length, const char *tag_s, const size_t tag_length, const char *id_s)
+{
+	const size_t id_length = strlen (id_s);
+	const char *current_p = data_s;
+	const char * const end_p = data_s + length;
+
+	while ((current_p = FindBytes (current_p, end_p - current_p, id_s, id_length)) != NULL)
+		{
+			const char *value_end_p = current_p + id_length;
+
+			/* The value must be quoted and preceded by id= */
+			if ((current_p - data_s >= 4) && (value_end_p < end_p) && ((*value_end_p == '"') || (*value_end_p == '\'')) && (* (current_p - 1) == *value_end_p))
+				{
+					const char *attr_p = current_p - 2;
+
+					while ((attr_p > data_s) && isspace ((unsigned char) *attr_p))
+						{
+							-- attr_p;
+						}
+
+					if ((*attr_p == '=') && (attr_p - data_s >= 2))
+						{
+							-- attr_p;
+
+							while ((attr_p > data_s) && isspace ((unsigned char) *attr_p))
+								{
+									-- attr_p;
+								}
+
+							if ((attr_p - data_s >= 2) && (strncasecmp (attr_p - 1, "id", 2) == 0) && isspace ((unsigned char) * (attr_p - 2)))
+								{
+									/* Now find the start of the tag that this attribute belongs to */
+									const char *tag_start_p = attr_p;
+
+									while ((tag_start_p > data_s) && (*tag_start_p != '<') && (*tag_start_p != '>'))
+										{
+											-- tag_start_p;
+										}
+
+									if ((*tag_start_p == '<') && (end_p - tag_start_p > (ptrdiff_t) (tag_length + 1)) && (strncasecmp (tag_start_p + 1, tag_s, tag_length) == 0) && isspace ((unsigned char) tag_start_p [tag_length + 1]))
+										{
+											return tag_start_p;
+										}
+								}
+						}
+				}
+
+			++ current_p;
+		}
+
+	return NULL;
+}
@@ -33,15 +33,289 @@
 #include "web_service_util.h"
 #include "service_job.h"
 #include "selector.hpp"
+#include "result_cache.hpp"
+#include "web_search_fetch.h"
+#include "background_tasks.hpp"
+#include "web_search_charset.h"
+#include "web_search_region.h"
+#include "circuit_breaker.hpp"
+#include "idle_resources.hpp"
+#include "config_watcher.hpp"
+#include "memory_budget.hpp"
+#include "search_scheduler.hpp"
+#include "allocation_stats.hpp"
+#include "request_trace.hpp"
+#include "result_index.hpp"
+#include "dns_cache.hpp"
+#include "search_job.hpp"
+
+
+/**
+ * The settings for an operation that can be changed whilst the service
+ * is running. Whenever the operation's configuration changes, a new
+ * WebSearchEngine is built and swapped in and any requests that are
+ * already running carry on with the one that they started with.
+ */
+typedef struct WebSearchEngine
+{
+	/** The operation's configuration, which the strings below point into. */
+	json_t *wse_op_p;
+
+	/** The address of the search engine. */
+	char *wse_base_uri_s;
+
+	const char *wse_link_selector_s;
+	const char *wse_title_selector_s;
+
+	/**
+	 * The optional markers for the part of the page that contains the results
+	 * so that only it needs parsing.
+	 */
+	const char *wse_region_start_s;
+	const char *wse_region_end_s;
+
+	/** The cache of previous results or <code>NULL</code> if caching is disabled. */
+	ResultCache *wse_cache_p;
+
+	/** The maximum number of background refreshes of stale results that can be outstanding. */
+	uint32 wse_max_refreshes;
+
+	/** The circuit breaker for the search engine or <code>NULL</code> if it is disabled. */
+	CircuitBreaker *wse_breaker_p;
+
+	/** Should results be added to the job in batches as they are extracted? */
+	bool wse_incremental_flag;
+
+	/** The number of results in each batch when adding them incrementally. */
+	uint32 wse_batch_size;
+
+	/** The maximum number of bytes in a page from the search engine or 0 for no limit. */
+	size_t wse_max_response_size;
+
+	/** The maximum number of elements in a page from the search engine or 0 for no limit. */
+	size_t wse_max_nodes;
+
+	/** The maximum number of seconds that a search waits for room in the memory budget. */
+	uint32 wse_memory_wait;
+
+	/** The priority class of searches that don't specify one. */
+	SearchPriority wse_priority;
+
+	/** The request parameter that can set the priority class or <code>NULL</code> if there isn't one. */
+	const char *wse_priority_param_s;
+
+	/** The maximum number of seconds that a search waits to be started by the scheduler. */
+	uint32 wse_queue_wait;
+
+	/** Should the memory allocated while extracting the results be counted? */
+	bool wse_allocation_stats_flag;
+
+	/** The number of searches between each logging of the allocation totals or 0 to not log them. */
+	uint32 wse_allocation_stats_interval;
+
+	/** The file to write the traces of searches to or <code>NULL</code> if tracing is disabled. */
+	const char *wse_trace_file_s;
+
+	/** The fraction of searches to trace. */
+	double wse_trace_sample_rate;
+
+	/** The size that the trace file can grow to or 0 for no limit. */
+	size_t wse_trace_max_file_size;
+
+	/** Where to find the results in the page's embedded structured data. */
+	StructuredDataMapping wse_structured_data;
+
+	/** Should the results be read from the structured data before trying the selectors? */
+	bool wse_structured_data_flag;
+
+	/** The local index of the extracted results or <code>NULL</code> if indexing is disabled. */
+	ResultIndex *wse_index_p;
+
+	/** Should searches be answered from the local index before calling the search engine? */
+	bool wse_local_first_flag;
+
+	/** The request parameter with the words to search the local index for. */
+	const char *wse_index_query_param_s;
+
+	/** The maximum number of results to get from the local index. */
+	uint32 wse_index_max_results;
+
+	/** The number of seconds that the search engine's addresses are cached for or 0 to let curl resolve them. */
+	uint32 wse_dns_cache_ttl;
+
+	/** How to canonicalise the results' URIs. */
+	UriCanonicalisation wse_canonical;
+
+	/** Should the results' URIs be canonicalised and any duplicates removed? */
+	bool wse_canonical_flag;
+
+	/** The configured parameters to remove from the URIs or <code>NULL</code> if the default ones are used. */
+	const char **wse_removed_params_ss;
+} WebSearchEngine;
 
 
 typedef struct WebSearchServiceData
 {
 	WebServiceData wssd_base_data;
-	const char *wssd_link_selector_s;
-	const char *wssd_title_selector_s;
+
+	/** The current WebSearchEngine along with the configuration file that it is reloaded from. */
+	ConfigWatcher *wssd_engines_p;
+
+	/** The base URI that InitWebServiceData set up, which is restored before it is cleared. */
+	const char *wssd_original_uri_s;
+
+	/** Should the search engine be asked to send compressed responses? */
+	bool wssd_compress_flag;
+
+	/**
+	 * Was the service registered as asynchronous so that searches are run
+	 * on threads of their own and their jobs can be polled for partial
+	 * results? This is fixed when the service is created.
+	 */
+	bool wssd_async_flag;
+
+	/**
+	 * The curl tool and buffer in wssd_base_data, which are only created
+	 * when they are needed and are released when they have been idle.
+	 */
+	IdleResource *wssd_transfer_p;
 } WebSearchServiceData;
 
+
+/**
+ * The outcome of calling the search engine.
+ */
+typedef enum WebSearchCallResult
+{
+	/** The search engine replied without an error. */
+	WSCR_SUCCEEDED,
+
+	/** The search engine couldn't be reached or replied with an error. */
+	WSCR_FAILED,
+
+	/** The search engine wasn't called because its circuit breaker is open. */
+	WSCR_REFUSED
+} WebSearchCallResult;
+
+
+/**
+ * The details needed to run a search on a thread of its own. The search
+ * has its own copy of the service's data with a curl tool and buffer of
+ * its own that the request encodes its parameters into, so searches that
+ * overlap never share a transfer.
+ */
+typedef struct WebSearchTask
+{
+	WebSearchServiceData wst_service_data;
+
+	/** The version of the settings that the request started with. */
+	ConfigVersion *wst_version_p;
+
+	SearchPriority wst_priority;
+
+	/** The trace of the request that started the search or <code>NULL</code> if it isn't being traced. */
+	RequestTrace *wst_trace_p;
+
+	/** The start of the request's search span. */
+	uint64 wst_search_start;
+} WebSearchTask;
+
+
+/**
+ * The details needed to refresh a stale cache entry after the
+ * request that found it has finished.
+ */
+typedef struct WebSearchRefreshTask
+{
+	/**
+	 * The version of the operation's settings that the request which found
+	 * the entry was using, which is kept until the refresh has finished.
+	 */
+	ConfigVersion *wsrt_version_p;
+
+	char *wsrt_key_s;
+	CachedResults wsrt_cached_results;
+	bool wsrt_compress_flag;
+} WebSearchRefreshTask;
+
+
+/** The name of the plugin, which its shared settings in the server's configuration are listed under. */
+static const char * const S_PLUGIN_NAME_S = "web_search_service";
+
+/** The default number of seconds that cached results are fresh for. */
+static const uint32 S_DEFAULT_CACHE_TTL = 0;
+
+/** The default maximum number of results sets to cache for each operation. */
+static const uint32 S_DEFAULT_CACHE_SIZE = 64;
+
+/** The default number of seconds after expiry that stale results can be served for. */
+static const uint32 S_DEFAULT_CACHE_STALE_TTL = 0;
+
+/** The default maximum number of searches with no results or that failed to remember for each operation. */
+static const uint32 S_DEFAULT_NEGATIVE_CACHE_SIZE = 64;
+
+/** The default number of seconds that searches with no results are remembered for. */
+static const uint32 S_DEFAULT_EMPTY_RESULTS_TTL = 0;
+
+/** The default number of seconds that failed searches are remembered for. */
+static const uint32 S_DEFAULT_FAILED_RESULTS_TTL = 0;
+
+/** The default maximum number of concurrent background refreshes for each operation. */
+static const uint32 S_DEFAULT_MAX_REFRESHES = 1;
+
+/** The default number of results in each batch added to a job incrementally. */
+static const uint32 S_DEFAULT_RESULTS_BATCH_SIZE = 10;
+
+/** The default number of seconds that an unused service keeps its curl tool and buffer for. */
+static const uint32 S_DEFAULT_IDLE_RELEASE_TIME = 300;
+
+/** The default minimum number of seconds between checks of whether the configuration file has changed. */
+static const uint32 S_DEFAULT_CONFIG_CHECK_INTERVAL = 10;
+
+/** The default type of the script element that holds a page's structured data. */
+static const char * const S_DEFAULT_STRUCTURED_DATA_SCRIPT_TYPE_S = "application/ld+json";
+
+/** The default maximum number of bytes in a page from the search engine. */
+static const uint32 S_DEFAULT_MAX_RESPONSE_SIZE = 10485760;
+
+/** The default maximum number of elements in a page from the search engine. */
+static const uint32 S_DEFAULT_MAX_PAGE_ELEMENTS = 500000;
+
+/** The default maximum number of seconds that a search waits for room in the memory budget. */
+static const uint32 S_DEFAULT_MEMORY_BUDGET_WAIT = 30;
+
+/** The default number of searches between each logging of the allocation totals. */
+static const uint32 S_DEFAULT_ALLOCATION_STATS_INTERVAL = 100;
+
+/** The default size in bytes that the trace file can grow to. */
+static const uint32 S_DEFAULT_TRACE_MAX_FILE_SIZE = 104857600;
+
+/** The default maximum number of results in the local index for each operation. */
+static const uint32 S_DEFAULT_LOCAL_INDEX_SIZE = 10000;
+
+/** The default maximum number of results to answer a search with from the local index. */
+static const uint32 S_DEFAULT_LOCAL_INDEX_MAX_RESULTS = 20;
+
+/** The default number of seconds that the addresses of a search engine are cached for. */
+static const uint32 S_DEFAULT_DNS_CACHE_TTL = 60;
+
+/** The default query parameters to remove when canonicalising the results' URIs. */
+static const char * const S_DEFAULT_TRACKING_PARAMETERS_SS [] = { "utm_*", "gclid", "fbclid", "msclkid", "mc_cid", "mc_eid" };
+
+/** The default maximum number of seconds that a search waits to be started by the scheduler. */
+static const uint32 S_DEFAULT_QUEUE_WAIT = 30;
+
+/** The default share of the searches started when both classes are waiting. */
+static const uint32 S_DEFAULT_INTERACTIVE_WEIGHT = 4;
+static const uint32 S_DEFAULT_BULK_WEIGHT = 1;
+
+/** The default number of recent requests that the circuit breaker tracks. */
+static const uint32 S_DEFAULT_BREAKER_WINDOW = 10;
+
+/** The default number of seconds that an open circuit breaker waits before letting a probe request through. */
+static const uint32 S_DEFAULT_BREAKER_OPEN_TIME = 30;
+
+
 /*
  * STATIC PROTOTYPES
  */
@@ -78,7 +352,89 @@ static void FreeWebSearchServiceData (WebSearchServiceData *data_p);
 
 static bool CloseWebSearchService (Service *service_p);
 
-static json_t *CreateWebSearchServiceResults (WebSearchServiceData *data_p);
+static WebSearchEngine *AllocateWebSearchEngine (json_t *op_p, const char *name_s, const char *base_uri_s);
+
+static void FreeWebSearchEngine (void *engine_p);
+
+static void *ReloadWebSearchEngine (const json_t *config_p, const void *current_p, void *data_p);
+
+static json_t *FindWebSearchServiceConfig (const json_t *json_p, const char *name_s, char **base_uri_ss);
+
+static json_t *CreateWebSearchServiceResults (WebSearchServiceData *data_p, const WebSearchEngine *engine_p, SearchJob *search_p);
+
+static json_t *GetWebSearchServiceResults (WebSearchServiceData *data_p, const ConfigVersion *version_p, SearchJob *search_p);
+
+static json_t *GetCachedWebSearchServiceResults (WebSearchServiceData *data_p, const ConfigVersion *version_p, const char *key_s, SearchJob *search_p);
+
+static char *GetWebSearchRequestKey (const WebServiceData *data_p);
+
+static bool InitWebSearchCache (WebSearchEngine *engine_p, const char *name_s, const json_t *op_p);
+
+static bool InitWebSearchTransfer (WebSearchServiceData *data_p, const json_t *op_p);
+
+static bool CreateWebSearchTransfer (void *data_p);
+
+static void ReleaseWebSearchTransfer (void *data_p);
+
+static void PrepareWebSearchSelectors (const json_t *config_p);
+
+static size_t CollectWebSearchSelectors (const json_t *json_p, const char **selectors_ss, size_t num_selectors);
+
+static void InitWebSearchCircuitBreaker (WebSearchEngine *engine_p, const char *name_s, const json_t *op_p);
+
+static WebSearchCallResult CallWebSearchEngine (WebSearchServiceData *data_p, const WebSearchEngine *engine_p, SearchJob *search_p);
+
+static SearchJob *GetIncrementalSearchJob (const WebSearchServiceData *data_p, const WebSearchEngine *engine_p, SearchJob *search_p);
+
+static bool IsFailedWebSearchResponse (const long response_code);
+
+static bool IsErrorWebSearchResponse (const long response_code);
+
+static void AddTransferTraceSpans (CurlTool *tool_p, const uint64 start);
+
+static uint64 GetTransferStageLength (const curl_off_t from, const curl_off_t to);
+
+static json_t *RunLimitedWebSearch (WebSearchServiceData *service_data_p, const ConfigVersion *version_p, SearchJob *search_p);
+
+static SearchPriority GetWebSearchPriority (const WebSearchEngine *engine_p, ParameterSet *param_set_p);
+
+static json_t *RunQueuedWebSearch (WebSearchServiceData *service_data_p, const ConfigVersion *version_p, const SearchPriority priority, SearchJob *search_p);
+
+static WebSearchTask *AllocateWebSearchTask (const WebSearchServiceData *service_data_p);
+
+static void StartBackgroundWebSearch (WebSearchTask *task_p, ConfigVersion *version_p, const SearchPriority priority, const uint64 search_start, SearchJob *search_p, ServiceJob *job_p);
+
+static json_t *RunBackgroundWebSearch (SearchJob *search_p, void *data_p);
+
+static void FreeWebSearchTask (void *data_p);
+
+static bool InitWebSearchPriority (WebSearchEngine *engine_p, const json_t *op_p);
+
+static bool InitWebSearchStructuredData (WebSearchEngine *engine_p, const json_t *op_p);
+
+static bool InitWebSearchIndex (WebSearchEngine *engine_p, const char *name_s, const json_t *op_p);
+
+static bool InitWebSearchCanonicalisation (WebSearchEngine *engine_p, const json_t *op_p);
+
+static json_t *GetLocalWebSearchResults (WebSearchServiceData *data_p, const ConfigVersion *version_p, ParameterSet *param_set_p);
+
+static void ScheduleLocalWebSearchRefresh (WebSearchServiceData *data_p, const ConfigVersion *version_p);
+
+static char *GetWebSearchRequestUri (const WebServiceData *data_p);
+
+static void ConfigureSharedSearchLimits (GrassrootsServer *grassroots_p);
+
+static json_t *ExtractWebSearchResults (const char *data_s, const char *content_type_s, const StructuredDataMapping *structured_data_p, const UriCanonicalisation *canonical_p, const char *link_selector_s, const char *title_selector_s, const char *region_start_s, const char *region_end_s, const char *base_uri_s, const size_t max_nodes, SearchJob *search_p, const uint32 batch_size);
+
+static void ScheduleWebSearchRefresh (WebSearchServiceData *data_p, const ConfigVersion *version_p, const char *key_s, CachedResults *cached_results_p);
+
+static bool ScheduleWebSearchRefreshTask (WebSearchServiceData *data_p, const ConfigVersion *version_p, const char *key_s, CachedResults *cached_results_p);
+
+static void RunWebSearchRefreshTask (void *data_p);
+
+static bool RefreshWebSearchResults (WebSearchRefreshTask *task_p);
+
+static void FreeWebSearchRefreshTask (void *data_p);
 
 static ServiceMetadata *GetWebSearchServiceMetadata (Service *service_p);
 
@@ -90,7 +446,12 @@ static ServiceMetadata *GetWebSearchServiceMetadata (Service *service_p);
  
 ServicesArray *GetReferenceServices (UserDetails *user_p, GrassrootsServer *grassroots_p, json_t *config_p)
 {
-	return GetReferenceServicesFromJSON (config_p, "web_search_service", GetWebSearchService, grassroots_p);
+	/* Check and compile all of the selectors in parallel before the services are built */
+	PrepareWebSearchSelectors (config_p);
+
+	ConfigureSharedSearchLimits (grassroots_p);
+
+	return GetReferenceServicesFromJSON (config_p, S_PLUGIN_NAME_S, GetWebSearchService, grassroots_p);
 }
 
 
@@ -110,7 +471,7 @@ static Service *GetWebSearchService (json_t *operation_json_p, size_t UNUSED_PAR
 	
 	if (web_service_p)
 		{
-			ServiceData *data_p = (ServiceData *) AllocateWebSearchServiceData (operation_json_p);
+			WebSearchServiceData *data_p = AllocateWebSearchServiceData (operation_json_p);
 			
 			if (data_p)
 				{
@@ -127,8 +488,8 @@ static Service *GetWebSearchService (json_t *operation_json_p, size_t UNUSED_PAR
 						CloseWebSearchService,
 						NULL,
 						false,
-						SY_SYNCHRONOUS,
-						data_p,
+						data_p -> wssd_async_flag ? SY_ASYNCHRONOUS_ATTACHED : SY_SYNCHRONOUS,
+						(ServiceData *) data_p,
 						GetWebSearchServiceMetadata,
 						NULL,
 						grassroots_p))
@@ -156,23 +517,48 @@ static WebSearchServiceData *AllocateWebSearchServiceData (json_t *service_confi
 				{
 					json_t *op_p = json_object_get (service_config_p, OPERATION_S);
 
+					service_data_p -> wssd_original_uri_s = data_p -> wsd_base_uri_s;
+					service_data_p -> wssd_transfer_p = NULL;
+					service_data_p -> wssd_async_flag = false;
+
 					if (op_p)
 						{
-							if ((service_data_p -> wssd_link_selector_s = GetJSONString (op_p, "link_selector")) != NULL)
+							WebSearchEngine *engine_p = AllocateWebSearchEngine (op_p, data_p -> wsd_name_s, data_p -> wsd_base_uri_s);
+
+							if (engine_p)
 								{
-									if ((service_data_p -> wssd_title_selector_s = GetJSONString (op_p, "title_selector")) != NULL)
+									int check_interval = S_DEFAULT_CONFIG_CHECK_INTERVAL;
+
+									GetJSONInteger (op_p, "config_check_interval", &check_interval);
+
+									/*
+									 * Partial results can only be seen if the job can be polled whilst the search
+									 * is running, so incremental operations are run asynchronously. A service's
+									 * synchronicity can't change once it has been created, so reloading the
+									 * settings doesn't affect this.
+									 */
+									GetJSONBoolean (op_p, "incremental_results", & (service_data_p -> wssd_async_flag));
+
+									/* The watcher takes ownership of the engine */
+									service_data_p -> wssd_engines_p = AllocateConfigWatcher (GetJSONString (op_p, "watch_config_file"), (check_interval > 0) ? (uint32) check_interval : 0, engine_p, ReloadWebSearchEngine, FreeWebSearchEngine, service_data_p);
+
+									if (service_data_p -> wssd_engines_p)
 										{
-											return service_data_p;
-										}		/* if ((service_data_p -> wssd_title_selector_s = GetJSONString (op_p, "title_selector")) != NULL) */
+											if (InitWebSearchTransfer (service_data_p, op_p))
+												{
+													return service_data_p;
+												}
+											else
+												{
+													PrintJSONToErrors (STM_LEVEL_SEVERE, __FILE__, __LINE__, op_p, "Failed to set up transfer options");
+												}
+
+											FreeConfigWatcher (service_data_p -> wssd_engines_p);
+										}
 									else
 										{
-											PrintJSONToErrors (STM_LEVEL_SEVERE, __FILE__, __LINE__, op_p, "Failed to get title_selector value");
+											PrintJSONToErrors (STM_LEVEL_SEVERE, __FILE__, __LINE__, op_p, "Failed to set up configuration watcher");
 										}
-
-								}		/* if ((service_data_p -> wssd_link_selector_s = GetJSONString (op_p, "link_selector")) != NULL) */
-							else
-								{
-									PrintJSONToErrors (STM_LEVEL_SEVERE, __FILE__, __LINE__, op_p, "Failed to get link_selector value");
 								}
 
 						}		/* if (op_p) */
@@ -199,183 +585,1828 @@ static WebSearchServiceData *AllocateWebSearchServiceData (json_t *service_confi
 }
 
 
-static void FreeWebSearchServiceData (WebSearchServiceData *data_p)
+/*
+ * Build the reloadable settings for an operation, checking that they
+ * are valid. The caches and circuit breakers are shared with any
+ * previous versions for the same operation.
+ */
+static WebSearchEngine *AllocateWebSearchEngine (json_t *op_p, const char *name_s, const char *base_uri_s)
 {
-	ClearWebServiceData (& (data_p -> wssd_base_data));
-	
-	FreeMemory (data_p);
-}
+	WebSearchEngine *engine_p = (WebSearchEngine *) AllocMemory (sizeof (WebSearchEngine));
 
+	if (engine_p)
+		{
+			memset (engine_p, 0, sizeof (WebSearchEngine));
 
-static const char *GetWebSearchServiceName (const Service *service_p)
-{
-	WebSearchServiceData *data_p = (WebSearchServiceData *) (service_p -> se_data_p);
-	
-	return (data_p -> wssd_base_data.wsd_name_s);
-}
+			if ((engine_p -> wse_base_uri_s = EasyCopyToNewString (base_uri_s ? base_uri_s : "")) != NULL)
+				{
+					if ((engine_p -> wse_link_selector_s = GetJSONString (op_p, "link_selector")) != NULL)
+						{
+							const char *selectors_ss [2];
+							int batch_size = S_DEFAULT_RESULTS_BATCH_SIZE;
+							int max_response_size = S_DEFAULT_MAX_RESPONSE_SIZE;
+							int max_nodes = S_DEFAULT_MAX_PAGE_ELEMENTS;
+							int memory_wait = S_DEFAULT_MEMORY_BUDGET_WAIT;
+							int stats_interval = S_DEFAULT_ALLOCATION_STATS_INTERVAL;
+							int trace_max_file_size = S_DEFAULT_TRACE_MAX_FILE_SIZE;
+							int dns_cache_ttl = S_DEFAULT_DNS_CACHE_TTL;
+
+							/* Without a title selector, each link's title attribute is used */
+							engine_p -> wse_title_selector_s = GetJSONString (op_p, "title_selector");
+
+							if ((engine_p -> wse_title_selector_s) && (* (engine_p -> wse_title_selector_s) == '\0'))
+								{
+									engine_p -> wse_title_selector_s = NULL;
+								}
 
+							engine_p -> wse_op_p = json_incref (op_p);
+							engine_p -> wse_region_start_s = GetJSONString (op_p, "region_start");
+							engine_p -> wse_region_end_s = GetJSONString (op_p, "region_end");
 
-static const char *GetWebSearchServiceDescription (const Service *service_p)
-{
-	WebSearchServiceData *data_p = (WebSearchServiceData *) (service_p -> se_data_p);
+							GetJSONBoolean (op_p, "incremental_results", & (engine_p -> wse_incremental_flag));
 
-	return (data_p -> wssd_base_data.wsd_description_s);
-}
+							GetJSONInteger (op_p, "results_batch_size", &batch_size);
+							engine_p -> wse_batch_size = (batch_size > 0) ? (uint32) batch_size : 0;
 
+							GetJSONInteger (op_p, "max_response_size", &max_response_size);
+							engine_p -> wse_max_response_size = (max_response_size > 0) ? (size_t) max_response_size : 0;
 
-static const char *GetWebSearchServiceAlias (const Service *service_p)
-{
-	WebSearchServiceData *data_p = (WebSearchServiceData *) (service_p -> se_data_p);
+							GetJSONInteger (op_p, "max_page_elements", &max_nodes);
+							engine_p -> wse_max_nodes = (max_nodes > 0) ? (size_t) max_nodes : 0;
 
-	return (data_p -> wssd_base_data.wsd_alias_s);
-}
+							GetJSONInteger (op_p, "memory_budget_wait", &memory_wait);
+							engine_p -> wse_memory_wait = (memory_wait > 0) ? (uint32) memory_wait : 0;
 
+							GetJSONBoolean (op_p, "allocation_stats", & (engine_p -> wse_allocation_stats_flag));
 
+							GetJSONInteger (op_p, "allocation_stats_interval", &stats_interval);
+							engine_p -> wse_allocation_stats_interval = (stats_interval > 0) ? (uint32) stats_interval : 0;
 
-static const char *GetWebSearchServiceInformationUri (const Service *service_p)
-{
-	WebSearchServiceData *data_p = (WebSearchServiceData *) (service_p -> se_data_p);
+							engine_p -> wse_trace_file_s = GetJSONString (op_p, "trace_file");
+							GetJSONReal (op_p, "trace_sample_rate", & (engine_p -> wse_trace_sample_rate));
 
-	return (data_p -> wssd_base_data.wsd_info_uri_s);
-}
+							GetJSONInteger (op_p, "trace_max_file_size", &trace_max_file_size);
+							engine_p -> wse_trace_max_file_size = (trace_max_file_size > 0) ? (size_t) trace_max_file_size : 0;
 
+							GetJSONInteger (op_p, "dns_cache_ttl", &dns_cache_ttl);
+							engine_p -> wse_dns_cache_ttl = (dns_cache_ttl > 0) ? (uint32) dns_cache_ttl : 0;
 
-static ParameterSet *GetWebSearchServiceParameters (Service *service_p, DataResource * UNUSED_PARAM (resource_p), UserDetails * UNUSED_PARAM (user_p))
-{
-	WebSearchServiceData *data_p = (WebSearchServiceData *) (service_p -> se_data_p);
+							/* Resolve the search engine's host now so that the first search doesn't have to */
+							if ((engine_p -> wse_dns_cache_ttl > 0) && (!WarmDnsCache (engine_p -> wse_base_uri_s, engine_p -> wse_dns_cache_ttl)))
+								{
+									PrintLog (STM_LEVEL_FINE, __FILE__, __LINE__, "Not caching the address of \"%s\"", engine_p -> wse_base_uri_s);
+								}
 
-	return (data_p -> wssd_base_data.wsd_params_p);
-}
+							selectors_ss [0] = engine_p -> wse_link_selector_s;
+							selectors_ss [1] = engine_p -> wse_title_selector_s;
+
+							/* These will usually have already been prepared by GetReferenceServices */
+							if (!PrepareSelectors (selectors_ss, 2))
+								{
+									PrintJSONToErrors (STM_LEVEL_SEVERE, __FILE__, __LINE__, op_p, "Invalid link_selector or title_selector");
+								}
+							else if (!InitWebSearchPriority (engine_p, op_p))
+								{
+									PrintJSONToErrors (STM_LEVEL_SEVERE, __FILE__, __LINE__, op_p, "Invalid priority");
+								}
+							else if (!InitWebSearchStructuredData (engine_p, op_p))
+								{
+									PrintJSONToErrors (STM_LEVEL_SEVERE, __FILE__, __LINE__, op_p, "Invalid structured_data");
+								}
+							else if (!InitWebSearchIndex (engine_p, name_s, op_p))
+								{
+									PrintJSONToErrors (STM_LEVEL_SEVERE, __FILE__, __LINE__, op_p, "Invalid local index settings");
+								}
+							else if (!InitWebSearchCanonicalisation (engine_p, op_p))
+								{
+									PrintJSONToErrors (STM_LEVEL_SEVERE, __FILE__, __LINE__, op_p, "Invalid tracking_parameters");
+								}
+							else if (InitWebSearchCache (engine_p, name_s, op_p))
+								{
+									InitWebSearchCircuitBreaker (engine_p, name_s, op_p);
 
+									return engine_p;
+								}
+							else
+								{
+									PrintJSONToErrors (STM_LEVEL_SEVERE, __FILE__, __LINE__, op_p, "Failed to set up results cache");
+								}
 
+						}		/* if ((engine_p -> wse_link_selector_s = GetJSONString (op_p, "link_selector")) != NULL) */
+					else
+						{
+							PrintJSONToErrors (STM_LEVEL_SEVERE, __FILE__, __LINE__, op_p, "Failed to get link_selector value");
+						}
 
-static bool GetWebSearchServiceParameterTypeForNamedParameter (const Service *service_p, const char *param_name_s, ParameterType *pt_p)
-{
-	bool success_flag = false;
-	WebSearchServiceData *data_p = (WebSearchServiceData *) (service_p -> se_data_p);
-	Parameter *param_p = GetParameterFromParameterSetByName (data_p -> wssd_base_data.wsd_params_p, param_name_s);
+				}		/* if ((engine_p -> wse_base_uri_s = EasyCopyToNewString (base_uri_s ? base_uri_s : "")) != NULL) */
 
-	if (param_p)
+			FreeWebSearchEngine (engine_p);
+		}		/* if (engine_p) */
+	else
 		{
-			*pt_p = param_p -> pa_type;
-			success_flag = true;
+			PrintJSONToErrors (STM_LEVEL_SEVERE, __FILE__, __LINE__, op_p, "Failed to allocate WebSearchEngine");
 		}
 
-	return success_flag;
+	return NULL;
 }
 
 
-
-
-static void ReleaseWebSearchServiceParameters (Service * UNUSED_PARAM (service_p), ParameterSet * UNUSED_PARAM (params_p))
+static bool InitWebSearchPriority (WebSearchEngine *engine_p, const json_t *op_p)
 {
-	/*
-	 * As the parameters are cached, we release the parameters when the service is destroyed
-	 * so we need to do anything here.
-	 */
-}
+	const char *priority_s = GetJSONString (op_p, "priority");
+	int queue_wait = S_DEFAULT_QUEUE_WAIT;
 
+	GetJSONInteger (op_p, "queue_wait", &queue_wait);
+	engine_p -> wse_queue_wait = (queue_wait > 0) ? (uint32) queue_wait : 0;
 
-static bool CloseWebSearchService (Service *service_p)
-{
-	bool success_flag = true;
-	WebSearchServiceData *data_p = (WebSearchServiceData *) (service_p -> se_data_p);
+	engine_p -> wse_priority_param_s = GetJSONString (op_p, "priority_parameter");
+	engine_p -> wse_priority = SP_INTERACTIVE;
 
-	FreeWebSearchServiceData (data_p);
-	
-	/*
-	if (service_p -> se_jobs_p)
-		{
-			FreeServiceJobSet (service_p -> se_jobs_p);
-			service_p -> se_jobs_p = 0;
-		}
-	 */
-	return success_flag;
+	return ((priority_s == NULL) || GetSearchPriorityFromString (priority_s, & (engine_p -> wse_priority)));
 }
 
 
-static ServiceJobSet *RunWebSearchService (Service *service_p, ParameterSet *param_set_p, UserDetails * UNUSED_PARAM (user_p), ProvidersStateTable * UNUSED_PARAM (providers_p))
+/*
+ * The strings in the mapping point into the operation's configuration,
+ * which the engine holds a reference to.
+ */
+static bool InitWebSearchStructuredData (WebSearchEngine *engine_p, const json_t *op_p)
 {
-	WebSearchServiceData *service_data_p = (WebSearchServiceData *) (service_p -> se_data_p);
-	WebServiceData *data_p = & (service_data_p -> wssd_base_data);
-	
-	/* We only have one task */
-	service_p -> se_jobs_p = AllocateSimpleServiceJobSet (service_p, NULL, "Web Search Service Job");
+	const json_t *structured_data_p = json_object_get (op_p, "structured_data");
 
-	if (service_p -> se_jobs_p)
+	if (structured_data_p)
 		{
-			ServiceJob *job_p = GetServiceJobFromServiceJobSet (service_p -> se_jobs_p, 0);
-
-			SetServiceJobStatus (job_p, OS_FAILED_TO_START);
+			StructuredDataMapping *mapping_p = & (engine_p -> wse_structured_data);
 
-			if (param_set_p)
+			if (json_is_object (structured_data_p))
 				{
-					bool success_flag = true;
-
-					ResetByteBuffer (data_p -> wsd_buffer_p);
-
-					switch (data_p -> wsd_method)
+					if ((mapping_p -> sdm_uri_path_s = GetJSONString (structured_data_p, "uri")) != NULL)
 						{
-							case SM_POST:
-								success_flag = AddParametersToPostWebService (data_p, param_set_p);
-								break;
-
-							case SM_GET:
-								success_flag = AddParametersToGetWebService (data_p, param_set_p);
-								break;
+							if ((mapping_p -> sdm_script_type_s = GetJSONString (structured_data_p, "script_type")) == NULL)
+								{
+									mapping_p -> sdm_script_type_s = S_DEFAULT_STRUCTURED_DATA_SCRIPT_TYPE_S;
+								}
 
-							case SM_BODY:
-								success_flag = AddParametersToBodyWebService (data_p, param_set_p);
-								break;
+							mapping_p -> sdm_script_id_s = GetJSONString (structured_data_p, "script_id");
+							mapping_p -> sdm_data_type_s = GetJSONString (structured_data_p, "type");
+							mapping_p -> sdm_results_path_s = GetJSONString (structured_data_p, "results");
+							mapping_p -> sdm_title_path_s = GetJSONString (structured_data_p, "title");
+							mapping_p -> sdm_snippet_path_s = GetJSONString (structured_data_p, "snippet");
 
-							default:
-								break;
+							engine_p -> wse_structured_data_flag = true;
 						}
-
-					if (success_flag)
+					else
+						{
+							PrintJSONToErrors (STM_LEVEL_SEVERE, __FILE__, __LINE__, structured_data_p, "Failed to get uri value");
+						}
+				}
+
+			return engine_p -> wse_structured_data_flag;
+		}
+
+	return true;
+}
+
+
+/*
+ * Answering searches from the index needs it to be built, so local_first
+ * turns on indexing too.
+ */
+static bool InitWebSearchIndex (WebSearchEngine *engine_p, const char *name_s, const json_t *op_p)
+{
+	bool index_flag = false;
+	bool success_flag = true;
+
+	GetJSONBoolean (op_p, "local_index", &index_flag);
+	GetJSONBoolean (op_p, "local_first", & (engine_p -> wse_local_first_flag));
+
+	if (index_flag || engine_p -> wse_local_first_flag)
+		{
+			int size = S_DEFAULT_LOCAL_INDEX_SIZE;
+			int max_results = S_DEFAULT_LOCAL_INDEX_MAX_RESULTS;
+
+			GetJSONInteger (op_p, "local_index_size", &size);
+			GetJSONInteger (op_p, "local_index_max_results", &max_results);
+
+			engine_p -> wse_index_max_results = (max_results > 0) ? (uint32) max_results : 0;
+			engine_p -> wse_index_query_param_s = GetJSONString (op_p, "local_index_query_parameter");
+
+			if (size > 0)
+				{
+					if ((engine_p -> wse_index_p = GetResultIndex (name_s, engine_p -> wse_base_uri_s, (uint32) size)) == NULL)
+						{
+							success_flag = false;
+						}
+				}
+
+			if (engine_p -> wse_local_first_flag && ((engine_p -> wse_index_p == NULL) || (engine_p -> wse_index_query_param_s == NULL)))
+				{
+					PrintJSONToErrors (STM_LEVEL_SEVERE, __FILE__, __LINE__, op_p, "local_first needs local_index_size and local_index_query_parameter");
+					success_flag = false;
+				}
+		}
+
+	return success_flag;
+}
+
+
+/*
+ * The names of the configured parameters point into the operation's
+ * configuration, which the engine holds a reference to.
+ */
+static bool InitWebSearchCanonicalisation (WebSearchEngine *engine_p, const json_t *op_p)
+{
+	GetJSONBoolean (op_p, "canonical_uris", & (engine_p -> wse_canonical_flag));
+
+	if (engine_p -> wse_canonical_flag)
+		{
+			const json_t *params_p = json_object_get (op_p, "tracking_parameters");
+			UriCanonicalisation *canonical_p = & (engine_p -> wse_canonical);
+
+			if (params_p)
+				{
+					const size_t num_params = json_array_size (params_p);
+					size_t i;
+
+					if (!json_is_array (params_p))
+						{
+							PrintJSONToErrors (STM_LEVEL_SEVERE, __FILE__, __LINE__, params_p, "tracking_parameters is not an array");
+							return false;
+						}
+
+					if (num_params > 0)
+						{
+							if ((engine_p -> wse_removed_params_ss = (const char **) AllocMemoryArray (num_params, sizeof (const char *))) == NULL)
+								{
+									PrintErrors (STM_LEVEL_SEVERE, __FILE__, __LINE__, "Failed to allocate %lu tracking parameters", (unsigned long) num_params);
+									return false;
+								}
+
+							for (i = 0; i < num_params; ++ i)
+								{
+									const json_t *param_p = json_array_get (params_p, i);
+
+									if (!json_is_string (param_p))
+										{
+											PrintJSONToErrors (STM_LEVEL_SEVERE, __FILE__, __LINE__, param_p, "Tracking parameter is not a string");
+											return false;
+										}
+
+									engine_p -> wse_removed_params_ss [i] = json_string_value (param_p);
+								}
+						}
+
+					canonical_p -> uc_removed_params_ss = engine_p -> wse_removed_params_ss;
+					canonical_p -> uc_num_removed_params = num_params;
+				}
+			else
+				{
+					canonical_p -> uc_removed_params_ss = S_DEFAULT_TRACKING_PARAMETERS_SS;
+					canonical_p -> uc_num_removed_params = sizeof (S_DEFAULT_TRACKING_PARAMETERS_SS) / sizeof (S_DEFAULT_TRACKING_PARAMETERS_SS [0]);
+				}
+		}
+
+	return true;
+}
+
+
+/*
+ * The scheduler and the memory budget are shared by every operation, so
+ * rather than letting each operation's reference file change them, they
+ * are set from the server's settings for the plugin as a whole. Each time
+ * that the services are loaded, these replace the previous settings.
+ */
+static void ConfigureSharedSearchLimits (GrassrootsServer *grassroots_p)
+{
+	bool alloc_flag = false;
+	json_t *plugin_config_p = GetGlobalServiceConfig (grassroots_p, S_PLUGIN_NAME_S, &alloc_flag);
+	int memory_budget = 0;
+
+	if (plugin_config_p)
+		{
+			const json_t *scheduler_p = json_object_get (plugin_config_p, "search_scheduler");
+
+			if (scheduler_p)
+				{
+					static const char * const S_CLASS_NAMES_SS [SP_NUM_PRIORITIES] = { "interactive", "bulk" };
+					SearchClassLimits limits [SP_NUM_PRIORITIES];
+					int max_running = 0;
+					int i;
+
+					GetJSONInteger (scheduler_p, "max_concurrent_searches", &max_running);
+
+					for (i = 0; i < SP_NUM_PRIORITIES; ++ i)
+						{
+							const json_t *class_p = json_object_get (scheduler_p, S_CLASS_NAMES_SS [i]);
+							int class_max_running = 0;
+							int weight = (i == SP_INTERACTIVE) ? S_DEFAULT_INTERACTIVE_WEIGHT : S_DEFAULT_BULK_WEIGHT;
+
+							if (class_p)
+								{
+									GetJSONInteger (class_p, "max_concurrent_searches", &class_max_running);
+									GetJSONInteger (class_p, "weight", &weight);
+								}
+
+							limits [i].scl_max_running = (class_max_running > 0) ? (uint32) class_max_running : 0;
+							limits [i].scl_weight = (weight > 0) ? (uint32) weight : 1;
+						}
+
+					SetSearchSchedulerLimits ((max_running > 0) ? (uint32) max_running : 0, limits);
+				}
+
+			GetJSONInteger (plugin_config_p, "memory_budget", &memory_budget);
+
+			if (alloc_flag)
+				{
+					json_decref (plugin_config_p);
+				}
+		}
+
+	SetMemoryBudget ((memory_budget > 0) ? (size_t) memory_budget : 0);
+}
+
+
+static void FreeWebSearchEngine (void *engine_p)
+{
+	WebSearchEngine *wse_p = (WebSearchEngine *) engine_p;
+
+	if (wse_p -> wse_op_p)
+		{
+			json_decref (wse_p -> wse_op_p);
+		}
+
+	if (wse_p -> wse_base_uri_s)
+		{
+			FreeCopiedString (wse_p -> wse_base_uri_s);
+		}
+
+	if (wse_p -> wse_removed_params_ss)
+		{
+			FreeMemory (wse_p -> wse_removed_params_ss);
+		}
+
+	FreeMemory (wse_p);
+}
+
+
+/*
+ * Called when the watched configuration file has changed. If this
+ * operation's settings are different and valid, a new WebSearchEngine
+ * is built for them and if they are the same, the current one is kept.
+ */
+static void *ReloadWebSearchEngine (const json_t *config_p, const void *current_p, void *data_p)
+{
+	const WebSearchServiceData *service_data_p = (const WebSearchServiceData *) data_p;
+	const WebSearchEngine *current_engine_p = (const WebSearchEngine *) current_p;
+	const char *name_s = service_data_p -> wssd_base_data.wsd_name_s;
+	void *engine_p = NULL;
+	char *base_uri_s = NULL;
+	json_t *service_config_p = FindWebSearchServiceConfig (config_p, name_s, &base_uri_s);
+
+	if (service_config_p)
+		{
+			json_t *op_p = json_object_get (service_config_p, OPERATION_S);
+
+			if ((strcmp (base_uri_s, current_engine_p -> wse_base_uri_s) != 0) || (!json_equal (op_p, current_engine_p -> wse_op_p)))
+				{
+					engine_p = AllocateWebSearchEngine (op_p, name_s, base_uri_s);
+
+					if (engine_p)
+						{
+							PrintLog (STM_LEVEL_INFO, __FILE__, __LINE__, "Reloaded the configuration for \"%s\"", name_s);
+						}
+					else
+						{
+							PrintErrors (STM_LEVEL_WARNING, __FILE__, __LINE__, "Keeping the previous configuration for \"%s\" as the new one is invalid", name_s);
+						}
+				}
+			else
+				{
+					/* Only another operation's settings have changed */
+					engine_p = (void *) current_p;
+				}
+
+			FreeCopiedString (base_uri_s);
+		}
+
+	return engine_p;
+}
+
+
+/*
+ * Find the service configuration for the named operation anywhere within
+ * a configuration file, also getting its base URI. The services' settings,
+ * such as their names and URIs, are read in the same way that they were
+ * when the services were first built.
+ */
+static json_t *FindWebSearchServiceConfig (const json_t *json_p, const char *name_s, char **base_uri_ss)
+{
+	if (json_is_object (json_p))
+		{
+			const json_t *op_p = json_object_get (json_p, OPERATION_S);
+			const char *key_s;
+			json_t *value_p;
+
+			if (json_is_object (op_p))
+				{
+					WebServiceData data;
+					json_t *service_config_p = NULL;
+
+					memset (&data, 0, sizeof (WebServiceData));
+
+					if (InitWebServiceData (&data, (json_t *) json_p))
+						{
+							if ((data.wsd_name_s) && (strcmp (data.wsd_name_s, name_s) == 0))
+								{
+									if ((*base_uri_ss = EasyCopyToNewString (data.wsd_base_uri_s ? data.wsd_base_uri_s : "")) != NULL)
+										{
+											service_config_p = (json_t *) json_p;
+										}
+								}
+
+							ClearWebServiceData (&data);
+						}
+
+					return service_config_p;
+				}
+
+			json_object_foreach ((json_t *) json_p, key_s, value_p)
+				{
+					json_t *service_config_p = FindWebSearchServiceConfig (value_p, name_s, base_uri_ss);
+
+					if (service_config_p)
+						{
+							return service_config_p;
+						}
+				}
+		}
+	else if (json_is_array (json_p))
+		{
+			size_t i;
+			json_t *value_p;
+
+			json_array_foreach (json_p, i, value_p)
+				{
+					json_t *service_config_p = FindWebSearchServiceConfig (value_p, name_s, base_uri_ss);
+
+					if (service_config_p)
+						{
+							return service_config_p;
+						}
+				}
+		}
+
+	return NULL;
+}
+
+
+static bool InitWebSearchCache (WebSearchEngine *engine_p, const char *name_s, const json_t *op_p)
+{
+	bool success_flag = true;
+	int ttl = S_DEFAULT_CACHE_TTL;
+	int size = S_DEFAULT_CACHE_SIZE;
+	int stale_ttl = S_DEFAULT_CACHE_STALE_TTL;
+	int max_refreshes = S_DEFAULT_MAX_REFRESHES;
+
+	engine_p -> wse_cache_p = NULL;
+
+	GetJSONInteger (op_p, "cache_ttl", &ttl);
+	GetJSONInteger (op_p, "cache_size", &size);
+	GetJSONInteger (op_p, "cache_stale_ttl", &stale_ttl);
+	GetJSONInteger (op_p, "max_background_refreshes", &max_refreshes);
+
+	engine_p -> wse_max_refreshes = (max_refreshes > 0) ? (uint32) max_refreshes : 0;
+
+	if ((ttl > 0) && (size > 0))
+		{
+			engine_p -> wse_cache_p = GetResultCache (name_s, engine_p -> wse_base_uri_s, (uint32) size, (uint32) ttl, (stale_ttl > 0) ? (uint32) stale_ttl : 0);
+
+			if (engine_p -> wse_cache_p)
+				{
+					const char *disk_cache_path_s = GetJSONString (op_p, "disk_cache_path");
+					int negative_size = S_DEFAULT_NEGATIVE_CACHE_SIZE;
+					int empty_ttl = S_DEFAULT_EMPTY_RESULTS_TTL;
+					int failed_ttl = S_DEFAULT_FAILED_RESULTS_TTL;
+
+					GetJSONInteger (op_p, "negative_cache_size", &negative_size);
+					GetJSONInteger (op_p, "empty_results_ttl", &empty_ttl);
+					GetJSONInteger (op_p, "failed_results_ttl", &failed_ttl);
+
+					SetNegativeCaching (engine_p -> wse_cache_p, (negative_size > 0) ? (uint32) negative_size : 0, (empty_ttl > 0) ? (uint32) empty_ttl : 0, (failed_ttl > 0) ? (uint32) failed_ttl : 0);
+
+					if (disk_cache_path_s)
+						{
+							int disk_cache_size = size;
+
+							GetJSONInteger (op_p, "disk_cache_size", &disk_cache_size);
+
+							/* We can still run without the persistent tier */
+							if ((disk_cache_size <= 0) || (!AttachDiskCache (engine_p -> wse_cache_p, disk_cache_path_s, (uint32) disk_cache_size)))
+								{
+									PrintJSONToErrors (STM_LEVEL_WARNING, __FILE__, __LINE__, op_p, "Failed to open disk cache at \"%s\"", disk_cache_path_s);
+								}
+						}
+				}
+			else
+				{
+					success_flag = false;
+				}
+		}
+
+	return success_flag;
+}
+
+
+static bool InitWebSearchTransfer (WebSearchServiceData *data_p, const json_t *op_p)
+{
+	int idle_time = S_DEFAULT_IDLE_RELEASE_TIME;
+
+	data_p -> wssd_compress_flag = true;
+
+	GetJSONBoolean (op_p, "compressed_transfer", & (data_p -> wssd_compress_flag));
+	GetJSONInteger (op_p, "idle_release_time", &idle_time);
+
+	/*
+	 * InitWebServiceData has already made a curl tool and buffer, but most
+	 * services are rarely used so we drop them until the first request.
+	 */
+	ReleaseWebSearchTransfer (data_p);
+
+	data_p -> wssd_transfer_p = AllocateIdleResource (CreateWebSearchTransfer, ReleaseWebSearchTransfer, data_p, (idle_time > 0) ? (uint32) idle_time : 0);
+
+	return (data_p -> wssd_transfer_p != NULL);
+}
+
+
+static bool CreateWebSearchTransfer (void *data_p)
+{
+	WebSearchServiceData *service_data_p = (WebSearchServiceData *) data_p;
+	WebServiceData *base_data_p = & (service_data_p -> wssd_base_data);
+
+	if ((base_data_p -> wsd_curl_data_p = AllocateCurlTool (CM_MEMORY)) != NULL)
+		{
+			if (SetCurlToolCompression (base_data_p -> wsd_curl_data_p, service_data_p -> wssd_compress_flag))
+				{
+					if ((base_data_p -> wsd_buffer_p = AllocateByteBuffer (1024)) != NULL)
+						{
+							return true;
+						}
+				}
+
+			FreeCurlTool (base_data_p -> wsd_curl_data_p);
+			base_data_p -> wsd_curl_data_p = NULL;
+		}
+
+	return false;
+}
+
+
+static void ReleaseWebSearchTransfer (void *data_p)
+{
+	WebServiceData *base_data_p = & (((WebSearchServiceData *) data_p) -> wssd_base_data);
+
+	if (base_data_p -> wsd_curl_data_p)
+		{
+			FreeCurlTool (base_data_p -> wsd_curl_data_p);
+			base_data_p -> wsd_curl_data_p = NULL;
+		}
+
+	if (base_data_p -> wsd_buffer_p)
+		{
+			FreeByteBuffer (base_data_p -> wsd_buffer_p);
+			base_data_p -> wsd_buffer_p = NULL;
+		}
+}
+
+
+static void PrepareWebSearchSelectors (const json_t *config_p)
+{
+	const size_t num_selectors = CollectWebSearchSelectors (config_p, NULL, 0);
+
+	if (num_selectors > 0)
+		{
+			const char **selectors_ss = (const char **) AllocMemory (num_selectors * sizeof (const char *));
+
+			if (selectors_ss)
+				{
+					CollectWebSearchSelectors (config_p, selectors_ss, 0);
+
+					/* Any invalid selectors are reported and their services rejected as they are built */
+					PrepareSelectors (selectors_ss, num_selectors);
+
+					FreeMemory (selectors_ss);
+				}
+		}
+}
+
+
+/*
+ * Walk through the configuration finding every link and title selector.
+ * If selectors_ss is NULL, they are just counted.
+ */
+static size_t CollectWebSearchSelectors (const json_t *json_p, const char **selectors_ss, size_t num_selectors)
+{
+	if (json_is_object (json_p))
+		{
+			const char *key_s;
+			json_t *value_p;
+
+			json_object_foreach ((json_t *) json_p, key_s, value_p)
+				{
+					if (json_is_string (value_p))
+						{
+							/* An empty title_selector is the same as not having one */
+							if (((strcmp (key_s, "link_selector") == 0) || (strcmp (key_s, "title_selector") == 0)) && (* (json_string_value (value_p)) != '\0'))
+								{
+									if (selectors_ss)
+										{
+											selectors_ss [num_selectors] = json_string_value (value_p);
+										}
+
+									++ num_selectors;
+								}
+						}
+					else
+						{
+							num_selectors = CollectWebSearchSelectors (value_p, selectors_ss, num_selectors);
+						}
+				}
+		}
+	else if (json_is_array (json_p))
+		{
+			size_t i;
+			json_t *value_p;
+
+			json_array_foreach (json_p, i, value_p)
+				{
+					num_selectors = CollectWebSearchSelectors (value_p, selectors_ss, num_selectors);
+				}
+		}
+
+	return num_selectors;
+}
+
+
+static void InitWebSearchCircuitBreaker (WebSearchEngine *engine_p, const char *name_s, const json_t *op_p)
+{
+	int threshold = 0;
+	int window = S_DEFAULT_BREAKER_WINDOW;
+	int open_time = S_DEFAULT_BREAKER_OPEN_TIME;
+
+	engine_p -> wse_breaker_p = NULL;
+
+	GetJSONInteger (op_p, "circuit_breaker_failures", &threshold);
+	GetJSONInteger (op_p, "circuit_breaker_window", &window);
+	GetJSONInteger (op_p, "circuit_breaker_open_time", &open_time);
+
+	if (threshold > 0)
+		{
+			engine_p -> wse_breaker_p = GetCircuitBreaker (name_s, (uint32) threshold, (window > 0) ? (uint32) window : 0, (open_time > 0) ? (uint32) open_time : 0);
+
+			/* We can still run without it */
+			if (! (engine_p -> wse_breaker_p))
+				{
+					PrintJSONToErrors (STM_LEVEL_WARNING, __FILE__, __LINE__, op_p, "Failed to set up circuit breaker");
+				}
+		}
+}
+
+
+/*
+ * Send the request to the search engine unless its circuit breaker is open.
+ * Server errors and rate limiting count as failures for the breaker as well
+ * as requests that could not be sent or that timed out. Any other error
+ * response, such as "404 Not Found", means that the search engine is up so
+ * it doesn't count against the breaker, but the search has still failed.
+ */
+/*
+ * If the search engine's circuit breaker is open, it isn't called and
+ * the search gets an error saying to try again later. Since this says
+ * nothing about the request itself, it shouldn't be remembered as a
+ * failed search.
+ */
+static WebSearchCallResult CallWebSearchEngine (WebSearchServiceData *data_p, const WebSearchEngine *engine_p, SearchJob *search_p)
+{
+	WebServiceData *base_data_p = & (data_p -> wssd_base_data);
+	uint32 ticket = 0;
+	WebSearchCallResult result = WSCR_FAILED;
+	bool available_flag = false;
+
+	if ((engine_p -> wse_breaker_p == NULL) || AllowCircuitBreakerRequest (engine_p -> wse_breaker_p, &ticket))
+		{
+			struct curl_slist *hosts_p = (engine_p -> wse_dns_cache_ttl > 0) ? SetCurlToolResolvedHost (base_data_p -> wsd_curl_data_p, engine_p -> wse_base_uri_s) : NULL;
+			const uint64 fetch_start = BeginTraceSpan ();
+			const bool called_flag = CallCurlWebservice (base_data_p);
+
+			ClearCurlToolResolvedHost (base_data_p -> wsd_curl_data_p, hosts_p);
+
+			if (fetch_start)
+				{
+					AddTransferTraceSpans (base_data_p -> wsd_curl_data_p, fetch_start);
+				}
+
+			if (called_flag)
+				{
+					const long code = GetCurlToolResponseCode (base_data_p -> wsd_curl_data_p);
+
+					available_flag = !IsFailedWebSearchResponse (code);
+
+					if (IsErrorWebSearchResponse (code))
+						{
+							PrintErrors (STM_LEVEL_WARNING, __FILE__, __LINE__, "\"%s\" returned HTTP status %ld", base_data_p -> wsd_name_s, code);
+						}
+					else
+						{
+							result = WSCR_SUCCEEDED;
+						}
+				}
+
+			if (engine_p -> wse_breaker_p)
+				{
+					RecordCircuitBreakerResult (engine_p -> wse_breaker_p, ticket, available_flag);
+				}
+		}
+	else
+		{
+			PrintErrors (STM_LEVEL_WARNING, __FILE__, __LINE__, "Not calling \"%s\" as its circuit breaker is open", base_data_p -> wsd_name_s);
+			AddSearchJobError (search_p, "The search engine is unavailable, please try again later");
+			result = WSCR_REFUSED;
+		}
+
+	return result;
+}
+
+
+/*
+ * In incremental mode, the results are added to the job in batches as they
+ * are extracted and then replaced with the full set once they are all done.
+ * A synchronous job can't be polled until then, so there's no point.
+ */
+static SearchJob *GetIncrementalSearchJob (const WebSearchServiceData *data_p, const WebSearchEngine *engine_p, SearchJob *search_p)
+{
+	return (engine_p -> wse_incremental_flag && data_p -> wssd_async_flag) ? search_p : NULL;
+}
+
+
+/*
+ * curl gives the time at which each stage of the transfer finished so
+ * each span runs from the end of the one before it.
+ */
+static void AddTransferTraceSpans (CurlTool *tool_p, const uint64 start)
+{
+	TransferTimings timings;
+
+	EndTraceSpan ("fetch", start);
+
+	if (GetCurlToolTimings (tool_p, &timings))
+		{
+			const curl_off_t connected = (timings.tt_app_connect > 0) ? timings.tt_app_connect : timings.tt_connect;
+
+			AddTraceSpan ("dns", start, GetTransferStageLength (0, timings.tt_name_lookup));
+			AddTraceSpan ("connect", start + timings.tt_name_lookup, GetTransferStageLength (timings.tt_name_lookup, timings.tt_connect));
+
+			if (timings.tt_app_connect > 0)
+				{
+					AddTraceSpan ("tls", start + timings.tt_connect, GetTransferStageLength (timings.tt_connect, timings.tt_app_connect));
+				}
+
+			AddTraceSpan ("first byte", start + connected, GetTransferStageLength (connected, timings.tt_start_transfer));
+			AddTraceSpan ("transfer", start + timings.tt_start_transfer, GetTransferStageLength (timings.tt_start_transfer, timings.tt_total));
+		}
+}
+
+
+static uint64 GetTransferStageLength (const curl_off_t from, const curl_off_t to)
+{
+	return (to > from) ? (uint64) (to - from) : 0;
+}
+
+
+/* The responses that show that the search engine is failing or overloaded */
+static bool IsFailedWebSearchResponse (const long response_code)
+{
+	return ((response_code >= 500) || (response_code == 429));
+}
+
+
+/* The responses that don't have any results in them */
+static bool IsErrorWebSearchResponse (const long response_code)
+{
+	return (response_code >= 400);
+}
+
+
+static void FreeWebSearchServiceData (WebSearchServiceData *data_p)
+{
+	json_t *stats_p = (data_p -> wssd_base_data.wsd_name_s) ? GetAllocationStatsAsJSON (data_p -> wssd_base_data.wsd_name_s) : NULL;
+
+	if (stats_p)
+		{
+			PrintJSONToLog (STM_LEVEL_INFO, __FILE__, __LINE__, stats_p, "Allocations for \"%s\": ", data_p -> wssd_base_data.wsd_name_s);
+			json_decref (stats_p);
+		}
+
+	if (data_p -> wssd_transfer_p)
+		{
+			FreeIdleResource (data_p -> wssd_transfer_p);
+		}
+
+	if (data_p -> wssd_engines_p)
+		{
+			FreeConfigWatcher (data_p -> wssd_engines_p);
+		}
+
+	data_p -> wssd_base_data.wsd_base_uri_s = data_p -> wssd_original_uri_s;
+	ClearWebServiceData (& (data_p -> wssd_base_data));
+	
+	FreeMemory (data_p);
+}
+
+
+static const char *GetWebSearchServiceName (const Service *service_p)
+{
+	WebSearchServiceData *data_p = (WebSearchServiceData *) (service_p -> se_data_p);
+	
+	return (data_p -> wssd_base_data.wsd_name_s);
+}
+
+
+static const char *GetWebSearchServiceDescription (const Service *service_p)
+{
+	WebSearchServiceData *data_p = (WebSearchServiceData *) (service_p -> se_data_p);
+
+	return (data_p -> wssd_base_data.wsd_description_s);
+}
+
+
+static const char *GetWebSearchServiceAlias (const Service *service_p)
+{
+	WebSearchServiceData *data_p = (WebSearchServiceData *) (service_p -> se_data_p);
+
+	return (data_p -> wssd_base_data.wsd_alias_s);
+}
+
+
+
+static const char *GetWebSearchServiceInformationUri (const Service *service_p)
+{
+	WebSearchServiceData *data_p = (WebSearchServiceData *) (service_p -> se_data_p);
+
+	return (data_p -> wssd_base_data.wsd_info_uri_s);
+}
+
+
+static ParameterSet *GetWebSearchServiceParameters (Service *service_p, DataResource * UNUSED_PARAM (resource_p), UserDetails * UNUSED_PARAM (user_p))
+{
+	WebSearchServiceData *data_p = (WebSearchServiceData *) (service_p -> se_data_p);
+
+	return (data_p -> wssd_base_data.wsd_params_p);
+}
+
+
+
+static bool GetWebSearchServiceParameterTypeForNamedParameter (const Service *service_p, const char *param_name_s, ParameterType *pt_p)
+{
+	bool success_flag = false;
+	WebSearchServiceData *data_p = (WebSearchServiceData *) (service_p -> se_data_p);
+	Parameter *param_p = GetParameterFromParameterSetByName (data_p -> wssd_base_data.wsd_params_p, param_name_s);
+
+	if (param_p)
+		{
+			*pt_p = param_p -> pa_type;
+			success_flag = true;
+		}
+
+	return success_flag;
+}
+
+
+
+
+static void ReleaseWebSearchServiceParameters (Service * UNUSED_PARAM (service_p), ParameterSet * UNUSED_PARAM (params_p))
+{
+	/*
+	 * As the parameters are cached, we release the parameters when the service is destroyed
+	 * so we need to do anything here.
+	 */
+}
+
+
+static bool CloseWebSearchService (Service *service_p)
+{
+	bool success_flag = true;
+	WebSearchServiceData *data_p = (WebSearchServiceData *) (service_p -> se_data_p);
+
+	FreeWebSearchServiceData (data_p);
+	
+	/*
+	if (service_p -> se_jobs_p)
+		{
+			FreeServiceJobSet (service_p -> se_jobs_p);
+			service_p -> se_jobs_p = 0;
+		}
+	 */
+	return success_flag;
+}
+
+
+static ServiceJobSet *RunWebSearchService (Service *service_p, ParameterSet *param_set_p, UserDetails * UNUSED_PARAM (user_p), ProvidersStateTable * UNUSED_PARAM (providers_p))
+{
+	WebSearchServiceData *service_data_p = (WebSearchServiceData *) (service_p -> se_data_p);
+
+	/* We only have one task */
+	service_p -> se_jobs_p = AllocateSimpleServiceJobSet (service_p, NULL, "Web Search Service Job");
+
+	if (service_p -> se_jobs_p)
+		{
+			ServiceJob *job_p = GetServiceJobFromServiceJobSet (service_p -> se_jobs_p, 0);
+			WebSearchTask *task_p = NULL;
+			bool transfer_flag = false;
+			bool handed_off_flag = false;
+
+			SetServiceJobStatus (job_p, OS_FAILED_TO_START);
+
+			/*
+			 * A search that will run in the background gets a transfer of its own, since
+			 * another request can start before it has finished. Otherwise the service's
+			 * curl tool and buffer are used, which are created here if this is the first
+			 * request for a while.
+			 */
+			if (param_set_p)
+				{
+					if (service_data_p -> wssd_async_flag)
+						{
+							if ((task_p = AllocateWebSearchTask (service_data_p)) != NULL)
+								{
+									service_data_p = & (task_p -> wst_service_data);
+									transfer_flag = true;
+								}
+						}
+					else
+						{
+							transfer_flag = AcquireIdleResource (service_data_p -> wssd_transfer_p);
+						}
+				}
+
+			/*
+			 * The request uses whichever version of the settings is current now for all
+			 * of its work, even if the configuration is reloaded in the meantime.
+			 */
+			if (transfer_flag)
+				{
+					WebServiceData *data_p = & (service_data_p -> wssd_base_data);
+					ConfigVersion *version_p = AcquireConfigVersion (service_data_p -> wssd_engines_p);
+
+					if (version_p)
+						{
+							const WebSearchEngine *engine_p = (const WebSearchEngine *) GetConfigVersionData (version_p);
+							bool success_flag = true;
+							const bool trace_flag = (engine_p -> wse_trace_file_s != NULL) && StartRequestTrace (data_p -> wsd_name_s, engine_p -> wse_trace_sample_rate);
+							const uint64 search_start = BeginTraceSpan ();
+							uint64 span_start;
+
+							data_p -> wsd_base_uri_s = engine_p -> wse_base_uri_s;
+
+							ResetByteBuffer (data_p -> wsd_buffer_p);
+
+							span_start = BeginTraceSpan ();
+
+							switch (data_p -> wsd_method)
+								{
+									case SM_POST:
+										success_flag = AddParametersToPostWebService (data_p, param_set_p);
+										break;
+
+									case SM_GET:
+										success_flag = AddParametersToGetWebService (data_p, param_set_p);
+										break;
+
+									case SM_BODY:
+										success_flag = AddParametersToBodyWebService (data_p, param_set_p);
+										break;
+
+									default:
+										break;
+								}
+
+							EndTraceSpan ("encode parameters", span_start);
+
+							if (success_flag)
+								{
+									SearchJob *search_p = AllocateSearchJob ();
+
+									if (search_p)
+										{
+											json_t *results_p = NULL;
+
+											SetServiceJobStatus (job_p, OS_STARTED);
+
+											/* A search that the local index can answer doesn't need to wait for the search engine */
+											if (engine_p -> wse_local_first_flag)
+												{
+													results_p = GetLocalWebSearchResults (service_data_p, version_p, param_set_p);
+												}
+
+											if (results_p)
+												{
+													FinishSearchJob (search_p, results_p);
+												}
+											else
+												{
+													const SearchPriority priority = GetWebSearchPriority (engine_p, param_set_p);
+
+													if (task_p)
+														{
+															StartBackgroundWebSearch (task_p, version_p, priority, search_start, search_p, job_p);
+															handed_off_flag = true;
+														}
+													else
+														{
+															FinishSearchJob (search_p, RunQueuedWebSearch (service_data_p, version_p, priority, search_p));
+														}
+												}
+
+											/*
+											 * The job isn't visible to anything else yet, so this can't race with
+											 * a background search's update function.
+											 */
+											UpdateServiceJobFromSearchJob (search_p, job_p);
+											FreeSearchJob (search_p);
+										}		/* if (search_p) */
+
+								}		/* if (success_flag) */
+
+							/* A background search has taken over the request's trace */
+							if (trace_flag && !handed_off_flag)
+								{
+									EndTraceSpan ("search", search_start);
+									FinishRequestTrace (engine_p -> wse_trace_file_s, engine_p -> wse_trace_max_file_size);
+								}
+
+							/* A background search releases the settings and its transfer once it has finished */
+							if (!handed_off_flag)
+								{
+									ReleaseConfigVersion (version_p);
+								}
+						}		/* if (version_p) */
+
+					if (!handed_off_flag)
+						{
+							if (task_p)
+								{
+									FreeWebSearchTask (task_p);
+								}
+							else
+								{
+									ReleaseIdleResource (service_data_p -> wssd_transfer_p);
+								}
+						}
+				}		/* if (transfer_flag) */
+
+		}
+
+	return service_p -> se_jobs_p;
+}
+
+
+/*
+ * Searches are started by priority class so that bulk searches can't
+ * crowd out interactive ones.
+ */
+static json_t *RunQueuedWebSearch (WebSearchServiceData *service_data_p, const ConfigVersion *version_p, const SearchPriority priority, SearchJob *search_p)
+{
+	const WebSearchEngine *engine_p = (const WebSearchEngine *) GetConfigVersionData (version_p);
+	json_t *results_p = NULL;
+	const uint64 span_start = BeginTraceSpan ();
+	const bool started_flag = AcquireSearchSlot (priority, engine_p -> wse_queue_wait);
+
+	EndTraceSpan ("queue", span_start);
+
+	if (started_flag)
+		{
+			results_p = RunLimitedWebSearch (service_data_p, version_p, search_p);
+			ReleaseSearchSlot (priority);
+		}
+	else
+		{
+			PrintErrors (STM_LEVEL_WARNING, __FILE__, __LINE__, "Timed out waiting to search \"%s\"", service_data_p -> wssd_base_data.wsd_name_s);
+			AddSearchJobError (search_p, "The server is too busy to run the search, please try again later");
+		}
+
+	return results_p;
+}
+
+
+/*
+ * Make a copy of the service's data with a curl tool and buffer of its
+ * own for a search that will be run in the background.
+ */
+static WebSearchTask *AllocateWebSearchTask (const WebSearchServiceData *service_data_p)
+{
+	WebSearchTask *task_p = (WebSearchTask *) AllocMemory (sizeof (WebSearchTask));
+
+	if (task_p)
+		{
+			memset (task_p, 0, sizeof (WebSearchTask));
+
+			task_p -> wst_service_data = *service_data_p;
+			task_p -> wst_service_data.wssd_base_data.wsd_curl_data_p = NULL;
+			task_p -> wst_service_data.wssd_base_data.wsd_buffer_p = NULL;
+
+			if (CreateWebSearchTransfer (& (task_p -> wst_service_data)))
+				{
+					return task_p;
+				}
+
+			FreeMemory (task_p);
+		}
+
+	PrintErrors (STM_LEVEL_WARNING, __FILE__, __LINE__, "Failed to allocate background search for \"%s\"", service_data_p -> wssd_base_data.wsd_name_s);
+
+	return NULL;
+}
+
+
+/*
+ * Hand the search over to a thread of its own along with the request's
+ * version of the settings and its trace. The task is handed over even if
+ * the thread could not be started, in which case the search will have
+ * finished with an error.
+ */
+static void StartBackgroundWebSearch (WebSearchTask *task_p, ConfigVersion *version_p, const SearchPriority priority, const uint64 search_start, SearchJob *search_p, ServiceJob *job_p)
+{
+	task_p -> wst_version_p = version_p;
+	task_p -> wst_priority = priority;
+	task_p -> wst_trace_p = DetachRequestTrace ();
+	task_p -> wst_search_start = search_start;
+
+	if (!RunSearchJobInBackground (search_p, job_p, RunBackgroundWebSearch, FreeWebSearchTask, task_p))
+		{
+			AddSearchJobError (search_p, "The server is too busy to run the search, please try again later");
+			FinishSearchJob (search_p, NULL);
+		}
+}
+
+
+static json_t *RunBackgroundWebSearch (SearchJob *search_p, void *data_p)
+{
+	WebSearchTask *task_p = (WebSearchTask *) data_p;
+	const WebSearchEngine *engine_p = (const WebSearchEngine *) GetConfigVersionData (task_p -> wst_version_p);
+	json_t *results_p;
+
+	/* The rest of the search is part of the trace of the request that started it */
+	AttachRequestTrace (task_p -> wst_trace_p);
+	task_p -> wst_trace_p = NULL;
+
+	results_p = RunQueuedWebSearch (& (task_p -> wst_service_data), task_p -> wst_version_p, task_p -> wst_priority, search_p);
+
+	EndTraceSpan ("search", task_p -> wst_search_start);
+	FinishRequestTrace (engine_p -> wse_trace_file_s, engine_p -> wse_trace_max_file_size);
+
+	return results_p;
+}
+
+
+static void FreeWebSearchTask (void *data_p)
+{
+	WebSearchTask *task_p = (WebSearchTask *) data_p;
+
+	/* If the search was never run, the request's trace still needs finishing */
+	if (task_p -> wst_trace_p)
+		{
+			const WebSearchEngine *engine_p = (const WebSearchEngine *) GetConfigVersionData (task_p -> wst_version_p);
+
+			AttachRequestTrace (task_p -> wst_trace_p);
+			FinishRequestTrace (engine_p -> wse_trace_file_s, engine_p -> wse_trace_max_file_size);
+		}
+
+	if (task_p -> wst_version_p)
+		{
+			ReleaseConfigVersion (task_p -> wst_version_p);
+		}
+
+	ReleaseWebSearchTransfer (& (task_p -> wst_service_data));
+	FreeMemory (task_p);
+}
+
+
+/*
+ * Run a search within the memory budget and the operation's limits
+ * on the size of the page.
+ */
+static json_t *RunLimitedWebSearch (WebSearchServiceData *service_data_p, const ConfigVersion *version_p, SearchJob *search_p)
+{
+	const WebSearchEngine *engine_p = (const WebSearchEngine *) GetConfigVersionData (version_p);
+	json_t *results_p = NULL;
+	WebServiceData *data_p = & (service_data_p -> wssd_base_data);
+	ResponseLimits limits;
+	const uint64 wait_start = BeginTraceSpan ();
+
+	/* Wait for other searches to finish with their pages rather than risk running out of memory */
+	const bool budget_flag = WaitForMemoryBudget (engine_p -> wse_memory_wait);
+
+	EndTraceSpan ("wait for memory", wait_start);
+
+	if (budget_flag)
+		{
+			if (StartLimitingResponseSize (data_p -> wsd_curl_data_p, &limits, engine_p -> wse_max_response_size))
+				{
+					const bool stats_flag = engine_p -> wse_allocation_stats_flag && StartAllocationAccounting ();
+
+					results_p = GetWebSearchServiceResults (service_data_p, version_p, search_p);
+
+					if (stats_flag)
 						{
-							if (CallCurlWebservice (data_p))
+							StopAllocationAccounting (data_p -> wsd_name_s, engine_p -> wse_allocation_stats_interval);
+						}
+
+					if ((!results_p) && (limits.rl_exceeded_flag))
+						{
+							PrintErrors (STM_LEVEL_WARNING, __FILE__, __LINE__, "Response from \"%s\" was larger than %lu bytes", data_p -> wsd_name_s, (unsigned long) (engine_p -> wse_max_response_size));
+							AddSearchJobError (search_p, "The search engine's response was larger than the maximum allowed size");
+						}
+
+					/* The page's memory is only released back to the budget once it has been parsed */
+					StopLimitingResponseSize (&limits);
+				}
+		}
+	else
+		{
+			PrintErrors (STM_LEVEL_WARNING, __FILE__, __LINE__, "Timed out waiting for memory to search \"%s\"", data_p -> wsd_name_s);
+			AddSearchJobError (search_p, "The server is too busy to run the search, please try again later");
+		}
+
+	return results_p;
+}
+
+
+/*
+ * The priority comes from the request parameter named by the operation's
+ * priority_parameter, if it has one and it was given, and otherwise from
+ * the operation's own priority.
+ */
+static SearchPriority GetWebSearchPriority (const WebSearchEngine *engine_p, ParameterSet *param_set_p)
+{
+	SearchPriority priority = engine_p -> wse_priority;
+
+	if (engine_p -> wse_priority_param_s)
+		{
+			const char *value_s = NULL;
+
+			if (GetCurrentStringParameterValueFromParameterSet (param_set_p, engine_p -> wse_priority_param_s, &value_s) && value_s)
+				{
+					if (!GetSearchPriorityFromString (value_s, &priority))
+						{
+							PrintErrors (STM_LEVEL_WARNING, __FILE__, __LINE__, "Unknown priority \"%s\", using the default", value_s);
+						}
+				}
+		}
+
+	return priority;
+}
+
+
+/*
+ * Answer a search from the local index of previously extracted results
+ * and refresh them from the search engine in the background so that
+ * the index keeps up with any changes. If the index has no matching
+ * results, NULL is returned so that the search engine is called as usual.
+ */
+static json_t *GetLocalWebSearchResults (WebSearchServiceData *data_p, const ConfigVersion *version_p, ParameterSet *param_set_p)
+{
+	const WebSearchEngine *engine_p = (const WebSearchEngine *) GetConfigVersionData (version_p);
+	json_t *results_p = NULL;
+	const char *query_s = NULL;
+
+	if (GetCurrentStringParameterValueFromParameterSet (param_set_p, engine_p -> wse_index_query_param_s, &query_s) && query_s)
+		{
+			const uint64 span_start = BeginTraceSpan ();
+
+			results_p = SearchResultIndex (engine_p -> wse_index_p, query_s, engine_p -> wse_index_max_results);
+
+			EndTraceSpan ("local index", span_start);
+
+			if (results_p)
+				{
+					if (json_array_size (results_p) > 0)
+						{
+							ScheduleLocalWebSearchRefresh (data_p, version_p);
+						}
+					else
+						{
+							json_decref (results_p);
+							results_p = NULL;
+						}
+				}
+		}
+
+	return results_p;
+}
+
+
+/*
+ * If the search's results are cached, they are refreshed in the same way
+ * as any other cached results, so fresh ones aren't fetched again. Only
+ * GET requests can be repeated in the background.
+ */
+static void ScheduleLocalWebSearchRefresh (WebSearchServiceData *data_p, const ConfigVersion *version_p)
+{
+	const WebSearchEngine *engine_p = (const WebSearchEngine *) GetConfigVersionData (version_p);
+	WebServiceData *base_data_p = & (data_p -> wssd_base_data);
+
+	if ((base_data_p -> wsd_method == SM_GET) && (engine_p -> wse_max_refreshes > 0))
+		{
+			char *key_s = GetWebSearchRequestKey (base_data_p);
+
+			if (key_s)
+				{
+					CachedResults cached_results;
+					CacheEntryState state = CES_MISSING;
+
+					memset (&cached_results, 0, sizeof (CachedResults));
+
+					if (engine_p -> wse_cache_p)
+						{
+							state = GetCachedResults (engine_p -> wse_cache_p, key_s, &cached_results);
+						}
+
+					if ((state == CES_STALE) || (state == CES_EXPIRED))
+						{
+							ScheduleWebSearchRefresh (data_p, version_p, key_s, &cached_results);
+						}
+					else if (state == CES_MISSING)
+						{
+							if ((cached_results.cr_request_uri_s = GetWebSearchRequestUri (base_data_p)) != NULL)
 								{
-									json_t *results_p = CreateWebSearchServiceResults (service_data_p);
+									ScheduleWebSearchRefreshTask (data_p, version_p, key_s, &cached_results);
+								}
+						}
+
+					ClearCachedResults (&cached_results);
+					FreeCopiedString (key_s);
+				}
+		}
+}
+
+
+static json_t *GetWebSearchServiceResults (WebSearchServiceData *data_p, const ConfigVersion *version_p, SearchJob *search_p)
+{
+	const WebSearchEngine *engine_p = (const WebSearchEngine *) GetConfigVersionData (version_p);
+	json_t *results_p = NULL;
+	WebServiceData *base_data_p = & (data_p -> wssd_base_data);
+
+	if (engine_p -> wse_cache_p)
+		{
+			char *key_s = GetWebSearchRequestKey (base_data_p);
+
+			if (key_s)
+				{
+					results_p = GetCachedWebSearchServiceResults (data_p, version_p, key_s, search_p);
+					FreeCopiedString (key_s);
+				}
+			else
+				{
+					PrintErrors (STM_LEVEL_WARNING, __FILE__, __LINE__, "Failed to get cache key for \"%s\"", base_data_p -> wsd_name_s);
+				}
+		}
+	else if (CallWebSearchEngine (data_p, engine_p, search_p) == WSCR_SUCCEEDED)
+		{
+			results_p = CreateWebSearchServiceResults (data_p, engine_p, GetIncrementalSearchJob (data_p, engine_p, search_p));
+		}
+
+	return results_p;
+}
+
+
+/*
+ * Use any cached results for the request, revalidating them with the
+ * search engine if they have expired. If the search engine replies with
+ * "304 Not Modified", the cached results are reused without downloading
+ * or parsing the page again. Results that are within their grace period
+ * are returned straight away and refreshed in the background.
+ */
+static json_t *GetCachedWebSearchServiceResults (WebSearchServiceData *data_p, const ConfigVersion *version_p, const char *key_s, SearchJob *search_p)
+{
+	const WebSearchEngine *engine_p = (const WebSearchEngine *) GetConfigVersionData (version_p);
+	json_t *results_p = NULL;
+	WebServiceData *base_data_p = & (data_p -> wssd_base_data);
+	CachedResults cached_results;
+	CacheEntryState state = GetCachedResults (engine_p -> wse_cache_p, key_s, &cached_results);
+
+	if (state == CES_FRESH)
+		{
+			results_p = cached_results.cr_results_p;
+			cached_results.cr_results_p = NULL;
+		}
+	else if (state == CES_STALE)
+		{
+			results_p = cached_results.cr_results_p;
+			cached_results.cr_results_p = NULL;
+
+			ScheduleWebSearchRefresh (data_p, version_p, key_s, &cached_results);
+		}
+	else if (state == CES_FAILED)
+		{
+			PrintLog (STM_LEVEL_FINE, __FILE__, __LINE__, "Not repeating recently failed search for \"%s\"", base_data_p -> wsd_name_s);
+			AddSearchJobError (search_p, "The search recently failed, please try again later");
+		}
+	else
+		{
+			struct curl_slist *conditional_headers_p = NULL;
+			ResponseHeaders response_headers;
+
+			/* Only GET requests can be revalidated */
+			if ((state == CES_EXPIRED) && (base_data_p -> wsd_method == SM_GET))
+				{
+					conditional_headers_p = SetConditionalRequestHeaders (base_data_p -> wsd_curl_data_p, cached_results.cr_etag_s, cached_results.cr_last_modified_s);
+				}
+
+			if (StartCapturingResponseHeaders (base_data_p -> wsd_curl_data_p, &response_headers))
+				{
+					const WebSearchCallResult call_result = CallWebSearchEngine (data_p, engine_p, search_p);
+
+					if (call_result == WSCR_SUCCEEDED)
+						{
+							if ((conditional_headers_p != NULL) && (GetCurlToolResponseCode (base_data_p -> wsd_curl_data_p) == 304))
+								{
+									RenewCachedResults (engine_p -> wse_cache_p, key_s);
+
+									results_p = cached_results.cr_results_p;
+									cached_results.cr_results_p = NULL;
+								}
+							else
+								{
+									results_p = CreateWebSearchServiceResults (data_p, engine_p, GetIncrementalSearchJob (data_p, engine_p, search_p));
 
 									if (results_p)
 										{
-											if (ReplaceServiceJobResults (job_p, results_p))
+											CachedResults new_results;
+
+											new_results.cr_results_p = results_p;
+											new_results.cr_etag_s = response_headers.rh_etag_s;
+											new_results.cr_last_modified_s = response_headers.rh_last_modified_s;
+											new_results.cr_request_uri_s = NULL;
+
+											/* A GET request can be repeated in the background from its URI */
+											if (base_data_p -> wsd_method == SM_GET)
 												{
-													SetServiceJobStatus (job_p, OS_SUCCEEDED);
+													new_results.cr_request_uri_s = (char *) GetCurlToolEffectiveUri (base_data_p -> wsd_curl_data_p);
 												}
-											else
+
+											AddCachedResults (engine_p -> wse_cache_p, key_s, &new_results);
+										}
+									else
+										{
+											AddFailedCachedResults (engine_p -> wse_cache_p, key_s);
+										}
+								}
+
+						}		/* if (call_result == WSCR_SUCCEEDED) */
+					else if (state == CES_EXPIRED)
+						{
+							/* The search engine is unavailable so the expired results are better than none */
+							PrintErrors (STM_LEVEL_WARNING, __FILE__, __LINE__, "Using expired results for \"%s\" as the search engine is unavailable", base_data_p -> wsd_name_s);
+
+							results_p = cached_results.cr_results_p;
+							cached_results.cr_results_p = NULL;
+						}
+					else if (call_result == WSCR_FAILED)
+						{
+							AddFailedCachedResults (engine_p -> wse_cache_p, key_s);
+						}
+
+					StopCapturingResponseHeaders (base_data_p -> wsd_curl_data_p);
+					ClearResponseHeaders (&response_headers);
+				}		/* if (StartCapturingResponseHeaders (base_data_p -> wsd_curl_data_p, &response_headers)) */
+
+			ClearConditionalRequestHeaders (base_data_p -> wsd_curl_data_p, conditional_headers_p);
+		}
+
+	ClearCachedResults (&cached_results);
+
+	return results_p;
+}
+
+
+static void ScheduleWebSearchRefresh (WebSearchServiceData *data_p, const ConfigVersion *version_p, const char *key_s, CachedResults *cached_results_p)
+{
+	const WebSearchEngine *engine_p = (const WebSearchEngine *) GetConfigVersionData (version_p);
+
+	if ((cached_results_p -> cr_request_uri_s) && (engine_p -> wse_max_refreshes > 0))
+		{
+			if (MarkCachedResultsAsRefreshing (engine_p -> wse_cache_p, key_s))
+				{
+					if (!ScheduleWebSearchRefreshTask (data_p, version_p, key_s, cached_results_p))
+						{
+							ClearCachedResultsRefreshing (engine_p -> wse_cache_p, key_s);
+						}
+
+				}		/* if (MarkCachedResultsAsRefreshing (engine_p -> wse_cache_p, key_s)) */
+
+		}		/* if ((cached_results_p -> cr_request_uri_s) && (engine_p -> wse_max_refreshes > 0)) */
+}
+
+
+/*
+ * Queue a background task to fetch the request's results again and
+ * replace the operation's cached and indexed ones with them.
+ */
+static bool ScheduleWebSearchRefreshTask (WebSearchServiceData *data_p, const ConfigVersion *version_p, const char *key_s, CachedResults *cached_results_p)
+{
+	const WebSearchEngine *engine_p = (const WebSearchEngine *) GetConfigVersionData (version_p);
+	WebSearchRefreshTask *task_p = (WebSearchRefreshTask *) AllocMemory (sizeof (WebSearchRefreshTask));
+	bool scheduled_flag = false;
+
+	if (task_p)
+		{
+			const WebServiceData *base_data_p = & (data_p -> wssd_base_data);
+
+			memset (task_p, 0, sizeof (WebSearchRefreshTask));
+
+			/* The task takes over the validators and request uri */
+			task_p -> wsrt_cached_results = *cached_results_p;
+			cached_results_p -> cr_etag_s = NULL;
+			cached_results_p -> cr_last_modified_s = NULL;
+			cached_results_p -> cr_request_uri_s = NULL;
+
+			task_p -> wsrt_compress_flag = data_p -> wssd_compress_flag;
+			task_p -> wsrt_key_s = EasyCopyToNewString (key_s);
+
+			/* The settings are kept for the task in case they are reloaded while it is waiting */
+			task_p -> wsrt_version_p = CopyConfigVersion (version_p);
+
+			if ((task_p -> wsrt_key_s) && (task_p -> wsrt_version_p))
+				{
+					scheduled_flag = ScheduleBackgroundTask (base_data_p -> wsd_name_s, engine_p -> wse_max_refreshes, RunWebSearchRefreshTask, FreeWebSearchRefreshTask, task_p);
+				}
+			else
+				{
+					FreeWebSearchRefreshTask (task_p);
+				}
+		}
+
+	return scheduled_flag;
+}
+
+
+static void RunWebSearchRefreshTask (void *data_p)
+{
+	WebSearchRefreshTask *task_p = (WebSearchRefreshTask *) data_p;
+	const WebSearchEngine *engine_p = (const WebSearchEngine *) GetConfigVersionData (task_p -> wsrt_version_p);
+	bool refreshed_flag = false;
+
+	/* Refreshes are background work so they are scheduled along with the bulk searches */
+	if (AcquireSearchSlot (SP_BULK, engine_p -> wse_queue_wait))
+		{
+			/* The refreshed page counts against the memory budget in the same way as a search's */
+			if (WaitForMemoryBudget (engine_p -> wse_memory_wait))
+				{
+					refreshed_flag = RefreshWebSearchResults (task_p);
+				}
+			else
+				{
+					PrintErrors (STM_LEVEL_WARNING, __FILE__, __LINE__, "Timed out waiting for memory to refresh \"%s\"", task_p -> wsrt_key_s);
+				}
+
+			ReleaseSearchSlot (SP_BULK);
+		}
+
+	if ((!refreshed_flag) && (engine_p -> wse_cache_p))
+		{
+			ClearCachedResultsRefreshing (engine_p -> wse_cache_p, task_p -> wsrt_key_s);
+		}
+}
+
+
+static bool RefreshWebSearchResults (WebSearchRefreshTask *task_p)
+{
+	const WebSearchEngine *engine_p = (const WebSearchEngine *) GetConfigVersionData (task_p -> wsrt_version_p);
+	CachedResults *cached_results_p = & (task_p -> wsrt_cached_results);
+	bool refreshed_flag = false;
+	CurlTool *tool_p = AllocateCurlTool (CM_MEMORY);
+
+	if (tool_p)
+		{
+			if (SetUriForCurlTool (tool_p, cached_results_p -> cr_request_uri_s) && SetCurlToolCompression (tool_p, task_p -> wsrt_compress_flag))
+				{
+					struct curl_slist *conditional_headers_p = SetConditionalRequestHeaders (tool_p, cached_results_p -> cr_etag_s, cached_results_p -> cr_last_modified_s);
+					struct curl_slist *hosts_p = (engine_p -> wse_dns_cache_ttl > 0) ? SetCurlToolResolvedHost (tool_p, cached_results_p -> cr_request_uri_s) : NULL;
+					ResponseHeaders response_headers;
+					ResponseLimits limits;
+					uint32 ticket = 0;
+
+					/* Don't add to the load on a search engine that is already failing */
+					if ((engine_p -> wse_breaker_p == NULL) || AllowCircuitBreakerRequest (engine_p -> wse_breaker_p, &ticket))
+						{
+							bool sent_flag = false;
+
+							if (StartLimitingResponseSize (tool_p, &limits, engine_p -> wse_max_response_size))
+								{
+									if (StartCapturingResponseHeaders (tool_p, &response_headers))
+										{
+											const bool ran_flag = (RunCurlTool (tool_p) == CURLE_OK);
+
+											sent_flag = true;
+
+											if (engine_p -> wse_breaker_p)
+												{
+													RecordCircuitBreakerResult (engine_p -> wse_breaker_p, ticket, ran_flag && !IsFailedWebSearchResponse (GetCurlToolResponseCode (tool_p)));
+												}
+
+											if (ran_flag)
 												{
-													json_decref (results_p);
-													PrintJSONToErrors (STM_LEVEL_SEVERE, __FILE__, __LINE__, results_p, "Failed to set job results");
+													const long code = GetCurlToolResponseCode (tool_p);
+
+													if ((code == 304) && (conditional_headers_p != NULL))
+														{
+															refreshed_flag = RenewCachedResults (engine_p -> wse_cache_p, task_p -> wsrt_key_s);
+														}
+													else if (code == 200)
+														{
+															const char *page_s = GetCurlToolData (tool_p);
+
+															if (page_s && *page_s)
+																{
+																	json_t *results_p = ExtractWebSearchResults (page_s, GetCurlToolContentType (tool_p), engine_p -> wse_structured_data_flag ? & (engine_p -> wse_structured_data) : NULL, engine_p -> wse_canonical_flag ? & (engine_p -> wse_canonical) : NULL, engine_p -> wse_link_selector_s, engine_p -> wse_title_selector_s, engine_p -> wse_region_start_s, engine_p -> wse_region_end_s, engine_p -> wse_base_uri_s, engine_p -> wse_max_nodes, NULL, 0);
+
+																	if (results_p)
+																		{
+																			if (engine_p -> wse_index_p)
+																				{
+																					AddResultsToIndex (engine_p -> wse_index_p, results_p);
+																				}
+
+																			/* A refresh of results from the local index may not have a cache to update */
+																			if (engine_p -> wse_cache_p)
+																				{
+																					CachedResults new_results;
+
+																					new_results.cr_results_p = results_p;
+																					new_results.cr_etag_s = response_headers.rh_etag_s;
+																					new_results.cr_last_modified_s = response_headers.rh_last_modified_s;
+																					new_results.cr_request_uri_s = cached_results_p -> cr_request_uri_s;
+
+																					refreshed_flag = AddCachedResults (engine_p -> wse_cache_p, task_p -> wsrt_key_s, &new_results);
+																				}
+																			else
+																				{
+																					refreshed_flag = true;
+																				}
+
+																			json_decref (results_p);
+																		}
+																}
+														}
+													else
+														{
+															PrintErrors (STM_LEVEL_WARNING, __FILE__, __LINE__, "Refreshing \"%s\" returned HTTP status %ld", cached_results_p -> cr_request_uri_s, code);
+														}
 												}
 
-										}		/* if (results_p) */
+											StopCapturingResponseHeaders (tool_p);
+											ClearResponseHeaders (&response_headers);
+										}		/* if (StartCapturingResponseHeaders (tool_p, &response_headers)) */
 
-								}		/* if (CallCurlWebservice (data_p)) */
+									StopLimitingResponseSize (&limits);
+								}		/* if (StartLimitingResponseSize (tool_p, &limits, engine_p -> wse_max_response_size)) */
 
-						}		/* if (success_flag) */
+							/* If this was the probe of a half-open breaker, let another request be it */
+							if ((!sent_flag) && (engine_p -> wse_breaker_p))
+								{
+									ReleaseCircuitBreakerRequest (engine_p -> wse_breaker_p, ticket);
+								}
+						}		/* if ((engine_p -> wse_breaker_p == NULL) || AllowCircuitBreakerRequest (engine_p -> wse_breaker_p, &ticket)) */
 
-				}		/* if (param_set_p) */
+					ClearCurlToolResolvedHost (tool_p, hosts_p);
+					ClearConditionalRequestHeaders (tool_p, conditional_headers_p);
+				}
 
+			FreeCurlTool (tool_p);
 		}
 
-	return service_p -> se_jobs_p;
+	return refreshed_flag;
+}
+
+
+static void FreeWebSearchRefreshTask (void *data_p)
+{
+	WebSearchRefreshTask *task_p = (WebSearchRefreshTask *) data_p;
+
+	ClearCachedResults (& (task_p -> wsrt_cached_results));
+
+	if (task_p -> wsrt_key_s)
+		{
+			FreeCopiedString (task_p -> wsrt_key_s);
+		}
+
+	if (task_p -> wsrt_version_p)
+		{
+			ReleaseConfigVersion (task_p -> wsrt_version_p);
+		}
+
+	FreeMemory (task_p);
+}
+
+
+/*
+ * The request is identified by the search engine's address along with
+ * the parameters that have been encoded for it.
+ */
+static char *GetWebSearchRequestKey (const WebServiceData *data_p)
+{
+	const char *uri_s = data_p -> wsd_base_uri_s ? data_p -> wsd_base_uri_s : "";
+	const char *params_s = GetByteBufferData (data_p -> wsd_buffer_p);
+
+	return ConcatenateVarargsStrings (uri_s, "\n", params_s ? params_s : "", NULL);
+}
+
+
+/*
+ * The encoded parameters of a GET request are the query string
+ * of the address that it calls.
+ */
+static char *GetWebSearchRequestUri (const WebServiceData *data_p)
+{
+	const char *uri_s = data_p -> wsd_base_uri_s ? data_p -> wsd_base_uri_s : "";
+	const char *params_s = GetByteBufferData (data_p -> wsd_buffer_p);
+
+	if (params_s && *params_s)
+		{
+			return ConcatenateVarargsStrings (uri_s, (*params_s == '?') ? "" : "?", params_s, NULL);
+		}
+
+	return EasyCopyToNewString (uri_s);
 }
 
 
-static json_t *CreateWebSearchServiceResults (WebSearchServiceData *data_p)
+static json_t *CreateWebSearchServiceResults (WebSearchServiceData *data_p, const WebSearchEngine *engine_p, SearchJob *search_p)
 {
 	json_t *res_p = NULL;
 	const char * const data_s = GetCurlToolData (data_p -> wssd_base_data.wsd_curl_data_p);
 
 	if (data_s && *data_s)
 		{
-			res_p = GetMatchingLinksAsJSON (data_s, data_p -> wssd_link_selector_s, data_p -> wssd_title_selector_s, data_p -> wssd_base_data.wsd_base_uri_s);
+			res_p = ExtractWebSearchResults (data_s, GetCurlToolContentType (data_p -> wssd_base_data.wsd_curl_data_p), engine_p -> wse_structured_data_flag ? & (engine_p -> wse_structured_data) : NULL, engine_p -> wse_canonical_flag ? & (engine_p -> wse_canonical) : NULL, engine_p -> wse_link_selector_s, engine_p -> wse_title_selector_s, engine_p -> wse_region_start_s, engine_p -> wse_region_end_s, engine_p -> wse_base_uri_s, engine_p -> wse_max_nodes, search_p, engine_p -> wse_batch_size);
+
+			if (res_p && engine_p -> wse_index_p)
+				{
+					AddResultsToIndex (engine_p -> wse_index_p, res_p);
+				}
 		}
 
 	return res_p;
 }
+
+
+/*
+ * The page is parsed straight from the CurlTool's buffer which, for a
+ * compressed response, libcurl will have decompressed into as it arrived.
+ * The only time that it is copied is if it needs converting to UTF-8.
+ * If the operation has region markers, only the part of the page between
+ * them is parsed. If a search job is given, the results are added to it in
+ * batches as they are extracted. If the operation maps the page's
+ * structured data, that is tried first, on the whole page, and the
+ * selectors are only used if it doesn't have the results. If canonical_p
+ * is set, the results' URIs are canonicalised and only the first result
+ * for each page is kept.
+ */
+static json_t *ExtractWebSearchResults (const char *data_s, const char *content_type_s, const StructuredDataMapping *structured_data_p, const UriCanonicalisation *canonical_p, const char *link_selector_s, const char *title_selector_s, const char *region_start_s, const char *region_end_s, const char *base_uri_s, const size_t max_nodes, SearchJob *search_p, const uint32 batch_size)
+{
+	json_t *results_p = NULL;
+	size_t length = strlen (data_s);
+	char *converted_data_s = ConvertPageToUTF8 (data_s, length, content_type_s, &length);
+
+	if (converted_data_s)
+		{
+			data_s = converted_data_s;
+		}
+
+	if (structured_data_p)
+		{
+			results_p = GetStructuredDataLinksAsJSONInBatches (data_s, length, structured_data_p, base_uri_s, canonical_p, batch_size, search_p ? AddSearchJobResults : NULL, search_p);
+		}
+
+	/* If the page's structured data had the results, the page doesn't need parsing */
+	if (!results_p)
+		{
+			if (region_start_s || region_end_s)
+				{
+					if (!GetPageRegion (data_s, length, region_start_s, region_end_s, &data_s, &length))
+						{
+							PrintErrors (STM_LEVEL_WARNING, __FILE__, __LINE__, "Failed to find region start \"%s\", parsing the whole page", region_start_s);
+						}
+				}
+
+			results_p = GetMatchingLinksAsJSONInBatches (data_s, length, link_selector_s, title_selector_s, base_uri_s, canonical_p, max_nodes, batch_size, search_p ? AddSearchJobResults : NULL, search_p);
+		}
+
+	if (converted_data_s)
+		{
+			FreeMemory (converted_data_s);
+		}
+
+	return results_p;
+}
 	
 
 static  ParameterSet *IsResourceForWebSearchService (Service * UNUSED_PARAM (service_p), DataResource * UNUSED_PARAM (resource_p), Handler * UNUSED_PARAM (handler_p))
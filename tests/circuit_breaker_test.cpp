@@ -0,0 +1,184 @@
+/*
+** Copyright 2014-2016 The Earlham Institute
+**
+** Licensed under the Apache License, Version 2.0 (the "License");
+** you may not use this file except in compliance with the License.
+** You may obtain a copy of the License at
+**
+**     http://www.apache.org/licenses/LICENSE-2.0
+**
+** Unless required by applicable law or agreed to in writing, software
+** distributed under the License is distributed on an "AS IS" BASIS,
+** WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+** See the License for the specific language governing permissions and
+** limitations under the License.
+*/
+/*
+ * circuit_breaker_test.cpp
+ *
+ *  Created on: 18 Oct 2026
+ */
+
+#include "circuit_breaker.hpp"
+
+#include "unit_test.hpp"
+
+
+/*
+ * Each test uses a breaker of its own since they are shared by name. An
+ * open_time of 0 lets the next request after the breaker opens be the
+ * probe without having to wait.
+ */
+
+static void RecordResults (CircuitBreaker *breaker_p, const bool *results_p, const size_t num_results)
+{
+	for (size_t i = 0; i < num_results; ++ i)
+		{
+			uint32 ticket;
+
+			CHECK (AllowCircuitBreakerRequest (breaker_p, &ticket));
+			RecordCircuitBreakerResult (breaker_p, ticket, results_p [i]);
+		}
+}
+
+
+static void TestOpensAtThreshold (void)
+{
+	CircuitBreaker *breaker_p = GetCircuitBreaker ("opens at threshold", 3, 5, 60);
+	const bool results [] = { false, true, false };
+	uint32 ticket;
+
+	CHECK (breaker_p != NULL);
+
+	RecordResults (breaker_p, results, 3);
+
+	/* Two failures out of three is still under the threshold */
+	CHECK (AllowCircuitBreakerRequest (breaker_p, &ticket));
+	RecordCircuitBreakerResult (breaker_p, ticket, false);
+
+	CHECK (!AllowCircuitBreakerRequest (breaker_p, &ticket));
+}
+
+
+static void TestFailuresLeaveWindow (void)
+{
+	CircuitBreaker *breaker_p = GetCircuitBreaker ("failures leave window", 2, 3, 60);
+	const bool results [] = { false, true, true, true, false };
+	uint32 ticket;
+
+	RecordResults (breaker_p, results, 5);
+
+	/* The first failure has dropped out of the window so there's only one in it */
+	CHECK (AllowCircuitBreakerRequest (breaker_p, &ticket));
+	RecordCircuitBreakerResult (breaker_p, ticket, true);
+}
+
+
+static void TestProbeSuccessCloses (void)
+{
+	CircuitBreaker *breaker_p = GetCircuitBreaker ("probe success closes", 1, 1, 0);
+	const bool results [] = { false };
+	uint32 probe_ticket;
+	uint32 ticket;
+
+	RecordResults (breaker_p, results, 1);
+
+	CHECK (AllowCircuitBreakerRequest (breaker_p, &probe_ticket));
+
+	/* Only the probe is let through whilst the breaker is half open */
+	CHECK (!AllowCircuitBreakerRequest (breaker_p, &ticket));
+
+	RecordCircuitBreakerResult (breaker_p, probe_ticket, true);
+
+	CHECK (AllowCircuitBreakerRequest (breaker_p, &ticket));
+	CHECK (AllowCircuitBreakerRequest (breaker_p, &ticket));
+}
+
+
+static void TestProbeFailureReopens (void)
+{
+	CircuitBreaker *breaker_p = GetCircuitBreaker ("probe failure reopens", 1, 1, 0);
+	const bool results [] = { false };
+	uint32 probe_ticket;
+	uint32 ticket;
+
+	RecordResults (breaker_p, results, 1);
+
+	CHECK (AllowCircuitBreakerRequest (breaker_p, &probe_ticket));
+
+	/* Give the breaker an open time so that it stays open once the probe fails */
+	CHECK (GetCircuitBreaker ("probe failure reopens", 1, 1, 60) == breaker_p);
+
+	RecordCircuitBreakerResult (breaker_p, probe_ticket, false);
+
+	CHECK (!AllowCircuitBreakerRequest (breaker_p, &ticket));
+}
+
+
+static void TestLateResultsIgnored (void)
+{
+	CircuitBreaker *breaker_p = GetCircuitBreaker ("late results ignored", 1, 1, 0);
+	uint32 failed_ticket;
+	uint32 late_ticket;
+	uint32 probe_ticket;
+	uint32 ticket;
+
+	/* Two requests are in flight when the first one fails and opens the breaker */
+	CHECK (AllowCircuitBreakerRequest (breaker_p, &failed_ticket));
+	CHECK (AllowCircuitBreakerRequest (breaker_p, &late_ticket));
+	RecordCircuitBreakerResult (breaker_p, failed_ticket, false);
+
+	CHECK (AllowCircuitBreakerRequest (breaker_p, &probe_ticket));
+
+	/* The late success must not close the breaker in place of the probe */
+	RecordCircuitBreakerResult (breaker_p, late_ticket, true);
+	CHECK (!AllowCircuitBreakerRequest (breaker_p, &ticket));
+
+	RecordCircuitBreakerResult (breaker_p, probe_ticket, true);
+	CHECK (AllowCircuitBreakerRequest (breaker_p, &ticket));
+	RecordCircuitBreakerResult (breaker_p, ticket, true);
+
+	/* Nor can a late failure open it again once it has closed */
+	RecordCircuitBreakerResult (breaker_p, late_ticket, false);
+	CHECK (AllowCircuitBreakerRequest (breaker_p, &ticket));
+	RecordCircuitBreakerResult (breaker_p, ticket, true);
+}
+
+
+static void TestReleasedProbe (void)
+{
+	CircuitBreaker *breaker_p = GetCircuitBreaker ("released probe", 1, 1, 0);
+	const bool results [] = { false };
+	uint32 probe_ticket;
+	uint32 ticket;
+
+	RecordResults (breaker_p, results, 1);
+
+	CHECK (AllowCircuitBreakerRequest (breaker_p, &probe_ticket));
+	CHECK (!AllowCircuitBreakerRequest (breaker_p, &ticket));
+
+	/* A probe that was never sent lets the next request be the probe instead */
+	ReleaseCircuitBreakerRequest (breaker_p, probe_ticket);
+
+	CHECK (AllowCircuitBreakerRequest (breaker_p, &probe_ticket));
+	RecordCircuitBreakerResult (breaker_p, probe_ticket, true);
+
+	/* Releasing a request that isn't the probe changes nothing */
+	CHECK (AllowCircuitBreakerRequest (breaker_p, &ticket));
+	ReleaseCircuitBreakerRequest (breaker_p, ticket);
+	CHECK (AllowCircuitBreakerRequest (breaker_p, &ticket));
+	RecordCircuitBreakerResult (breaker_p, ticket, true);
+}
+
+
+int main (void)
+{
+	RUN_TEST (TestOpensAtThreshold);
+	RUN_TEST (TestFailuresLeaveWindow);
+	RUN_TEST (TestProbeSuccessCloses);
+	RUN_TEST (TestProbeFailureReopens);
+	RUN_TEST (TestLateResultsIgnored);
+	RUN_TEST (TestReleasedProbe);
+
+	return GetTestsExitCode ();
+}
@@ -0,0 +1,264 @@
+/*
+** Copyright 2014-2016 The Earlham Institute
+**
+** Licensed under the Apache License, Version 2.0 (the "License");
+** you may not use this file except in compliance with the License.
+** You may obtain a copy of the License at
+**
+**     http://www.apache.org/licenses/LICENSE-2.0
+**
+** Unless required by applicable law or agreed to in writing, software
+** distributed under the License is distributed on an "AS IS" BASIS,
+** WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+** See the License for the specific language governing permissions and
+** limitations under the License.
+*/
+/*
+ * disk_cache_test.cpp
+ *
+ *  Created on: 18 Oct 2026
+ */
+
+#include "disk_cache.hpp"
+
+#include <cstdlib>
+#include <string>
+
+#include <dirent.h>
+#include <unistd.h>
+
+#include "unit_test.hpp"
+
+using namespace std;
+
+
+/*
+ * Each test uses a cache of its own in a temporary directory. Entries
+ * that are meant to stay live expire well in the future.
+ */
+
+static string s_dir;
+
+static const time_t S_FUTURE = time (NULL) + 3600;
+
+
+static string GetKey (const int i)
+{
+	return "key " + to_string (i);
+}
+
+
+static bool AddEntry (DiskCache *cache_p, const int i, const time_t expiry)
+{
+	bool success_flag = false;
+	json_t *value_p = json_integer (i);
+
+	if (value_p)
+		{
+			success_flag = AddDiskCacheEntry (cache_p, GetKey (i).c_str (), value_p, expiry);
+			json_decref (value_p);
+		}
+
+	return success_flag;
+}
+
+
+static bool HasEntry (DiskCache *cache_p, const int i)
+{
+	bool found_flag = false;
+	time_t expiry;
+	json_t *value_p = GetDiskCacheEntry (cache_p, GetKey (i).c_str (), &expiry);
+
+	if (value_p)
+		{
+			found_flag = (json_integer_value (value_p) == i);
+			json_decref (value_p);
+		}
+
+	return found_flag;
+}
+
+
+static int CountEntries (DiskCache *cache_p, const int num_added)
+{
+	int count = 0;
+
+	for (int i = 0; i < num_added; ++ i)
+		{
+			if (HasEntry (cache_p, i))
+				{
+					++ count;
+				}
+		}
+
+	return count;
+}
+
+
+static void RemoveDirectory (const string &dir_r)
+{
+	DIR *dir_p = opendir (dir_r.c_str ());
+
+	if (dir_p)
+		{
+			struct dirent *entry_p;
+
+			while ((entry_p = readdir (dir_p)) != NULL)
+				{
+					const string name (entry_p -> d_name);
+
+					if ((name != ".") && (name != ".."))
+						{
+							unlink ((dir_r + "/" + name).c_str ());
+						}
+				}
+
+			closedir (dir_p);
+		}
+
+	rmdir (dir_r.c_str ());
+}
+
+
+static void TestRoundTrip (void)
+{
+	const string path (s_dir + "/round_trip");
+	DiskCache *cache_p = OpenDiskCache (path.c_str (), 8, 0);
+	time_t expiry = 0;
+
+	CHECK (cache_p != NULL);
+
+	CHECK (AddEntry (cache_p, 1, S_FUTURE));
+	CHECK (HasEntry (cache_p, 1));
+	CHECK (!HasEntry (cache_p, 2));
+
+	/* Replacing an entry keeps the latest value */
+	CHECK (AddEntry (cache_p, 1, S_FUTURE + 1));
+
+	json_t *value_p = GetDiskCacheEntry (cache_p, GetKey (1).c_str (), &expiry);
+	CHECK ((value_p != NULL) && (json_integer_value (value_p) == 1));
+	CHECK (expiry == S_FUTURE + 1);
+	json_decref (value_p);
+
+	CHECK (SetDiskCacheEntryExpiry (cache_p, GetKey (1).c_str (), S_FUTURE + 2));
+	CHECK (!SetDiskCacheEntryExpiry (cache_p, GetKey (2).c_str (), S_FUTURE));
+
+	value_p = GetDiskCacheEntry (cache_p, GetKey (1).c_str (), &expiry);
+	CHECK (expiry == S_FUTURE + 2);
+	json_decref (value_p);
+
+	CloseDiskCache (cache_p);
+
+	/* The entries are still there once the cache is reopened */
+	cache_p = OpenDiskCache (path.c_str (), 8, 0);
+	CHECK (cache_p != NULL);
+	CHECK (HasEntry (cache_p, 1));
+	CloseDiskCache (cache_p);
+}
+
+
+static void TestEviction (void)
+{
+	const string path (s_dir + "/eviction");
+	DiskCache *cache_p = OpenDiskCache (path.c_str (), 8, 0);
+	const int num_added = 40;
+
+	CHECK (cache_p != NULL);
+
+	/* Each later entry expires after the earlier ones, so it is kept in preference to them */
+	for (int i = 0; i < num_added; ++ i)
+		{
+			CHECK (AddEntry (cache_p, i, S_FUTURE + i));
+		}
+
+	CHECK (CountEntries (cache_p, num_added) <= 8);
+
+	for (int i = num_added - 4; i < num_added; ++ i)
+		{
+			CHECK (HasEntry (cache_p, i));
+		}
+
+	CloseDiskCache (cache_p);
+}
+
+
+static void TestCompactionDropsExpired (void)
+{
+	const string path (s_dir + "/expired");
+	DiskCache *cache_p = OpenDiskCache (path.c_str (), 8, 0);
+
+	CHECK (cache_p != NULL);
+
+	CHECK (AddEntry (cache_p, 0, time (NULL) - 60));
+	CHECK (AddEntry (cache_p, 1, S_FUTURE));
+
+	/* Expired entries can still be read until the cache is compacted */
+	CHECK (HasEntry (cache_p, 0));
+
+	CloseDiskCache (cache_p);
+
+	/* Opening it with a different size compacts it */
+	cache_p = OpenDiskCache (path.c_str (), 16, 0);
+	CHECK (cache_p != NULL);
+	CHECK (!HasEntry (cache_p, 0));
+	CHECK (HasEntry (cache_p, 1));
+	CloseDiskCache (cache_p);
+}
+
+
+static void TestResize (void)
+{
+	const string path (s_dir + "/resize");
+	DiskCache *cache_p = OpenDiskCache (path.c_str (), 8, 0);
+	const int num_added = 8;
+	int num_kept;
+
+	CHECK (cache_p != NULL);
+
+	for (int i = 0; i < num_added; ++ i)
+		{
+			CHECK (AddEntry (cache_p, i, S_FUTURE + i));
+		}
+
+	CloseDiskCache (cache_p);
+
+	/* Shrinking keeps the entries with the latest expiry times */
+	cache_p = OpenDiskCache (path.c_str (), 4, 0);
+	CHECK (cache_p != NULL);
+	num_kept = CountEntries (cache_p, num_added);
+	CHECK ((num_kept > 0) && (num_kept <= 4));
+	CHECK (HasEntry (cache_p, num_added - 1));
+
+	/* Lookups of missing keys must still end with the index this full */
+	CHECK (!HasEntry (cache_p, num_added + 1));
+	CloseDiskCache (cache_p);
+
+	/* Growing keeps all of the ones that are left */
+	cache_p = OpenDiskCache (path.c_str (), 32, 0);
+	CHECK (cache_p != NULL);
+	CHECK (CountEntries (cache_p, num_added) == num_kept);
+	CloseDiskCache (cache_p);
+}
+
+
+int main (void)
+{
+	char dir_s [] = "/tmp/disk_cache_test_XXXXXX";
+
+	if (!mkdtemp (dir_s))
+		{
+			perror ("mkdtemp");
+			return 1;
+		}
+
+	s_dir = dir_s;
+
+	RUN_TEST (TestRoundTrip);
+	RUN_TEST (TestEviction);
+	RUN_TEST (TestCompactionDropsExpired);
+	RUN_TEST (TestResize);
+
+	RemoveDirectory (s_dir);
+
+	return GetTestsExitCode ();
+}
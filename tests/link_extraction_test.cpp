@@ -0,0 +1,229 @@
+/*
+** Copyright 2014-2016 The Earlham Institute
+**
+** Licensed under the Apache License, Version 2.0 (the "License");
+** you may not use this file except in compliance with the License.
+** You may obtain a copy of the License at
+**
+**     http://www.apache.org/licenses/LICENSE-2.0
+**
+** Unless required by applicable law or agreed to in writing, software
+** distributed under the License is distributed on an "AS IS" BASIS,
+** WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+** See the License for the specific language governing permissions and
+** limitations under the License.
+*/
+/*
+ * link_extraction_test.cpp
+ *
+ *  Created on: 18 Oct 2026
+ */
+
+#include "selector.hpp"
+
+#include <cstdlib>
+#include <cstring>
+
+#include "unit_test.hpp"
+
+
+/*
+ * The links on each of these pages are found by the AnchorScanner unless
+ * there is a title selector, which makes them come from the DOM instead.
+ * A title selector that doesn't match anything leaves the links' titles
+ * as they are, so both ways should give exactly the same JSON.
+ */
+static const char * const S_DOM_TITLE_SELECTOR_S = "span.no-such-title";
+
+static const char * const S_BASE_URI_S = "https://example.com";
+
+
+typedef struct LinkPage
+{
+	const char *lp_name_s;
+	const char *lp_link_selector_s;
+	const char *lp_page_s;
+
+	/** The number of links that the selector should find. */
+	size_t lp_num_links;
+} LinkPage;
+
+
+static const LinkPage S_PAGES [] =
+{
+	{
+		"nested elements",
+		"div.results a",
+		"<html><body><div class=\"results\"><ul><li><a href=\"/1\">One <b>bold</b> link</a></li>"
+		"<li><div class=\"entry\"><a href=\"/2\" title=\"Second\">Two</a></div></li></ul></div>"
+		"<a href=\"/outside\">Outside</a></body></html>",
+		2
+	},
+	{
+		"unclosed elements",
+		"div.results a",
+		"<div class=\"results\"><ul><li><p><a href=\"/1\"><b>One</a><li><p><a href=\"/2\">Two <i>2</a></ul></div>"
+		"<a href=\"/3\">Three</a>",
+		2
+	},
+	{
+		"unclosed element between a link and its parent",
+		"div.results > a",
+		"<div class=\"results\"><span><a href=\"/1\">One</a></div>"
+		"<div class=\"results\"><span><a href=\"/2\">Two</a></span></div>",
+		1
+	},
+	{
+		"a link that is never closed",
+		"div.results a",
+		"<div class=\"results\"><a href=\"/1\">One<a href=\"/2\">Two</a></div><a href=\"/3\">Three",
+		1
+	},
+	{
+		"upper case tags",
+		"div.results a",
+		"<DIV CLASS=\"results\"><A HREF=\"/1\">One</A><a Href=\"/2\">Two</A></DIV><A HREF=\"/3\">Three</A>",
+		2
+	},
+	{
+		"comments",
+		"div.results a",
+		"<div class=\"results\"><!-- <a href=\"/hidden\">Hidden</a> --><a href=\"/1\">One<!-- </a> --> more</a>"
+		"<!-- a -- b --><a href=\"/2\">Two</a><!-- </div> --><a href=\"/3\">Three</a></div>",
+		3
+	},
+	{
+		"script and style text",
+		"div.results a",
+		"<div class=\"results\"><script>var s = \"<a href='/script'>No</a></div>\"; if (a < b) { }</script>"
+		"<style>a[href=\"/style\"]::after { content: \"</div><a href=/x>\"; }</style>"
+		"<a href=\"/1\">One</a><textarea><a href=\"/textarea\">No</a></textarea></div>",
+		1
+	},
+	{
+		"script text that runs to the end of the page",
+		"div.results a",
+		"<div class=\"results\"><a href=\"/1\">One</a><SCRIPT>document.write ('<a href=\"/2\">')",
+		1
+	},
+	{
+		"stray '<'",
+		"div.results a",
+		"<div class=\"results\"><a href=\"/1\">1 < 2</a> a <> b <= c </3> <a href=\"/2\">x<3</a></div>",
+		2
+	}
+};
+
+static const size_t S_NUM_PAGES = sizeof (S_PAGES) / sizeof (S_PAGES [0]);
+
+
+static json_t *GetLinks (const LinkPage *page_p, const bool dom_flag, const size_t max_nodes)
+{
+	return GetMatchingLinksAsJSONInBatches (page_p -> lp_page_s, strlen (page_p -> lp_page_s), page_p -> lp_link_selector_s, dom_flag ? S_DOM_TITLE_SELECTOR_S : NULL, S_BASE_URI_S, NULL, max_nodes, 0, NULL, NULL);
+}
+
+
+static void PrintLinks (const char *label_s, const json_t *links_p)
+{
+	char *links_s = links_p ? json_dumps (links_p, JSON_COMPACT) : NULL;
+
+	fprintf (stderr, "%s: %s\n", label_s, links_s ? links_s : "NULL");
+
+	if (links_s)
+		{
+			free (links_s);
+		}
+}
+
+
+/*
+ * Check that both ways of finding the links give the same result, which
+ * can be NULL if the page has more than max_nodes nodes.
+ */
+static bool CompareLinks (const LinkPage *page_p, const size_t max_nodes, json_t **scanned_pp)
+{
+	json_t *scanned_p = GetLinks (page_p, false, max_nodes);
+	json_t *parsed_p = GetLinks (page_p, true, max_nodes);
+	bool same_flag = (scanned_p && parsed_p) ? (json_equal (scanned_p, parsed_p) != 0) : (scanned_p == parsed_p);
+
+	if (!same_flag)
+		{
+			fprintf (stderr, "The links for %s differ with a limit of %lu nodes\n", page_p -> lp_name_s, (unsigned long) max_nodes);
+			PrintLinks ("scanned", scanned_p);
+			PrintLinks ("parsed", parsed_p);
+		}
+
+	if (parsed_p)
+		{
+			json_decref (parsed_p);
+		}
+
+	if (scanned_pp)
+		{
+			*scanned_pp = scanned_p;
+		}
+	else if (scanned_p)
+		{
+			json_decref (scanned_p);
+		}
+
+	return same_flag;
+}
+
+
+static void TestSameLinks (void)
+{
+	for (size_t i = 0; i < S_NUM_PAGES; ++ i)
+		{
+			const LinkPage *page_p = S_PAGES + i;
+			json_t *links_p = NULL;
+
+			CHECK (CompareLinks (page_p, 0, &links_p));
+
+			if (links_p)
+				{
+					if (json_array_size (links_p) != page_p -> lp_num_links)
+						{
+							fprintf (stderr, "Found %lu links for %s rather than %lu\n", (unsigned long) json_array_size (links_p), page_p -> lp_name_s, (unsigned long) (page_p -> lp_num_links));
+							CHECK (json_array_size (links_p) == page_p -> lp_num_links);
+						}
+
+					json_decref (links_p);
+				}
+			else
+				{
+					fprintf (stderr, "No links for %s\n", page_p -> lp_name_s);
+					CHECK (links_p != NULL);
+				}
+		}
+}
+
+
+/*
+ * The scanner counts the nodes that the DOM would have, so a page should
+ * be turned down at exactly the same limit either way.
+ */
+static void TestSameNodeLimits (void)
+{
+	for (size_t i = 0; i < S_NUM_PAGES; ++ i)
+		{
+			const LinkPage *page_p = S_PAGES + i;
+			bool same_flag = true;
+
+			for (size_t max_nodes = 1; (max_nodes <= 64) && same_flag; ++ max_nodes)
+				{
+					same_flag = CompareLinks (page_p, max_nodes, NULL);
+				}
+
+			CHECK (same_flag);
+		}
+}
+
+
+int main (void)
+{
+	RUN_TEST (TestSameLinks);
+	RUN_TEST (TestSameNodeLimits);
+
+	return GetTestsExitCode ();
+}
@@ -0,0 +1,62 @@
+/*
+** Copyright 2014-2016 The Earlham Institute
+**
+** Licensed under the Apache License, Version 2.0 (the "License");
+** you may not use this file except in compliance with the License.
+** You may obtain a copy of the License at
+**
+**     http://www.apache.org/licenses/LICENSE-2.0
+**
+** Unless required by applicable law or agreed to in writing, software
+** distributed under the License is distributed on an "AS IS" BASIS,
+** WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+** See the License for the specific language governing permissions and
+** limitations under the License.
+*/
+
+/**
+ * @file
+ * @brief The checks shared by the unit tests. Each test program runs its
+ * tests in turn and exits with a non-zero status if any check failed.
+ */
+#ifndef UNIT_TEST_HPP
+#define UNIT_TEST_HPP
+
+#include <cstdio>
+
+
+static int s_num_failed_checks = 0;
+
+
+#define CHECK(condition) CheckCondition ((condition), #condition, __FILE__, __LINE__)
+
+#define RUN_TEST(test_fn) RunTest (test_fn, #test_fn)
+
+
+static void CheckCondition (const bool condition_flag, const char *condition_s, const char *filename_s, const int line)
+{
+	if (!condition_flag)
+		{
+			fprintf (stderr, "%s:%d: check failed: %s\n", filename_s, line, condition_s);
+			++ s_num_failed_checks;
+		}
+}
+
+
+static void RunTest (void (*test_fn) (void), const char *name_s)
+{
+	const int num_failed_before = s_num_failed_checks;
+
+	test_fn ();
+
+	printf ("%s %s\n", (s_num_failed_checks == num_failed_before) ? "PASS" : "FAIL", name_s);
+}
+
+
+static int GetTestsExitCode (void)
+{
+	return (s_num_failed_checks == 0) ? 0 : 1;
+}
+
+
+#endif		/* #ifndef UNIT_TEST_HPP */
@@ -0,0 +1,141 @@
+/*
+** Copyright 2014-2016 The Earlham Institute
+**
+** Licensed under the Apache License, Version 2.0 (the "License");
+** you may not use this file except in compliance with the License.
+** You may obtain a copy of the License at
+**
+**     http://www.apache.org/licenses/LICENSE-2.0
+**
+** Unless required by applicable law or agreed to in writing, software
+** distributed under the License is distributed on an "AS IS" BASIS,
+** WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+** See the License for the specific language governing permissions and
+** limitations under the License.
+*/
+/*
+ * uri_canonicalisation_test.cpp
+ *
+ *  Created on: 18 Oct 2026
+ */
+
+#include "uri_canonicalisation.hpp"
+
+#include <string>
+
+#include "unit_test.hpp"
+
+using namespace std;
+
+
+static const char * const S_REMOVED_PARAMS_SS [] = { "utm_*", "gclid", "fbclid" };
+
+static const UriCanonicalisation S_CANONICAL = { S_REMOVED_PARAMS_SS, sizeof (S_REMOVED_PARAMS_SS) / sizeof (S_REMOVED_PARAMS_SS [0]) };
+
+
+static bool CheckCanonicalUri (const char *uri_s, const char *expected_uri_s, const char *expected_key_s)
+{
+	string uri;
+	string key;
+
+	if (GetCanonicalUri (uri_s, &S_CANONICAL, uri, key))
+		{
+			if ((uri.compare (expected_uri_s) == 0) && ((!expected_key_s) || (key.compare (expected_key_s) == 0)))
+				{
+					return true;
+				}
+
+			fprintf (stderr, "\"%s\" gave \"%s\" with key \"%s\"\n", uri_s, uri.c_str (), key.c_str ());
+		}
+	else
+		{
+			fprintf (stderr, "\"%s\" was not canonicalised\n", uri_s);
+		}
+
+	return false;
+}
+
+
+static string GetKey (const char *uri_s)
+{
+	string uri;
+	string key;
+
+	GetCanonicalUri (uri_s, &S_CANONICAL, uri, key);
+
+	return key;
+}
+
+
+static void TestHostAndPort (void)
+{
+	CHECK (CheckCanonicalUri ("HTTP://Example.COM:80", "http://example.com/", "example.com"));
+	CHECK (CheckCanonicalUri ("https://user@Host.com:8080/a/..", "https://user@host.com:8080/", NULL));
+	CHECK (CheckCanonicalUri ("http://[::1]:80/x/", "http://[::1]/x/", NULL));
+}
+
+
+static void TestPathAndQuery (void)
+{
+	CHECK (CheckCanonicalUri ("https://example.com:443/a/./b/../c/?utm_source=x&q=%2fa&gclid=1#frag", "https://example.com/a/c/?q=%2Fa", "example.com/a/c?q=%2Fa"));
+	CHECK (CheckCanonicalUri ("https://example.com/a?utm_x=1", "https://example.com/a", NULL));
+}
+
+
+static void TestOtherSchemes (void)
+{
+	string uri;
+	string key;
+
+	CHECK (!GetCanonicalUri ("ftp://a/b", &S_CANONICAL, uri, key));
+	CHECK (!GetCanonicalUri ("/relative/path", &S_CANONICAL, uri, key));
+}
+
+
+static void TestDuplicates (void)
+{
+	SeenUriSet seen (4);
+
+	CHECK (seen.Add (GetKey ("https://example.com/a")));
+
+	/* The scheme, the host's case, a trailing slash and tracking parameters don't make a page different */
+	CHECK (!seen.Add (GetKey ("https://EXAMPLE.com/a/")));
+	CHECK (!seen.Add (GetKey ("http://example.com/a?utm_source=x")));
+
+	CHECK (seen.Add (GetKey ("https://example.com/b")));
+	CHECK (seen.Add (GetKey ("https://example.com/a?q=1")));
+	CHECK (!seen.Add (GetKey ("https://example.com/a/?q=1")));
+}
+
+
+static void TestManyLinks (void)
+{
+	SeenUriSet seen (64);
+	int num_added = 0;
+
+	/* Every link on the page is different */
+	for (int i = 0; i < 64; ++ i)
+		{
+			const string uri ("https://example.com/" + to_string (i));
+
+			if (seen.Add (GetKey (uri.c_str ())))
+				{
+					++ num_added;
+				}
+		}
+
+	CHECK (num_added == 64);
+	CHECK (!seen.Add (GetKey ("https://example.com/0")));
+}
+
+
+int main (void)
+{
+	RUN_TEST (TestHostAndPort);
+	RUN_TEST (TestPathAndQuery);
+	RUN_TEST (TestOtherSchemes);
+	RUN_TEST (TestDuplicates);
+	RUN_TEST (TestManyLinks);
+
+	return GetTestsExitCode ();
+}